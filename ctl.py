@@ -55,6 +55,35 @@ def test_rpc(*_):
     check_call(["grpc_cli", "call", GRPC_ADDR, "Shutdown", ""])
 
 
+@register("q")
+def samples_query(args):
+    query = args[0] if args else "table: 'taxi' dbl_col_names: 'tip_amount' limit: 10"
+    check_call(["grpc_cli", "call", GRPC_ADDR, "RunSamplesQuery", query])
+
+
+@register("tq")
+def table_query(args):
+    query = args[0] if args else (
+        "table: 'taxi' group_by: {name: 'passenger_count' type: INT} "
+        "aggregations: {op: AVG col: {name: 'tip_amount' type: DOUBLE}}")
+    check_call(["grpc_cli", "call", GRPC_ADDR, "RunTableQuery", query])
+
+
+@register("compact")
+def compact(args):
+    request = args[0] if args else "table: 'taxi' out_dir: '/tmp/taxi_compacted'"
+    check_call(["grpc_cli", "call", GRPC_ADDR, "Compact", request])
+
+
+@register("append")
+def append(args):
+    request = args[0] if args else (
+        "table: 'taxi' cols: {name: 'tip_amount' type: DOUBLE} "
+        "rows: {vals: {double_val: 1.5}}"
+    )
+    check_call(["grpc_cli", "call", GRPC_ADDR, "Append", request])
+
+
 @register("a")
 def test_arrow(*_):
     check_call(["grpc_cli", "call", GRPC_ADDR, "ArrowTest", ""])
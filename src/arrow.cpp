@@ -1,24 +1,82 @@
 #include "src/arrow.h"
 #include "if/bapid.pb.h"
+#include "src/dictionary.h"
+#include "src/fragment_stats.h"
+#include "src/fused_filter.h"
+#include "src/hot_tier.h"
+#include "src/manifest.h"
+#include "src/sampling.h"
+#include "src/shared_scan.h"
+#include "src/single_flight.h"
+#include "src/sketches.h"
+#include "src/time_index.h"
+#include "src/top_k.h"
+#include "src/write_buffer.h"
 #include <algorithm>
 #include <arrow/api.h>
+#include <arrow/compute/api_aggregate.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/compute/cast.h>
 #include <arrow/compute/exec/exec_plan.h>
 #include <arrow/dataset/file_parquet.h>
 #include <arrow/filesystem/filesystem.h>
+#include <arrow/filesystem/path_util.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/type_traits.h>
+#include <arrow/util/async_generator.h>
+#include <arrow/util/byte_size.h>
+#include <chrono>
+#include <fmt/core.h>
+#include <folly/Conv.h>
 #include <folly/Expected.h>
+#include <folly/MapUtil.h>
 #include <folly/logging/xlog.h>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <parquet/arrow/writer.h>
+#include <parquet/metadata.h>
+#include <parquet/properties.h>
+#include <random>
 #include <stdexcept>
 #include <string_view>
+#include <unordered_set>
 #include <utility>
 
 namespace bapid {
 
 DEFINE_string(dataset_dir, "", "dataset dir"); // NOLINT
-DEFINE_string(out_dir, "", "out dir");         // NOLINT
+DEFINE_string(table_name, "taxi", "name of the table in dataset_dir"); // NOLINT
+DEFINE_string(ts_col_name, "",
+              "timestamp col of the table in dataset_dir"); // NOLINT
+DEFINE_bool(late_materialization, true,
+            "scan the filter cols first for selective queries"); // NOLINT
+DEFINE_int64(result_cache_bytes, 256 << 20,
+             "memory budget of the result cache of each table"); // NOLINT
+DEFINE_int64(
+    shared_result_set_bytes, 64 << 20,
+    "batches a running query keeps for identical queries to join"); // NOLINT
+DEFINE_int64(hot_tier_bytes, 0,
+             "memory budget of the decoded cols each table keeps; 0 disables "
+             "the hot tier"); // NOLINT
+DEFINE_int32(shared_scan_window_ms, 0,
+             "time a scan waits for other queries to share its pass with; 0 "
+             "disables shared scans"); // NOLINT
+DEFINE_int64(write_buffer_flush_bytes, 64 << 20,
+             "size of the appended rows a table flushes to a file"); // NOLINT
+DEFINE_int32(write_buffer_flush_ms, 10000,
+             "time after which a table flushes the rows appended to "
+             "it"); // NOLINT
+DEFINE_int64(write_buffer_max_bytes, 1 << 30,
+             "size of the appended rows a table holds before rejecting "
+             "appends"); // NOLINT
+DEFINE_int32(refresh_interval_ms, 1000,
+             "time after which a query refreshes the dataset of its "
+             "table"); // NOLINT
 
 namespace {
 namespace fs = arrow::fs;
@@ -41,7 +99,7 @@ getFsDataset(const std::string &root_path) {
 
   ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments())
   for (const auto &fragment : fragments) {
-    XLOG(INFO) << "Found fragment: " << (*fragment)->ToString();
+    XLOG(DBG) << "Found fragment: " << (*fragment)->ToString();
   }
 
   return dataset;
@@ -52,14 +110,69 @@ arrow::Status describeFsDatasetImpl(const std::string &root_path) {
   ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
   auto maybe_scanner = scan_builder->Finish();
   ARROW_ASSIGN_OR_RAISE(auto scanner, maybe_scanner);
-  ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable());
+  // Counts from the Parquet footers and reads only the first row instead of
+  // materializing the whole table
+  ARROW_ASSIGN_OR_RAISE(auto num_rows, scanner->CountRows());
+  ARROW_ASSIGN_OR_RAISE(auto head, scanner->Head(1));
 
-  std::cout << "Total rows: " << table->num_rows()
-            << "; Table info: " << std::endl;
-  std::cout << table->Slice(0, 1)->ToString() << std::endl;
+  std::cout << "Total rows: " << num_rows << "; Table info: " << std::endl;
+  std::cout << head->ToString() << std::endl;
   return arrow::Status::OK();
 }
 
+// Same as the defaults of FileSystemFactoryOptions::selector_ignore_prefixes
+bool isIgnoredFile(const fs::FileInfo &info) {
+  if (!info.IsFile()) {
+    return true;
+  }
+
+  const auto base_name = info.base_name();
+  return base_name.empty() || base_name.front() == '.' ||
+         base_name.front() == '_';
+}
+
+// The bitmap index next to the fragment of `stats`, or nullptr if it is
+// unreadable or of another version of the fragment, which only makes the
+// scans of the fragment skip less
+std::shared_ptr<const BitmapIndex>
+loadBitmapIndex(fs::FileSystem &file_sys, const FragmentStats &stats) {
+  auto index = BitmapIndex::read(file_sys, getBitmapIndexPath(stats.path));
+  if (!index.ok()) {
+    XLOG(WARN) << "Fail to read the bitmap index of " << stats.path << ": "
+               << index.status().ToString();
+    return nullptr;
+  }
+  if ((*index)->numRows() != stats.num_rows) {
+    XLOG(WARN) << "Bitmap index of " << stats.path << " is outdated";
+    return nullptr;
+  }
+  return index.MoveValueUnsafe();
+}
+
+// Same as above for the Bloom filters of the row groups of the fragment
+std::shared_ptr<const BloomFilterIndex>
+loadBloomFilters(fs::FileSystem &file_sys, const FragmentStats &stats) {
+  auto index =
+      BloomFilterIndex::read(file_sys, getBloomFilterPath(stats.path));
+  if (!index.ok()) {
+    XLOG(WARN) << "Fail to read the Bloom filters of " << stats.path << ": "
+               << index.status().ToString();
+    return nullptr;
+  }
+
+  const auto &row_group_num_rows = (*index)->rowGroupNumRows();
+  const auto matches_row_groups = std::equal(
+      row_group_num_rows.begin(), row_group_num_rows.end(),
+      stats.row_groups.begin(), stats.row_groups.end(),
+      [](const auto num_rows, const auto &row_group) {
+        return num_rows == row_group.num_rows;
+      });
+  if (!matches_row_groups) {
+    XLOG(WARN) << "Bloom filters of " << stats.path << " are outdated";
+    return nullptr;
+  }
+  return index.MoveValueUnsafe();
+}
 } // namespace
 
 /*static*/ folly::Expected<folly::Unit, std::string>
@@ -74,38 +187,727 @@ BapidTable::describeFsDataset(const std::string &root_path) {
 
 /*static*/
 folly::Expected<std::unique_ptr<BapidTable>, std::string>
-BapidTable::fromFsDataset(const std::string &dataset_dir, std::string name) {
-  auto dataset = getFsDataset(dataset_dir);
-  if (!dataset.ok()) {
-    return folly::makeUnexpected(dataset.status().ToString());
+BapidTable::fromFsDataset(const std::string &dataset_dir, std::string name,
+                          std::string ts_col_name) {
+  auto file_sys = fs::FileSystemFromUriOrPath(dataset_dir);
+  if (!file_sys.ok()) {
+    return folly::makeUnexpected(file_sys.status().ToString());
+  }
+
+  auto table = std::make_unique<BapidTable>(std::move(name), dataset_dir,
+                                            file_sys.MoveValueUnsafe(),
+                                            std::move(ts_col_name));
+  auto status = table->loadManifest();
+  if (status.ok()) {
+    return table;
+  }
+  XLOG(INFO) << "Table " << table->getName()
+             << " discovers its dataset: " << status.ToString();
+
+  auto refreshed = table->refresh();
+  if (refreshed.hasError()) {
+    return folly::makeUnexpected(std::move(refreshed.error()));
   }
 
-  return std::make_unique<BapidTable>(std::move(name),
-                                      dataset.MoveValueUnsafe());
+  return table;
 }
 
 BapidTable::BapidTable(std::string name, std::shared_ptr<ds::Dataset> dataset)
-    : name_{std::move(name)}, dataset_{std::move(dataset)} {}
+    : name_{std::move(name)}, state_{State{.dataset = std::move(dataset)}} {}
+
+BapidTable::BapidTable(std::string name, std::string dataset_dir,
+                       std::shared_ptr<fs::FileSystem> file_sys,
+                       std::string ts_col_name)
+    : name_{std::move(name)}, dataset_dir_{std::move(dataset_dir)},
+      file_sys_{std::move(file_sys)}, ts_col_name_{std::move(ts_col_name)} {}
+
+BapidTable::~BapidTable() {
+  flusher_.reset();
+  auto flushed = flush();
+  if (flushed.hasError()) {
+    XLOG(ERR) << "Table " << name_ << " loses " << numBufferedRows()
+              << " appended rows: " << flushed.error();
+  }
+}
+
+const std::string &BapidTable::getName() const { return name_; }
+
+std::shared_ptr<ds::Dataset> BapidTable::getDataset() const {
+  return state_.rlock()->dataset;
+}
+
+arrow::Status BapidTable::publish(State state,
+                                  std::shared_ptr<arrow::Schema> schema,
+                                  size_t num_flushed_batches) {
+  // String cols are read as dictionaries, whose codes filters and group-bys
+  // work on. The schema only changes from empty.
+  schema = withDictionaryStrings(schema);
+  std::unordered_set<std::string> dict_columns{};
+  for (const auto &field : schema->fields()) {
+    if (field->type()->id() == arrow::Type::DICTIONARY) {
+      dict_columns.emplace(field->name());
+    }
+  }
+  // Running scans may still read with the current format, hence a new one,
+  // along with the fragments remade with it
+  if (format_->reader_options.dict_columns != dict_columns) {
+    auto format = std::make_shared<ds::ParquetFileFormat>();
+    format->reader_options = format_->reader_options;
+    format->reader_options.dict_columns = std::move(dict_columns);
+    format->default_fragment_scan_options =
+        format_->default_fragment_scan_options;
+    for (auto &[_, file] : state.files) {
+      ARROW_ASSIGN_OR_RAISE(
+          file.fragment,
+          format->MakeFragment(file.fragment->source(),
+                               file.fragment->partition_expression()));
+    }
+    format_ = std::move(format);
+  }
+
+  std::vector<std::shared_ptr<ds::FileFragment>> fragments{};
+  fragments.reserve(state.files.size());
+  auto table_stats = std::make_shared<TableStats>();
+  table_stats->fragments.reserve(state.files.size());
+  for (const auto &[path, file] : state.files) {
+    fragments.emplace_back(file.fragment);
+    table_stats->fragments.emplace(path, file.stats);
+    if (file.bitmap_index) {
+      table_stats->bitmap_indexes.emplace(path, file.bitmap_index);
+    }
+    if (file.bloom_filters) {
+      table_stats->bloom_filters.emplace(path, file.bloom_filters);
+    }
+  }
+
+  table_stats->columns =
+      TableColumnStats::make(*schema, table_stats->fragments);
+  if (!ts_col_name_.empty()) {
+    ARROW_ASSIGN_OR_RAISE(
+        table_stats->time_index,
+        TimeIndex::make(*schema, ts_col_name_, table_stats->fragments));
+  }
+
+  ARROW_ASSIGN_OR_RAISE(
+      state.dataset,
+      ds::FileSystemDataset::Make(std::move(schema), cp::literal(true),
+                                  format_, file_sys_, std::move(fragments)));
+  state.table_stats = std::move(table_stats);
+
+  // Appends keep going meanwhile, so the buffer is the current one
+  const auto version = [&]() {
+    auto locked = state_.wlock();
+    state.buffer = std::move(locked->buffer);
+    state.buffer.drop(num_flushed_batches);
+    state.version = locked->version + 1;
+    *locked = std::move(state);
+    return locked->version;
+  }();
+  result_cache_.invalidate(version);
+  return arrow::Status::OK();
+}
+
+// The manifest is trusted as is: the files are neither listed nor opened until
+// the first refresh reconciles it with the dataset dir.
+arrow::Status BapidTable::loadManifest() {
+  std::lock_guard<std::mutex> refreshing{refresh_mutex_};
+  auto manifest = FragmentManifest::read(dataset_dir_);
+  if (manifest.hasError()) {
+    return arrow::Status::IOError(manifest.error());
+  }
+
+  State state{.dir_mtime = fs::TimePoint{
+                  fs::TimePoint::duration{manifest->dir_mtime_ns}}};
+  for (auto &stats : manifest->fragments) {
+    ARROW_ASSIGN_OR_RAISE(
+        auto fragment,
+        format_->MakeFragment(ds::FileSource(stats->fileInfo(), file_sys_)));
+    // Only the indexes are read
+    auto bitmap_index = stats->has_bitmap_index
+                            ? loadBitmapIndex(*file_sys_, *stats)
+                            : nullptr;
+    auto bloom_filters = stats->has_bloom_filters
+                             ? loadBloomFilters(*file_sys_, *stats)
+                             : nullptr;
+    state.files.emplace(stats->path,
+                        DiscoveredFile{std::move(fragment), std::move(stats),
+                                       std::move(bitmap_index),
+                                       std::move(bloom_filters)});
+  }
+
+  XLOG(INFO) << "Table " << name_ << ": " << state.files.size()
+             << " fragments loaded from the manifest";
+  return publish(std::move(state), std::move(manifest->schema));
+}
+
+arrow::Status BapidTable::refreshImpl() {
+  std::lock_guard<std::mutex> refreshing{refresh_mutex_};
+  last_refresh_ = std::chrono::steady_clock::now();
+  return refreshLocked(std::nullopt);
+}
+
+arrow::Status BapidTable::refreshLocked(std::optional<FlushedFile> flushed) {
+  ARROW_ASSIGN_OR_RAISE(auto dir_info, file_sys_->GetFileInfo(dataset_dir_));
+  const auto prev_state = state_.copy();
+  // The mtime of the dir may not tell a flush apart, e.g. if coarse
+  if (!flushed && prev_state.dataset &&
+      prev_state.dir_mtime == dir_info.mtime()) {
+    return arrow::Status::OK();
+  }
+
+  fs::FileSelector selector;
+  selector.base_dir = dataset_dir_;
+  ARROW_ASSIGN_OR_RAISE(auto infos, file_sys_->GetFileInfo(selector));
+  std::unordered_set<std::string> paths{};
+  for (const auto &info : infos) {
+    paths.emplace(info.path());
+  }
+
+  // Like the dataset factory, infers the schema from the first fragment unless
+  // it is already known
+  std::shared_ptr<arrow::Schema> schema{};
+  if (prev_state.dataset && prev_state.dataset->schema()->num_fields() > 0) {
+    schema = prev_state.dataset->schema();
+  }
+
+  // Only the files added since the last discovery are opened; the others keep
+  // their fragments and stats.
+  State state{.dir_mtime = dir_info.mtime()};
+  int num_added = 0;
+  int num_skipped = 0;
+  for (auto &info : infos) {
+    if (isIgnoredFile(info)) {
+      continue;
+    }
+
+    const auto has_bitmap_index =
+        paths.count(getBitmapIndexPath(info.path())) > 0;
+    const auto has_bloom_filters =
+        paths.count(getBloomFilterPath(info.path())) > 0;
+    auto prev = prev_state.files.find(info.path());
+    if (prev != prev_state.files.end() &&
+        prev->second.stats->size == info.size() &&
+        prev->second.stats->mtime_ns ==
+            info.mtime().time_since_epoch().count() &&
+        prev->second.stats->has_bitmap_index == has_bitmap_index &&
+        prev->second.stats->has_bloom_filters == has_bloom_filters) {
+      state.files.emplace(prev->first, prev->second);
+      continue;
+    }
+
+    auto discovered = [&]() -> arrow::Result<DiscoveredFile> {
+      ARROW_ASSIGN_OR_RAISE(auto fragment,
+                            format_->MakeFragment(
+                                ds::FileSource(info, file_sys_)));
+      auto parquet_fragment =
+          std::static_pointer_cast<ds::ParquetFileFragment>(fragment);
+      ARROW_RETURN_NOT_OK(parquet_fragment->EnsureCompleteMetadata());
+      auto file_schema = schema;
+      if (!file_schema) {
+        ARROW_ASSIGN_OR_RAISE(file_schema, fragment->ReadPhysicalSchema());
+      }
+
+      ARROW_ASSIGN_OR_RAISE(
+          auto stats, FragmentStats::fromParquetMetadata(
+                          info, *parquet_fragment->metadata(), *file_schema));
+      if (has_bitmap_index || has_bloom_filters) {
+        auto indexed_stats = std::make_shared<FragmentStats>(*stats);
+        indexed_stats->has_bitmap_index = has_bitmap_index;
+        indexed_stats->has_bloom_filters = has_bloom_filters;
+        stats = std::move(indexed_stats);
+      }
+      schema = std::move(file_schema);
+      auto bitmap_index =
+          has_bitmap_index ? loadBitmapIndex(*file_sys_, *stats) : nullptr;
+      auto bloom_filters =
+          has_bloom_filters ? loadBloomFilters(*file_sys_, *stats) : nullptr;
+      return DiscoveredFile{std::move(fragment), std::move(stats),
+                            std::move(bitmap_index),
+                            std::move(bloom_filters)};
+    }();
+    // A file that can not be read yet, e.g. still being copied, is left out
+    // rather than failing the queries, and tried again on the next refresh
+    if (!discovered.ok()) {
+      if (flushed && info.path() == flushed->path) {
+        return discovered.status();
+      }
+      XLOG(WARN) << "Table " << name_ << " skips " << info.path() << ": "
+                 << discovered.status().ToString();
+      state.dir_mtime = std::nullopt;
+      num_skipped++;
+      continue;
+    }
+    state.files.emplace(info.path(), discovered.MoveValueUnsafe());
+    num_added++;
+  }
+
+  if (!schema) {
+    schema = arrow::schema({});
+  }
+  if (flushed && state.files.count(flushed->path) == 0) {
+    return arrow::Status::IOError("flushed file ", flushed->path,
+                                  " is not in the dataset dir");
+  }
+
+  const auto changed =
+      num_added > 0 || state.files.size() != prev_state.files.size();
+  // Keeps the version, hence the cached and running queries
+  if (!changed && !flushed && prev_state.dataset) {
+    state_.wlock()->dir_mtime = state.dir_mtime;
+    return arrow::Status::OK();
+  }
+  XLOG(INFO) << "Table " << name_ << ": " << state.files.size()
+             << " fragments, " << num_added << " newly discovered and "
+             << num_skipped << " skipped";
+  if (changed) {
+    // Persisting the manifest is best effort, e.g. the dir may be read-only
+    FragmentManifest manifest{
+        .schema = schema,
+        .dir_mtime_ns = dir_info.mtime().time_since_epoch().count(),
+    };
+    for (const auto &[_, file] : state.files) {
+      manifest.fragments.emplace_back(file.stats);
+    }
+
+    auto written = manifest.write(dataset_dir_);
+    if (written.hasError()) {
+      XLOG(WARN) << "Table " << name_
+                 << " fails to write its manifest: " << written.error();
+    }
+    // Writing the manifest changes the mtime of the dir, which must not tell
+    // the next refresh to list it again
+    auto written_dir_info = file_sys_->GetFileInfo(dataset_dir_);
+    if (written.hasValue() && written_dir_info.ok() && state.dir_mtime) {
+      state.dir_mtime = written_dir_info->mtime();
+    }
+  }
+
+  return publish(std::move(state), std::move(schema),
+                 flushed ? flushed->num_batches : 0);
+}
+
+folly::Expected<folly::Unit, std::string> BapidTable::refresh() {
+  if (!file_sys_) {
+    return folly::Unit{};
+  }
+
+  auto status = refreshImpl();
+  if (!status.ok()) {
+    return folly::makeUnexpected(status.ToString());
+  }
+
+  return folly::Unit{};
+}
+
+void BapidTable::refreshIfStale() {
+  if (!file_sys_) {
+    return;
+  }
+  const auto now = std::chrono::steady_clock::now();
+  if (now - last_refresh_.load() <
+      std::chrono::milliseconds{FLAGS_refresh_interval_ms}) {
+    return;
+  }
+  // Queries do not wait for a refresh another one runs
+  std::unique_lock<std::mutex> refreshing{refresh_mutex_, std::try_to_lock};
+  if (!refreshing.owns_lock()) {
+    return;
+  }
+
+  last_refresh_ = now;
+  auto status = refreshLocked(std::nullopt);
+  if (!status.ok()) {
+    XLOG(WARN) << "Table " << name_
+               << " keeps its dataset, as it fails to refresh: "
+               << status.ToString();
+  }
+}
 
 SamplesQuery BapidTable::newSamplesQueryX() {
-  return SamplesQuery::fromDataset(dataset_).value();
+  auto state = state_.rlock();
+  auto query =
+      SamplesQuery::fromDataset(state->dataset, state->table_stats).value();
+  query.scanBuffered(state->buffer.batches());
+  return query;
+}
+
+namespace {
+// Applies the filters and the time range that all query requests have
+template <typename Query, typename Request>
+folly::Expected<folly::Unit, std::string>
+applyFilters(Query &query, const Request &request) {
+  try {
+    for (const auto &filter : request.int_filters()) {
+      query.filter(filter);
+    }
+    for (const auto &filter : request.str_filters()) {
+      query.filter(filter);
+    }
+  } catch (const std::runtime_error &e) {
+    return folly::makeUnexpected(std::string{e.what()});
+  }
+
+  if (request.min_ts() != 0 || request.has_max_ts()) {
+    query.timeRange(request.min_ts(), request.has_max_ts()
+                                          ? std::make_optional(request.max_ts())
+                                          : std::nullopt);
+  }
+  return folly::unit;
+}
+
+// Unset rates keep everything
+Sampling getSampling(const bapidrpc::Sampling &sampling) {
+  return Sampling{
+      .row_group_rate =
+          sampling.row_group_rate() == 0 ? 1 : sampling.row_group_rate(),
+      .row_rate = sampling.row_rate() == 0 ? 1 : sampling.row_rate(),
+      .seed = sampling.has_seed() ? std::make_optional(sampling.seed())
+                                  : std::nullopt,
+  };
+}
+
+// Applies the group-by cols and the aggregations of an aggregation request
+template <typename Query, typename Request>
+folly::Expected<folly::Unit, std::string>
+applyAggregations(Query &query, const Request &request) {
+  try {
+    for (const auto &col : request.group_by()) {
+      query.groupBy(col);
+    }
+    for (const auto &aggregation : request.aggregations()) {
+      if (aggregation.op() == bapidrpc::AggOp::PERCENTILE) {
+        query.percentile(aggregation.col(), aggregation.percentile());
+        continue;
+      }
+      query.aggregate(aggregation.op(), aggregation.col());
+    }
+  } catch (const std::runtime_error &e) {
+    return folly::makeUnexpected(std::string{e.what()});
+  }
+
+  if (request.has_approximation()) {
+    const auto &approximation = request.approximation();
+    query.approximate(Approximation{
+        .sample_rate = approximation.has_sample_rate()
+                           ? std::make_optional(approximation.sample_rate())
+                           : std::nullopt,
+        .target_error = approximation.has_target_error()
+                            ? std::make_optional(approximation.target_error())
+                            : std::nullopt,
+        .seed = approximation.has_seed()
+                    ? std::make_optional(approximation.seed())
+                    : std::nullopt,
+    });
+  }
+  return folly::unit;
+}
+} // namespace
+
+folly::Expected<SamplesQuery, std::string>
+BapidTable::newSamplesQuery(const bapidrpc::SamplesQuery &query) {
+  auto samples_query = newQuery();
+  if (samples_query.hasError()) {
+    return samples_query;
+  }
+
+  auto applied = applyFilters(samples_query.value(), query);
+  if (applied.hasError()) {
+    return folly::makeUnexpected(std::move(applied.error()));
+  }
+
+  for (const auto &name : query.int_col_names()) {
+    samples_query->project(INT_COL(name));
+  }
+  for (const auto &name : query.dbl_col_names()) {
+    samples_query->project(DBL_COL(name));
+  }
+  for (const auto &name : query.istr_col_names()) {
+    samples_query->project(STR_COL(name));
+  }
+
+  if (query.has_limit()) {
+    samples_query->take(query.limit());
+  }
+  if (query.has_sampling()) {
+    samples_query->sample(getSampling(query.sampling()));
+  }
+  if (query.has_order_by()) {
+    samples_query->orderBy(query.order_by().col(), query.order_by().desc());
+  }
+
+  return samples_query;
+}
+
+namespace {
+// A copy of `query` without its table, with its filters and their values in
+// a canonical order, which does not change the result set
+template <typename Request> Request canonicalize(const Request &query) {
+  auto canonical = query;
+  canonical.clear_table();
+  auto sortFilters = [](auto *filters) {
+    for (auto &filter : *filters) {
+      std::sort(filter.mutable_int_vals()->begin(),
+                filter.mutable_int_vals()->end());
+      std::sort(filter.mutable_double_vals()->begin(),
+                filter.mutable_double_vals()->end());
+      std::sort(filter.mutable_str_vals()->begin(),
+                filter.mutable_str_vals()->end());
+    }
+    std::sort(filters->begin(), filters->end(),
+              [](const auto &a, const auto &b) {
+                return a.SerializeAsString() < b.SerializeAsString();
+              });
+  };
+  sortFilters(canonical.mutable_int_filters());
+  sortFilters(canonical.mutable_str_filters());
+  return canonical;
+}
+
+// The same for samples queries that only differ by the order of their filters
+// and projected cols. Samples differ from one run to the next, even seeded
+// ones, so are not cached.
+std::optional<std::string>
+getResultCacheKey(const bapidrpc::SamplesQuery &query) {
+  if (query.has_sampling()) {
+    return std::nullopt;
+  }
+
+  auto canonical = canonicalize(query);
+  for (auto *names :
+       {canonical.mutable_int_col_names(), canonical.mutable_dbl_col_names(),
+        canonical.mutable_istr_col_names()}) {
+    std::sort(names->begin(), names->end());
+  }
+  return canonical.SerializeAsString();
+}
+
+// Orders the cols of a cached result set as `query` projects them
+arrow::Result<std::shared_ptr<arrow::Table>>
+reorderCols(const std::shared_ptr<arrow::Table> &result_set,
+            const bapidrpc::SamplesQuery &query) {
+  const auto &schema = *result_set->schema();
+  std::vector<int> indices{};
+  std::vector<bool> selected(schema.num_fields(), false);
+  for (const auto *names : {&query.int_col_names(), &query.dbl_col_names(),
+                            &query.istr_col_names()}) {
+    for (const auto &name : *names) {
+      const auto index = schema.GetFieldIndex(name);
+      if (index < 0) {
+        return arrow::Status::Invalid("no unique col ", name);
+      }
+      indices.emplace_back(index);
+      selected[index] = true;
+    }
+  }
+  // e.g. the order by col if not projected
+  for (int i = 0; i < schema.num_fields(); i++) {
+    if (!selected[i]) {
+      indices.emplace_back(i);
+    }
+  }
+  return result_set->SelectColumns(indices);
+}
+} // namespace
+
+uint64_t BapidTable::getVersion() const { return state_.rlock()->version; }
+
+std::shared_ptr<arrow::Table>
+BapidTable::getCachedResultSet(const bapidrpc::SamplesQuery &query,
+                               uint64_t version) {
+  const auto key = getResultCacheKey(query);
+  auto result_set = key ? result_cache_.get(*key, version) : nullptr;
+  if (!result_set) {
+    return nullptr;
+  }
+
+  auto reordered = reorderCols(result_set, query);
+  return reordered.ok() ? reordered.MoveValueUnsafe() : nullptr;
+}
+
+void BapidTable::cacheResultSet(const bapidrpc::SamplesQuery &query,
+                                uint64_t version,
+                                std::shared_ptr<arrow::Table> result_set) {
+  if (auto key = getResultCacheKey(query)) {
+    result_cache_.put(*key, version, std::move(result_set));
+  }
+}
+
+int64_t BapidTable::maxCachedResultSetBytes() const {
+  return result_cache_.maxEntryBytes();
+}
+
+namespace {
+// Identifies the queries of a kind with the same result set on `version` of
+// the table. Unlike the result cache key, the order of the projected cols
+// matters, as the batches are shared as they are.
+template <typename Request>
+std::string getSingleFlightKey(std::string_view kind, uint64_t version,
+                               const Request &query) {
+  return folly::to<std::string>(kind, ":", version, ":",
+                                canonicalize(query).SerializeAsString());
+}
+
+template <typename Query>
+folly::Expected<BatchStream, std::string>
+startQuery(folly::Expected<Query, std::string> query) {
+  if (query.hasError()) {
+    return folly::makeUnexpected(std::move(query.error()));
+  }
+
+  auto runnable = std::move(query.value()).finalize();
+  if (runnable.hasError()) {
+    return folly::makeUnexpected(std::move(runnable.error()));
+  }
+
+  auto schema = runnable->schema();
+  return BatchStream{
+      std::move(schema),
+      [runnable = std::move(runnable.value())]() mutable {
+        return runnable.next();
+      }};
+}
+} // namespace
+
+folly::SemiFuture<SingleFlight::ReaderOrError>
+BapidTable::runSamplesQuery(const bapidrpc::SamplesQuery &query,
+                            uint64_t version) {
+  return single_flight_.join(
+      getSingleFlightKey("samples", version, query),
+      [this, &query]() { return startQuery(newSamplesQuery(query)); });
+}
+
+folly::SemiFuture<SingleFlight::ReaderOrError>
+BapidTable::runTableQuery(const bapidrpc::TableQuery &query,
+                          uint64_t version) {
+  return single_flight_.join(
+      getSingleFlightKey("table", version, query),
+      [this, &query]() { return startQuery(newTableQuery(query)); });
+}
+
+folly::SemiFuture<SingleFlight::ReaderOrError>
+BapidTable::runTimelineQuery(const bapidrpc::TimelineQuery &query,
+                             uint64_t version) {
+  return single_flight_.join(
+      getSingleFlightKey("timeline", version, query),
+      [this, &query]() { return startQuery(newTimelineQuery(query)); });
+}
+
+folly::Expected<CompactionStats, std::string>
+BapidTable::compact(CompactionOptions options) {
+  // The output would otherwise be discovered as a part of the dataset
+  if (!dataset_dir_.empty() &&
+      (options.out_dir == dataset_dir_ ||
+       options.out_dir.rfind(dataset_dir_ + "/", 0) == 0)) {
+    return folly::makeUnexpected(
+        std::string{"cannot compact a dataset into its own dir"});
+  }
+  if (options.sort_col.empty()) {
+    options.sort_col = ts_col_name_;
+  }
+  // The compaction only reads the files
+  auto flushed = flush();
+  if (flushed.hasError()) {
+    return folly::makeUnexpected(std::move(flushed.error()));
+  }
+
+  auto [dataset, table_stats] = [&]() {
+    auto state = state_.rlock();
+    return std::make_pair(state->dataset, state->table_stats);
+  }();
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  if (!fs_dataset) {
+    return folly::makeUnexpected(std::string{"not a file system dataset"});
+  }
+
+  auto stats = compactDataset(
+      *fs_dataset, table_stats ? &table_stats->fragments : nullptr, options);
+  if (!stats.ok()) {
+    return folly::makeUnexpected(stats.status().ToString());
+  }
+  return stats.MoveValueUnsafe();
+}
+
+folly::Expected<SamplesQuery, std::string> BapidTable::newQuery() {
+  auto samples_query = [&]() {
+    auto state = state_.rlock();
+    auto query = SamplesQuery::fromDataset(state->dataset, state->table_stats);
+    if (query.hasValue()) {
+      query->scanBuffered(state->buffer.batches());
+    }
+    return query;
+  }();
+  if (samples_query.hasValue() && FLAGS_shared_scan_window_ms > 0) {
+    samples_query->shareScan(shared_scan_);
+  }
+  if (samples_query.hasValue() && FLAGS_hot_tier_bytes > 0) {
+    samples_query->useHotTier(hot_tier_);
+  }
+  return samples_query;
+}
+
+folly::Expected<TableQuery, std::string>
+BapidTable::newTableQuery(const bapidrpc::TableQuery &query) {
+  auto samples_query = newQuery();
+  if (samples_query.hasError()) {
+    return folly::makeUnexpected(std::move(samples_query.error()));
+  }
+
+  auto table_query = TableQuery{std::move(samples_query.value())};
+  auto applied = applyFilters(table_query, query);
+  if (applied.hasValue()) {
+    applied = applyAggregations(table_query, query);
+  }
+  if (applied.hasError()) {
+    return folly::makeUnexpected(std::move(applied.error()));
+  }
+  return table_query;
+}
+
+folly::Expected<TimelineQuery, std::string>
+BapidTable::newTimelineQuery(const bapidrpc::TimelineQuery &query) {
+  auto samples_query = newQuery();
+  if (samples_query.hasError()) {
+    return folly::makeUnexpected(std::move(samples_query.error()));
+  }
+
+  auto timeline_query =
+      TimelineQuery{std::move(samples_query.value()), query.granularity()};
+  auto applied = applyFilters(timeline_query, query);
+  if (applied.hasValue()) {
+    applied = applyAggregations(timeline_query, query);
+  }
+  if (applied.hasError()) {
+    return folly::makeUnexpected(std::move(applied.error()));
+  }
+  return timeline_query;
 }
 
 namespace {
 arrow::Result<SamplesQuery>
-samplesQueryfromDatasetImpl(std::shared_ptr<ds::Dataset> dataset) {
+samplesQueryfromDatasetImpl(
+    std::shared_ptr<ds::Dataset> dataset,
+    std::shared_ptr<const TableStats> table_stats) {
   auto *registry = cp::default_exec_factory_registry();
   ds::internal::InitializeScanner(registry);
+  registerFusedFilterNode(registry);
+  registerBernoulliSampleNode(registry);
+  registerTopKNode(registry);
+  registerSketchFunctions();
+  registerDictionaryFunctions();
   ARROW_ASSIGN_OR_RAISE(auto plan,
                         cp::ExecPlan::Make(cp::default_exec_context()));
 
-  return SamplesQuery{registry, std::move(plan), std::move(dataset)};
+  return SamplesQuery{registry, std::move(plan), std::move(dataset),
+                      std::move(table_stats)};
 }
 } // namespace
 
 /*static*/ folly::Expected<SamplesQuery, std::string>
-SamplesQuery::fromDataset(std::shared_ptr<ds::Dataset> dataset) {
-  auto samples_query = samplesQueryfromDatasetImpl(std::move(dataset));
+SamplesQuery::fromDataset(
+    std::shared_ptr<ds::Dataset> dataset,
+    std::shared_ptr<const TableStats> table_stats) {
+  auto samples_query = samplesQueryfromDatasetImpl(std::move(dataset),
+                                                   std::move(table_stats));
   if (!samples_query.ok()) {
     return folly::makeUnexpected(samples_query.status().ToString());
   }
@@ -113,30 +915,129 @@ SamplesQuery::fromDataset(std::shared_ptr<ds::Dataset> dataset) {
   return samples_query.MoveValueUnsafe();
 }
 
-SamplesQuery::SamplesQuery(cp::ExecFactoryRegistry *registry,
-                           std::shared_ptr<cp::ExecPlan> plan,
-                           std::shared_ptr<ds::Dataset> dataset)
-    : registry_(registry), plan_{std::move(plan)}, dataset_{
-                                                       std::move(dataset)} {}
+SamplesQuery::SamplesQuery(
+    cp::ExecFactoryRegistry *registry, std::shared_ptr<cp::ExecPlan> plan,
+    std::shared_ptr<ds::Dataset> dataset,
+    std::shared_ptr<const TableStats> table_stats)
+    : registry_(registry), plan_{std::move(plan)}, dataset_{std::move(dataset)},
+      table_stats_{std::move(table_stats)} {}
 
 namespace {
-// TODO(liuz): implement
+// The values of a filter as literals, whichever of int_vals, double_vals and
+// str_vals it sets
+std::vector<cp::Expression> getFilterLiterals(const bapidrpc::Filter &filter) {
+  std::vector<cp::Expression> literals{};
+  for (const auto val : filter.int_vals()) {
+    literals.emplace_back(cp::literal(val));
+  }
+  for (const auto val : filter.double_vals()) {
+    literals.emplace_back(cp::literal(val));
+  }
+  for (const auto &val : filter.str_vals()) {
+    literals.emplace_back(cp::literal(val));
+  }
+  return literals;
+}
+
+// The values of a filter as the value set of a set lookup
+std::shared_ptr<arrow::Array>
+getFilterValueSet(const bapidrpc::Filter &filter) {
+  auto build = [](arrow::ArrayBuilder &builder, const arrow::Status &status)
+      -> std::shared_ptr<arrow::Array> {
+    if (!status.ok()) {
+      throw std::runtime_error(status.ToString());
+    }
+    return builder.Finish().ValueOrDie();
+  };
+
+  if (!filter.int_vals().empty()) {
+    auto builder = arrow::Int64Builder{};
+    return build(builder, builder.AppendValues(filter.int_vals().begin(),
+                                               filter.int_vals().end()));
+  }
+  if (!filter.double_vals().empty()) {
+    auto builder = arrow::DoubleBuilder{};
+    return build(builder, builder.AppendValues(filter.double_vals().begin(),
+                                               filter.double_vals().end()));
+  }
+  auto builder = arrow::StringBuilder{};
+  return build(builder,
+               builder.AppendValues(std::vector<std::string>{
+                   filter.str_vals().begin(), filter.str_vals().end()}));
+}
+
+// A multi-valued EQ is a single set lookup rather than an OR of comparisons.
+// The hash set of the values is built once when the filter node binds the
+// expression, then probed once per row.
+cp::Expression getArrowExpForSetLookup(const bapidrpc::Filter &filter) {
+  auto is_in =
+      cp::call("is_in", {cp::field_ref(filter.col_name())},
+               cp::SetLookupOptions{getFilterValueSet(filter),
+                                    /*skip_nulls=*/true});
+  if (filter.op() == bapidrpc::FilterOp::EQ) {
+    return is_in;
+  }
+  // Like NE on a single value, NOT IN drops the rows where the col is null
+  return cp::and_(cp::is_valid(cp::field_ref(filter.col_name())),
+                  cp::call("invert", {std::move(is_in)}));
+}
+
 cp::Expression getArrowExpForFilter(const bapidrpc::Filter &filter) {
+  auto field = cp::field_ref(filter.col_name());
+  switch (filter.op()) {
+  case bapidrpc::FilterOp::NULL_:
+    return cp::is_null(std::move(field));
+  case bapidrpc::FilterOp::NONNULL:
+    return cp::is_valid(std::move(field));
+  default:
+    break;
+  }
+
+  auto literals = getFilterLiterals(filter);
+  if (literals.empty()) {
+    throw std::runtime_error("no value for filter on " + filter.col_name());
+  }
+
+  if (literals.size() > 1) {
+    if (filter.op() != bapidrpc::FilterOp::EQ &&
+        filter.op() != bapidrpc::FilterOp::NE) {
+      throw std::runtime_error("multiple values for filter on " +
+                               filter.col_name());
+    }
+    return getArrowExpForSetLookup(filter);
+  }
+
+  auto &literal = literals[0];
   switch (filter.op()) {
+  case bapidrpc::FilterOp::EQ:
+    return cp::equal(std::move(field), std::move(literal));
+  case bapidrpc::FilterOp::NE:
+    return cp::not_equal(std::move(field), std::move(literal));
+  case bapidrpc::FilterOp::LT:
+    return cp::less(std::move(field), std::move(literal));
   case bapidrpc::FilterOp::GT:
-    return cp::greater(cp::field_ref(filter.col_name()),
-                       cp::literal(filter.double_vals(0)));
+    return cp::greater(std::move(field), std::move(literal));
+  case bapidrpc::FilterOp::LE:
+    return cp::less_equal(std::move(field), std::move(literal));
+  case bapidrpc::FilterOp::GE:
+    return cp::greater_equal(std::move(field), std::move(literal));
   default:
     throw std::runtime_error("unimplemented");
   }
 }
 
-const std::shared_ptr<arrow::DataType> &
+std::shared_ptr<arrow::DataType>
 getArrowTypeForCol(const bapidrpc::Col &col) {
   switch (col.type()) {
+  case bapidrpc::ColType::INT: {
+    return arrow::int64();
+  }
   case bapidrpc::ColType::DOUBLE: {
     return arrow::float64();
   }
+  case bapidrpc::ColType::STR: {
+    return arrow::utf8();
+  }
   default:
     throw std::runtime_error("unimplemented");
   }
@@ -150,118 +1051,1964 @@ SamplesQuery &SamplesQuery::filter(const bapidrpc::Filter &filter) {
 }
 
 SamplesQuery &SamplesQuery::project(const bapidrpc::Col &col) {
-  projects_.push_back(cp::field_ref(col.name()));
+  auto type = getArrowTypeForCol(col);
+  // Casts to the type of the col so that the result set always matches its
+  // schema, whatever physical type the fragments store the col as
+  projects_.push_back(cp::call("cast", {cp::field_ref(col.name())},
+                               cp::CastOptions::Safe(type)));
   fields_.emplace(col.name());
-  result_set_schema_.push_back(
-      arrow::field(col.name(), getArrowTypeForCol(col)));
+  result_set_schema_.push_back(arrow::field(col.name(), std::move(type)));
   return *this;
 }
 
-folly::Expected<SamplesQuery::RunnableQuery, std::string>
-SamplesQuery::finalize() && {
-  auto options = std::make_shared<ds::ScanOptions>();
+namespace {
+// Below this estimated selectivity, queries use a two-phase scan
+constexpr double kMaxLateMaterializationSelectivity = 0.01;
 
-  std::vector<cp::Expression> scanner_projects{};
-  std::transform(fields_.begin(), fields_.end(),
-                 std::back_inserter(scanner_projects),
-                 [](const auto &field) { return cp::field_ref(field); });
+// What the scan planning of a query prunes fragments and row groups by
+struct PruningCtx {
+  const arrow::Schema &schema;
+  const TableStats *table_stats;
+  const std::optional<TimeWindow> &time_window;
+  // Whose EQ and IN on indexed cols the bitmap indexes match
+  const std::vector<cp::Expression> &filters;
+  // Whether the row groups all of whose rows match are counted rather than
+  // scanned, by a count-only query
+  bool count_by_stats{false};
+  // Indices of the fields of `schema` the filter refers to
+  std::vector<int> filter_fields{};
+};
 
-  options->projection = cp::project(std::move(scanner_projects), {});
-  arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen;
+// What the indexes of a fragment tell about its rows that match the filters
+struct IndexMatches {
+  // The rows its bitmap index matches
+  std::optional<RowBitmap> rows{};
+  // Whether each row group may match, by its Bloom filters
+  std::optional<std::vector<bool>> row_groups{};
+};
 
-  decls_.emplace_back("scan", ds::ScanNodeOptions{
-                                  dataset_,
-                                  options,
-                              });
-  for (const auto &filter : filters_) {
-    decls_.emplace_back("filter", cp::FilterNodeOptions{filter});
+// Returns the fragment narrowed to the row groups that may match `filter`, or
+// nullptr if none may. Uses the known stats of the fragment if any, so that
+// the fragment is not opened, and otherwise the stats in its footer. The
+// `index_matches` only apply along with known stats. With `count_by_stats`,
+// the row groups all of whose rows match are counted into `stats` and dropped.
+arrow::Result<std::shared_ptr<ds::FileFragment>>
+pruneRowGroups(const std::shared_ptr<ds::ParquetFileFragment> &fragment,
+               const cp::Expression &filter,
+               const FragmentStats *fragment_stats,
+               const TimeIndex::FragmentTimeRanges *time_ranges,
+               const IndexMatches &index_matches, const PruningCtx &ctx,
+               ScanStats &stats) {
+  // A count needs the rows of each row group, hence the stats of the footer
+  std::shared_ptr<const FragmentStats> footer_stats{};
+  if (!fragment_stats && ctx.count_by_stats) {
+    ARROW_RETURN_NOT_OK(fragment->EnsureCompleteMetadata());
+    ARROW_ASSIGN_OR_RAISE(footer_stats,
+                          FragmentStats::fromParquetMetadata(
+                              fs::FileInfo{fragment->source().path()},
+                              *fragment->metadata(), ctx.schema));
+    fragment_stats = footer_stats.get();
   }
 
-  decls_.emplace_back("project", cp::ProjectNodeOptions{projects_});
-  decls_.emplace_back("sink", cp::SinkNodeOptions{&sink_gen});
+  if (!fragment_stats) {
+    ARROW_RETURN_NOT_OK(fragment->EnsureCompleteMetadata());
+    const auto num_row_groups =
+        fragment->row_groups().empty()
+            ? int64_t{fragment->metadata()->num_row_groups()}
+            : static_cast<int64_t>(fragment->row_groups().size());
+    ARROW_ASSIGN_OR_RAISE(auto subset, fragment->Subset(filter));
+    const auto num_selected = static_cast<int64_t>(
+        std::static_pointer_cast<ds::ParquetFileFragment>(subset)
+            ->row_groups()
+            .size());
 
-  auto result =
-      cp::Declaration::Sequence(std::move(decls_)).AddToPlan(plan_.get());
+    stats.num_row_groups += num_row_groups;
+    stats.num_row_groups_skipped += num_row_groups - num_selected;
+    if (num_selected == 0) {
+      return nullptr;
+    }
+    return std::static_pointer_cast<ds::FileFragment>(std::move(subset));
+  }
 
-  if (!result.ok()) {
-    return folly::makeUnexpected(result.status().ToString());
+  auto row_groups = fragment->row_groups();
+  if (row_groups.empty()) {
+    row_groups.resize(fragment_stats->row_groups.size());
+    std::iota(row_groups.begin(), row_groups.end(), 0);
   }
 
-  return SamplesQuery::RunnableQuery{
-      std::move(plan_), arrow::schema(std::move(result_set_schema_)),
-      std::move(sink_gen), take_};
-}
+  std::vector<int64_t> row_offsets{0};
+  if (index_matches.rows) {
+    for (const auto &row_group_stats : fragment_stats->row_groups) {
+      row_offsets.emplace_back(row_offsets.back() + row_group_stats.num_rows);
+    }
+  }
 
-SamplesQuery::RunnableQuery::RunnableQuery(
-    std::shared_ptr<cp::ExecPlan> plan, std::shared_ptr<arrow::Schema> schema,
-    arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen,
-    std::optional<int> take)
-    : plan_{std::move(plan)}, schema_{std::move(schema)},
-      sink_gen_{std::move(sink_gen)}, take_{take} {}
+  std::vector<int> selected{};
+  size_t num_counted = 0;
+  for (const auto row_group : row_groups) {
+    // The time index is checked first as it is a plain comparison
+    if (ctx.time_window && time_ranges &&
+        time_ranges->row_groups[row_group] &&
+        !ctx.time_window->overlaps(*time_ranges->row_groups[row_group])) {
+      stats.num_row_groups_skipped_by_time++;
+      continue;
+    }
 
-namespace {
-arrow::Result<std::shared_ptr<arrow::Table>>
-genImpl(const std::shared_ptr<cp::ExecPlan> &plan,
-        std::shared_ptr<arrow::Schema> schema,
-        arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen) {
-  auto sink_reader =
-      cp::MakeGeneratorReader(std::move(schema), std::move(sink_gen),
-                              cp::default_exec_context()->memory_pool());
+    if (index_matches.rows &&
+        !index_matches.rows->intersects(row_offsets[row_group],
+                                        row_offsets[row_group + 1])) {
+      stats.num_row_groups_skipped_by_index++;
+      continue;
+    }
 
-  ARROW_RETURN_NOT_OK(plan->StartProducing());
-  std::shared_ptr<arrow::Table> result_set;
-  ARROW_ASSIGN_OR_RAISE(result_set,
-                        arrow::Table::FromRecordBatchReader(sink_reader.get()));
-  plan->StopProducing();
+    if (index_matches.row_groups &&
+        !(*index_matches.row_groups)[row_group]) {
+      stats.num_row_groups_skipped_by_bloom_filter++;
+      continue;
+    }
 
-  const auto future = plan->finished();
-  ARROW_RETURN_NOT_OK(future.status());
-  return result_set;
-}
-} // namespace
+    ARROW_ASSIGN_OR_RAISE(
+        auto simplified_filter,
+        cp::SimplifyWithGuarantee(filter, fragment_stats->rowGroupGuarantee(
+                                              row_group, ctx.schema,
+                                              ctx.filter_fields)));
+    if (!simplified_filter.IsSatisfiable()) {
+      continue;
+    }
+    if (ctx.count_by_stats && simplified_filter.Equals(cp::literal(true))) {
+      stats.num_row_groups_counted_by_stats++;
+      stats.num_rows_counted_by_stats +=
+          fragment_stats->row_groups[row_group].num_rows;
+      num_counted++;
+      continue;
+    }
+    selected.emplace_back(row_group);
+  }
 
-folly::Expected<std::shared_ptr<arrow::Table>, std::string>
-SamplesQuery::RunnableQuery::gen() && {
-  auto result_set = genImpl(plan_, std::move(schema_), std::move(sink_gen_));
-  if (!result_set.ok()) {
-    return folly::makeUnexpected(result_set.status().ToString());
+  stats.num_row_groups += static_cast<int64_t>(row_groups.size());
+  stats.num_row_groups_skipped += static_cast<int64_t>(
+      row_groups.size() - selected.size() - num_counted);
+  if (selected.empty()) {
+    return nullptr;
   }
 
-  if (!take_) {
-    return result_set.MoveValueUnsafe();
+  if (selected.size() == row_groups.size()) {
+    return std::static_pointer_cast<ds::FileFragment>(fragment);
   }
 
-  return result_set.MoveValueUnsafe()->Slice(0, take_.value());
+  auto &format = static_cast<ds::ParquetFileFormat &>(*fragment->format());
+  ARROW_ASSIGN_OR_RAISE(
+      auto subset,
+      format.MakeFragment(fragment->source(), fragment->partition_expression(),
+                          /*physical_schema=*/nullptr, std::move(selected)));
+  return std::static_pointer_cast<ds::FileFragment>(std::move(subset));
 }
 
-SamplesQuery &SamplesQuery::take(int to_take) {
-  take_ = to_take;
-  return *this;
-}
+// Drops the fragments whose partition guarantee contradicts `filter`, those
+// outside the time window, and the row groups whose statistics contradict
+// `filter`, so that the scan never opens them.
+arrow::Result<std::shared_ptr<ds::Dataset>>
+pruneDataset(const std::shared_ptr<ds::Dataset> &dataset,
+             const cp::Expression &filter, PruningCtx &ctx, ScanStats &stats) {
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  if (!fs_dataset) {
+    return dataset;
+  }
 
-bapidrpc::Col DBL_COL(std::string name) {
-  auto col = bapidrpc::Col{};
-  col.set_name(std::move(name));
-  col.set_type(bapidrpc::ColType::DOUBLE);
-  return col;
-}
+  ARROW_ASSIGN_OR_RAISE(auto bound_filter, filter.Bind(ctx.schema));
+  for (const auto &ref : cp::FieldsInExpression(bound_filter)) {
+    ARROW_ASSIGN_OR_RAISE(auto path, ref.FindOne(ctx.schema));
+    ctx.filter_fields.emplace_back(path[0]);
+  }
 
-bapidrpc::Filter DBL_GT(std::string name, double val) {
-  auto filter = bapidrpc::Filter{};
-  filter.set_col_name(std::move(name));
-  filter.set_op(bapidrpc::FilterOp::GT);
-  filter.add_double_vals(val);
-  return filter;
-}
+  const auto *time_index =
+      ctx.table_stats ? ctx.table_stats->time_index.get() : nullptr;
+  ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
+  std::vector<std::shared_ptr<ds::FileFragment>> pruned_fragments{};
+  for (const auto &maybe_fragment : fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    stats.num_fragments++;
 
-void test_arrow() {
-  BapidTable::describeFsDataset(FLAGS_dataset_dir);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    const auto *time_ranges =
+        parquet_fragment && time_index
+            ? time_index->find(parquet_fragment->source().path())
+            : nullptr;
+    if (ctx.time_window && time_ranges && time_ranges->fragment &&
+        !ctx.time_window->overlaps(*time_ranges->fragment)) {
+      stats.num_fragments_skipped++;
+      stats.num_fragments_skipped_by_time++;
+      continue;
+    }
 
-  auto table = BapidTable::fromFsDataset(FLAGS_dataset_dir, "taxi");
-  XCHECK(table.hasValue());
+    ARROW_ASSIGN_OR_RAISE(
+        auto simplified_filter,
+        cp::SimplifyWithGuarantee(bound_filter,
+                                  fragment->partition_expression()));
+    if (!simplified_filter.IsSatisfiable()) {
+      stats.num_fragments_skipped++;
+      continue;
+    }
+
+    if (!parquet_fragment) {
+      pruned_fragments.emplace_back(
+          std::static_pointer_cast<ds::FileFragment>(fragment));
+      continue;
+    }
+
+    const FragmentStats *known_stats = nullptr;
+    if (ctx.table_stats) {
+      const auto &fragment_stats = ctx.table_stats->fragments;
+      auto it = fragment_stats.find(parquet_fragment->source().path());
+      known_stats = it == fragment_stats.end() ? nullptr : it->second.get();
+    }
+
+    // Only for fragments whose stats tell where their row groups start
+    IndexMatches index_matches{};
+    if (known_stats && !ctx.filters.empty()) {
+      const auto &path = parquet_fragment->source().path();
+      const auto *bitmap_index =
+          folly::get_ptr(ctx.table_stats->bitmap_indexes, path);
+      if (bitmap_index) {
+        index_matches.rows = (*bitmap_index)->match(ctx.filters);
+      }
+      const auto *bloom_filters =
+          folly::get_ptr(ctx.table_stats->bloom_filters, path);
+      if (bloom_filters) {
+        index_matches.row_groups = (*bloom_filters)->match(ctx.filters);
+      }
+    }
+
+    const auto num_counted = stats.num_row_groups_counted_by_stats;
+    ARROW_ASSIGN_OR_RAISE(
+        auto pruned_fragment,
+        pruneRowGroups(parquet_fragment, simplified_filter, known_stats,
+                       time_ranges, index_matches, ctx, stats));
+    if (!pruned_fragment) {
+      // Unless its rows were counted
+      if (stats.num_row_groups_counted_by_stats == num_counted) {
+        stats.num_fragments_skipped++;
+      }
+      continue;
+    }
+
+    pruned_fragments.emplace_back(std::move(pruned_fragment));
+  }
+
+  return ds::FileSystemDataset::Make(
+      dataset->schema(), dataset->partition_expression(), fs_dataset->format(),
+      fs_dataset->filesystem(), std::move(pruned_fragments),
+      fs_dataset->partitioning());
+}
+
+// The row groups of a fragment, from its known stats if any so that its footer
+// is not read
+arrow::Result<std::vector<int>>
+getRowGroups(ds::ParquetFileFragment &fragment, const TableStats *table_stats) {
+  if (!fragment.row_groups().empty()) {
+    return fragment.row_groups();
+  }
+
+  int num_row_groups = 0;
+  const auto *known_stats =
+      table_stats ? folly::get_ptr(table_stats->fragments,
+                                   fragment.source().path())
+                  : nullptr;
+  if (known_stats) {
+    num_row_groups = static_cast<int>((*known_stats)->row_groups.size());
+  } else {
+    ARROW_RETURN_NOT_OK(fragment.EnsureCompleteMetadata());
+    num_row_groups = fragment.metadata()->num_row_groups();
+  }
+
+  std::vector<int> row_groups(num_row_groups);
+  std::iota(row_groups.begin(), row_groups.end(), 0);
+  return row_groups;
+}
+
+// Keeps each row group with probability `rate`, so that a sampled scan reads
+// only those. A fragment that is not Parquet is kept or not as a whole. With
+// `split`, each sampled row group is a fragment of its own.
+arrow::Result<std::shared_ptr<ds::Dataset>>
+sampleRowGroups(const std::shared_ptr<ds::Dataset> &dataset, double rate,
+                bool split, std::mt19937_64 &rng,
+                const TableStats *table_stats, ScanStats &stats) {
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  if (!fs_dataset) {
+    return dataset;
+  }
+
+  std::bernoulli_distribution keep{rate};
+  auto &format = static_cast<ds::ParquetFileFormat &>(*fs_dataset->format());
+  std::vector<std::shared_ptr<ds::FileFragment>> fragments{};
+  ARROW_ASSIGN_OR_RAISE(auto dataset_fragments, dataset->GetFragments());
+  for (const auto &maybe_fragment : dataset_fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    if (!parquet_fragment) {
+      if (keep(rng)) {
+        fragments.emplace_back(
+            std::static_pointer_cast<ds::FileFragment>(fragment));
+      }
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto row_groups,
+                          getRowGroups(*parquet_fragment, table_stats));
+    std::vector<int> sampled{};
+    for (const auto row_group : row_groups) {
+      if (keep(rng)) {
+        sampled.emplace_back(row_group);
+      } else {
+        stats.num_row_groups_skipped_by_sampling++;
+      }
+    }
+    if (sampled.empty()) {
+      continue;
+    }
+
+    if (split) {
+      for (const auto row_group : sampled) {
+        ARROW_ASSIGN_OR_RAISE(
+            auto sampled_fragment,
+            format.MakeFragment(parquet_fragment->source(),
+                                parquet_fragment->partition_expression(),
+                                /*physical_schema=*/nullptr, {row_group}));
+        fragments.emplace_back(std::move(sampled_fragment));
+      }
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(
+        auto sampled_fragment,
+        format.MakeFragment(parquet_fragment->source(),
+                            parquet_fragment->partition_expression(),
+                            /*physical_schema=*/nullptr, std::move(sampled)));
+    fragments.emplace_back(std::move(sampled_fragment));
+  }
+
+  return ds::FileSystemDataset::Make(
+      dataset->schema(), dataset->partition_expression(), fs_dataset->format(),
+      fs_dataset->filesystem(), std::move(fragments),
+      fs_dataset->partitioning());
+}
+
+// Drops the row groups whose stats tell that none of their rows can be among
+// the first `k` in `order_by`. Only valid for a query without filters.
+arrow::Result<std::shared_ptr<ds::Dataset>>
+pruneByTopK(const std::shared_ptr<ds::Dataset> &dataset,
+            const OrderBy &order_by, int64_t k, const TableStats &table_stats,
+            ScanStats &stats) {
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  const auto field_index =
+      dataset->schema()->GetFieldIndex(order_by.col_name);
+  if (!fs_dataset || field_index < 0) {
+    return dataset;
+  }
+  const auto bound =
+      getTopKBound(table_stats.fragments, field_index, order_by, k);
+  if (!bound) {
+    return dataset;
+  }
+
+  auto &format = static_cast<ds::ParquetFileFormat &>(*fs_dataset->format());
+  std::vector<std::shared_ptr<ds::FileFragment>> fragments{};
+  ARROW_ASSIGN_OR_RAISE(auto dataset_fragments, dataset->GetFragments());
+  for (const auto &maybe_fragment : dataset_fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    const auto *known_stats =
+        parquet_fragment ? folly::get_ptr(table_stats.fragments,
+                                          parquet_fragment->source().path())
+                         : nullptr;
+    if (!known_stats) {
+      fragments.emplace_back(
+          std::static_pointer_cast<ds::FileFragment>(fragment));
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto row_groups,
+                          getRowGroups(*parquet_fragment, &table_stats));
+    std::vector<int> kept{};
+    for (const auto row_group : row_groups) {
+      const auto &cols = (*known_stats)->row_groups[row_group].cols;
+      if (static_cast<size_t>(field_index) >= cols.size() ||
+          mayReachBound(cols[field_index], order_by, *bound)) {
+        kept.emplace_back(row_group);
+      } else {
+        stats.num_row_groups_skipped_by_top_k++;
+      }
+    }
+    if (kept.empty()) {
+      continue;
+    }
+    if (kept.size() == row_groups.size()) {
+      fragments.emplace_back(
+          std::static_pointer_cast<ds::FileFragment>(fragment));
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(
+        auto kept_fragment,
+        format.MakeFragment(parquet_fragment->source(),
+                            parquet_fragment->partition_expression(),
+                            /*physical_schema=*/nullptr, std::move(kept)));
+    fragments.emplace_back(std::move(kept_fragment));
+  }
+
+  return ds::FileSystemDataset::Make(
+      dataset->schema(), dataset->partition_expression(), fs_dataset->format(),
+      fs_dataset->filesystem(), std::move(fragments),
+      fs_dataset->partitioning());
+}
+
+// Phase one of a two-phase scan. Scans only the cols `filters` read and
+// returns the dataset narrowed to the row groups with a matching row, so that
+// the scan of phase two decodes the other cols only for those. The Parquet
+// reader cannot skip pages within a col chunk, hence row group granularity.
+arrow::Result<std::shared_ptr<ds::Dataset>>
+selectMatchingRowGroups(const std::shared_ptr<ds::Dataset> &dataset,
+                        const std::vector<cp::Expression> &filters,
+                        const TableStats *table_stats, ScanStats &stats) {
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  if (!fs_dataset) {
+    return dataset;
+  }
+
+  // One fragment per row group, so that the fragment index the scan tags each
+  // batch with identifies its row group
+  struct RowGroupRef {
+    std::shared_ptr<ds::ParquetFileFragment> fragment;
+    int row_group;
+  };
+  std::vector<RowGroupRef> row_group_refs{};
+  std::vector<std::shared_ptr<ds::FileFragment>> row_group_fragments{};
+  std::vector<std::shared_ptr<ds::FileFragment>> other_fragments{};
+  auto &format = static_cast<ds::ParquetFileFormat &>(*fs_dataset->format());
+  ARROW_ASSIGN_OR_RAISE(auto dataset_fragments, dataset->GetFragments());
+  for (const auto &maybe_fragment : dataset_fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    if (!parquet_fragment) {
+      other_fragments.emplace_back(
+          std::static_pointer_cast<ds::FileFragment>(fragment));
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto row_groups,
+                          getRowGroups(*parquet_fragment, table_stats));
+    for (const auto row_group : row_groups) {
+      ARROW_ASSIGN_OR_RAISE(
+          auto row_group_fragment,
+          format.MakeFragment(parquet_fragment->source(),
+                              parquet_fragment->partition_expression(),
+                              /*physical_schema=*/nullptr, {row_group}));
+      row_group_fragments.emplace_back(std::move(row_group_fragment));
+      row_group_refs.emplace_back(RowGroupRef{parquet_fragment, row_group});
+    }
+  }
+
+  ARROW_ASSIGN_OR_RAISE(
+      auto row_group_dataset,
+      ds::FileSystemDataset::Make(
+          dataset->schema(), dataset->partition_expression(),
+          fs_dataset->format(), fs_dataset->filesystem(),
+          std::move(row_group_fragments), fs_dataset->partitioning()));
+
+  auto options = std::make_shared<ds::ScanOptions>();
+  options->filter = cp::and_(filters);
+  std::vector<cp::Expression> filter_projects{};
+  for (const auto &ref : cp::FieldsInExpression(options->filter)) {
+    filter_projects.emplace_back(cp::field_ref(ref));
+  }
+  options->projection = cp::project(std::move(filter_projects), {});
+
+  ARROW_ASSIGN_OR_RAISE(auto plan,
+                        cp::ExecPlan::Make(cp::default_exec_context()));
+  arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen;
+  ARROW_RETURN_NOT_OK(
+      cp::Declaration::Sequence(
+          {
+              {"scan", ds::ScanNodeOptions{std::move(row_group_dataset),
+                                           options}},
+              {kFusedFilterNode, FusedFilterNodeOptions{filters}},
+              {"project", cp::ProjectNodeOptions{{cp::field_ref(
+                              "__fragment_index")}}},
+              {"sink", cp::SinkNodeOptions{&sink_gen}},
+          })
+          .AddToPlan(plan.get())
+          .status());
+
+  auto fragment_index_schema =
+      arrow::schema({arrow::field("__fragment_index", arrow::int32())});
+  auto reader = cp::MakeGeneratorReader(
+      fragment_index_schema, std::move(sink_gen),
+      cp::default_exec_context()->memory_pool());
+  ARROW_RETURN_NOT_OK(plan->StartProducing());
+
+  std::vector<bool> matched(row_group_refs.size(), false);
+  while (true) {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+    if (!batch) {
+      break;
+    }
+    if (batch->num_rows() == 0) {
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto index, batch->column(0)->GetScalar(0));
+    matched[std::static_pointer_cast<arrow::Int32Scalar>(index)->value] =
+        true;
+  }
+  ARROW_RETURN_NOT_OK(plan->finished().status());
+
+  // Regroups the matched row groups by fragment to keep one fragment per file
+  std::vector<std::shared_ptr<ds::FileFragment>> fragments{
+      std::move(other_fragments)};
+  for (size_t i = 0; i < row_group_refs.size();) {
+    const auto &fragment = row_group_refs[i].fragment;
+    std::vector<int> row_groups{};
+    for (; i < row_group_refs.size() && row_group_refs[i].fragment == fragment;
+         i++) {
+      if (matched[i]) {
+        row_groups.emplace_back(row_group_refs[i].row_group);
+      } else {
+        stats.num_row_groups_skipped_by_filter++;
+      }
+    }
+
+    if (!row_groups.empty()) {
+      ARROW_ASSIGN_OR_RAISE(
+          auto matched_fragment,
+          format.MakeFragment(fragment->source(),
+                              fragment->partition_expression(),
+                              /*physical_schema=*/nullptr,
+                              std::move(row_groups)));
+      fragments.emplace_back(std::move(matched_fragment));
+    }
+  }
+
+  return ds::FileSystemDataset::Make(
+      dataset->schema(), dataset->partition_expression(), fs_dataset->format(),
+      fs_dataset->filesystem(), std::move(fragments),
+      fs_dataset->partitioning());
+}
+
+// The row groups the scan of `dataset` reads, or nullopt if it is not made of
+// Parquet files only. With `unpartitioned`, also nullopt if a file has a
+// partition expression, whose cols are not in the file.
+arrow::Result<std::optional<std::vector<ScanRowGroups>>>
+getScanRowGroups(const ds::Dataset &dataset, const TableStats *table_stats,
+                 bool unpartitioned) {
+  std::vector<ScanRowGroups> row_groups{};
+  ARROW_ASSIGN_OR_RAISE(auto fragments, dataset.GetFragments());
+  for (const auto &maybe_fragment : fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    if (!parquet_fragment ||
+        (unpartitioned &&
+         !fragment->partition_expression().Equals(cp::literal(true)))) {
+      return std::nullopt;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(auto fragment_row_groups,
+                          getRowGroups(*parquet_fragment, table_stats));
+    const auto &path = parquet_fragment->source().path();
+    const auto *known_stats =
+        table_stats ? folly::get_ptr(table_stats->fragments, path) : nullptr;
+    auto file_key =
+        known_stats ? folly::to<std::string>(path, ":", (*known_stats)->size,
+                                             ":", (*known_stats)->mtime_ns)
+                    : std::string{};
+    row_groups.emplace_back(ScanRowGroups{std::move(parquet_fragment),
+                                          std::move(fragment_row_groups),
+                                          std::move(file_key)});
+  }
+  return row_groups;
+}
+
+// The scan of `fields` of `dataset` as a part of a pass shared with other
+// queries, or nullptr if the dataset is not made of Parquet files only
+arrow::Result<std::shared_ptr<SharedScan::Subscription>>
+subscribeSharedScan(SharedScan &shared_scan,
+                    const std::shared_ptr<ds::Dataset> &dataset,
+                    const std::vector<std::string> &fields,
+                    const TableStats *table_stats) {
+  auto fs_dataset = std::dynamic_pointer_cast<ds::FileSystemDataset>(dataset);
+  if (!fs_dataset) {
+    return nullptr;
+  }
+
+  ARROW_ASSIGN_OR_RAISE(
+      auto row_groups,
+      getScanRowGroups(*dataset, table_stats, /*unpartitioned=*/false));
+  if (!row_groups) {
+    return nullptr;
+  }
+  return shared_scan.subscribe(fs_dataset, std::move(*row_groups), fields);
+}
+
+// The scan of `fields` of `dataset` through the hot tier, as a source of
+// batches, or nullopt if the dataset is not made of unpartitioned Parquet
+// files only
+arrow::Result<std::optional<cp::SourceNodeOptions>>
+scanHotTier(HotTier &hot_tier, const ds::Dataset &dataset,
+            const std::vector<std::string> &fields,
+            const TableStats *table_stats) {
+  ARROW_ASSIGN_OR_RAISE(
+      auto row_groups,
+      getScanRowGroups(dataset, table_stats, /*unpartitioned=*/true));
+  if (!row_groups) {
+    return std::nullopt;
+  }
+
+  arrow::FieldVector schema_fields{};
+  for (const auto &name : fields) {
+    auto field = dataset.schema()->GetFieldByName(name);
+    if (!field) {
+      return arrow::Status::Invalid("no unique field ", name);
+    }
+    schema_fields.emplace_back(std::move(field));
+  }
+  auto schema = arrow::schema(std::move(schema_fields));
+  auto gen = hot_tier.scan(std::move(*row_groups), schema);
+  return cp::SourceNodeOptions{std::move(schema), std::move(gen)};
+}
+
+// The cols of `schema` of `batches`, e.g. the buffered rows of a table, as
+// the batches of a source
+arrow::Result<arrow::AsyncGenerator<std::optional<cp::ExecBatch>>>
+scanBatches(const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches,
+            const arrow::Schema &schema) {
+  std::vector<std::optional<cp::ExecBatch>> exec_batches{};
+  exec_batches.reserve(batches.size());
+  for (const auto &batch : batches) {
+    std::vector<arrow::Datum> cols{};
+    cols.reserve(schema.num_fields());
+    for (const auto &field : schema.fields()) {
+      auto col = batch->GetColumnByName(field->name());
+      if (!col) {
+        return arrow::Status::Invalid("no col ", field->name(),
+                                      " in the buffered rows");
+      }
+      cols.emplace_back(std::move(col));
+    }
+    exec_batches.emplace_back(
+        cp::ExecBatch{std::move(cols), batch->num_rows()});
+  }
+  return arrow::MakeVectorGenerator(std::move(exec_batches));
+}
+} // namespace
+
+SamplesQuery &
+SamplesQuery::shareScan(std::shared_ptr<SharedScan> shared_scan) {
+  shared_scan_ = std::move(shared_scan);
+  return *this;
+}
+
+SamplesQuery &SamplesQuery::useHotTier(std::shared_ptr<HotTier> hot_tier) {
+  hot_tier_ = std::move(hot_tier);
+  return *this;
+}
+
+SamplesQuery &SamplesQuery::scanBuffered(
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches) {
+  buffered_ = std::move(batches);
+  return *this;
+}
+
+SamplesQuery &SamplesQuery::timeRange(int64_t min_ts,
+                                      std::optional<int64_t> max_ts) {
+  time_window_ = TimeWindow{.min_ts = min_ts, .max_ts = max_ts};
+  return *this;
+}
+
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+SamplesQuery::finalize() && {
+  std::vector<cp::Declaration> decls{
+      {"project", cp::ProjectNodeOptions{std::move(projects_)}}};
+  auto schema = arrow::schema(std::move(result_set_schema_));
+  return std::move(*this).finalize(std::move(decls), std::move(schema));
+}
+
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+SamplesQuery::finalize(std::vector<cp::Declaration> decls,
+                       std::shared_ptr<arrow::Schema> schema) && {
+  if (time_window_) {
+    const auto *time_index =
+        table_stats_ ? table_stats_->time_index.get() : nullptr;
+    if (!time_index) {
+      return folly::makeUnexpected(
+          std::string{"time range on a table without timestamp col"});
+    }
+
+    auto time_filter = time_index->makeFilter(time_window_.value());
+    if (!time_filter.ok()) {
+      return folly::makeUnexpected(time_filter.status().ToString());
+    }
+
+    filters_.emplace_back(time_filter.MoveValueUnsafe());
+    fields_.emplace(time_index->getTsField()->name());
+  }
+
+  if (table_stats_) {
+    reorderPredicates(filters_, *dataset_->schema(), table_stats_->columns);
+  }
+
+  auto options = std::make_shared<ds::ScanOptions>();
+  // The filters stay in the plan, since the scan only uses its filter to skip
+  // data and does not filter rows.
+  options->filter = cp::and_(filters_);
+
+  ScanStats stats{};
+  PruningCtx pruning_ctx{
+      .schema = *dataset_->schema(),
+      .table_stats = table_stats_.get(),
+      .time_window = time_window_,
+      .filters = filters_,
+      .count_by_stats = count_only_,
+  };
+  auto dataset = pruneDataset(dataset_, options->filter, pruning_ctx, stats);
+  if (!dataset.ok()) {
+    return folly::makeUnexpected(dataset.status().ToString());
+  }
+  // The scan only counts the rows of the other row groups
+  if (stats.num_row_groups_counted_by_stats > 0) {
+    decls.emplace_back(
+        "project",
+        cp::ProjectNodeOptions{
+            {cp::call("add", {cp::field_ref("count"),
+                              cp::literal(stats.num_rows_counted_by_stats)})},
+            {"count"}});
+  }
+
+  if (sampling_ && (sampling_->row_group_rate <= 0 ||
+                    sampling_->row_group_rate > 1 ||
+                    sampling_->row_rate <= 0 || sampling_->row_rate > 1)) {
+    return folly::makeUnexpected(std::string{"invalid sampling rate"});
+  }
+  auto rng = makeRng(sampling_ ? sampling_->seed : std::nullopt);
+  if (order_by_ && (!take_ || sampling_)) {
+    return folly::makeUnexpected(
+        std::string{"order by requires a limit and no sampling"});
+  }
+  // Without filters, the stats tell which row groups hold the top rows
+  if (order_by_ && filters_.empty() && table_stats_) {
+    dataset = pruneByTopK(dataset.MoveValueUnsafe(), *order_by_,
+                          take_.value(), *table_stats_, stats);
+    if (!dataset.ok()) {
+      return folly::makeUnexpected(dataset.status().ToString());
+    }
+  }
+
+  if (sampling_ && sampling_->row_group_rate < 1) {
+    dataset = sampleRowGroups(
+        dataset.MoveValueUnsafe(), sampling_->row_group_rate,
+        sampling_->row_group_fragments, rng, table_stats_.get(), stats);
+    if (!dataset.ok()) {
+      return folly::makeUnexpected(dataset.status().ToString());
+    }
+  }
+
+  // A two-phase scan pays off when the filters match few rows, and only if
+  // some of the cols are not read by the filters. It merges the row groups of
+  // a file back into one fragment, hence not with row group fragments. Not
+  // with a plain limit either, as its phase one would scan all the row groups
+  // while the scan stops as soon as it has the rows to take.
+  std::unordered_set<std::string> filter_fields{};
+  for (const auto &ref : cp::FieldsInExpression(options->filter)) {
+    if (ref.name()) {
+      filter_fields.emplace(*ref.name());
+    }
+  }
+  const auto has_output_only_fields =
+      std::any_of(fields_.begin(), fields_.end(), [&](const auto &field) {
+        return filter_fields.count(field) == 0;
+      });
+  const auto has_row_group_fragments =
+      sampling_ && sampling_->row_group_fragments;
+  const auto stops_early = take_ && !order_by_ && !sampling_;
+  if (FLAGS_late_materialization && table_stats_ && !filters_.empty() &&
+      has_output_only_fields && !has_row_group_fragments && !stops_early &&
+      table_stats_->columns.estimateSelectivity(options->filter) <
+          kMaxLateMaterializationSelectivity) {
+    dataset = selectMatchingRowGroups(dataset.MoveValueUnsafe(), filters_,
+                                      table_stats_.get(), stats);
+    if (!dataset.ok()) {
+      return folly::makeUnexpected(dataset.status().ToString());
+    }
+  }
+
+  XLOG(DBG) << "Scan pruned " << stats.num_fragments_skipped << "/"
+            << stats.num_fragments << " fragments and "
+            << stats.num_row_groups_skipped << "/" << stats.num_row_groups
+            << " row groups ("
+            << stats.num_fragments_skipped_by_time << " fragments and "
+            << stats.num_row_groups_skipped_by_time
+            << " row groups by time and "
+            << stats.num_row_groups_skipped_by_index
+            << " row groups by bitmap index and "
+            << stats.num_row_groups_skipped_by_bloom_filter
+            << " row groups by Bloom filter), then "
+            << stats.num_row_groups_skipped_by_filter
+            << " row groups without match and "
+            << stats.num_row_groups_skipped_by_sampling
+            << " row groups by sampling and "
+            << stats.num_row_groups_skipped_by_top_k
+            << " row groups by top k, and counted "
+            << stats.num_row_groups_counted_by_stats
+            << " row groups from their stats";
+
+  std::vector<cp::Expression> scanner_projects{};
+  std::transform(fields_.begin(), fields_.end(),
+                 std::back_inserter(scanner_projects),
+                 [](const auto &field) { return cp::field_ref(field); });
+
+  options->projection = cp::project(std::move(scanner_projects), {});
+  arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen;
+
+  // Neither a pass shared with other queries nor the hot tier can tell row
+  // group fragments apart
+  const std::vector<std::string> fields{fields_.begin(), fields_.end()};
+  std::shared_ptr<SharedScan::Subscription> subscription{};
+  if (shared_scan_ && !has_row_group_fragments) {
+    auto subscribed = subscribeSharedScan(*shared_scan_, dataset.ValueUnsafe(),
+                                          fields, table_stats_.get());
+    if (!subscribed.ok()) {
+      return folly::makeUnexpected(subscribed.status().ToString());
+    }
+    subscription = subscribed.MoveValueUnsafe();
+  }
+  std::optional<cp::SourceNodeOptions> hot_source{};
+  if (!subscription && hot_tier_ && !has_row_group_fragments) {
+    auto scanned = scanHotTier(*hot_tier_, *dataset.ValueUnsafe(), fields,
+                               table_stats_.get());
+    if (!scanned.ok()) {
+      return folly::makeUnexpected(scanned.status().ToString());
+    }
+    hot_source = scanned.MoveValueUnsafe();
+  }
+
+  // The buffered rows are not in row groups to sample
+  const auto scans_buffered =
+      !buffered_.empty() && !(sampling_ && sampling_->row_group_rate < 1);
+  if (subscription || hot_source) {
+    auto source = subscription
+                      ? cp::SourceNodeOptions{subscription->schema(),
+                                              subscription->generator()}
+                      : std::move(*hot_source);
+    if (scans_buffered) {
+      auto buffered_gen = scanBatches(buffered_, *source.output_schema);
+      if (!buffered_gen.ok()) {
+        return folly::makeUnexpected(buffered_gen.status().ToString());
+      }
+      source.generator = arrow::MakeConcatenatedGenerator(
+          arrow::MakeVectorGenerator<
+              arrow::AsyncGenerator<std::optional<cp::ExecBatch>>>(
+              {std::move(source.generator),
+               buffered_gen.MoveValueUnsafe()}));
+    }
+    decls_.emplace_back("source", std::move(source));
+  } else {
+    auto scanned = dataset.MoveValueUnsafe();
+    if (scans_buffered) {
+      auto with_buffered = ds::UnionDataset::Make(
+          dataset_->schema(),
+          {std::move(scanned), std::make_shared<ds::InMemoryDataset>(
+                                   dataset_->schema(), buffered_)});
+      if (!with_buffered.ok()) {
+        return folly::makeUnexpected(with_buffered.status().ToString());
+      }
+      scanned = with_buffered.MoveValueUnsafe();
+    }
+    decls_.emplace_back("scan", ds::ScanNodeOptions{
+                                    std::move(scanned),
+                                    options,
+                                });
+  }
+  if (!filters_.empty()) {
+    // One node for all the filters, so that a batch is filtered in one pass
+    // and copied once
+    decls_.emplace_back(kFusedFilterNode, FusedFilterNodeOptions{filters_});
+  }
+  if (sampling_ && sampling_->row_rate < 1) {
+    decls_.emplace_back(kBernoulliSampleNode,
+                        BernoulliSampleNodeOptions{sampling_->row_rate, rng()});
+  }
+
+  std::move(decls.begin(), decls.end(), std::back_inserter(decls_));
+  if (order_by_) {
+    // Each batch is cut down to its top rows in parallel, so that the
+    // collector only merges those
+    decls_.emplace_back(kTopKNode, TopKNodeOptions{*order_by_, *take_});
+  }
+  // The sink applies backpressure so that the scan does not read far ahead of
+  // the consumer of the result set, e.g. a limit or a slow streaming client.
+  decls_.emplace_back(
+      "sink",
+      cp::SinkNodeOptions{&sink_gen,
+                          cp::BackpressureOptions::DefaultBackpressure()});
+
+  auto result =
+      cp::Declaration::Sequence(std::move(decls_)).AddToPlan(plan_.get());
+
+  if (!result.ok()) {
+    return folly::makeUnexpected(result.status().ToString());
+  }
+
+  // An ordered or sampled query keeps the top rows or a uniform sample of
+  // the rows reaching the sink rather than the first ones, which come from
+  // whichever fragments the scan reads first
+  std::unique_ptr<Collector> collector{};
+  if (order_by_) {
+    collector = std::make_unique<TopK>(schema, *order_by_, take_.value());
+  } else if (sampling_ && take_) {
+    collector =
+        std::make_unique<ReservoirSample>(schema, take_.value(), rng());
+  }
+  if (collector) {
+    return SamplesQuery::RunnableQuery{std::move(plan_), std::move(schema),
+                                       std::move(sink_gen), std::nullopt,
+                                       stats, std::move(collector),
+                                       std::move(subscription)};
+  }
+
+  return SamplesQuery::RunnableQuery{std::move(plan_), std::move(schema),
+                                     std::move(sink_gen), take_, stats,
+                                     nullptr, std::move(subscription)};
+}
+
+SamplesQuery::RunnableQuery::RunnableQuery(
+    std::shared_ptr<cp::ExecPlan> plan, std::shared_ptr<arrow::Schema> schema,
+    arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen,
+    std::optional<int> take, ScanStats scan_stats,
+    std::unique_ptr<Collector> collector,
+    std::shared_ptr<SharedScan::Subscription> subscription)
+    : plan_{std::move(plan)}, schema_{std::move(schema)},
+      sink_gen_{std::move(sink_gen)}, take_{take}, scan_stats_{scan_stats},
+      collector_{std::move(collector)}, subscription_{std::move(subscription)} {
+}
+
+const ScanStats &SamplesQuery::RunnableQuery::scanStats() const {
+  return scan_stats_;
+}
+
+SamplesQuery::RunnableQuery::~RunnableQuery() {
+  if (plan_ && sink_reader_ && !done_) {
+    ARROW_UNUSED(stop());
+  }
+}
+
+const std::shared_ptr<arrow::Schema> &
+SamplesQuery::RunnableQuery::schema() const {
+  return schema_;
+}
+
+arrow::Status SamplesQuery::RunnableQuery::stop() {
+  done_ = true;
+  plan_->StopProducing();
+  const auto future = plan_->finished();
+  return future.status();
+}
+
+arrow::Status SamplesQuery::RunnableQuery::collect() {
+  while (true) {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    auto status = sink_reader_->ReadNext(&batch);
+    if (status.ok() && batch) {
+      status = collector_->add(batch);
+    }
+    if (!status.ok()) {
+      ARROW_UNUSED(stop());
+      return status;
+    }
+    if (!batch) {
+      break;
+    }
+  }
+  ARROW_RETURN_NOT_OK(stop());
+
+  ARROW_ASSIGN_OR_RAISE(collected_, collector_->finish());
+  collected_reader_ = std::make_unique<arrow::TableBatchReader>(*collected_);
+  return arrow::Status::OK();
+}
+
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+SamplesQuery::RunnableQuery::nextImpl() {
+  if (!collected_reader_ && done_) {
+    return nullptr;
+  }
+
+  if (!sink_reader_) {
+    sink_reader_ =
+        cp::MakeGeneratorReader(schema_, std::move(sink_gen_),
+                                cp::default_exec_context()->memory_pool());
+    if (subscription_) {
+      subscription_->start();
+    }
+    ARROW_RETURN_NOT_OK(plan_->StartProducing());
+  }
+
+  if (collector_) {
+    if (!collected_reader_) {
+      ARROW_RETURN_NOT_OK(collect());
+    }
+    std::shared_ptr<arrow::RecordBatch> batch;
+    ARROW_RETURN_NOT_OK(collected_reader_->ReadNext(&batch));
+    return batch;
+  }
+
+  // Stopping the plan once the limit is reached cancels the outstanding
+  // fragment reads of the scan node.
+  if (take_ && num_rows_ >= take_.value()) {
+    ARROW_RETURN_NOT_OK(stop());
+    return nullptr;
+  }
+
+  std::shared_ptr<arrow::RecordBatch> batch;
+  auto status = sink_reader_->ReadNext(&batch);
+  if (!status.ok()) {
+    ARROW_UNUSED(stop());
+    return status;
+  }
+
+  if (!batch) {
+    ARROW_RETURN_NOT_OK(stop());
+    return nullptr;
+  }
+
+  if (take_) {
+    batch = batch->Slice(0, take_.value() - num_rows_);
+  }
+  num_rows_ += batch->num_rows();
+  return batch;
+}
+
+folly::Expected<std::shared_ptr<arrow::RecordBatch>, std::string>
+SamplesQuery::RunnableQuery::next() {
+  auto batch = nextImpl();
+  if (!batch.ok()) {
+    return folly::makeUnexpected(batch.status().ToString());
+  }
+
+  return batch.MoveValueUnsafe();
+}
+
+folly::Expected<std::shared_ptr<arrow::Table>, std::string>
+SamplesQuery::RunnableQuery::gen() && {
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches{};
+  while (true) {
+    auto batch = next();
+    if (batch.hasError()) {
+      return folly::makeUnexpected(std::move(batch.error()));
+    }
+
+    if (!batch.value()) {
+      break;
+    }
+    batches.emplace_back(std::move(batch.value()));
+  }
+
+  auto result_set =
+      arrow::Table::FromRecordBatches(schema_, std::move(batches));
+  if (!result_set.ok()) {
+    return folly::makeUnexpected(result_set.status().ToString());
+  }
+
+  return result_set.MoveValueUnsafe();
+}
+
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+SamplesQuery::count() && {
+  if (take_ || sampling_ || order_by_) {
+    return folly::makeUnexpected(
+        std::string{"count with a limit, sampling or order by"});
+  }
+
+  count_only_ = true;
+  std::vector<cp::Declaration> decls{
+      {"project", cp::ProjectNodeOptions{{cp::literal(true)}, {"__count"}}},
+      {"aggregate",
+       cp::AggregateNodeOptions{
+           {cp::Aggregate{
+               "count",
+               std::make_shared<cp::CountOptions>(cp::CountOptions::ALL),
+               cp::FieldRef{"__count"}, "count"}},
+           {}}},
+  };
+  return std::move(*this).finalize(
+      std::move(decls), arrow::schema({arrow::field("count", arrow::int64())}));
+}
+
+SamplesQuery &SamplesQuery::take(int to_take) {
+  take_ = to_take;
+  return *this;
+}
+
+SamplesQuery &SamplesQuery::sample(Sampling sampling) {
+  sampling_ = sampling;
+  return *this;
+}
+
+SamplesQuery &SamplesQuery::orderBy(const bapidrpc::Col &col,
+                                    bool descending) {
+  const auto is_projected = std::any_of(
+      result_set_schema_.begin(), result_set_schema_.end(),
+      [&](const auto &field) { return field->name() == col.name(); });
+  if (!is_projected) {
+    project(col);
+  }
+  order_by_ = OrderBy{col.name(), descending};
+  return *this;
+}
+
+namespace {
+std::string getAggregationName(bapidrpc::AggOp op) {
+  switch (op) {
+  case bapidrpc::AggOp::COUNT:
+    return "count";
+  case bapidrpc::AggOp::SUM:
+    return "sum";
+  case bapidrpc::AggOp::AVG:
+    return "avg";
+  case bapidrpc::AggOp::MIN:
+    return "min";
+  case bapidrpc::AggOp::MAX:
+    return "max";
+  case bapidrpc::AggOp::APPROX_COUNT_DISTINCT:
+    return "approx_count_distinct";
+  default:
+    throw std::runtime_error("unimplemented");
+  }
+}
+
+std::string getAggregateFunction(bapidrpc::AggOp op) {
+  switch (op) {
+  case bapidrpc::AggOp::AVG:
+    return "mean";
+  case bapidrpc::AggOp::APPROX_COUNT_DISTINCT:
+    return kApproxCountDistinct;
+  default:
+    return getAggregationName(op);
+  }
+}
+
+std::shared_ptr<cp::FunctionOptions>
+getAggregateOptions(bapidrpc::AggOp op) {
+  switch (op) {
+  case bapidrpc::AggOp::COUNT:
+    return std::make_shared<cp::CountOptions>(cp::CountOptions::ALL);
+  case bapidrpc::AggOp::APPROX_COUNT_DISTINCT:
+    return nullptr;
+  default:
+    return std::make_shared<cp::ScalarAggregateOptions>(
+        cp::ScalarAggregateOptions::Defaults());
+  }
+}
+
+// Of the 95% confidence interval of a normally distributed estimate
+constexpr double kZ95 = 1.96;
+
+cp::Expression castEstimate(cp::Expression estimate,
+                            const std::shared_ptr<arrow::DataType> &type) {
+  if (arrow::is_integer(type->id())) {
+    estimate = cp::call("round", {std::move(estimate)});
+  }
+  return cp::call("cast", {std::move(estimate)}, cp::CastOptions::Safe(type));
+}
+} // namespace
+
+TableQuery::TableQuery(SamplesQuery query) : query_{std::move(query)} {}
+
+TableQuery &TableQuery::filter(const bapidrpc::Filter &filter) {
+  query_.filter(filter);
+  return *this;
+}
+
+TableQuery &TableQuery::timeRange(int64_t min_ts,
+                                  std::optional<int64_t> max_ts) {
+  query_.timeRange(min_ts, max_ts);
+  return *this;
+}
+
+TableQuery &TableQuery::groupBy(const bapidrpc::Col &col) {
+  auto type = getArrowTypeForCol(col);
+  const auto field = query_.dataset_->schema()->GetFieldByName(col.name());
+  if (type->id() == arrow::Type::STRING && field &&
+      field->type()->Equals(getDictionaryType())) {
+    auto interner = std::make_shared<StringInterner>();
+    keys_.emplace_back(Key{
+        cp::call(kIntern, {cp::field_ref(col.name())}, InternOptions{interner}),
+        arrow::field(col.name(), type),
+        std::move(interner),
+    });
+    query_.fields_.emplace(col.name());
+    return *this;
+  }
+
+  keys_.emplace_back(Key{
+      cp::call("cast", {cp::field_ref(col.name())},
+               cp::CastOptions::Safe(type)),
+      arrow::field(col.name(), type),
+  });
+  query_.fields_.emplace(col.name());
+  return *this;
+}
+
+TableQuery &TableQuery::aggregate(bapidrpc::AggOp op,
+                                  const bapidrpc::Col &col) {
+  if (op == bapidrpc::AggOp::COUNT) {
+    aggregations_.emplace_back(
+        Aggregation{op, getAggregateFunction(op), getAggregateOptions(op),
+                    cp::literal(true), arrow::field("count", arrow::int64())});
+    return *this;
+  }
+
+  auto type = getArrowTypeForCol(col);
+  if (op != bapidrpc::AggOp::MIN && op != bapidrpc::AggOp::MAX &&
+      op != bapidrpc::AggOp::APPROX_COUNT_DISTINCT &&
+      !arrow::is_numeric(type->id())) {
+    throw std::runtime_error("cannot " + getAggregationName(op) + " col " +
+                             col.name());
+  }
+
+  // The sum of an int col is an int, other aggregations keep the type of the
+  // col, but for the average and the distinct count
+  auto result_type = op == bapidrpc::AggOp::AVG ? arrow::float64()
+                     : op == bapidrpc::AggOp::APPROX_COUNT_DISTINCT
+                         ? arrow::int64()
+                         : type;
+  aggregations_.emplace_back(Aggregation{
+      op,
+      getAggregateFunction(op),
+      getAggregateOptions(op),
+      cp::call("cast", {cp::field_ref(col.name())},
+               cp::CastOptions::Safe(type)),
+      arrow::field(getAggregationName(op) + "_" + col.name(),
+                   std::move(result_type)),
+  });
+  query_.fields_.emplace(col.name());
+  return *this;
+}
+
+TableQuery &TableQuery::percentile(const bapidrpc::Col &col,
+                                   double percentile) {
+  auto type = getArrowTypeForCol(col);
+  if (!arrow::is_numeric(type->id())) {
+    throw std::runtime_error("cannot percentile col " + col.name());
+  }
+  if (percentile < 0 || percentile > 100) {
+    throw std::runtime_error("invalid percentile " +
+                             folly::to<std::string>(percentile));
+  }
+
+  // The t-digest of each thread is merged into the one of the query, which
+  // keeps the error of the extreme percentiles low
+  aggregations_.emplace_back(Aggregation{
+      bapidrpc::AggOp::PERCENTILE,
+      "tdigest",
+      std::make_shared<cp::TDigestOptions>(percentile / 100),
+      cp::call("cast", {cp::field_ref(col.name())},
+               cp::CastOptions::Safe(type)),
+      arrow::field("p" + folly::to<std::string>(percentile) + "_" +
+                       col.name(),
+                   arrow::float64()),
+      /*is_list_per_group=*/true,
+  });
+  query_.fields_.emplace(col.name());
+  return *this;
+}
+
+TableQuery &TableQuery::approximate(Approximation approximation) {
+  approximation_ = approximation;
+  return *this;
+}
+
+/*static*/ cp::Expression TableQuery::getKeyOutput(const Key &key,
+                                                  const std::string &name) {
+  if (!key.interner) {
+    return cp::field_ref(name);
+  }
+  return cp::call(kLookupInterned, {cp::field_ref(name)},
+                  InternOptions{key.interner});
+}
+
+std::optional<double> TableQuery::getSampleRate() const {
+  if (!approximation_) {
+    return std::nullopt;
+  }
+  if (approximation_->sample_rate) {
+    return approximation_->sample_rate;
+  }
+
+  const auto &table_stats = query_.table_stats_;
+  if (!approximation_->target_error || !table_stats) {
+    return std::nullopt;
+  }
+  int64_t num_row_groups = 0;
+  for (const auto &[_, fragment] : table_stats->fragments) {
+    num_row_groups += static_cast<int64_t>(fragment->row_groups.size());
+  }
+
+  // Sampling each of n row groups of similar counts with probability r gives
+  // a count whose relative standard error is sqrt((1 - r) / (r * n))
+  const auto error = approximation_->target_error.value() / kZ95;
+  return 1 / (1 + static_cast<double>(num_row_groups) * error * error);
+}
+
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+TableQuery::finalize() && {
+  if (aggregations_.empty()) {
+    return folly::makeUnexpected(std::string{"no aggregation"});
+  }
+
+  const auto sample_rate = getSampleRate();
+  if (sample_rate && (*sample_rate <= 0 || *sample_rate > 1)) {
+    return folly::makeUnexpected(std::string{"invalid sample rate"});
+  }
+  if (sample_rate && *sample_rate < 1) {
+    return std::move(*this).finalizeApproximate(*sample_rate);
+  }
+  if (keys_.empty() && aggregations_.size() == 1 &&
+      aggregations_[0].op == bapidrpc::AggOp::COUNT) {
+    return std::move(query_).count();
+  }
+
+  // The keys and the aggregated cols are projected under names of their own,
+  // since a col may be both grouped by and aggregated
+  std::vector<cp::Expression> inputs{};
+  std::vector<std::string> input_names{};
+  std::vector<cp::FieldRef> key_refs{};
+  std::vector<cp::Expression> outputs{};
+  std::vector<std::shared_ptr<arrow::Field>> fields{};
+  for (size_t i = 0; i < keys_.size(); i++) {
+    auto name = "__key_" + std::to_string(i);
+    inputs.emplace_back(std::move(keys_[i].expr));
+    input_names.emplace_back(name);
+    key_refs.emplace_back(name);
+    outputs.emplace_back(getKeyOutput(keys_[i], name));
+    fields.emplace_back(keys_[i].field);
+  }
+
+  std::vector<cp::Aggregate> aggregates{};
+  for (size_t i = 0; i < aggregations_.size(); i++) {
+    auto &aggregation = aggregations_[i];
+    auto name = "__agg_" + std::to_string(i);
+    inputs.emplace_back(std::move(aggregation.expr));
+    input_names.emplace_back(name);
+    aggregates.emplace_back(cp::Aggregate{
+        keys_.empty() ? aggregation.function : "hash_" + aggregation.function,
+        aggregation.options,
+        cp::FieldRef{name},
+        aggregation.field->name(),
+    });
+    auto output = cp::field_ref(aggregation.field->name());
+    if (aggregation.is_list_per_group && !keys_.empty()) {
+      output = cp::call("list_element", {std::move(output), cp::literal(0)});
+    }
+    outputs.emplace_back(cp::call("cast", {std::move(output)},
+                                  cp::CastOptions::Safe(
+                                      aggregation.field->type())));
+    fields.emplace_back(aggregation.field);
+  }
+
+  std::vector<std::string> output_names{};
+  std::transform(fields.begin(), fields.end(), std::back_inserter(output_names),
+                 [](const auto &field) { return field->name(); });
+
+  std::vector<cp::Declaration> decls{
+      {"project",
+       cp::ProjectNodeOptions{std::move(inputs), std::move(input_names)}},
+      {"aggregate", cp::AggregateNodeOptions{std::move(aggregates),
+                                             std::move(key_refs)}},
+      // Puts the keys first, as the aggregate node outputs them last
+      {"project",
+       cp::ProjectNodeOptions{std::move(outputs), std::move(output_names)}},
+  };
+  return std::move(query_).finalize(std::move(decls),
+                                    arrow::schema(std::move(fields)));
+}
+
+// Aggregates each sampled row group first, then sums the aggregates of the
+// row groups into Horvitz-Thompson estimates: a total is the sum over the
+// sample divided by the sample rate r, and its variance is estimated as
+// (1 - r) / r^2 times the sum of the squared totals of the row groups. An
+// average is the ratio of two such totals.
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+TableQuery::finalizeApproximate(double sample_rate) && {
+  constexpr char kRowGroup[] = "__row_group";
+  const auto scale = cp::literal(1 / sample_rate);
+  const auto variance_scale =
+      cp::literal((1 - sample_rate) / (sample_rate * sample_rate));
+
+  std::vector<cp::Expression> inputs{};
+  std::vector<std::string> input_names{};
+  std::vector<cp::FieldRef> key_refs{};
+  std::vector<cp::Expression> row_group_outputs{};
+  std::vector<std::string> row_group_output_names{};
+  std::vector<cp::Expression> outputs{};
+  std::vector<std::shared_ptr<arrow::Field>> fields{};
+  for (size_t i = 0; i < keys_.size(); i++) {
+    auto name = "__key_" + std::to_string(i);
+    inputs.emplace_back(std::move(keys_[i].expr));
+    input_names.emplace_back(name);
+    key_refs.emplace_back(name);
+    row_group_outputs.emplace_back(cp::field_ref(name));
+    row_group_output_names.emplace_back(name);
+    outputs.emplace_back(getKeyOutput(keys_[i], name));
+    fields.emplace_back(keys_[i].field);
+  }
+  inputs.emplace_back(cp::field_ref("__fragment_index"));
+  input_names.emplace_back(kRowGroup);
+  auto row_group_key_refs = key_refs;
+  row_group_key_refs.emplace_back(kRowGroup);
+
+  std::vector<cp::Aggregate> row_group_aggregates{};
+  std::vector<cp::Aggregate> aggregates{};
+  // `name` is the aggregate of `input` per row group, which is projected by
+  // `expr` and then aggregated over the row groups under the same name
+  auto addPartial = [&](const std::string &function,
+                        std::shared_ptr<cp::FunctionOptions> options,
+                        const std::string &input, const std::string &name) {
+    row_group_aggregates.emplace_back(cp::Aggregate{
+        "hash_" + function, std::move(options), cp::FieldRef{input}, name});
+  };
+  auto addTotal = [&](cp::Expression expr, const std::string &name,
+                      const std::string &function) {
+    row_group_outputs.emplace_back(std::move(expr));
+    row_group_output_names.emplace_back(name);
+    aggregates.emplace_back(cp::Aggregate{
+        keys_.empty() ? function : "hash_" + function,
+        function == "sum" ? std::make_shared<cp::ScalarAggregateOptions>(
+                                cp::ScalarAggregateOptions::Defaults())
+                          : nullptr,
+        cp::FieldRef{name}, name});
+  };
+  auto asDouble = [](const std::string &name) {
+    return cp::call("cast", {cp::field_ref(name)},
+                    cp::CastOptions::Safe(arrow::float64()));
+  };
+  auto square = [&](const std::string &name) {
+    return cp::call("multiply", {asDouble(name), asDouble(name)});
+  };
+  auto confidenceInterval = [&](cp::Expression variance) {
+    return cp::call(
+        "multiply",
+        {cp::literal(kZ95),
+         cp::call("sqrt", {cp::call("max_element_wise",
+                                    {cp::call("multiply", {std::move(variance),
+                                                           variance_scale}),
+                                     cp::literal(0.0)})})});
+  };
+
+  for (size_t i = 0; i < aggregations_.size(); i++) {
+    auto &aggregation = aggregations_[i];
+    const auto &field = aggregation.field;
+    const auto input = "__agg_" + std::to_string(i);
+    const auto y = input + "_y";
+    const auto yy = input + "_yy";
+    const auto ci_field = arrow::field(field->name() + "_ci", arrow::float64());
+    inputs.emplace_back(std::move(aggregation.expr));
+    input_names.emplace_back(input);
+
+    switch (aggregation.op) {
+    case bapidrpc::AggOp::COUNT:
+    case bapidrpc::AggOp::SUM: {
+      addPartial(aggregation.function, aggregation.options, input, y);
+      addTotal(asDouble(y), y, "sum");
+      addTotal(square(y), yy, "sum");
+      outputs.emplace_back(castEstimate(
+          cp::call("multiply", {cp::field_ref(y), scale}), field->type()));
+      outputs.emplace_back(confidenceInterval(cp::field_ref(yy)));
+      fields.emplace_back(field);
+      fields.emplace_back(ci_field);
+      break;
+    }
+    case bapidrpc::AggOp::AVG: {
+      // The ratio of the estimated sum to the estimated count of values
+      const auto x = input + "_x";
+      const auto xx = input + "_xx";
+      const auto xy = input + "_xy";
+      addPartial("sum", getAggregateOptions(bapidrpc::AggOp::SUM), input, y);
+      addPartial(
+          "count",
+          std::make_shared<cp::CountOptions>(cp::CountOptions::ONLY_VALID),
+          input, x);
+      addTotal(asDouble(y), y, "sum");
+      addTotal(asDouble(x), x, "sum");
+      addTotal(square(y), yy, "sum");
+      addTotal(square(x), xx, "sum");
+      addTotal(cp::call("multiply", {asDouble(x), asDouble(y)}), xy, "sum");
+
+      auto ratio = cp::call("divide", {cp::field_ref(y), cp::field_ref(x)});
+      auto variance = cp::call(
+          "subtract",
+          {cp::call("add", {cp::field_ref(yy),
+                            cp::call("multiply",
+                                     {cp::call("multiply", {ratio, ratio}),
+                                      cp::field_ref(xx)})}),
+           cp::call("multiply",
+                    {cp::literal(2.0),
+                     cp::call("multiply", {ratio, cp::field_ref(xy)})})});
+      outputs.emplace_back(ratio);
+      outputs.emplace_back(cp::call(
+          "divide", {confidenceInterval(std::move(variance)),
+                     cp::call("multiply", {cp::field_ref(x), scale})}));
+      fields.emplace_back(field);
+      fields.emplace_back(ci_field);
+      break;
+    }
+    case bapidrpc::AggOp::MIN:
+    case bapidrpc::AggOp::MAX: {
+      addPartial(aggregation.function, aggregation.options, input, y);
+      addTotal(cp::field_ref(y), y, aggregation.function);
+      outputs.emplace_back(cp::call("cast", {cp::field_ref(y)},
+                                    cp::CastOptions::Safe(field->type())));
+      fields.emplace_back(field);
+      break;
+    }
+    default:
+      return folly::makeUnexpected("cannot approximate " + field->name());
+    }
+  }
+
+  std::vector<std::string> output_names{};
+  std::transform(fields.begin(), fields.end(), std::back_inserter(output_names),
+                 [](const auto &field) { return field->name(); });
+
+  query_.sample(Sampling{
+      .row_group_rate = sample_rate,
+      .seed = approximation_->seed,
+      .row_group_fragments = true,
+  });
+  std::vector<cp::Declaration> decls{
+      {"project",
+       cp::ProjectNodeOptions{std::move(inputs), std::move(input_names)}},
+      {"aggregate",
+       cp::AggregateNodeOptions{std::move(row_group_aggregates),
+                                std::move(row_group_key_refs)}},
+      {"project", cp::ProjectNodeOptions{std::move(row_group_outputs),
+                                         std::move(row_group_output_names)}},
+      {"aggregate", cp::AggregateNodeOptions{std::move(aggregates),
+                                             std::move(key_refs)}},
+      {"project",
+       cp::ProjectNodeOptions{std::move(outputs), std::move(output_names)}},
+  };
+  return std::move(query_).finalize(std::move(decls),
+                                    arrow::schema(std::move(fields)));
+}
+
+TimelineQuery::TimelineQuery(SamplesQuery query, int64_t granularity)
+    : query_{std::move(query)}, granularity_{granularity} {}
+
+TimelineQuery &TimelineQuery::filter(const bapidrpc::Filter &filter) {
+  query_.filter(filter);
+  return *this;
+}
+
+TimelineQuery &TimelineQuery::timeRange(int64_t min_ts,
+                                        std::optional<int64_t> max_ts) {
+  query_.timeRange(min_ts, max_ts);
+  return *this;
+}
+
+TimelineQuery &TimelineQuery::groupBy(const bapidrpc::Col &col) {
+  query_.groupBy(col);
+  return *this;
+}
+
+TimelineQuery &TimelineQuery::aggregate(bapidrpc::AggOp op,
+                                        const bapidrpc::Col &col) {
+  query_.aggregate(op, col);
+  return *this;
+}
+
+TimelineQuery &TimelineQuery::percentile(const bapidrpc::Col &col,
+                                         double percentile) {
+  query_.percentile(col, percentile);
+  return *this;
+}
+
+TimelineQuery &TimelineQuery::approximate(Approximation approximation) {
+  query_.approximate(approximation);
+  return *this;
+}
+
+folly::Expected<SamplesQuery::RunnableQuery, std::string>
+TimelineQuery::finalize() && {
+  const auto &table_stats = query_.query_.table_stats_;
+  const auto *time_index =
+      table_stats ? table_stats->time_index.get() : nullptr;
+  if (!time_index) {
+    return folly::makeUnexpected(
+        std::string{"timeline on a table without timestamp col"});
+  }
+
+  auto bucket = time_index->makeBucket(granularity_);
+  if (!bucket.ok()) {
+    return folly::makeUnexpected(bucket.status().ToString());
+  }
+
+  const auto &ts_name = time_index->getTsField()->name();
+  query_.keys_.insert(query_.keys_.begin(),
+                      TableQuery::Key{bucket.MoveValueUnsafe(),
+                                      arrow::field(ts_name, arrow::int64())});
+  query_.query_.fields_.emplace(ts_name);
+  return std::move(query_).finalize();
+}
+
+bapidrpc::Col DBL_COL(std::string name) {
+  auto col = bapidrpc::Col{};
+  col.set_name(std::move(name));
+  col.set_type(bapidrpc::ColType::DOUBLE);
+  return col;
+}
+
+bapidrpc::Col INT_COL(std::string name) {
+  auto col = bapidrpc::Col{};
+  col.set_name(std::move(name));
+  col.set_type(bapidrpc::ColType::INT);
+  return col;
+}
+
+bapidrpc::Col STR_COL(std::string name) {
+  auto col = bapidrpc::Col{};
+  col.set_name(std::move(name));
+  col.set_type(bapidrpc::ColType::STR);
+  return col;
+}
+
+bapidrpc::Filter DBL_GT(std::string name, double val) {
+  auto filter = bapidrpc::Filter{};
+  filter.set_col_name(std::move(name));
+  filter.set_op(bapidrpc::FilterOp::GT);
+  filter.add_double_vals(val);
+  return filter;
+}
+
+/*static*/ folly::Expected<IpcStreamEncoder, std::string>
+IpcStreamEncoder::make(const std::shared_ptr<arrow::Schema> &schema) {
+  auto sink = arrow::io::BufferOutputStream::Create();
+  if (!sink.ok()) {
+    return folly::makeUnexpected(sink.status().ToString());
+  }
+
+  auto writer = arrow::ipc::MakeStreamWriter(sink.ValueUnsafe(), schema);
+  if (!writer.ok()) {
+    return folly::makeUnexpected(writer.status().ToString());
+  }
+
+  return IpcStreamEncoder{sink.MoveValueUnsafe(), writer.MoveValueUnsafe()};
+}
+
+IpcStreamEncoder::IpcStreamEncoder(
+    std::shared_ptr<arrow::io::BufferOutputStream> sink,
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> writer)
+    : sink_{std::move(sink)}, writer_{std::move(writer)} {}
+
+arrow::Result<std::shared_ptr<arrow::Buffer>> IpcStreamEncoder::flush() {
+  ARROW_ASSIGN_OR_RAISE(auto chunk, sink_->Finish());
+  ARROW_RETURN_NOT_OK(sink_->Reset());
+  return chunk;
+}
+
+folly::Expected<std::shared_ptr<arrow::Buffer>, std::string>
+IpcStreamEncoder::encode(const arrow::RecordBatch &batch) {
+  auto status = writer_->WriteRecordBatch(batch);
+  if (!status.ok()) {
+    return folly::makeUnexpected(status.ToString());
+  }
+
+  auto chunk = flush();
+  if (!chunk.ok()) {
+    return folly::makeUnexpected(chunk.status().ToString());
+  }
+
+  return chunk.MoveValueUnsafe();
+}
+
+folly::Expected<std::shared_ptr<arrow::Buffer>, std::string>
+IpcStreamEncoder::finish() {
+  auto status = writer_->Close();
+  if (!status.ok()) {
+    return folly::makeUnexpected(status.ToString());
+  }
+
+  auto chunk = flush();
+  if (!chunk.ok()) {
+    return folly::makeUnexpected(chunk.status().ToString());
+  }
+
+  return chunk.MoveValueUnsafe();
+}
+
+namespace {
+// How often the flusher of a table checks the age of its write buffer
+constexpr std::chrono::milliseconds kFlushCheckInterval{100};
+
+arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>>
+decodeIpcStream(const std::string &arrow_ipc) {
+  // Copied, as the batches read point into the stream
+  auto input = std::make_shared<arrow::io::BufferReader>(
+      arrow::Buffer::FromString(arrow_ipc));
+  ARROW_ASSIGN_OR_RAISE(auto reader,
+                        arrow::ipc::RecordBatchStreamReader::Open(input));
+  return reader->ToRecordBatches();
+}
+
+// nullptr if unset
+std::shared_ptr<arrow::Scalar> getScalar(const bapidrpc::Value &val) {
+  switch (val.val_case()) {
+  case bapidrpc::Value::kIntVal:
+    return arrow::MakeScalar(val.int_val());
+  case bapidrpc::Value::kDoubleVal:
+    return arrow::MakeScalar(val.double_val());
+  case bapidrpc::Value::kStrVal:
+    return std::make_shared<arrow::StringScalar>(val.str_val());
+  default:
+    return nullptr;
+  }
+}
+
+// The rows of `request` as one batch of its cols, whose values are cast to
+// the types of the cols
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+decodeRows(const bapidrpc::AppendRequest &request) {
+  arrow::FieldVector fields{};
+  std::vector<std::unique_ptr<arrow::ArrayBuilder>> builders{};
+  for (const auto &col : request.cols()) {
+    fields.emplace_back(arrow::field(col.name(), getArrowTypeForCol(col)));
+    ARROW_ASSIGN_OR_RAISE(auto builder,
+                          arrow::MakeBuilder(fields.back()->type()));
+    ARROW_RETURN_NOT_OK(builder->Reserve(request.rows_size()));
+    builders.emplace_back(std::move(builder));
+  }
+
+  for (const auto &row : request.rows()) {
+    if (row.vals_size() != request.cols_size()) {
+      return arrow::Status::Invalid("row of ", row.vals_size(), " vals for ",
+                                    request.cols_size(), " cols");
+    }
+    for (int i = 0; i < row.vals_size(); i++) {
+      auto scalar = getScalar(row.vals(i));
+      if (!scalar) {
+        ARROW_RETURN_NOT_OK(builders[i]->AppendNull());
+        continue;
+      }
+      if (!scalar->type->Equals(fields[i]->type())) {
+        ARROW_ASSIGN_OR_RAISE(scalar, scalar->CastTo(fields[i]->type()));
+      }
+      ARROW_RETURN_NOT_OK(builders[i]->AppendScalar(*scalar));
+    }
+  }
+
+  std::vector<std::shared_ptr<arrow::Array>> cols{};
+  for (auto &builder : builders) {
+    ARROW_ASSIGN_OR_RAISE(auto col, builder->Finish());
+    cols.emplace_back(std::move(col));
+  }
+  return arrow::RecordBatch::Make(arrow::schema(std::move(fields)),
+                                  request.rows_size(), std::move(cols));
+}
+} // namespace
+
+folly::Expected<int64_t, std::string>
+BapidTable::append(const bapidrpc::AppendRequest &request) {
+  auto batches =
+      [&]() -> arrow::Result<std::vector<std::shared_ptr<arrow::RecordBatch>>> {
+    if (!request.arrow_ipc().empty()) {
+      return decodeIpcStream(request.arrow_ipc());
+    }
+    ARROW_ASSIGN_OR_RAISE(auto batch, decodeRows(request));
+    return std::vector<std::shared_ptr<arrow::RecordBatch>>{std::move(batch)};
+  }();
+  if (!batches.ok()) {
+    return folly::makeUnexpected(batches.status().ToString());
+  }
+
+  int64_t num_rows = 0;
+  for (const auto &batch : batches.ValueUnsafe()) {
+    num_rows += batch->num_rows();
+  }
+  auto appended = append(batches.MoveValueUnsafe());
+  if (appended.hasError()) {
+    return folly::makeUnexpected(std::move(appended.error()));
+  }
+  return num_rows;
+}
+
+folly::Expected<folly::Unit, std::string> BapidTable::append(
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches) {
+  auto status = appendImpl(std::move(batches));
+  if (!status.ok()) {
+    return folly::makeUnexpected(status.ToString());
+  }
+  return folly::Unit{};
+}
+
+arrow::Status BapidTable::appendImpl(
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches) {
+  if (!file_sys_) {
+    return arrow::Status::Invalid("table ", name_,
+                                  " has no dataset dir to flush appends to");
+  }
+  batches.erase(std::remove_if(batches.begin(), batches.end(),
+                               [](const auto &batch) {
+                                 return batch->num_rows() == 0;
+                               }),
+                batches.end());
+  if (batches.empty()) {
+    return arrow::Status::OK();
+  }
+
+  auto schema = getDataset()->schema();
+  if (schema->num_fields() == 0) {
+    std::lock_guard<std::mutex> refreshing{refresh_mutex_};
+    auto state = state_.copy();
+    schema = state.dataset->schema();
+    if (schema->num_fields() == 0) {
+      ARROW_RETURN_NOT_OK(
+          publish(std::move(state), batches.front()->schema()));
+      schema = getDataset()->schema();
+    }
+  }
+
+  // Conformed first, so that the batches are appended all or none
+  int64_t num_bytes = 0;
+  for (auto &batch : batches) {
+    ARROW_ASSIGN_OR_RAISE(batch, conformBatch(*batch, schema));
+    num_bytes += arrow::util::TotalBufferSize(*batch);
+  }
+
+  uint64_t version = 0;
+  bool should_flush = false;
+  {
+    auto state = state_.wlock();
+    if (state->buffer.numBytes() + num_bytes > FLAGS_write_buffer_max_bytes) {
+      return arrow::Status::CapacityError("write buffer of table ", name_,
+                                          " is full");
+    }
+    for (auto &batch : batches) {
+      state->buffer.append(std::move(batch));
+    }
+    version = ++state->version;
+    should_flush = state->buffer.numBytes() >= FLAGS_write_buffer_flush_bytes;
+  }
+  result_cache_.invalidate(version);
+
+  std::call_once(flusher_started_, [this]() {
+    flusher_ = std::make_unique<PeriodicTask>(kFlushCheckInterval, [this]() {
+      const auto should_flush = state_.rlock()->buffer.shouldFlush(
+          FLAGS_write_buffer_flush_bytes,
+          std::chrono::milliseconds{FLAGS_write_buffer_flush_ms});
+      if (!should_flush) {
+        return;
+      }
+      auto status = flushImpl();
+      if (!status.ok()) {
+        XLOG(ERR) << "Table " << name_
+                  << " fails to flush its write buffer: "
+                  << status.ToString();
+      }
+    });
+  });
+  if (should_flush) {
+    flusher_->wake();
+  }
+  return arrow::Status::OK();
+}
+
+folly::Expected<folly::Unit, std::string> BapidTable::flush() {
+  if (!file_sys_) {
+    return folly::Unit{};
+  }
+
+  auto status = flushImpl();
+  if (!status.ok()) {
+    return folly::makeUnexpected(status.ToString());
+  }
+  return folly::Unit{};
+}
+
+arrow::Status BapidTable::flushImpl() {
+  std::lock_guard<std::mutex> flushing{flush_mutex_};
+  auto [schema, batches] = [&]() {
+    auto state = state_.rlock();
+    return std::make_pair(state->dataset->schema(), state->buffer.batches());
+  }();
+  if (batches.empty()) {
+    return arrow::Status::OK();
+  }
+
+  const auto path = fs::internal::ConcatAbstractPath(
+      dataset_dir_,
+      fmt::format("ingest-{}.parquet",
+                  std::chrono::system_clock::now().time_since_epoch().count()));
+  // The indexes go first, so that the refresh discovering the file finds them
+  const auto bloom_filter_cols = getBloomFilterCols();
+  if (FLAGS_bitmap_index_max_values > 0 || !bloom_filter_cols.empty()) {
+    ARROW_ASSIGN_OR_RAISE(auto table,
+                          arrow::Table::FromRecordBatches(schema, batches));
+    ARROW_ASSIGN_OR_RAISE(
+        auto bitmap_index,
+        BitmapIndex::build(*table, FLAGS_bitmap_index_max_values));
+    if (bitmap_index) {
+      ARROW_RETURN_NOT_OK(
+          bitmap_index->write(*file_sys_, getBitmapIndexPath(path)));
+    }
+    // The rows per row group of writeParquetFile
+    ARROW_ASSIGN_OR_RAISE(
+        auto bloom_filters,
+        BloomFilterIndex::build(*table, bloom_filter_cols,
+                                pq::DEFAULT_MAX_ROW_GROUP_LENGTH));
+    if (bloom_filters) {
+      ARROW_RETURN_NOT_OK(
+          bloom_filters->write(*file_sys_, getBloomFilterPath(path)));
+    }
+  }
+  const auto hidden_path = getHiddenPath(path);
+  auto status = writeParquetFile(*file_sys_, hidden_path, schema, batches);
+  const auto num_batches = batches.size();
+  if (status.ok()) {
+    // Refreshes, which queries run first, only wait for the file to be moved
+    // in place and discovered
+    std::lock_guard<std::mutex> refreshing{refresh_mutex_};
+    status = file_sys_->Move(hidden_path, path);
+    if (status.ok()) {
+      status = refreshLocked(FlushedFile{path, num_batches});
+      if (!status.ok()) {
+        // The rows stay buffered, and would otherwise be in the dataset twice
+        (void)file_sys_->DeleteFile(path);
+      }
+    }
+  }
+  if (!status.ok()) {
+    // Best effort, the hidden files are ignored by the listings anyway
+    (void)file_sys_->DeleteFile(hidden_path);
+    (void)file_sys_->DeleteFile(getBitmapIndexPath(path));
+    (void)file_sys_->DeleteFile(getBloomFilterPath(path));
+    return status;
+  }
+
+  XLOG(INFO) << "Table " << name_ << " flushed " << num_batches
+             << " appended batches to " << path;
+  return arrow::Status::OK();
+}
+
+int64_t BapidTable::numBufferedRows() const {
+  return state_.rlock()->buffer.numRows();
+}
+
+void test_arrow(BapidTable &table) {
+  BapidTable::describeFsDataset(FLAGS_dataset_dir);
 
-  auto query = table.value()
-                   ->newSamplesQueryX()
+  auto query = table.newSamplesQueryX()
                    .filter(DBL_GT("tip_amount", 30))
                    .filter(DBL_GT("tolls_amount", 10))
                    .project(DBL_COL("tip_amount"))
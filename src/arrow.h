@@ -1,58 +1,211 @@
+#pragma once
+
 #include "if/bapid.grpc.pb.h"
 #include "if/bapid.pb.h"
+#include "src/bitmap_index.h"
+#include "src/bloom_filter.h"
+#include "src/collector.h"
+#include "src/column_stats.h"
+#include "src/compaction.h"
+#include "src/dictionary.h"
+#include "src/fragment_stats.h"
+#include "src/hot_tier.h"
+#include "src/result_cache.h"
+#include "src/sampling.h"
+#include "src/shared_scan.h"
+#include "src/single_flight.h"
+#include "src/time_index.h"
+#include "src/top_k.h"
+#include "src/write_buffer.h"
 #include <arrow/api.h>
 #include <arrow/compute/exec/exec_plan.h>
 #include <arrow/dataset/file_parquet.h>
 #include <arrow/filesystem/filesystem.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/writer.h>
+#include <atomic>
+#include <chrono>
 #include <folly/Expected.h>
+#include <folly/Synchronized.h>
+#include <gflags/gflags.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 namespace bapid {
 
+DECLARE_string(dataset_dir); // NOLINT
+DECLARE_string(table_name);  // NOLINT
+DECLARE_string(ts_col_name); // NOLINT
+DECLARE_bool(late_materialization); // NOLINT
+DECLARE_int64(result_cache_bytes);  // NOLINT
+DECLARE_int64(shared_result_set_bytes); // NOLINT
+DECLARE_int32(shared_scan_window_ms);   // NOLINT
+DECLARE_int64(hot_tier_bytes);          // NOLINT
+DECLARE_int64(write_buffer_flush_bytes); // NOLINT
+DECLARE_int32(write_buffer_flush_ms);    // NOLINT
+DECLARE_int64(write_buffer_max_bytes);   // NOLINT
+DECLARE_int32(refresh_interval_ms);      // NOLINT
+
 namespace fs = arrow::fs;
 namespace ds = arrow::dataset;
 namespace pq = parquet;
 namespace cp = arrow::compute;
 
 bapidrpc::Col DBL_COL(std::string name);
+bapidrpc::Col INT_COL(std::string name);
+bapidrpc::Col STR_COL(std::string name);
 bapidrpc::Filter DBL_GT(std::string name, double val);
 
+// What a table knows about its fragments without opening them, which the scan
+// planning uses to skip data
+struct TableStats {
+  FragmentStatsIndex fragments{};
+  TableColumnStats columns{};
+  // nullptr if the table has no timestamp col
+  std::shared_ptr<const TimeIndex> time_index{};
+  // Of the fragments that have them, keyed by their paths
+  std::unordered_map<std::string, std::shared_ptr<const BitmapIndex>>
+      bitmap_indexes{};
+  std::unordered_map<std::string, std::shared_ptr<const BloomFilterIndex>>
+      bloom_filters{};
+};
+
+// Counters of the data skipped when planning the scan of a query
+struct ScanStats {
+  int64_t num_fragments{0};
+  int64_t num_fragments_skipped{0};
+  int64_t num_row_groups{0};
+  int64_t num_row_groups_skipped{0};
+  // Included in the above, skipped by the time index alone
+  int64_t num_fragments_skipped_by_time{0};
+  int64_t num_row_groups_skipped_by_time{0};
+  // Included in the above, without a row the bitmap indexes match
+  int64_t num_row_groups_skipped_by_index{0};
+  // Included in the above, without a value the Bloom filters may match
+  int64_t num_row_groups_skipped_by_bloom_filter{0};
+  // Not in the above, skipped by the second phase of a two-phase scan as the
+  // first one found no matching row in them
+  int64_t num_row_groups_skipped_by_filter{0};
+  // Not in the above, left out of a sampled scan
+  int64_t num_row_groups_skipped_by_sampling{0};
+  // Not in the above, whose rows cannot be among the top ones of an ordered
+  // query
+  int64_t num_row_groups_skipped_by_top_k{0};
+  // Not in the above, not scanned by a count as their stats tell that all of
+  // their rows match, and the number of those rows
+  int64_t num_row_groups_counted_by_stats{0};
+  int64_t num_rows_counted_by_stats{0};
+};
+
 class SamplesQuery {
 public:
+  // `table_stats` are the known stats of the fragments of the dataset, which
+  // spare the scan planning from opening their footers
   static folly::Expected<SamplesQuery, std::string>
-  fromDataset(std::shared_ptr<ds::Dataset> dataset);
+  fromDataset(std::shared_ptr<ds::Dataset> dataset,
+              std::shared_ptr<const TableStats> table_stats = {});
 
   SamplesQuery(cp::ExecFactoryRegistry *registry,
                std::shared_ptr<cp::ExecPlan> plan,
-               std::shared_ptr<ds::Dataset> dataset);
+               std::shared_ptr<ds::Dataset> dataset,
+               std::shared_ptr<const TableStats> table_stats = {});
 
   class RunnableQuery {
   public:
     folly::Expected<std::shared_ptr<arrow::Table>, std::string> gen() &&;
+    // Returns the next batch of the result set as soon as the plan produces
+    // it, or nullptr once the result set is exhausted or the limit is reached.
+    // The plan starts producing on the first call.
+    folly::Expected<std::shared_ptr<arrow::RecordBatch>, std::string> next();
+    const std::shared_ptr<arrow::Schema> &schema() const;
+    const ScanStats &scanStats() const;
+
     RunnableQuery(std::shared_ptr<cp::ExecPlan> plan,
                   std::shared_ptr<arrow::Schema> schema,
                   arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen,
-                  std::optional<int> take);
+                  std::optional<int> take, ScanStats scan_stats,
+                  std::unique_ptr<Collector> collector = nullptr,
+                  std::shared_ptr<SharedScan::Subscription> subscription =
+                      nullptr);
+    // Stops the plan if the result set was not fully consumed
+    ~RunnableQuery();
+
+    RunnableQuery(RunnableQuery &&) = default;
+    RunnableQuery &operator=(RunnableQuery &&) = default;
+    RunnableQuery(const RunnableQuery &) = delete;
+    RunnableQuery &operator=(const RunnableQuery &) = delete;
 
   private:
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> nextImpl();
+    // Consumes the whole result set into the collector
+    arrow::Status collect();
+    arrow::Status stop();
+
     std::shared_ptr<cp::ExecPlan> plan_;
     std::shared_ptr<arrow::Schema> schema_;
     arrow::AsyncGenerator<std::optional<cp::ExecBatch>> sink_gen_;
     std::optional<int> take_;
+    ScanStats scan_stats_;
+    // Set for a query whose result set is only known once all the rows
+    // reached the sink, e.g. a sample or the top rows
+    std::unique_ptr<Collector> collector_;
+    // Set for a query whose scan is a part of a pass shared with others
+    std::shared_ptr<SharedScan::Subscription> subscription_;
+
+    std::shared_ptr<arrow::RecordBatchReader> sink_reader_{};
+    std::shared_ptr<arrow::Table> collected_{};
+    std::unique_ptr<arrow::TableBatchReader> collected_reader_{};
+    int64_t num_rows_{0};
+    bool done_{false};
   };
 
   SamplesQuery &filter(const bapidrpc::Filter &filter);
   SamplesQuery &project(const bapidrpc::Col &col);
+  // The first `to_take` rows to reach the sink, or with a sampling a uniform
+  // random sample of `to_take` of the sampled rows
   SamplesQuery &take(int to_take);
+  SamplesQuery &sample(Sampling sampling);
+  // The result set is then the first rows in the order of `col`, sorted, up
+  // to the limit, which is required. Projects `col` if it is not yet.
+  SamplesQuery &orderBy(const bapidrpc::Col &col, bool descending);
+  // Only keeps the rows whose timestamp col is in [min_ts, max_ts], in
+  // seconds. Requires the table to have a timestamp col.
+  SamplesQuery &timeRange(int64_t min_ts, std::optional<int64_t> max_ts);
+  // Scans as a part of the next pass of `shared_scan` over the table
+  SamplesQuery &shareScan(std::shared_ptr<SharedScan> shared_scan);
+  // Scans the cols kept decoded by `hot_tier` from there rather than from
+  // their files, unless the scan is shared
+  SamplesQuery &useHotTier(std::shared_ptr<HotTier> hot_tier);
+  // Also scans `batches`, the rows appended to the table but not in its files
+  // yet, unless row groups are sampled
+  SamplesQuery &
+  scanBuffered(std::vector<std::shared_ptr<arrow::RecordBatch>> batches);
   folly::Expected<RunnableQuery, std::string> finalize() &&;
+  // Counts the rows that match the filters instead, as a result set of one
+  // `count` col and row. The row groups whose stats tell that all of their
+  // rows match are counted from their footers, so that only the others are
+  // scanned. Takes no limit, sampling or order by.
+  folly::Expected<RunnableQuery, std::string> count() &&;
 
 private:
+  friend class TableQuery;
+  friend class TimelineQuery;
+
+  // Plans the scan and the filters of the query, followed by `decls` that
+  // produce a result set of `schema`
+  folly::Expected<RunnableQuery, std::string>
+  finalize(std::vector<cp::Declaration> decls,
+           std::shared_ptr<arrow::Schema> schema) &&;
+
   cp::ExecFactoryRegistry *registry_;
   std::shared_ptr<cp::ExecPlan> plan_;
   std::shared_ptr<ds::Dataset> dataset_;
+  std::shared_ptr<const TableStats> table_stats_;
 
   std::vector<cp::Expression> filters_{};
   std::unordered_set<std::string> fields_{};
@@ -60,23 +213,275 @@ private:
   std::vector<std::shared_ptr<arrow::Field>> result_set_schema_{};
   std::vector<cp::Declaration> decls_{};
   std::optional<int> take_;
+  std::optional<TimeWindow> time_window_;
+  std::optional<Sampling> sampling_;
+  std::optional<OrderBy> order_by_;
+  std::shared_ptr<SharedScan> shared_scan_{};
+  std::shared_ptr<HotTier> hot_tier_{};
+  std::vector<std::shared_ptr<arrow::RecordBatch>> buffered_{};
+  bool count_only_{false};
+};
+
+// How an aggregation query trades accuracy for speed, by scanning a random
+// sample of the row groups of the table
+struct Approximation {
+  // Share of the row groups scanned, in (0, 1]; 1 is exact
+  std::optional<double> sample_rate{};
+  // Relative half-width of the 95% confidence interval of a count, which
+  // picks the sample rate if it is unset
+  std::optional<double> target_error{};
+  std::optional<uint64_t> seed{};
 };
 
+// Aggregates the rows of a table that match its filters, grouped by the values
+// of its group-by cols. Runs as a hash aggregation in the plan: each thread
+// aggregates the batches it gets into its own state, and the states are merged
+// once the scan is done. Without group-by cols the result set has one row, and
+// a lone COUNT is then answered by SamplesQuery::count.
+class TableQuery {
+public:
+  explicit TableQuery(SamplesQuery query);
+
+  TableQuery &filter(const bapidrpc::Filter &filter);
+  TableQuery &timeRange(int64_t min_ts, std::optional<int64_t> max_ts);
+  TableQuery &groupBy(const bapidrpc::Col &col);
+  // `col` is ignored by COUNT, which counts rows
+  TableQuery &aggregate(bapidrpc::AggOp op, const bapidrpc::Col &col);
+  // Approximate `percentile` in [0, 100] of a numeric col, from t-digest
+  // sketches merged across threads
+  TableQuery &percentile(const bapidrpc::Col &col, double percentile);
+  // Counts, sums and averages are then estimated from the sampled row groups,
+  // each followed by a `<name>_ci` col with the half-width of its 95%
+  // confidence interval. Mins and maxes are those of the sample.
+  TableQuery &approximate(Approximation approximation);
+  folly::Expected<SamplesQuery::RunnableQuery, std::string> finalize() &&;
+
+private:
+  friend class TimelineQuery;
+
+  struct Key {
+    cp::Expression expr;
+    std::shared_ptr<arrow::Field> field;
+    // Set if grouped by the codes of the strings of a dictionary col, which
+    // are looked up once per group
+    std::shared_ptr<StringInterner> interner{};
+  };
+
+  struct Aggregation {
+    bapidrpc::AggOp op;
+    // Of the aggregate function without groups, prefixed with hash_ for the
+    // one with groups
+    std::string function;
+    std::shared_ptr<cp::FunctionOptions> options;
+    // Of the aggregated col, unused by COUNT
+    cp::Expression expr;
+    std::shared_ptr<arrow::Field> field;
+    // The function with groups outputs a list of one value per group
+    bool is_list_per_group{false};
+  };
+
+  // The key `name` of the result set, as the col of `key`
+  static cp::Expression getKeyOutput(const Key &key, const std::string &name);
+  // Share of the row groups to sample to meet the target error, if any
+  std::optional<double> getSampleRate() const;
+  folly::Expected<SamplesQuery::RunnableQuery, std::string>
+  finalizeApproximate(double sample_rate) &&;
+
+  SamplesQuery query_;
+  std::vector<Key> keys_{};
+  std::vector<Aggregation> aggregations_{};
+  std::optional<Approximation> approximation_{};
+};
+
+// A TableQuery whose rows are first grouped by time bucket, e.g. to chart an
+// aggregation over time. The time bucket is the first col of the result set,
+// named after the timestamp col of the table.
+class TimelineQuery {
+public:
+  // `granularity` is the width of the time buckets in seconds
+  TimelineQuery(SamplesQuery query, int64_t granularity);
+
+  TimelineQuery &filter(const bapidrpc::Filter &filter);
+  TimelineQuery &timeRange(int64_t min_ts, std::optional<int64_t> max_ts);
+  TimelineQuery &groupBy(const bapidrpc::Col &col);
+  TimelineQuery &aggregate(bapidrpc::AggOp op, const bapidrpc::Col &col);
+  TimelineQuery &percentile(const bapidrpc::Col &col, double percentile);
+  TimelineQuery &approximate(Approximation approximation);
+  folly::Expected<SamplesQuery::RunnableQuery, std::string> finalize() &&;
+
+private:
+  TableQuery query_;
+  int64_t granularity_;
+};
+
+// Encodes record batches as chunks of a single Arrow IPC stream. The first
+// chunk carries the schema and the one returned by `finish` the end-of-stream
+// marker, so the chunks concatenated in order form a complete stream.
+class IpcStreamEncoder {
+public:
+  static folly::Expected<IpcStreamEncoder, std::string>
+  make(const std::shared_ptr<arrow::Schema> &schema);
+
+  IpcStreamEncoder(std::shared_ptr<arrow::io::BufferOutputStream> sink,
+                   std::shared_ptr<arrow::ipc::RecordBatchWriter> writer);
+
+  folly::Expected<std::shared_ptr<arrow::Buffer>, std::string>
+  encode(const arrow::RecordBatch &batch);
+  folly::Expected<std::shared_ptr<arrow::Buffer>, std::string> finish();
+
+private:
+  arrow::Result<std::shared_ptr<arrow::Buffer>> flush();
+
+  std::shared_ptr<arrow::io::BufferOutputStream> sink_;
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> writer_;
+};
+
+// A named dataset served by bapid. A table discovered from a dataset dir keeps
+// its fragments and their stats in memory across queries, and persists them in
+// a manifest next to the dataset for the next time it is loaded.
 class BapidTable {
 public:
   static folly::Expected<folly::Unit, std::string>
   describeFsDataset(const std::string &root_path);
 
+  // Loads the table from the manifest of `dataset_dir` if there is one, which
+  // is reconciled with the dir on the first refresh, and otherwise discovers
+  // the dataset. `ts_col_name` optionally designates the timestamp col that
+  // time ranges of queries apply to.
   static folly::Expected<std::unique_ptr<BapidTable>, std::string>
-  fromFsDataset(const std::string &dataset_dir, std::string name);
+  fromFsDataset(const std::string &dataset_dir, std::string name,
+                std::string ts_col_name = {});
 
   BapidTable(std::string name, std::shared_ptr<ds::Dataset> dataset);
+  BapidTable(std::string name, std::string dataset_dir,
+             std::shared_ptr<fs::FileSystem> file_sys,
+             std::string ts_col_name);
+  // Flushes the rows still in the write buffer
+  ~BapidTable();
+
+  const std::string &getName() const;
+  std::shared_ptr<ds::Dataset> getDataset() const;
+  // Updates the dataset with the files added to or removed from the dataset
+  // dir since the last discovery. Only the new files are opened, and nothing
+  // is listed if the dir is unchanged.
+  folly::Expected<folly::Unit, std::string> refresh();
+  // Same as above, unless the last refresh was less than
+  // --refresh_interval_ms ago or another one is running. On error, the
+  // dataset stays as it was.
+  void refreshIfStale();
+
   SamplesQuery newSamplesQueryX();
+  folly::Expected<SamplesQuery, std::string>
+  newSamplesQuery(const bapidrpc::SamplesQuery &query);
+  folly::Expected<TableQuery, std::string>
+  newTableQuery(const bapidrpc::TableQuery &query);
+  folly::Expected<TimelineQuery, std::string>
+  newTimelineQuery(const bapidrpc::TimelineQuery &query);
+
+  // Bumped whenever the fragments of the table change
+  uint64_t getVersion() const;
+  // The result set of a samples query of the same shape run on `version` of
+  // the table, with the cols in the order `query` projects them; nullptr if
+  // not cached. Filters and projected cols match in any order.
+  std::shared_ptr<arrow::Table>
+  getCachedResultSet(const bapidrpc::SamplesQuery &query, uint64_t version);
+  void cacheResultSet(const bapidrpc::SamplesQuery &query, uint64_t version,
+                      std::shared_ptr<arrow::Table> result_set);
+  int64_t maxCachedResultSetBytes() const;
+
+  // Run the query, unless an identical one is running on `version` of the
+  // table and can still be joined, whose result set is then shared. Filters
+  // match in any order. `query` must outlive the future, which may wait for
+  // an identical query to start.
+  folly::SemiFuture<SingleFlight::ReaderOrError>
+  runSamplesQuery(const bapidrpc::SamplesQuery &query, uint64_t version);
+  folly::SemiFuture<SingleFlight::ReaderOrError>
+  runTableQuery(const bapidrpc::TableQuery &query, uint64_t version);
+  folly::SemiFuture<SingleFlight::ReaderOrError>
+  runTimelineQuery(const bapidrpc::TimelineQuery &query, uint64_t version);
+
+  // Rewrites the dataset into `options.out_dir`, sorted by the timestamp col
+  // of the table unless `options` name another sort col. Flushes the write
+  // buffer first, so that the output has the buffered rows.
+  folly::Expected<CompactionStats, std::string>
+  compact(CompactionOptions options);
+
+  // Appends the rows of `request` to the write buffer, where queries see them
+  // right away, and returns their number. A background task flushes the
+  // buffer to a new file of the dataset once it is large or old enough; the
+  // rows are lost if bapid dies before. The first rows appended to a table
+  // without files give it its schema.
+  folly::Expected<int64_t, std::string>
+  append(const bapidrpc::AppendRequest &request);
+  folly::Expected<folly::Unit, std::string>
+  append(std::vector<std::shared_ptr<arrow::RecordBatch>> batches);
+  // Writes the buffered rows to a new file of the dataset, which replaces
+  // them for the queries
+  folly::Expected<folly::Unit, std::string> flush();
+  int64_t numBufferedRows() const;
 
 private:
+  struct DiscoveredFile {
+    std::shared_ptr<ds::FileFragment> fragment;
+    std::shared_ptr<const FragmentStats> stats;
+    std::shared_ptr<const BitmapIndex> bitmap_index{};
+    std::shared_ptr<const BloomFilterIndex> bloom_filters{};
+  };
+
+  struct State {
+    std::shared_ptr<ds::Dataset> dataset{};
+    std::shared_ptr<const TableStats> table_stats{};
+    std::optional<fs::TimePoint> dir_mtime{};
+    std::map<std::string, DiscoveredFile> files{};
+    WriteBuffer buffer{};
+    uint64_t version{0};
+  };
+
+  // A file the write buffer was flushed to, whose batches the refresh
+  // discovering it drops from the buffer
+  struct FlushedFile {
+    std::string path;
+    size_t num_batches;
+  };
+
+  // A query on the current dataset, scanning as a part of a shared pass or
+  // through the hot tier if enabled
+  folly::Expected<SamplesQuery, std::string> newQuery();
+  arrow::Status loadManifest();
+  arrow::Status refreshImpl();
+  // Requires `refresh_mutex_`
+  arrow::Status refreshLocked(std::optional<FlushedFile> flushed);
+  arrow::Status publish(State state, std::shared_ptr<arrow::Schema> schema,
+                        size_t num_flushed_batches = 0);
+  arrow::Status
+  appendImpl(std::vector<std::shared_ptr<arrow::RecordBatch>> batches);
+  arrow::Status flushImpl();
+
   std::string name_;
-  std::shared_ptr<ds::Dataset> dataset_;
+  std::string dataset_dir_{};
+  std::shared_ptr<fs::FileSystem> file_sys_{};
+  std::string ts_col_name_{};
+  // Replaced rather than changed, under `refresh_mutex_`, as the fragments
+  // being scanned share it
+  std::shared_ptr<ds::ParquetFileFormat> format_ =
+      std::make_shared<ds::ParquetFileFormat>();
+
+  std::mutex refresh_mutex_{};
+  std::atomic<std::chrono::steady_clock::time_point> last_refresh_{};
+  // Held for a whole flush, so that two flushes never write the same rows.
+  // Refreshes only wait for the flushed file to be moved in place.
+  std::mutex flush_mutex_{};
+  folly::Synchronized<State> state_{};
+  ResultCache result_cache_{FLAGS_result_cache_bytes};
+  SingleFlight single_flight_{FLAGS_shared_result_set_bytes};
+  std::shared_ptr<SharedScan> shared_scan_{std::make_shared<SharedScan>(
+      std::chrono::milliseconds{FLAGS_shared_scan_window_ms})};
+  std::shared_ptr<HotTier> hot_tier_{
+      std::make_shared<HotTier>(FLAGS_hot_tier_bytes)};
+  // Started by the first append, and stopped first on destruction
+  std::once_flag flusher_started_{};
+  std::unique_ptr<PeriodicTask> flusher_{};
 };
 
-void test_arrow();
+void test_arrow(BapidTable &table);
 } // namespace bapid
@@ -1,4 +1,5 @@
 #include "src/bapid_main.h"
+#include "src/arrow.h"
 #include <fmt/core.h>
 #include <folly/File.h>
 #include <folly/FileUtil.h>
@@ -66,6 +67,25 @@ initLogging(const std::string &flag_log_dir) {
 
   return {{std::move(original_stderr), std::move(log_filename)}};
 }
+
+// `bapid compact` rewrites the dataset in --dataset_dir into --out_dir
+int runCompaction() {
+  auto table = BapidTable::fromFsDataset(FLAGS_dataset_dir, FLAGS_table_name,
+                                         FLAGS_ts_col_name);
+  if (table.hasError()) {
+    XLOG(ERR) << "fail to load " << FLAGS_dataset_dir << ": "
+              << table.error();
+    return kExitCodeError;
+  }
+
+  auto stats = table.value()->compact(CompactionOptions::fromFlags());
+  if (stats.hasError()) {
+    XLOG(ERR) << "fail to compact " << FLAGS_dataset_dir << ": "
+              << stats.error();
+    return kExitCodeError;
+  }
+  return kExitCodeSuccess;
+}
 } // namespace
 
 BapidMain::BapidMain(Bapid::Config &&config) : config_{std::move(config)} {}
@@ -79,6 +99,10 @@ void BapidMain::start(folly::SemiFuture<folly::Unit> &&on_serve) {
 
 int runBapidMain(int argc, char **argv) {
   folly::init(&argc, &argv);
+  if (argc > 1 && argv[1] == "compact"sv) {
+    return runCompaction();
+  }
+
   auto logging = initLogging(FLAGS_log_dir);
   if (!logging) {
     return kExitCodeError;
@@ -1,12 +1,15 @@
 #include "src/bapid_server.h"
 #include "if/bapid.grpc.pb.h"
 #include "src/arrow.h"
+#include "src/catalog.h"
 #include "src/common/rpc_runtime.h"
 #include "src/common/rpc_server.h"
+#include <arrow/util/byte_size.h>
 #include <atomic>
 #include <chrono>
 #include <folly/executors/GlobalExecutor.h>
 #include <folly/experimental/coro/Task.h>
+#include <folly/futures/Future.h>
 #include <folly/io/async/EventBaseManager.h>
 #include <folly/logging/xlog.h>
 #include <initializer_list>
@@ -14,6 +17,9 @@
 
 namespace bapid {
 
+DEFINE_int32(query_threads, 16,
+             "threads that start queries and pull their batches"); // NOLINT
+
 folly::coro::Task<void>
 BapidHandlers::ping(bapidrpc::PingReply &reply,
                     const bapidrpc::PingRequest &request,
@@ -32,10 +38,251 @@ folly::coro::Task<void> BapidHandlers::shutdown(bapidrpc::Empty &reply,
 folly::coro::Task<void> BapidHandlers::arrowTest(bapidrpc::Empty &reply,
                                                  const bapidrpc::Empty &reuqest,
                                                  BapidHandlerCtx &ctx) {
-  test_arrow();
+  auto table = ctx.server->catalog_.getTable(FLAGS_table_name);
+  if (table.hasError()) {
+    XLOG(ERR) << table.error();
+    co_return;
+  }
+
+  test_arrow(*table.value());
   co_return;
 }
 
+namespace {
+// Streams the batches `next` returns until it returns nullptr. `next` runs on
+// `executor`, as it blocks until the query produces a batch.
+template <typename NextFn>
+folly::coro::Task<grpc::Status>
+streamBatches(folly::Executor::KeepAlive<> executor,
+              const std::shared_ptr<arrow::Schema> &schema, NextFn next,
+              RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer) {
+  auto encoder = IpcStreamEncoder::make(schema);
+  if (encoder.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::INTERNAL, encoder.error());
+  }
+
+  // Each batch is sent as soon as the plan produces it. The write resumes
+  // only after gRPC consumed the message, which with the sink's backpressure
+  // bounds the batches a query holds in memory.
+  bapidrpc::SamplesQueryResult result{};
+  while (true) {
+    auto batch =
+        co_await folly::via(executor, [&]() { return next(); }).semi();
+    if (batch.hasError()) {
+      co_return grpc::Status(grpc::StatusCode::INTERNAL, batch.error());
+    }
+
+    if (!batch.value()) {
+      break;
+    }
+
+    if (batch.value()->num_rows() == 0) {
+      continue;
+    }
+
+    auto chunk = encoder->encode(*batch.value());
+    if (chunk.hasError()) {
+      co_return grpc::Status(grpc::StatusCode::INTERNAL, chunk.error());
+    }
+
+    result.set_arrow_ipc(chunk.value()->data(), chunk.value()->size());
+    if (!co_await writer.write(result)) {
+      co_return grpc::Status::CANCELLED;
+    }
+  }
+
+  auto chunk = encoder->finish();
+  if (chunk.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::INTERNAL, chunk.error());
+  }
+
+  result.set_arrow_ipc(chunk.value()->data(), chunk.value()->size());
+  co_await writer.write(result);
+  co_return grpc::Status::OK;
+}
+
+folly::coro::Task<grpc::Status>
+streamResultSet(folly::Executor::KeepAlive<> executor,
+                SharedResultSet::Reader &reader,
+                RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer) {
+  co_return co_await streamBatches(
+      std::move(executor), reader.schema(), [&]() { return reader.next(); },
+      writer);
+}
+
+folly::coro::Task<grpc::Status>
+streamResultSet(folly::Executor::KeepAlive<> executor,
+                const arrow::Table &result_set,
+                RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer) {
+  arrow::TableBatchReader reader{result_set};
+  co_return co_await streamBatches(
+      std::move(executor), result_set.schema(),
+      [&]() -> folly::Expected<std::shared_ptr<arrow::RecordBatch>,
+                               std::string> {
+        std::shared_ptr<arrow::RecordBatch> batch;
+        auto status = reader.ReadNext(&batch);
+        if (!status.ok()) {
+          return folly::makeUnexpected(status.ToString());
+        }
+        return batch;
+      },
+      writer);
+}
+
+// Runs the query `runQuery` starts on the table of the request, or joins the
+// identical one already running. Starting it may scan, e.g. the first phase
+// of a two-phase scan, hence on `executor`.
+template <typename Request, typename RunQueryFn>
+folly::coro::Task<grpc::Status>
+runQuery(RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+         const Request &request, TableCatalog &catalog,
+         folly::Executor::KeepAlive<> executor, RunQueryFn runQuery) {
+  auto table = catalog.getTable(request.table());
+  if (table.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::NOT_FOUND, table.error());
+  }
+
+  auto reader = co_await folly::via(executor, [&]() {
+                  return runQuery(*table.value(), request);
+                }).semi();
+  if (reader.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, reader.error());
+  }
+
+  co_return co_await streamResultSet(std::move(executor), reader.value(),
+                                     writer);
+}
+} // namespace
+
+// Serves repeated samples queries from the result cache of the table. A
+// result set is cached once fully sent, unless it is too large to be.
+folly::coro::Task<grpc::Status> BapidHandlers::runSamplesQuery(
+    RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+    const bapidrpc::SamplesQuery &request, BapidHandlerCtx &ctx) {
+  auto table = ctx.server->catalog_.getTable(request.table());
+  if (table.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::NOT_FOUND, table.error());
+  }
+
+  auto executor = folly::getKeepAliveToken(ctx.server->query_executor_);
+  auto &bapid_table = *table.value();
+  const auto version = bapid_table.getVersion();
+  if (auto cached = bapid_table.getCachedResultSet(request, version)) {
+    co_return co_await streamResultSet(executor, *cached, writer);
+  }
+
+  auto reader = co_await folly::via(executor, [&]() {
+                  return bapid_table.runSamplesQuery(request, version);
+                }).semi();
+  if (reader.hasError()) {
+    co_return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, reader.error());
+  }
+
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches{};
+  int64_t num_bytes = 0;
+  bool cacheable = true;
+  auto status = co_await streamBatches(
+      executor, reader->schema(),
+      [&]() {
+        auto batch = reader->next();
+        if (cacheable && batch.hasValue() && batch.value()) {
+          num_bytes += arrow::util::TotalBufferSize(*batch.value());
+          cacheable = num_bytes <= bapid_table.maxCachedResultSetBytes();
+          if (cacheable) {
+            batches.emplace_back(batch.value());
+          } else {
+            batches.clear();
+          }
+        }
+        return batch;
+      },
+      writer);
+  if (!status.ok() || !cacheable) {
+    co_return status;
+  }
+
+  auto result_set =
+      arrow::Table::FromRecordBatches(reader->schema(), std::move(batches));
+  if (result_set.ok()) {
+    bapid_table.cacheResultSet(request, version, result_set.MoveValueUnsafe());
+  }
+  co_return status;
+}
+
+folly::coro::Task<grpc::Status> BapidHandlers::runTableQuery(
+    RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+    const bapidrpc::TableQuery &request, BapidHandlerCtx &ctx) {
+  co_return co_await runQuery(
+      writer, request, ctx.server->catalog_,
+      folly::getKeepAliveToken(ctx.server->query_executor_),
+      [](BapidTable &table, const auto &query) {
+        return table.runTableQuery(query, table.getVersion());
+      });
+}
+
+folly::coro::Task<grpc::Status> BapidHandlers::runTimelineQuery(
+    RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+    const bapidrpc::TimelineQuery &request, BapidHandlerCtx &ctx) {
+  co_return co_await runQuery(
+      writer, request, ctx.server->catalog_,
+      folly::getKeepAliveToken(ctx.server->query_executor_),
+      [](BapidTable &table, const auto &query) {
+        return table.runTimelineQuery(query, table.getVersion());
+      });
+}
+
+folly::coro::Task<void>
+BapidHandlers::compact(bapidrpc::CompactReply &reply,
+                       const bapidrpc::CompactRequest &request,
+                       BapidHandlerCtx &ctx) {
+  auto table = ctx.server->catalog_.getTable(request.table());
+  if (table.hasError()) {
+    reply.set_error(table.error());
+    co_return;
+  }
+
+  auto options = CompactionOptions::fromFlags();
+  options.out_dir = request.out_dir();
+  options.sort_col = request.sort_col();
+  if (request.has_rows_per_file()) {
+    options.rows_per_file = request.rows_per_file();
+  }
+  if (request.has_rows_per_row_group()) {
+    options.rows_per_row_group = request.rows_per_row_group();
+  }
+
+  // Off the RPC threads, as it rewrites the whole dataset
+  auto executor = folly::getKeepAliveToken(ctx.server->compaction_executor_);
+  auto stats = co_await folly::via(executor, [&]() {
+                 return table.value()->compact(std::move(options));
+               }).semi();
+  if (stats.hasError()) {
+    reply.set_error(stats.error());
+    co_return;
+  }
+  reply.set_num_input_files(stats->num_input_files);
+  reply.set_num_output_files(stats->num_output_files);
+  reply.set_num_rows(stats->num_rows);
+}
+
+folly::coro::Task<void>
+BapidHandlers::append(bapidrpc::AppendReply &reply,
+                      const bapidrpc::AppendRequest &request,
+                      BapidHandlerCtx &ctx) {
+  auto table = ctx.server->catalog_.getTable(request.table());
+  if (table.hasError()) {
+    reply.set_error(table.error());
+    co_return;
+  }
+
+  auto num_rows = table.value()->append(request);
+  if (num_rows.hasError()) {
+    reply.set_error(num_rows.error());
+    co_return;
+  }
+  reply.set_num_rows(num_rows.value());
+}
+
 void BapidServer::shutdownRequested() {
   XLOG(INFO) << "shutdown requested...";
   shutdown_requested_.setValue(folly::Unit{});
@@ -60,8 +307,30 @@ BapidServer::BapidServer(std::string addr, int num_threads,
       &BapidHandlers::shutdown);
   registry->registerHandler<&BapidService::AsyncService::RequestArrowTest>(
       &BapidHandlers::arrowTest);
+  registry->registerStreamingHandler<
+      &BapidService::AsyncService::RequestRunSamplesQuery>(
+      &BapidHandlers::runSamplesQuery);
+  registry->registerStreamingHandler<
+      &BapidService::AsyncService::RequestRunTableQuery>(
+      &BapidHandlers::runTableQuery);
+  registry->registerStreamingHandler<
+      &BapidService::AsyncService::RequestRunTimelineQuery>(
+      &BapidHandlers::runTimelineQuery);
+  registry->registerHandler<&BapidService::AsyncService::RequestCompact>(
+      &BapidHandlers::compact);
+  registry->registerHandler<&BapidService::AsyncService::RequestAppend>(
+      &BapidHandlers::append);
 
   initService(std::move(service), std::move(registry));
+
+  if (!FLAGS_dataset_dir.empty()) {
+    auto table = catalog_.addFsTable(FLAGS_table_name, FLAGS_dataset_dir,
+                                     FLAGS_ts_col_name);
+    if (table.hasError()) {
+      XLOG(ERR) << "fail to load table " << FLAGS_table_name << ": "
+                << table.error();
+    }
+  }
 }
 
 } // namespace bapid
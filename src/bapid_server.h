@@ -1,14 +1,18 @@
 #pragma once
 
 #include "if/bapid.grpc.pb.h"
+#include "src/catalog.h"
 #include "src/common/rpc_runtime.h"
 #include "src/common/rpc_server.h"
 #include <folly/CancellationToken.h>
 #include <folly/Unit.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/executors/GlobalExecutor.h>
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
 #include <folly/experimental/coro/Task.h>
 #include <folly/io/async/EventBase.h>
 #include <folly/logging/xlog.h>
+#include <gflags/gflags.h>
 #include <grpc/support/log.h>
 
 #include <functional>
@@ -20,6 +24,8 @@
 
 namespace bapid {
 
+DECLARE_int32(query_threads); // NOLINT
+
 struct BapidHandlers;
 class BapidServer : public RpcServerBase {
 public:
@@ -31,6 +37,16 @@ private:
   void shutdownRequested();
 
   folly::Promise<folly::Unit> shutdown_requested_{};
+  TableCatalog catalog_{};
+  // Runs the parts of queries that block, i.e. starting them and pulling
+  // their batches, so that slow queries do not hold up the threads of the
+  // other RPCs. Stopped before the tables go away.
+  folly::CPUThreadPoolExecutor query_executor_{
+      static_cast<size_t>(FLAGS_query_threads),
+      std::make_shared<folly::NamedThreadFactory>("BapidQuery")};
+  // Rewrites whole datasets, one at a time
+  folly::CPUThreadPoolExecutor compaction_executor_{
+      1, std::make_shared<folly::NamedThreadFactory>("BapidCompact")};
 };
 
 struct BapidHandlerCtx {
@@ -49,5 +65,26 @@ struct BapidHandlers {
   folly::coro::Task<void> arrowTest(bapidrpc::Empty &reply,
                                     const bapidrpc::Empty &reuqest,
                                     BapidHandlerCtx &ctx);
+
+  folly::coro::Task<grpc::Status>
+  runSamplesQuery(RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+                  const bapidrpc::SamplesQuery &request, BapidHandlerCtx &ctx);
+
+  folly::coro::Task<grpc::Status>
+  runTableQuery(RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+                const bapidrpc::TableQuery &request, BapidHandlerCtx &ctx);
+
+  folly::coro::Task<grpc::Status>
+  runTimelineQuery(RpcStreamWriter<bapidrpc::SamplesQueryResult> &writer,
+                   const bapidrpc::TimelineQuery &request,
+                   BapidHandlerCtx &ctx);
+
+  folly::coro::Task<void> compact(bapidrpc::CompactReply &reply,
+                                  const bapidrpc::CompactRequest &request,
+                                  BapidHandlerCtx &ctx);
+
+  folly::coro::Task<void> append(bapidrpc::AppendReply &reply,
+                                 const bapidrpc::AppendRequest &request,
+                                 BapidHandlerCtx &ctx);
 };
 } // namespace bapid
@@ -0,0 +1,509 @@
+#include "src/bitmap_index.h"
+#include "if/bitmap_index.pb.h"
+#include "src/dictionary.h"
+#include <algorithm>
+#include <arrow/compute/api.h>
+#include <bit>
+#include <cstring>
+#include <gflags/gflags.h>
+#include <iterator>
+#include <limits>
+#include <utility>
+
+namespace bapid {
+
+DEFINE_int32(bitmap_index_max_values, 0,
+             "cols with at most this many values in a file get a bitmap "
+             "index when compacted or flushed; 0 disables"); // NOLINT
+
+bool RowBitmap::Container::contains(uint16_t low) const {
+  if (bits.empty()) {
+    return std::binary_search(array.begin(), array.end(), low);
+  }
+  return (bits[low / 64] >> (low % 64)) & 1;
+}
+
+bool RowBitmap::Container::intersects(uint32_t begin, uint32_t end) const {
+  if (bits.empty()) {
+    auto it = std::lower_bound(array.begin(), array.end(), begin);
+    return it != array.end() && *it < end;
+  }
+
+  const auto first_word = begin / 64;
+  const auto last_word = (end - 1) / 64;
+  for (auto word = first_word; word <= last_word; word++) {
+    auto mask = ~uint64_t{0};
+    if (word == first_word) {
+      mask &= ~uint64_t{0} << (begin % 64);
+    }
+    if (word == last_word) {
+      mask &= ~uint64_t{0} >> (63 - (end - 1) % 64);
+    }
+    if (bits[word] & mask) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RowBitmap::Container::toBits() {
+  if (!bits.empty()) {
+    return;
+  }
+  bits.assign(kNumWords, 0);
+  for (const auto low : array) {
+    bits[low / 64] |= uint64_t{1} << (low % 64);
+  }
+  array = {};
+}
+
+void RowBitmap::Container::shrink() {
+  if (bits.empty() || cardinality >= kMaxArraySize) {
+    return;
+  }
+  array.reserve(cardinality);
+  for (uint32_t word = 0; word < kNumWords; word++) {
+    for (auto remaining = bits[word]; remaining != 0;
+         remaining &= remaining - 1) {
+      array.emplace_back(
+          static_cast<uint16_t>(word * 64 + std::countr_zero(remaining)));
+    }
+  }
+  bits = {};
+}
+
+/*static*/ RowBitmap::Container RowBitmap::unite(const Container &a,
+                                                 const Container &b) {
+  Container united{.key = a.key};
+  if (a.bits.empty() && b.bits.empty()) {
+    std::set_union(a.array.begin(), a.array.end(), b.array.begin(),
+                   b.array.end(), std::back_inserter(united.array));
+    united.cardinality = static_cast<uint32_t>(united.array.size());
+    if (united.cardinality >= kMaxArraySize) {
+      united.toBits();
+    }
+    return united;
+  }
+
+  united.bits.assign(kNumWords, 0);
+  for (const auto *container : {&a, &b}) {
+    if (container->bits.empty()) {
+      for (const auto low : container->array) {
+        united.bits[low / 64] |= uint64_t{1} << (low % 64);
+      }
+      continue;
+    }
+    for (uint32_t word = 0; word < kNumWords; word++) {
+      united.bits[word] |= container->bits[word];
+    }
+  }
+  for (const auto word : united.bits) {
+    united.cardinality += std::popcount(word);
+  }
+  return united;
+}
+
+/*static*/ RowBitmap::Container RowBitmap::intersect(const Container &a,
+                                                     const Container &b) {
+  Container intersection{.key = a.key};
+  if (a.bits.empty() || b.bits.empty()) {
+    const auto &array = a.bits.empty() ? a : b;
+    const auto &other = a.bits.empty() ? b : a;
+    for (const auto low : array.array) {
+      if (other.contains(low)) {
+        intersection.array.emplace_back(low);
+      }
+    }
+    intersection.cardinality =
+        static_cast<uint32_t>(intersection.array.size());
+    return intersection;
+  }
+
+  intersection.bits.resize(kNumWords);
+  for (uint32_t word = 0; word < kNumWords; word++) {
+    intersection.bits[word] = a.bits[word] & b.bits[word];
+    intersection.cardinality += std::popcount(intersection.bits[word]);
+  }
+  intersection.shrink();
+  return intersection;
+}
+
+void RowBitmap::add(uint32_t row) {
+  const auto key = static_cast<uint16_t>(row >> 16);
+  const auto low = static_cast<uint16_t>(row & 0xffff);
+  if (containers_.empty() || containers_.back().key != key) {
+    containers_.emplace_back(Container{.key = key});
+  }
+
+  auto &container = containers_.back();
+  if (container.bits.empty()) {
+    if (!container.array.empty() && container.array.back() == low) {
+      return;
+    }
+    container.array.emplace_back(low);
+    if (++container.cardinality >= kMaxArraySize) {
+      container.toBits();
+    }
+    return;
+  }
+  if (!container.contains(low)) {
+    container.bits[low / 64] |= uint64_t{1} << (low % 64);
+    container.cardinality++;
+  }
+}
+
+RowBitmap &RowBitmap::operator|=(const RowBitmap &other) {
+  std::vector<Container> united{};
+  united.reserve(containers_.size() + other.containers_.size());
+  size_t i = 0;
+  size_t j = 0;
+  while (i < containers_.size() || j < other.containers_.size()) {
+    if (j == other.containers_.size() ||
+        (i < containers_.size() &&
+         containers_[i].key < other.containers_[j].key)) {
+      united.emplace_back(std::move(containers_[i++]));
+    } else if (i == containers_.size() ||
+               other.containers_[j].key < containers_[i].key) {
+      united.emplace_back(other.containers_[j++]);
+    } else {
+      united.emplace_back(unite(containers_[i++], other.containers_[j++]));
+    }
+  }
+  containers_ = std::move(united);
+  return *this;
+}
+
+RowBitmap &RowBitmap::operator&=(const RowBitmap &other) {
+  std::vector<Container> intersection{};
+  size_t j = 0;
+  for (const auto &container : containers_) {
+    while (j < other.containers_.size() &&
+           other.containers_[j].key < container.key) {
+      j++;
+    }
+    if (j == other.containers_.size()) {
+      break;
+    }
+    if (other.containers_[j].key != container.key) {
+      continue;
+    }
+
+    auto common = intersect(container, other.containers_[j]);
+    if (common.cardinality > 0) {
+      intersection.emplace_back(std::move(common));
+    }
+  }
+  containers_ = std::move(intersection);
+  return *this;
+}
+
+uint64_t RowBitmap::cardinality() const {
+  uint64_t cardinality = 0;
+  for (const auto &container : containers_) {
+    cardinality += container.cardinality;
+  }
+  return cardinality;
+}
+
+bool RowBitmap::intersects(uint64_t begin, uint64_t end) const {
+  if (begin >= end) {
+    return false;
+  }
+  auto it = std::lower_bound(containers_.begin(), containers_.end(),
+                             begin >> 16, [](const auto &container, auto key) {
+                               return container.key < key;
+                             });
+  for (; it != containers_.end(); it++) {
+    const auto first = uint64_t{it->key} << 16;
+    if (first >= end) {
+      return false;
+    }
+    const auto lo = std::max(begin, first) - first;
+    const auto hi = std::min(end, first + (1 << 16)) - first;
+    if (it->intersects(static_cast<uint32_t>(lo), static_cast<uint32_t>(hi))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+// The key of `value` in a col of an index, nullopt if the index cannot tell
+// which rows hold it
+std::optional<std::string> getKey(const arrow::Scalar &value, bool is_string) {
+  if (is_string) {
+    if (!arrow::is_base_binary_like(value.type->id())) {
+      return std::nullopt;
+    }
+    return static_cast<const arrow::BaseBinaryScalar &>(value)
+        .value->ToString();
+  }
+
+  if (!arrow::is_integer(value.type->id())) {
+    return std::nullopt;
+  }
+  // As the values are indexed
+  auto key = value.CastTo(arrow::utf8());
+  if (!key.ok()) {
+    return std::nullopt;
+  }
+  return static_cast<const arrow::StringScalar &>(**key).value->ToString();
+}
+
+void serializeContainer(const std::vector<uint16_t> &array,
+                        const std::vector<uint64_t> &bits,
+                        std::string &data) {
+  if (bits.empty()) {
+    data.assign(reinterpret_cast<const char *>(array.data()),
+                array.size() * sizeof(uint16_t));
+  } else {
+    data.assign(reinterpret_cast<const char *>(bits.data()),
+                bits.size() * sizeof(uint64_t));
+  }
+}
+} // namespace
+
+/*static*/ arrow::Result<std::shared_ptr<const BitmapIndex>>
+BitmapIndex::build(const arrow::Table &table, int max_values) {
+  if (max_values <= 0 ||
+      table.num_rows() > std::numeric_limits<uint32_t>::max()) {
+    return nullptr;
+  }
+
+  auto index = std::make_shared<BitmapIndex>();
+  index->num_rows_ = table.num_rows();
+  for (int i = 0; i < table.num_columns(); i++) {
+    const auto &field = table.schema()->field(i);
+    const auto is_string = isStringType(*field->type());
+    if (!is_string && !arrow::is_integer(field->type()->id())) {
+      continue;
+    }
+
+    // Strings of any encoding and integers of any width index alike
+    ARROW_ASSIGN_OR_RAISE(auto values,
+                          cp::Cast(table.column(i), arrow::utf8()));
+    Column column{.is_string = is_string};
+    uint32_t row = 0;
+    auto too_many = false;
+    for (const auto &chunk : values.chunked_array()->chunks()) {
+      const auto &strings = static_cast<const arrow::StringArray &>(*chunk);
+      for (int64_t j = 0; j < strings.length() && !too_many; j++, row++) {
+        if (strings.IsNull(j)) {
+          continue;
+        }
+        auto [it, inserted] =
+            column.rows.try_emplace(std::string{strings.GetView(j)});
+        too_many = inserted && column.rows.size() >
+                                   static_cast<size_t>(max_values);
+        it->second.add(row);
+      }
+      if (too_many) {
+        break;
+      }
+    }
+
+    if (!too_many && !column.rows.empty()) {
+      index->cols_.emplace(field->name(), std::move(column));
+    }
+  }
+
+  if (index->cols_.empty()) {
+    return nullptr;
+  }
+  return index;
+}
+
+/*static*/ arrow::Result<std::shared_ptr<const BitmapIndex>>
+BitmapIndex::read(fs::FileSystem &file_sys, const std::string &path) {
+  ARROW_ASSIGN_OR_RAISE(auto input, file_sys.OpenInputFile(path));
+  ARROW_ASSIGN_OR_RAISE(auto size, input->GetSize());
+  ARROW_ASSIGN_OR_RAISE(auto data, input->ReadAt(0, size));
+  bapidindex::BitmapIndex proto{};
+  if (!proto.ParseFromArray(data->data(), static_cast<int>(data->size()))) {
+    return arrow::Status::IOError("corrupted bitmap index: ", path);
+  }
+  if (proto.version() != kVersion) {
+    return arrow::Status::Invalid("unsupported bitmap index version ",
+                                  proto.version());
+  }
+
+  auto index = std::make_shared<BitmapIndex>();
+  index->num_rows_ = proto.num_rows();
+  for (const auto &col_proto : proto.cols()) {
+    Column column{.is_string = col_proto.is_string()};
+    for (const auto &value_proto : col_proto.values()) {
+      const auto &bitmap_proto = value_proto.rows();
+      if (bitmap_proto.keys_size() != bitmap_proto.containers_size()) {
+        return arrow::Status::IOError("corrupted bitmap index: ", path);
+      }
+
+      RowBitmap rows{};
+      for (int i = 0; i < bitmap_proto.keys_size(); i++) {
+        const auto key = bitmap_proto.keys(i);
+        const auto &container_data = bitmap_proto.containers(i);
+        if (key > 0xffff ||
+            (!rows.containers_.empty() && key <= rows.containers_.back().key)) {
+          return arrow::Status::IOError("corrupted bitmap index: ", path);
+        }
+
+        RowBitmap::Container container{.key = static_cast<uint16_t>(key)};
+        if (container_data.size() ==
+            RowBitmap::kNumWords * sizeof(uint64_t)) {
+          container.bits.resize(RowBitmap::kNumWords);
+          std::memcpy(container.bits.data(), container_data.data(),
+                      container_data.size());
+          for (const auto word : container.bits) {
+            container.cardinality += std::popcount(word);
+          }
+        } else if (container_data.size() % sizeof(uint16_t) == 0 &&
+                   container_data.size() / sizeof(uint16_t) <
+                       RowBitmap::kMaxArraySize) {
+          container.array.resize(container_data.size() / sizeof(uint16_t));
+          std::memcpy(container.array.data(), container_data.data(),
+                      container_data.size());
+          container.cardinality =
+              static_cast<uint32_t>(container.array.size());
+        } else {
+          return arrow::Status::IOError("corrupted bitmap index: ", path);
+        }
+        if (container.cardinality > 0) {
+          rows.containers_.emplace_back(std::move(container));
+        }
+      }
+      column.rows.emplace(value_proto.value(), std::move(rows));
+    }
+    index->cols_.emplace(col_proto.name(), std::move(column));
+  }
+  return index;
+}
+
+arrow::Status BitmapIndex::write(fs::FileSystem &file_sys,
+                                 const std::string &path) const {
+  bapidindex::BitmapIndex proto{};
+  proto.set_version(kVersion);
+  proto.set_num_rows(num_rows_);
+  for (const auto &[name, column] : cols_) {
+    auto *col_proto = proto.add_cols();
+    col_proto->set_name(name);
+    col_proto->set_is_string(column.is_string);
+    for (const auto &[value, rows] : column.rows) {
+      auto *value_proto = col_proto->add_values();
+      value_proto->set_value(value);
+      auto *bitmap_proto = value_proto->mutable_rows();
+      for (const auto &container : rows.containers_) {
+        bitmap_proto->add_keys(container.key);
+        serializeContainer(container.array, container.bits,
+                           *bitmap_proto->add_containers());
+      }
+    }
+  }
+
+  std::string data{};
+  if (!proto.SerializeToString(&data)) {
+    return arrow::Status::IOError("fail to serialize bitmap index");
+  }
+  ARROW_ASSIGN_OR_RAISE(auto output, file_sys.OpenOutputStream(path));
+  ARROW_RETURN_NOT_OK(
+      output->Write(data.data(), static_cast<int64_t>(data.size())));
+  return output->Close();
+}
+
+std::optional<RowBitmap>
+BitmapIndex::match(const std::vector<cp::Expression> &filters) const {
+  std::optional<RowBitmap> matched{};
+  for (const auto &filter : filters) {
+    auto rows = matchFilter(filter);
+    if (!rows) {
+      continue;
+    }
+    if (!matched) {
+      matched = std::move(rows);
+    } else {
+      *matched &= *rows;
+    }
+  }
+  return matched;
+}
+
+std::optional<RowBitmap>
+BitmapIndex::matchFilter(const cp::Expression &filter) const {
+  auto lookup = getValueLookup(filter);
+  if (!lookup) {
+    return std::nullopt;
+  }
+  auto col = cols_.find(lookup->col);
+  if (col == cols_.end()) {
+    return std::nullopt;
+  }
+
+  RowBitmap rows{};
+  for (const auto &value : lookup->values) {
+    // Nulls match no row
+    if (!value->is_valid) {
+      continue;
+    }
+    auto key = getKey(*value, col->second.is_string);
+    if (!key) {
+      return std::nullopt;
+    }
+    auto value_rows = col->second.rows.find(*key);
+    if (value_rows != col->second.rows.end()) {
+      rows |= value_rows->second;
+    }
+  }
+  return rows;
+}
+
+std::optional<ValueLookup> getValueLookup(const cp::Expression &filter) {
+  const auto *call = filter.call();
+  if (!call || call->arguments.empty()) {
+    return std::nullopt;
+  }
+  const auto *ref = call->arguments[0].field_ref();
+  const auto *name = ref ? ref->name() : nullptr;
+  if (!name) {
+    return std::nullopt;
+  }
+
+  ValueLookup lookup{.col = *name};
+  if (call->function_name == "equal" && call->arguments.size() == 2) {
+    const auto *literal = call->arguments[1].literal();
+    if (!literal || !literal->is_scalar()) {
+      return std::nullopt;
+    }
+    lookup.values.emplace_back(literal->scalar());
+    return lookup;
+  }
+  if (call->function_name != "is_in") {
+    return std::nullopt;
+  }
+
+  const auto *options =
+      dynamic_cast<const cp::SetLookupOptions *>(call->options.get());
+  if (!options || !options->value_set.is_array()) {
+    return std::nullopt;
+  }
+  auto value_set = options->value_set.make_array();
+  for (int64_t i = 0; i < value_set->length(); i++) {
+    auto value = value_set->GetScalar(i);
+    if (!value.ok()) {
+      return std::nullopt;
+    }
+    lookup.values.emplace_back(value.MoveValueUnsafe());
+  }
+  return lookup;
+}
+
+std::string getSidecarPath(const std::string &fragment_path,
+                           const std::string &extension) {
+  const auto slash = fragment_path.rfind('/');
+  return slash == std::string::npos
+             ? "_" + fragment_path + extension
+             : fragment_path.substr(0, slash + 1) + "_" +
+                   fragment_path.substr(slash + 1) + extension;
+}
+
+std::string getBitmapIndexPath(const std::string &fragment_path) {
+  return getSidecarPath(fragment_path, ".bapid_index");
+}
+} // namespace bapid
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/filesystem/filesystem.h>
+#include <cstdint>
+#include <gflags/gflags_declare.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+DECLARE_int32(bitmap_index_max_values); // NOLINT
+
+namespace fs = arrow::fs;
+namespace cp = arrow::compute;
+
+// A set of rows of a fragment as a roaring bitmap: the rows are split into
+// chunks of 2^16, each holding the low bits of its rows in a sorted array
+// while sparse and in a bitset once dense
+class RowBitmap {
+public:
+  // Rows are added in increasing order
+  void add(uint32_t row);
+  RowBitmap &operator|=(const RowBitmap &other);
+  RowBitmap &operator&=(const RowBitmap &other);
+
+  bool empty() const { return containers_.empty(); }
+  uint64_t cardinality() const;
+  // Whether any row in [begin, end) is in the set
+  bool intersects(uint64_t begin, uint64_t end) const;
+
+private:
+  friend class BitmapIndex;
+
+  // Arrays hold fewer rows than this, and bitsets at least as many
+  static constexpr uint32_t kMaxArraySize = 4096;
+  static constexpr uint32_t kNumWords = (1 << 16) / 64;
+
+  struct Container {
+    uint16_t key;
+    uint32_t cardinality{0};
+    std::vector<uint16_t> array{};
+    // Empty while the container is an array
+    std::vector<uint64_t> bits{};
+
+    bool contains(uint16_t low) const;
+    bool intersects(uint32_t begin, uint32_t end) const;
+    void toBits();
+    // Back to an array if sparse enough
+    void shrink();
+  };
+
+  static Container unite(const Container &a, const Container &b);
+  static Container intersect(const Container &a, const Container &b);
+
+  // Sorted by key, none empty
+  std::vector<Container> containers_{};
+};
+
+// Maps each value of the low-cardinality int and string cols of a fragment to
+// the rows holding it, so that EQ and IN filters on those cols tell which row
+// groups of the fragment have matching rows. Stored next to the fragment.
+class BitmapIndex {
+public:
+  static constexpr int kVersion = 1;
+
+  // Indexes the cols of `table` with at most `max_values` distinct values,
+  // nulls aside; nullptr if none has
+  static arrow::Result<std::shared_ptr<const BitmapIndex>>
+  build(const arrow::Table &table, int max_values);
+
+  static arrow::Result<std::shared_ptr<const BitmapIndex>>
+  read(fs::FileSystem &file_sys, const std::string &path);
+  arrow::Status write(fs::FileSystem &file_sys, const std::string &path) const;
+
+  int64_t numRows() const { return num_rows_; }
+  // The rows that may match all of `filters`, narrowed by those that are EQ
+  // or IN on indexed cols; nullopt if none is
+  std::optional<RowBitmap>
+  match(const std::vector<cp::Expression> &filters) const;
+
+private:
+  struct Column {
+    bool is_string;
+    std::unordered_map<std::string, RowBitmap> rows{};
+  };
+
+  std::optional<RowBitmap> matchFilter(const cp::Expression &filter) const;
+
+  int64_t num_rows_{0};
+  std::unordered_map<std::string, Column> cols_{};
+};
+
+// An EQ or IN filter, which matches the rows whose col holds one of `values`.
+// A null value matches no row.
+struct ValueLookup {
+  std::string col;
+  std::vector<std::shared_ptr<arrow::Scalar>> values{};
+};
+
+// `filter` as a ValueLookup if it is one
+std::optional<ValueLookup> getValueLookup(const cp::Expression &filter);
+
+// A file about the fragment at `fragment_path` in the same dir, named after it
+// with `extension`, whose leading underscore keeps it out of dataset discovery
+std::string getSidecarPath(const std::string &fragment_path,
+                           const std::string &extension);
+
+std::string getBitmapIndexPath(const std::string &fragment_path);
+} // namespace bapid
@@ -0,0 +1,301 @@
+#include "src/bloom_filter.h"
+#include "if/bloom_filter.pb.h"
+#include "src/bitmap_index.h"
+#include "src/dictionary.h"
+#include <algorithm>
+#include <arrow/compute/api.h>
+#include <cmath>
+#include <cstring>
+#include <folly/String.h>
+#include <gflags/gflags.h>
+#include <utility>
+
+namespace bapid {
+
+DEFINE_string(bloom_filter_cols, "",
+              "comma-separated cols whose row groups get Bloom filters when "
+              "compacted or flushed, e.g. ids"); // NOLINT
+
+namespace {
+// Those of Parquet
+constexpr uint32_t kSalts[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                                0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                                0x9efc4947U, 0x5c6bfb31U};
+constexpr uint32_t kBlockWords = 8;
+constexpr double kFalsePositiveRate = 0.01;
+// 128MB per filter, as Parquet caps them
+constexpr int64_t kMaxBlocks = int64_t{1} << 22;
+
+// Finalizer of splitmix64, so that close values spread over the blocks
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// The hash of `value` in a col of an index, nullopt if the index cannot tell
+// which row groups hold it
+std::optional<uint64_t> hashValue(const arrow::Scalar &value,
+                                  bool is_string) {
+  if (is_string) {
+    if (!arrow::is_base_binary_like(value.type->id())) {
+      return std::nullopt;
+    }
+    const auto &buffer =
+        *static_cast<const arrow::BaseBinaryScalar &>(value).value;
+    return BloomFilter::hash(
+        std::string_view{reinterpret_cast<const char *>(buffer.data()),
+                         static_cast<size_t>(buffer.size())});
+  }
+
+  if (!arrow::is_integer(value.type->id())) {
+    return std::nullopt;
+  }
+  auto int_value = value.CastTo(arrow::int64());
+  if (!int_value.ok()) {
+    return std::nullopt;
+  }
+  return BloomFilter::hash(
+      std::static_pointer_cast<arrow::Int64Scalar>(*int_value)->value);
+}
+} // namespace
+
+/*static*/ BloomFilter BloomFilter::make(int64_t num_values) {
+  // With 8 bits set per value
+  const auto num_bits =
+      -8.0 * static_cast<double>(std::max<int64_t>(num_values, 1)) /
+      std::log(1 - std::pow(kFalsePositiveRate, 1.0 / kBlockWords));
+  const auto num_blocks = std::clamp<int64_t>(
+      static_cast<int64_t>(std::ceil(num_bits / (kBlockWords * 32))), 1,
+      kMaxBlocks);
+  return BloomFilter{std::vector<uint32_t>(num_blocks * kBlockWords, 0)};
+}
+
+BloomFilter::BloomFilter(std::vector<uint32_t> words)
+    : words_{std::move(words)} {}
+
+void BloomFilter::insert(uint64_t hash) {
+  const auto num_blocks = words_.size() / kBlockWords;
+  const auto block = ((hash >> 32) * num_blocks) >> 32;
+  const auto key = static_cast<uint32_t>(hash);
+  auto *words = &words_[block * kBlockWords];
+  for (uint32_t i = 0; i < kBlockWords; i++) {
+    words[i] |= uint32_t{1} << ((key * kSalts[i]) >> 27);
+  }
+}
+
+bool BloomFilter::mayContain(uint64_t hash) const {
+  const auto num_blocks = words_.size() / kBlockWords;
+  const auto block = ((hash >> 32) * num_blocks) >> 32;
+  const auto key = static_cast<uint32_t>(hash);
+  const auto *words = &words_[block * kBlockWords];
+  for (uint32_t i = 0; i < kBlockWords; i++) {
+    if (!(words[i] & (uint32_t{1} << ((key * kSalts[i]) >> 27)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*static*/ uint64_t BloomFilter::hash(int64_t value) {
+  return mix(static_cast<uint64_t>(value));
+}
+
+/*static*/ uint64_t BloomFilter::hash(std::string_view value) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const auto c : value) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  return mix(hash);
+}
+
+/*static*/ arrow::Result<std::shared_ptr<const BloomFilterIndex>>
+BloomFilterIndex::build(const arrow::Table &table,
+                        const std::vector<std::string> &cols,
+                        int64_t rows_per_row_group) {
+  if (rows_per_row_group <= 0) {
+    return arrow::Status::Invalid("invalid rows per row group");
+  }
+
+  auto index = std::make_shared<BloomFilterIndex>();
+  for (int64_t offset = 0; offset < table.num_rows();
+       offset += rows_per_row_group) {
+    index->row_group_num_rows_.emplace_back(
+        std::min(rows_per_row_group, table.num_rows() - offset));
+  }
+
+  for (const auto &name : cols) {
+    const auto i = table.schema()->GetFieldIndex(name);
+    if (i < 0) {
+      continue;
+    }
+    const auto &type = *table.schema()->field(i)->type();
+    const auto is_string = isStringType(type);
+    if (!is_string && !arrow::is_integer(type.id())) {
+      continue;
+    }
+    // Strings of any encoding and integers of any width hash alike, and
+    // integers that do not fit are left out
+    auto values = cp::Cast(table.column(i),
+                           is_string ? arrow::utf8() : arrow::int64());
+    if (!values.ok()) {
+      continue;
+    }
+
+    Column column{.is_string = is_string};
+    for (const auto num_rows : index->row_group_num_rows_) {
+      column.row_groups.emplace_back(BloomFilter::make(num_rows));
+    }
+    int64_t row = 0;
+    for (const auto &chunk : values->chunked_array()->chunks()) {
+      for (int64_t j = 0; j < chunk->length(); j++, row++) {
+        if (chunk->IsNull(j)) {
+          continue;
+        }
+        auto &filter = column.row_groups[row / rows_per_row_group];
+        if (is_string) {
+          const auto view =
+              static_cast<const arrow::StringArray &>(*chunk).GetView(j);
+          filter.insert(
+              BloomFilter::hash(std::string_view{view.data(), view.size()}));
+        } else {
+          filter.insert(BloomFilter::hash(
+              static_cast<const arrow::Int64Array &>(*chunk).Value(j)));
+        }
+      }
+    }
+    index->cols_.emplace(name, std::move(column));
+  }
+
+  if (index->cols_.empty()) {
+    return nullptr;
+  }
+  return index;
+}
+
+/*static*/ arrow::Result<std::shared_ptr<const BloomFilterIndex>>
+BloomFilterIndex::read(fs::FileSystem &file_sys, const std::string &path) {
+  ARROW_ASSIGN_OR_RAISE(auto input, file_sys.OpenInputFile(path));
+  ARROW_ASSIGN_OR_RAISE(auto size, input->GetSize());
+  ARROW_ASSIGN_OR_RAISE(auto data, input->ReadAt(0, size));
+  bapidbloom::BloomFilterIndex proto{};
+  if (!proto.ParseFromArray(data->data(), static_cast<int>(data->size()))) {
+    return arrow::Status::IOError("corrupted Bloom filters: ", path);
+  }
+  if (proto.version() != kVersion) {
+    return arrow::Status::Invalid("unsupported Bloom filters version ",
+                                  proto.version());
+  }
+
+  auto index = std::make_shared<BloomFilterIndex>();
+  index->row_group_num_rows_.assign(proto.row_group_num_rows().begin(),
+                                    proto.row_group_num_rows().end());
+  for (const auto &col_proto : proto.cols()) {
+    if (col_proto.row_groups_size() !=
+        static_cast<int>(index->row_group_num_rows_.size())) {
+      return arrow::Status::IOError("corrupted Bloom filters: ", path);
+    }
+
+    Column column{.is_string = col_proto.is_string()};
+    for (const auto &words_data : col_proto.row_groups()) {
+      constexpr auto kBlockBytes = kBlockWords * sizeof(uint32_t);
+      if (words_data.empty() || words_data.size() % kBlockBytes != 0) {
+        return arrow::Status::IOError("corrupted Bloom filters: ", path);
+      }
+      std::vector<uint32_t> words(words_data.size() / sizeof(uint32_t));
+      std::memcpy(words.data(), words_data.data(), words_data.size());
+      column.row_groups.emplace_back(std::move(words));
+    }
+    index->cols_.emplace(col_proto.name(), std::move(column));
+  }
+  return index;
+}
+
+arrow::Status BloomFilterIndex::write(fs::FileSystem &file_sys,
+                                      const std::string &path) const {
+  bapidbloom::BloomFilterIndex proto{};
+  proto.set_version(kVersion);
+  for (const auto num_rows : row_group_num_rows_) {
+    proto.add_row_group_num_rows(num_rows);
+  }
+  for (const auto &[name, column] : cols_) {
+    auto *col_proto = proto.add_cols();
+    col_proto->set_name(name);
+    col_proto->set_is_string(column.is_string);
+    for (const auto &filter : column.row_groups) {
+      col_proto->add_row_groups()->assign(
+          reinterpret_cast<const char *>(filter.words().data()),
+          filter.words().size() * sizeof(uint32_t));
+    }
+  }
+
+  std::string data{};
+  if (!proto.SerializeToString(&data)) {
+    return arrow::Status::IOError("fail to serialize Bloom filters");
+  }
+  ARROW_ASSIGN_OR_RAISE(auto output, file_sys.OpenOutputStream(path));
+  ARROW_RETURN_NOT_OK(
+      output->Write(data.data(), static_cast<int64_t>(data.size())));
+  return output->Close();
+}
+
+std::optional<std::vector<bool>>
+BloomFilterIndex::match(const std::vector<cp::Expression> &filters) const {
+  std::optional<std::vector<bool>> matched{};
+  for (const auto &filter : filters) {
+    auto lookup = getValueLookup(filter);
+    if (!lookup) {
+      continue;
+    }
+    auto col = cols_.find(lookup->col);
+    if (col == cols_.end()) {
+      continue;
+    }
+
+    std::vector<uint64_t> hashes{};
+    auto hashed = true;
+    for (const auto &value : lookup->values) {
+      // Nulls match no row
+      if (!value->is_valid) {
+        continue;
+      }
+      auto hash = hashValue(*value, col->second.is_string);
+      if (!hash) {
+        hashed = false;
+        break;
+      }
+      hashes.emplace_back(*hash);
+    }
+    if (!hashed) {
+      continue;
+    }
+
+    if (!matched) {
+      matched.emplace(row_group_num_rows_.size(), true);
+    }
+    for (size_t i = 0; i < row_group_num_rows_.size(); i++) {
+      const auto &row_group = col->second.row_groups[i];
+      (*matched)[i] =
+          (*matched)[i] &&
+          std::any_of(hashes.begin(), hashes.end(), [&](const auto hash) {
+            return row_group.mayContain(hash);
+          });
+    }
+  }
+  return matched;
+}
+
+std::vector<std::string> getBloomFilterCols() {
+  std::vector<std::string> cols{};
+  folly::split(',', FLAGS_bloom_filter_cols, cols, /*ignoreEmpty=*/true);
+  return cols;
+}
+
+std::string getBloomFilterPath(const std::string &fragment_path) {
+  return getSidecarPath(fragment_path, ".bapid_bloom");
+}
+} // namespace bapid
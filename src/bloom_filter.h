@@ -0,0 +1,81 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/filesystem/filesystem.h>
+#include <cstdint>
+#include <gflags/gflags_declare.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+DECLARE_string(bloom_filter_cols); // NOLINT
+
+namespace fs = arrow::fs;
+namespace cp = arrow::compute;
+
+// A split block Bloom filter, as in Parquet: a value sets one bit in each of
+// the 8 words of the 256-bit block its hash picks
+class BloomFilter {
+public:
+  // Sized for `num_values` distinct values at a 1% false positive rate
+  static BloomFilter make(int64_t num_values);
+  // `words` are a whole number of blocks
+  explicit BloomFilter(std::vector<uint32_t> words);
+
+  void insert(uint64_t hash);
+  bool mayContain(uint64_t hash) const;
+  const std::vector<uint32_t> &words() const { return words_; }
+
+  static uint64_t hash(int64_t value);
+  static uint64_t hash(std::string_view value);
+
+private:
+  std::vector<uint32_t> words_;
+};
+
+// Bloom filters of the values of each row group of some int and string cols of
+// a fragment, for EQ and IN filters on cols with too many values for a bitmap
+// index, e.g. ids. Stored next to the fragment.
+class BloomFilterIndex {
+public:
+  static constexpr int kVersion = 1;
+
+  // Indexes the `cols` of `table`, as written in row groups of
+  // `rows_per_row_group` rows; nullptr if it has none of them
+  static arrow::Result<std::shared_ptr<const BloomFilterIndex>>
+  build(const arrow::Table &table, const std::vector<std::string> &cols,
+        int64_t rows_per_row_group);
+
+  static arrow::Result<std::shared_ptr<const BloomFilterIndex>>
+  read(fs::FileSystem &file_sys, const std::string &path);
+  arrow::Status write(fs::FileSystem &file_sys, const std::string &path) const;
+
+  const std::vector<int64_t> &rowGroupNumRows() const {
+    return row_group_num_rows_;
+  }
+  // Whether each row group may have rows that match all of `filters`, judged
+  // by those that are EQ or IN on indexed cols; nullopt if none is
+  std::optional<std::vector<bool>>
+  match(const std::vector<cp::Expression> &filters) const;
+
+private:
+  struct Column {
+    bool is_string;
+    std::vector<BloomFilter> row_groups{};
+  };
+
+  std::vector<int64_t> row_group_num_rows_{};
+  std::unordered_map<std::string, Column> cols_{};
+};
+
+// The cols named by --bloom_filter_cols
+std::vector<std::string> getBloomFilterCols();
+
+std::string getBloomFilterPath(const std::string &fragment_path);
+} // namespace bapid
@@ -0,0 +1,40 @@
+#include "src/catalog.h"
+#include "src/arrow.h"
+#include <folly/Expected.h>
+#include <folly/logging/xlog.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace bapid {
+
+folly::Expected<std::shared_ptr<BapidTable>, std::string>
+TableCatalog::addFsTable(std::string name, const std::string &dataset_dir,
+                         std::string ts_col_name) {
+  auto table =
+      BapidTable::fromFsDataset(dataset_dir, name, std::move(ts_col_name));
+  if (table.hasError()) {
+    return folly::makeUnexpected(std::move(table.error()));
+  }
+
+  std::shared_ptr<BapidTable> shared_table = std::move(table.value());
+  tables_.wlock()->insert_or_assign(std::move(name), shared_table);
+  return shared_table;
+}
+
+folly::Expected<std::shared_ptr<BapidTable>, std::string>
+TableCatalog::getTable(const std::string &name) {
+  auto table = [&]() -> std::shared_ptr<BapidTable> {
+    auto tables = tables_.rlock();
+    auto it = tables->find(name);
+    return it == tables->end() ? nullptr : it->second;
+  }();
+
+  if (!table) {
+    return folly::makeUnexpected("no such table: " + name);
+  }
+
+  table->refreshIfStale();
+  return table;
+}
+} // namespace bapid
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "src/arrow.h"
+#include <folly/Expected.h>
+#include <folly/Synchronized.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace bapid {
+
+// The tables served by bapid, keyed by their names. Tables are discovered once
+// and live as long as the catalog, so queries do not pay for dataset discovery.
+class TableCatalog {
+public:
+  // Discovers the dataset in `dataset_dir` and serves it as table `name`,
+  // with its time index on `ts_col_name` if given
+  folly::Expected<std::shared_ptr<BapidTable>, std::string>
+  addFsTable(std::string name, const std::string &dataset_dir,
+             std::string ts_col_name = {});
+
+  // Returns the table after picking up the files added to or removed from its
+  // dataset dir since it was last refreshed, at most every
+  // --refresh_interval_ms
+  folly::Expected<std::shared_ptr<BapidTable>, std::string>
+  getTable(const std::string &name);
+
+private:
+  folly::Synchronized<
+      std::unordered_map<std::string, std::shared_ptr<BapidTable>>>
+      tables_{};
+};
+} // namespace bapid
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <memory>
+
+namespace bapid {
+
+// Consumes the whole result set of a query to produce the one returned to the
+// client, e.g. a sample or the top rows, keeping only what it may return
+class Collector {
+public:
+  virtual ~Collector() = default;
+
+  virtual arrow::Status
+  add(const std::shared_ptr<arrow::RecordBatch> &batch) = 0;
+  virtual arrow::Result<std::shared_ptr<arrow::Table>> finish() = 0;
+};
+} // namespace bapid
@@ -0,0 +1,327 @@
+#include "src/column_stats.h"
+#include "src/dictionary.h"
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/compute/api_scalar.h>
+#include <arrow/type_traits.h>
+#include <numeric>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+constexpr int kNumBuckets = 32;
+// Used when the stats of a col do not tell, as in most query optimizers
+constexpr double kDefaultSelectivity = 1.0 / 3;
+constexpr double kDefaultEqSelectivity = 0.05;
+
+std::optional<double> toDouble(const arrow::Scalar &scalar) {
+  if (!scalar.is_valid) {
+    return std::nullopt;
+  }
+  if (scalar.type->id() == arrow::Type::TIMESTAMP) {
+    return static_cast<double>(
+        static_cast<const arrow::TimestampScalar &>(scalar).value);
+  }
+  if (!arrow::is_numeric(scalar.type->id())) {
+    return std::nullopt;
+  }
+
+  auto value = scalar.CastTo(arrow::float64());
+  if (!value.ok()) {
+    return std::nullopt;
+  }
+  return std::static_pointer_cast<arrow::DoubleScalar>(*value)->value;
+}
+
+// [min, max] of the non-null values of a col in a row group
+struct ValueRange {
+  double min;
+  double max;
+  double num_values;
+};
+
+std::vector<double> makeHistogram(const std::vector<ValueRange> &ranges,
+                                  double min, double max) {
+  std::vector<double> histogram(kNumBuckets, 0);
+  const auto width = (max - min) / kNumBuckets;
+  auto getBucket = [&](double value) {
+    if (width <= 0) {
+      return 0;
+    }
+    return std::clamp(static_cast<int>((value - min) / width), 0,
+                      kNumBuckets - 1);
+  };
+
+  for (const auto &range : ranges) {
+    if (range.max <= range.min || width <= 0) {
+      histogram[getBucket(range.min)] += range.num_values;
+      continue;
+    }
+
+    for (auto bucket = getBucket(range.min); bucket <= getBucket(range.max);
+         bucket++) {
+      const auto lo = std::max(range.min, min + bucket * width);
+      const auto hi = std::min(range.max, min + (bucket + 1) * width);
+      histogram[bucket] +=
+          range.num_values * std::max(0.0, hi - lo) / (range.max - range.min);
+    }
+  }
+  return histogram;
+}
+
+// Share of the non-null values of the col below `value`
+double getFractionBelow(const ColumnStats &col, double value) {
+  const auto min = col.min.value();
+  const auto max = col.max.value();
+  if (value <= min) {
+    return 0;
+  }
+  if (value > max) {
+    return 1;
+  }
+
+  const auto total =
+      std::accumulate(col.histogram.begin(), col.histogram.end(), 0.0);
+  if (total <= 0) {
+    return kDefaultSelectivity;
+  }
+
+  const auto width = (max - min) / kNumBuckets;
+  double below = 0;
+  for (int bucket = 0; bucket < kNumBuckets; bucket++) {
+    const auto lo = min + bucket * width;
+    if (value >= lo + width) {
+      below += col.histogram[bucket];
+      continue;
+    }
+    below += col.histogram[bucket] * (value - lo) / width;
+    break;
+  }
+  return std::clamp(below / total, 0.0, 1.0);
+}
+
+double getEqSelectivity(const ColumnStats &col, std::optional<double> value) {
+  const auto non_null = 1 - col.null_fraction;
+  if (value && col.min && (*value < *col.min || *value > *col.max)) {
+    return 0;
+  }
+  if (col.ndv) {
+    return non_null / std::max(1.0, *col.ndv);
+  }
+  return non_null * kDefaultEqSelectivity;
+}
+
+std::optional<double> getLiteralValue(const cp::Expression &expr) {
+  const auto *literal = expr.literal();
+  if (!literal || !literal->is_scalar()) {
+    return std::nullopt;
+  }
+  return toDouble(*literal->scalar());
+}
+
+bool isStringField(const cp::Expression &expr, const arrow::Schema &schema) {
+  const auto *ref = expr.field_ref();
+  if (!ref || !ref->name()) {
+    return false;
+  }
+  auto field = schema.GetFieldByName(*ref->name());
+  return field && isStringType(*field->type());
+}
+
+// Relative cost per row of evaluating `predicate`
+double estimateCost(const cp::Expression &predicate,
+                    const arrow::Schema &schema) {
+  const auto *call = predicate.call();
+  if (!call) {
+    return 0;
+  }
+
+  double cost = 0;
+  for (const auto &arg : call->arguments) {
+    cost += estimateCost(arg, schema);
+  }
+  const auto &name = call->function_name;
+  if (name == "is_null" || name == "is_valid") {
+    // Only reads the validity bitmap
+    return cost + 0.25;
+  }
+
+  double own_cost = name == "is_in" ? 2 : 1;
+  for (const auto &arg : call->arguments) {
+    if (isStringField(arg, schema)) {
+      own_cost *= 4;
+      break;
+    }
+  }
+  return cost + own_cost;
+}
+} // namespace
+
+/*static*/ TableColumnStats
+TableColumnStats::make(const arrow::Schema &schema,
+                       const FragmentStatsIndex &fragment_stats) {
+  TableColumnStats table_stats{};
+  for (int i = 0; i < schema.num_fields(); i++) {
+    const auto &field = schema.field(i);
+    ColumnStats stats{};
+    int64_t num_counted_rows = 0;
+    int64_t null_count = 0;
+    std::vector<ValueRange> ranges{};
+    bool all_ranges_known = true;
+
+    for (const auto &[_, fragment] : fragment_stats) {
+      for (const auto &row_group : fragment->row_groups) {
+        stats.num_rows += row_group.num_rows;
+        const auto *col = static_cast<size_t>(i) < row_group.cols.size() &&
+                                  row_group.cols[i]
+                              ? &row_group.cols[i].value()
+                              : nullptr;
+        if (col && col->null_count) {
+          num_counted_rows += row_group.num_rows;
+          null_count += col->null_count.value();
+        }
+
+        auto min = col && col->min ? toDouble(*col->min) : std::nullopt;
+        auto max = col && col->max ? toDouble(*col->max) : std::nullopt;
+        if (!min || !max) {
+          all_ranges_known = false;
+          continue;
+        }
+        ranges.emplace_back(ValueRange{
+            *min, *max,
+            static_cast<double>(row_group.num_rows -
+                                col->null_count.value_or(0))});
+      }
+    }
+
+    if (stats.num_rows == 0) {
+      continue;
+    }
+    if (num_counted_rows > 0) {
+      stats.null_fraction = static_cast<double>(null_count) / num_counted_rows;
+    }
+
+    if (all_ranges_known && !ranges.empty()) {
+      stats.min = std::min_element(ranges.begin(), ranges.end(),
+                                   [](const auto &a, const auto &b) {
+                                     return a.min < b.min;
+                                   })
+                      ->min;
+      stats.max = std::max_element(ranges.begin(), ranges.end(),
+                                   [](const auto &a, const auto &b) {
+                                     return a.max < b.max;
+                                   })
+                      ->max;
+      stats.histogram = makeHistogram(ranges, *stats.min, *stats.max);
+
+      const auto type_id = field->type()->id();
+      if (arrow::is_integer(type_id) || type_id == arrow::Type::TIMESTAMP) {
+        const auto num_values = std::accumulate(
+            stats.histogram.begin(), stats.histogram.end(), 0.0);
+        stats.ndv = std::min(num_values, *stats.max - *stats.min + 1);
+      }
+    }
+
+    table_stats.cols_.emplace(field->name(), std::move(stats));
+  }
+  return table_stats;
+}
+
+const ColumnStats *TableColumnStats::find(const std::string &name) const {
+  auto it = cols_.find(name);
+  return it == cols_.end() ? nullptr : &it->second;
+}
+
+double
+TableColumnStats::estimateSelectivity(const cp::Expression &predicate) const {
+  const auto *call = predicate.call();
+  if (!call) {
+    return kDefaultSelectivity;
+  }
+
+  const auto &name = call->function_name;
+  const auto &args = call->arguments;
+  if (name == "and" || name == "and_kleene") {
+    double selectivity = 1;
+    for (const auto &arg : args) {
+      selectivity *= estimateSelectivity(arg);
+    }
+    return selectivity;
+  }
+  if (name == "or" || name == "or_kleene") {
+    double rejected = 1;
+    for (const auto &arg : args) {
+      rejected *= 1 - estimateSelectivity(arg);
+    }
+    return 1 - rejected;
+  }
+  if (name == "invert" && args.size() == 1) {
+    return 1 - estimateSelectivity(args[0]);
+  }
+
+  const auto *ref = args.empty() ? nullptr : args[0].field_ref();
+  const auto *col = ref && ref->name() ? find(*ref->name()) : nullptr;
+  if (!col) {
+    return kDefaultSelectivity;
+  }
+
+  const auto non_null = 1 - col->null_fraction;
+  if (name == "is_null") {
+    return col->null_fraction;
+  }
+  if (name == "is_valid") {
+    return non_null;
+  }
+  if (name == "is_in") {
+    const auto &options =
+        static_cast<const cp::SetLookupOptions &>(*call->options);
+    return std::min(non_null, options.value_set.length() *
+                                  getEqSelectivity(*col, std::nullopt));
+  }
+  if (args.size() != 2) {
+    return kDefaultSelectivity;
+  }
+
+  const auto value = getLiteralValue(args[1]);
+  if (name == "equal") {
+    return getEqSelectivity(*col, value);
+  }
+  if (name == "not_equal") {
+    return std::max(0.0, non_null - getEqSelectivity(*col, value));
+  }
+  if (!value || col->histogram.empty()) {
+    return kDefaultSelectivity;
+  }
+  if (name == "less" || name == "less_equal") {
+    return non_null * getFractionBelow(*col, *value);
+  }
+  if (name == "greater" || name == "greater_equal") {
+    return non_null * (1 - getFractionBelow(*col, *value));
+  }
+  return kDefaultSelectivity;
+}
+
+// For independent predicates, evaluating them by increasing cost per rejected
+// row minimizes the expected cost of the conjunction.
+void reorderPredicates(std::vector<cp::Expression> &predicates,
+                       const arrow::Schema &schema,
+                       const TableColumnStats &column_stats) {
+  std::vector<std::pair<double, cp::Expression>> ranked{};
+  ranked.reserve(predicates.size());
+  for (auto &predicate : predicates) {
+    const auto rejected =
+        std::max(1e-3, 1 - column_stats.estimateSelectivity(predicate));
+    ranked.emplace_back(estimateCost(predicate, schema) / rejected,
+                        std::move(predicate));
+  }
+
+  std::stable_sort(
+      ranked.begin(), ranked.end(),
+      [](const auto &a, const auto &b) { return a.first < b.first; });
+  predicates.clear();
+  for (auto &[_, predicate] : ranked) {
+    predicates.emplace_back(std::move(predicate));
+  }
+}
+} // namespace bapid
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+// Table-wide statistics of a col, aggregated from the row group statistics of
+// its fragments
+struct ColumnStats {
+  int64_t num_rows{0};
+  // Over the rows of the row groups whose null count is known
+  double null_fraction{0};
+  // Only for numeric and timestamp cols with known min and max
+  std::optional<double> min{};
+  std::optional<double> max{};
+  // Non-null rows per equal-width bucket of [min, max], assuming the rows of a
+  // row group are spread uniformly over its [min, max]
+  std::vector<double> histogram{};
+  // Approximate number of distinct values, only for integer cols
+  std::optional<double> ndv{};
+};
+
+// The stats of the cols of a table, used to estimate how selective its
+// filters are
+class TableColumnStats {
+public:
+  static TableColumnStats make(const arrow::Schema &schema,
+                               const FragmentStatsIndex &fragment_stats);
+
+  // nullptr if nothing is known about the col
+  const ColumnStats *find(const std::string &name) const;
+  // Estimated share of the rows for which `predicate` holds, in [0, 1]
+  double estimateSelectivity(const cp::Expression &predicate) const;
+
+private:
+  std::unordered_map<std::string, ColumnStats> cols_{};
+};
+
+// Orders the predicates of a conjunction so that the cheap ones that reject
+// the most rows run first. Predicates with equal rank keep their order.
+void reorderPredicates(std::vector<cp::Expression> &predicates,
+                       const arrow::Schema &schema,
+                       const TableColumnStats &column_stats);
+} // namespace bapid
@@ -37,6 +37,12 @@ void HandlerState::processCallData(CallDataBase *call_data) {
   }
 }
 
+void HandlerState::completeWrite(CallDataBase *call_data, bool ok) {
+  auto promise = std::move(call_data->pending_write.value());
+  call_data->pending_write.reset();
+  promise.setValue(ok);
+}
+
 std::vector<std::unique_ptr<HandlerState>>
 IRpcHanlderRegistry::bindRuntime(RpcRuntimeCtx &runtime_ctx) {
   std::vector<std::unique_ptr<HandlerState>> states{};
@@ -52,11 +58,18 @@ void RpcServiceRuntime::serve() const {
   void *tag{};
   bool ok{false};
   while (ctx_.cq->Next(&tag, &ok)) {
+    auto *call_data = static_cast<CallDataBase *>(tag);
+    // A failed write only breaks its own stream; the handler decides how to
+    // finish the call.
+    if (call_data->pending_write) {
+      call_data->state->completeWrite(call_data, ok);
+      continue;
+    }
+
     if (!ok) {
       break;
     }
 
-    auto *call_data = static_cast<CallDataBase *>(tag);
     call_data->state->processCallData(call_data);
   }
 }
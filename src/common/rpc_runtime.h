@@ -4,6 +4,7 @@
 #include <folly/Unit.h>
 #include <folly/executors/GlobalExecutor.h>
 #include <folly/experimental/coro/Task.h>
+#include <folly/futures/Promise.h>
 #include <folly/logging/xlog.h>
 #include <functional>
 #include <grpc/support/log.h>
@@ -12,6 +13,8 @@
 #include <grpcpp/impl/service_type.h>
 #include <list>
 #include <memory>
+#include <optional>
+#include <string>
 #include <tuple>
 #include <type_traits>
 #include <utility>
@@ -60,6 +63,32 @@ struct CallDataBase {
   std::list<std::unique_ptr<CallDataBase>>::iterator it;
   // true if the hanlder has handled the call and a reply is ready.
   bool processed{false};
+  // Set while a write of a server-streaming call is inflight. The completion
+  // of the write fulfills it instead of finishing the call.
+  std::optional<folly::Promise<bool>> pending_write{};
+};
+
+// Writer passed to the handler of a server-streaming method. A write resumes
+// the handler once gRPC has sent the message, so a call buffers at most one
+// message at a time.
+template <typename Reply> class RpcStreamWriter {
+public:
+  RpcStreamWriter(grpc::ServerAsyncWriter<Reply> *responder,
+                  CallDataBase *call_data)
+      : responder_{responder}, call_data_{call_data} {}
+
+  // Returns false if the stream is broken, e.g. the client has gone away
+  folly::coro::Task<bool> write(const Reply &reply) {
+    folly::Promise<bool> promise{};
+    auto written = promise.getSemiFuture();
+    call_data_->pending_write = std::move(promise);
+    responder_->Write(reply, call_data_);
+    co_return co_await std::move(written);
+  }
+
+private:
+  grpc::ServerAsyncWriter<Reply> *responder_;
+  CallDataBase *call_data_;
 };
 
 // Holds the runtime's completion queue and the executor for running the
@@ -103,6 +132,7 @@ struct HandlerState {
   HandlerState(RpcRuntimeCtx ctx, IHandlerRecord *record);
   void receivingNextRequest();
   void processCallData(CallDataBase *call_data);
+  void completeWrite(CallDataBase *call_data, bool ok);
 };
 
 // Interface of RpcHandlerRegistry. The registry holds the handler records and
@@ -138,6 +168,13 @@ public:
                                                          const Request &request,
                                                          THanlderCtx &ctx);
 
+  // The implementation of a server-streaming method. The handler writes the
+  // replies through `writer` and returns the status the call finishes with.
+  template <typename Request, typename Reply>
+  using StreamingHanlder = folly::coro::Task<grpc::Status> (THanlders::*)(
+      RpcStreamWriter<Reply> &writer, const Request &request,
+      THanlderCtx &ctx);
+
   RpcHanlderRegistry(grpc::Service *service, THanlderCtx hanlder_ctx)
       : service_{dynamic_cast<typename TService::AsyncService *>(service)},
         hanlder_ctx_{hanlder_ctx} {}
@@ -156,43 +193,85 @@ public:
           : CallDataBase{state}, responder{&grpc_ctx} {}
     };
 
-    struct HanlderRecord : public IHandlerRecord {
-      HanlderRecord(typename TService::AsyncService *service,
-                    THanlders *hanlder, Hanlder<Request, Reply> process,
-                    THanlderCtx *hanlder_ctx)
-          : IHandlerRecord(
-                /*process_fn=*/
-                [hanlder, process, hanlder_ctx](CallDataBase *baseData) {
-                  auto *data = static_cast<CallData *>(baseData);
-                  return (hanlder->*process)(data->reply, data->request,
-                                             *hanlder_ctx)
-                      .semi()
-                      .deferValue([data = data](auto &&) {
-                        data->responder.Finish(data->reply, grpc::Status::OK,
-                                               data);
-                      });
-                },
-                /*receiving_next_request_fn=*/
-                [service](HandlerState *state) {
-                  auto data = std::make_unique<CallData>(state);
-                  (service->*TGrpcRegisterFn)(
-                      &(data->grpc_ctx), &(data->request), &(data->responder),
-                      state->ctx.cq, state->ctx.cq, data.get());
-                  return data;
-                },
-                /*bind_runtime_fn=*/
-                [this](RpcRuntimeCtx &ctx) {
-                  auto state = std::make_unique<HandlerState>(ctx, this);
-                  state->receivingNextRequest();
-                  return state;
-                }) {}
+    hanlder_records_.emplace_back(
+        std::make_unique<HanlderRecord<TGrpcRegisterFn, CallData>>(
+            service_,
+            /*process_fn=*/
+            [hanlder = &hanlders_, process,
+             hanlder_ctx = &hanlder_ctx_](CallDataBase *baseData) {
+              auto *data = static_cast<CallData *>(baseData);
+              return (hanlder->*process)(data->reply, data->request,
+                                         *hanlder_ctx)
+                  .semi()
+                  .deferValue([data = data](auto &&) {
+                    data->responder.Finish(data->reply, grpc::Status::OK,
+                                           data);
+                  });
+            }));
+  }
+
+  // Creates the handler record for a hanlder of a server-streaming method
+  template <auto TGrpcRegisterFn,
+            typename Request = typename unwrap_request<TGrpcRegisterFn>::type,
+            typename Reply = typename unwrap_reply<TGrpcRegisterFn>::type>
+  void registerStreamingHandler(StreamingHanlder<Request, Reply> process) {
+    struct CallData : public CallDataBase {
+      grpc::ServerAsyncWriter<Reply> responder;
+      RpcStreamWriter<Reply> writer;
+      Request request{};
+
+      explicit CallData(HandlerState *state)
+          : CallDataBase{state}, responder{&grpc_ctx}, writer{&responder,
+                                                              this} {}
     };
 
-    hanlder_records_.emplace_back(std::make_unique<HanlderRecord>(
-        service_, &hanlders_, process, &hanlder_ctx_));
+    hanlder_records_.emplace_back(
+        std::make_unique<HanlderRecord<TGrpcRegisterFn, CallData>>(
+            service_,
+            /*process_fn=*/
+            [hanlder = &hanlders_, process,
+             hanlder_ctx = &hanlder_ctx_](CallDataBase *baseData) {
+              auto *data = static_cast<CallData *>(baseData);
+              return (hanlder->*process)(data->writer, data->request,
+                                         *hanlder_ctx)
+                  .semi()
+                  .deferTry([data = data](folly::Try<grpc::Status> &&status) {
+                    data->responder.Finish(
+                        status.hasValue()
+                            ? status.value()
+                            : grpc::Status(
+                                  grpc::StatusCode::INTERNAL,
+                                  status.exception().what().toStdString()),
+                        data);
+                  });
+            }));
   }
 
 private:
+  // Sets up runtimes to receive the calls of the method registered by
+  // `TGrpcRegisterFn`, whose state is held by `CallData`
+  template <auto TGrpcRegisterFn, typename CallData>
+  struct HanlderRecord : public IHandlerRecord {
+    HanlderRecord(typename TService::AsyncService *service,
+                  ProcessFn process_fn)
+        : IHandlerRecord(
+              std::move(process_fn),
+              /*receiving_next_request_fn=*/
+              [service](HandlerState *state) {
+                auto data = std::make_unique<CallData>(state);
+                (service->*TGrpcRegisterFn)(
+                    &(data->grpc_ctx), &(data->request), &(data->responder),
+                    state->ctx.cq, state->ctx.cq, data.get());
+                return data;
+              },
+              /*bind_runtime_fn=*/
+              [this](RpcRuntimeCtx &ctx) {
+                auto state = std::make_unique<HandlerState>(ctx, this);
+                state->receivingNextRequest();
+                return state;
+              }) {}
+  };
+
   typename TService::AsyncService *service_;
   THanlderCtx hanlder_ctx_;
   THanlders hanlders_{};
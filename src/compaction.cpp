@@ -0,0 +1,286 @@
+#include "src/compaction.h"
+#include "src/bitmap_index.h"
+#include "src/bloom_filter.h"
+#include "src/dictionary.h"
+#include <algorithm>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/api.h>
+#include <atomic>
+#include <fmt/core.h>
+#include <folly/MapUtil.h>
+#include <folly/logging/xlog.h>
+#include <gflags/gflags.h>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bapid {
+
+DEFINE_string(out_dir, "", "dir a compaction writes the dataset to"); // NOLINT
+DEFINE_string(
+    sort_col, "",
+    "col a compaction sorts by; the timestamp col if unset"); // NOLINT
+DEFINE_int64(compaction_rows_per_file, 1 << 22,
+             "rows of each file a compaction writes"); // NOLINT
+DEFINE_int64(compaction_rows_per_row_group, 1 << 17,
+             "rows of each row group a compaction writes"); // NOLINT
+DEFINE_int64(compaction_page_bytes, 1 << 20,
+             "size of the data pages a compaction writes"); // NOLINT
+DEFINE_int32(compaction_threads, 4,
+             "files a compaction writes at the same time"); // NOLINT
+
+namespace cp = arrow::compute;
+
+namespace {
+struct InputFile {
+  std::shared_ptr<ds::ParquetFileFragment> fragment;
+  int64_t num_rows;
+  // Min of the sort col, nullopt if unknown
+  std::optional<double> min_key;
+};
+
+std::optional<double> toDouble(const arrow::Scalar &scalar) {
+  if (!scalar.is_valid) {
+    return std::nullopt;
+  }
+  if (scalar.type->id() == arrow::Type::TIMESTAMP) {
+    return static_cast<double>(
+        static_cast<const arrow::TimestampScalar &>(scalar).value);
+  }
+  if (!arrow::is_numeric(scalar.type->id())) {
+    return std::nullopt;
+  }
+
+  auto value = scalar.CastTo(arrow::float64());
+  if (!value.ok()) {
+    return std::nullopt;
+  }
+  return std::static_pointer_cast<arrow::DoubleScalar>(*value)->value;
+}
+
+arrow::Result<InputFile> getInputFile(
+    std::shared_ptr<ds::ParquetFileFragment> fragment,
+    const FragmentStatsIndex *fragment_stats, int sort_field_index) {
+  const auto *known_stats =
+      fragment_stats
+          ? folly::get_ptr(*fragment_stats, fragment->source().path())
+          : nullptr;
+  if (!known_stats) {
+    ARROW_RETURN_NOT_OK(fragment->EnsureCompleteMetadata());
+    // Read before `fragment` is moved from
+    const auto num_rows = fragment->metadata()->num_rows();
+    return InputFile{std::move(fragment), num_rows, std::nullopt};
+  }
+
+  std::optional<double> min_key{};
+  for (const auto &row_group : (*known_stats)->row_groups) {
+    if (sort_field_index < 0 ||
+        static_cast<size_t>(sort_field_index) >= row_group.cols.size() ||
+        !row_group.cols[sort_field_index] ||
+        !row_group.cols[sort_field_index]->min) {
+      continue;
+    }
+    const auto value = toDouble(*row_group.cols[sort_field_index]->min);
+    if (value && (!min_key || *value < *min_key)) {
+      min_key = value;
+    }
+  }
+  return InputFile{std::move(fragment), (*known_stats)->num_rows, min_key};
+}
+
+std::shared_ptr<pq::WriterProperties>
+makeWriterProperties(const arrow::Schema &schema,
+                     const CompactionOptions &options) {
+  pq::WriterProperties::Builder builder{};
+  builder.max_row_group_length(options.rows_per_row_group)
+      ->data_pagesize(options.page_bytes)
+      ->disable_dictionary();
+  // Strings repeat the most, and their filters then compare small codes
+  for (const auto &field : schema.fields()) {
+    if (isStringType(*field->type())) {
+      builder.enable_dictionary(field->name());
+    }
+  }
+  return builder.build();
+}
+
+// Reads the rows of `files`, sorts them and writes them to `path`
+arrow::Status writeOutputFile(const ds::FileSystemDataset &dataset,
+                              const std::vector<InputFile> &files,
+                              const std::string &path,
+                              const CompactionOptions &options) {
+  std::vector<std::shared_ptr<ds::FileFragment>> fragments{};
+  for (const auto &file : files) {
+    fragments.emplace_back(file.fragment);
+  }
+  ARROW_ASSIGN_OR_RAISE(
+      auto group_dataset,
+      ds::FileSystemDataset::Make(dataset.schema(),
+                                  dataset.partition_expression(),
+                                  dataset.format(), dataset.filesystem(),
+                                  std::move(fragments)));
+  ARROW_ASSIGN_OR_RAISE(auto builder, group_dataset->NewScan());
+  ARROW_ASSIGN_OR_RAISE(auto scanner, builder->Finish());
+  ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable());
+
+  if (!options.sort_col.empty()) {
+    ARROW_ASSIGN_OR_RAISE(
+        auto indices,
+        cp::SortIndices(arrow::Datum{table},
+                        cp::SortOptions{{cp::SortKey{options.sort_col}}}));
+    ARROW_ASSIGN_OR_RAISE(auto sorted, cp::Take(table, indices));
+    table = sorted.table();
+  }
+
+  ARROW_ASSIGN_OR_RAISE(
+      auto bitmap_index,
+      BitmapIndex::build(*table, options.bitmap_index_max_values));
+  if (bitmap_index) {
+    ARROW_RETURN_NOT_OK(bitmap_index->write(*dataset.filesystem(),
+                                            getBitmapIndexPath(path)));
+  }
+  ARROW_ASSIGN_OR_RAISE(auto bloom_filters,
+                        BloomFilterIndex::build(*table,
+                                                options.bloom_filter_cols,
+                                                options.rows_per_row_group));
+  if (bloom_filters) {
+    ARROW_RETURN_NOT_OK(bloom_filters->write(*dataset.filesystem(),
+                                             getBloomFilterPath(path)));
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto output,
+                        dataset.filesystem()->OpenOutputStream(path));
+  ARROW_RETURN_NOT_OK(pq::arrow::WriteTable(
+      *table, arrow::default_memory_pool(), output, options.rows_per_row_group,
+      makeWriterProperties(*table->schema(), options),
+      pq::ArrowWriterProperties::Builder().store_schema()->build()));
+  return output->Close();
+}
+} // namespace
+
+/*static*/ CompactionOptions CompactionOptions::fromFlags() {
+  return CompactionOptions{
+      .out_dir = FLAGS_out_dir,
+      .sort_col = FLAGS_sort_col,
+      .rows_per_file = FLAGS_compaction_rows_per_file,
+      .rows_per_row_group = FLAGS_compaction_rows_per_row_group,
+      .page_bytes = FLAGS_compaction_page_bytes,
+      .num_threads = FLAGS_compaction_threads,
+      .bitmap_index_max_values = FLAGS_bitmap_index_max_values,
+      .bloom_filter_cols = getBloomFilterCols(),
+  };
+}
+
+arrow::Result<CompactionStats>
+compactDataset(const ds::FileSystemDataset &dataset,
+               const FragmentStatsIndex *fragment_stats,
+               const CompactionOptions &options) {
+  if (options.out_dir.empty() || options.rows_per_file <= 0 ||
+      options.rows_per_row_group <= 0 || options.page_bytes <= 0 ||
+      options.num_threads <= 0) {
+    return arrow::Status::Invalid("invalid compaction options");
+  }
+  const auto sort_field_index =
+      options.sort_col.empty()
+          ? -1
+          : dataset.schema()->GetFieldIndex(options.sort_col);
+  if (!options.sort_col.empty() && sort_field_index < 0) {
+    return arrow::Status::Invalid("no unique col ", options.sort_col);
+  }
+
+  const auto &file_sys = dataset.filesystem();
+  fs::FileSelector selector{};
+  selector.base_dir = options.out_dir;
+  selector.allow_not_found = true;
+  ARROW_ASSIGN_OR_RAISE(auto existing, file_sys->GetFileInfo(selector));
+  if (!existing.empty()) {
+    return arrow::Status::Invalid("out dir ", options.out_dir,
+                                  " is not empty");
+  }
+  ARROW_RETURN_NOT_OK(file_sys->CreateDir(options.out_dir));
+
+  CompactionStats stats{};
+  std::vector<InputFile> files{};
+  ARROW_ASSIGN_OR_RAISE(auto fragments, dataset.GetFragments());
+  for (const auto &maybe_fragment : fragments) {
+    ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+    auto parquet_fragment =
+        std::dynamic_pointer_cast<ds::ParquetFileFragment>(fragment);
+    if (!parquet_fragment) {
+      return arrow::Status::NotImplemented("compaction of ",
+                                           fragment->type_name(), " files");
+    }
+    ARROW_ASSIGN_OR_RAISE(auto file,
+                          getInputFile(std::move(parquet_fragment),
+                                       fragment_stats, sort_field_index));
+    stats.num_input_files++;
+    stats.num_rows += file.num_rows;
+    files.emplace_back(std::move(file));
+  }
+
+  // Files without stats go last, in path order
+  std::stable_sort(files.begin(), files.end(),
+                   [](const auto &a, const auto &b) {
+                     const auto a_key =
+                         a.min_key.value_or(std::numeric_limits<double>::max());
+                     const auto b_key =
+                         b.min_key.value_or(std::numeric_limits<double>::max());
+                     if (a_key != b_key) {
+                       return a_key < b_key;
+                     }
+                     return a.fragment->source().path() <
+                            b.fragment->source().path();
+                   });
+
+  std::vector<std::vector<InputFile>> groups{};
+  int64_t num_group_rows = 0;
+  for (auto &file : files) {
+    if (groups.empty() ||
+        num_group_rows + file.num_rows > options.rows_per_file) {
+      groups.emplace_back();
+      num_group_rows = 0;
+    }
+    num_group_rows += file.num_rows;
+    groups.back().emplace_back(std::move(file));
+  }
+  stats.num_output_files = static_cast<int64_t>(groups.size());
+
+  // Each thread writes whole files, so that the scans within a file do not
+  // wait on the threads of the others
+  std::atomic<size_t> next_group{0};
+  std::mutex status_mutex{};
+  arrow::Status status{};
+  auto work = [&]() {
+    for (auto i = next_group++; i < groups.size(); i = next_group++) {
+      const auto path =
+          fmt::format("{}/part-{:05d}.parquet", options.out_dir, i);
+      auto written = writeOutputFile(dataset, groups[i], path, options);
+      if (!written.ok()) {
+        std::lock_guard<std::mutex> lock{status_mutex};
+        status &= written;
+        return;
+      }
+    }
+  };
+  std::vector<std::thread> threads{};
+  const auto num_threads =
+      std::min(static_cast<size_t>(options.num_threads), groups.size());
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(work);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ARROW_RETURN_NOT_OK(status);
+
+  XLOG(INFO) << "Compacted " << stats.num_input_files << " files of "
+             << stats.num_rows << " rows into " << stats.num_output_files
+             << " files in " << options.out_dir;
+  return stats;
+}
+} // namespace bapid
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/dataset/api.h>
+#include <cstdint>
+#include <gflags/gflags_declare.h>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+DECLARE_string(out_dir);                      // NOLINT
+DECLARE_string(sort_col);                     // NOLINT
+DECLARE_int64(compaction_rows_per_file);      // NOLINT
+DECLARE_int64(compaction_rows_per_row_group); // NOLINT
+DECLARE_int64(compaction_page_bytes);         // NOLINT
+DECLARE_int32(compaction_threads);            // NOLINT
+
+namespace ds = arrow::dataset;
+
+// How a dataset is rewritten into fewer, larger files
+struct CompactionOptions {
+  std::string out_dir;
+  // Col the rows of each output file are sorted by; kept in the input order
+  // if empty
+  std::string sort_col{};
+  int64_t rows_per_file{1 << 22};
+  int64_t rows_per_row_group{1 << 17};
+  int64_t page_bytes{1 << 20};
+  // Output files written at the same time
+  int num_threads{4};
+  // Cols of an output file with at most this many values get a bitmap index
+  // next to it; none if 0
+  int bitmap_index_max_values{0};
+  // Cols whose row groups get Bloom filters next to each output file
+  std::vector<std::string> bloom_filter_cols{};
+
+  // The options set by the compaction flags
+  static CompactionOptions fromFlags();
+};
+
+struct CompactionStats {
+  int64_t num_input_files{0};
+  int64_t num_output_files{0};
+  int64_t num_rows{0};
+};
+
+// Rewrites the Parquet files of `dataset` into `out_dir` of its file system,
+// which must be empty or missing. The input files are ordered by the min of
+// the sort col in `fragment_stats`, then merged in that order into output
+// files of about `rows_per_file` rows, each sorted by the sort col. With
+// inputs that cover narrow ranges of it, e.g. ingested over time, the output
+// is close to sorted overall, so that the stats of its row groups prune well.
+// String cols are dictionary encoded, and the low-cardinality cols of each
+// output file get a bitmap index if enabled, and the chosen cols Bloom filters.
+arrow::Result<CompactionStats>
+compactDataset(const ds::FileSystemDataset &dataset,
+               const FragmentStatsIndex *fragment_stats,
+               const CompactionOptions &options);
+} // namespace bapid
@@ -0,0 +1,399 @@
+#include "src/dictionary.h"
+#include <algorithm>
+#include <arrow/compute/api.h>
+#include <arrow/compute/kernel.h>
+#include <arrow/compute/registry.h>
+#include <arrow/util/bit_util.h>
+#include <folly/logging/xlog.h>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace bapid {
+
+std::shared_ptr<arrow::DataType> getDictionaryType() {
+  // As the Parquet reader decodes dictionary pages
+  return arrow::dictionary(arrow::int32(), arrow::utf8());
+}
+
+std::shared_ptr<arrow::Schema>
+withDictionaryStrings(const std::shared_ptr<arrow::Schema> &schema) {
+  arrow::FieldVector fields{};
+  fields.reserve(schema->num_fields());
+  bool changed = false;
+  for (const auto &field : schema->fields()) {
+    if (field->type()->id() == arrow::Type::STRING) {
+      fields.emplace_back(field->WithType(getDictionaryType()));
+      changed = true;
+      continue;
+    }
+    fields.emplace_back(field);
+  }
+  return changed ? arrow::schema(std::move(fields), schema->metadata())
+                 : schema;
+}
+
+bool isStringType(const arrow::DataType &type) {
+  if (type.id() == arrow::Type::DICTIONARY) {
+    return isStringType(
+        *static_cast<const arrow::DictionaryType &>(type).value_type());
+  }
+  return type.id() == arrow::Type::STRING ||
+         type.id() == arrow::Type::LARGE_STRING;
+}
+
+arrow::Result<std::vector<int32_t>>
+StringInterner::intern(const arrow::Array &dictionary) {
+  if (dictionary.type_id() != arrow::Type::STRING) {
+    return arrow::Status::TypeError("cannot intern ",
+                                    dictionary.type()->ToString());
+  }
+  const auto &strings = static_cast<const arrow::StringArray &>(dictionary);
+
+  std::vector<int32_t> codes(strings.length(), -1);
+  auto state = state_.wlock();
+  for (int64_t i = 0; i < strings.length(); i++) {
+    if (strings.IsNull(i)) {
+      continue;
+    }
+    const auto value = strings.GetView(i);
+    auto [it, inserted] = state->codes.try_emplace(
+        std::string{value}, static_cast<int32_t>(state->strings.size()));
+    if (inserted) {
+      state->strings.emplace_back(value);
+    }
+    codes[i] = it->second;
+  }
+  return codes;
+}
+
+arrow::Result<std::shared_ptr<arrow::Array>>
+StringInterner::lookup(const arrow::Int32Array &codes) const {
+  arrow::StringBuilder builder{};
+  ARROW_RETURN_NOT_OK(builder.Reserve(codes.length()));
+  auto state = state_.rlock();
+  for (int64_t i = 0; i < codes.length(); i++) {
+    const auto code = codes.Value(i);
+    if (codes.IsNull(i) || code < 0 ||
+        static_cast<size_t>(code) >= state->strings.size()) {
+      ARROW_RETURN_NOT_OK(builder.AppendNull());
+      continue;
+    }
+    ARROW_RETURN_NOT_OK(builder.Append(state->strings[code]));
+  }
+  return builder.Finish();
+}
+
+namespace {
+class InternOptionsType : public cp::FunctionOptionsType {
+public:
+  static const InternOptionsType *get() {
+    static const InternOptionsType type{};
+    return &type;
+  }
+
+  const char *type_name() const override { return "InternOptions"; }
+
+  std::string
+  Stringify(const cp::FunctionOptions & /*options*/) const override {
+    return "InternOptions";
+  }
+
+  bool Compare(const cp::FunctionOptions &a,
+               const cp::FunctionOptions &b) const override {
+    return static_cast<const InternOptions &>(a).interner ==
+           static_cast<const InternOptions &>(b).interner;
+  }
+
+  std::unique_ptr<cp::FunctionOptions>
+  Copy(const cp::FunctionOptions &options) const override {
+    return std::make_unique<InternOptions>(
+        static_cast<const InternOptions &>(options).interner);
+  }
+};
+} // namespace
+
+InternOptions::InternOptions(std::shared_ptr<StringInterner> interner)
+    : cp::FunctionOptions(InternOptionsType::get()),
+      interner{std::move(interner)} {}
+
+namespace {
+template <typename Options> struct OptionsState : public cp::KernelState {
+  explicit OptionsState(const Options &options) : options{options} {}
+
+  Options options;
+};
+
+template <typename Options>
+arrow::Result<std::unique_ptr<cp::KernelState>>
+initOptions(cp::KernelContext * /*ctx*/, const cp::KernelInitArgs &args) {
+  if (!args.options) {
+    return arrow::Status::Invalid("no options for ",
+                                  args.kernel->signature->ToString());
+  }
+  return std::make_unique<OptionsState<Options>>(
+      static_cast<const Options &>(*args.options));
+}
+
+template <typename Options>
+const Options &getOptions(cp::KernelContext *ctx) {
+  return static_cast<const OptionsState<Options> *>(ctx->state())->options;
+}
+
+template <typename IndexType, typename Fn>
+void visitValidCodes(const arrow::Array &indices, Fn &fn) {
+  const auto &typed =
+      static_cast<const arrow::NumericArray<IndexType> &>(indices);
+  if (typed.null_count() == 0) {
+    for (int64_t i = 0; i < typed.length(); i++) {
+      fn(i, static_cast<int64_t>(typed.Value(i)));
+    }
+    return;
+  }
+  for (int64_t i = 0; i < typed.length(); i++) {
+    if (typed.IsValid(i)) {
+      fn(i, static_cast<int64_t>(typed.Value(i)));
+    }
+  }
+}
+
+// Calls `fn(row, code)` for the rows of a dictionary array that are not null
+template <typename Fn>
+arrow::Status visitValidCodes(const arrow::DictionaryArray &array, Fn fn) {
+  const auto &indices = *array.indices();
+  switch (indices.type_id()) {
+  case arrow::Type::INT8:
+    visitValidCodes<arrow::Int8Type>(indices, fn);
+    return arrow::Status::OK();
+  case arrow::Type::INT16:
+    visitValidCodes<arrow::Int16Type>(indices, fn);
+    return arrow::Status::OK();
+  case arrow::Type::INT32:
+    visitValidCodes<arrow::Int32Type>(indices, fn);
+    return arrow::Status::OK();
+  case arrow::Type::INT64:
+    visitValidCodes<arrow::Int64Type>(indices, fn);
+    return arrow::Status::OK();
+  default:
+    return arrow::Status::TypeError("dictionary indices of type ",
+                                    indices.type()->ToString());
+  }
+}
+
+arrow::Result<std::shared_ptr<arrow::DictionaryArray>>
+getDictionaryArray(const cp::ExecSpan &batch) {
+  if (!batch[0].is_array()) {
+    return arrow::Status::NotImplemented("scalar dictionary input");
+  }
+  return std::static_pointer_cast<arrow::DictionaryArray>(
+      batch[0].array.ToArray());
+}
+
+arrow::Status execDictIsIn(cp::KernelContext *ctx, const cp::ExecSpan &batch,
+                           cp::ExecResult *out) {
+  const auto &options = getOptions<cp::SetLookupOptions>(ctx);
+  ARROW_ASSIGN_OR_RAISE(auto array, getDictionaryArray(batch));
+  const auto &dictionary = array->dictionary();
+
+  // Resolved once for the whole dictionary, then indexed by the codes
+  auto value_set = options.value_set;
+  if (!value_set.type()->Equals(dictionary->type())) {
+    ARROW_ASSIGN_OR_RAISE(value_set,
+                          cp::Cast(value_set, dictionary->type(),
+                                   cp::CastOptions::Safe(),
+                                   ctx->exec_context()));
+  }
+  ARROW_ASSIGN_OR_RAISE(
+      auto matches_datum,
+      cp::IsIn(dictionary,
+               cp::SetLookupOptions{std::move(value_set), options.skip_nulls},
+               ctx->exec_context()));
+  const auto matches = matches_datum.array_as<arrow::BooleanArray>();
+  std::vector<uint8_t> matched(dictionary->length(), 0);
+  for (int64_t i = 0; i < matches->length(); i++) {
+    matched[i] = matches->IsValid(i) && matches->Value(i);
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto bitmap, arrow::AllocateEmptyBitmap(
+                                         array->length(), ctx->memory_pool()));
+  auto *bits = bitmap->mutable_data();
+  ARROW_RETURN_NOT_OK(visitValidCodes(*array, [&](int64_t row, int64_t code) {
+    if (matched[code]) {
+      arrow::bit_util::SetBit(bits, row);
+    }
+  }));
+  // Like is_in, null rows match a null of the value set unless skipped
+  const auto &indices = *array->indices();
+  if (!options.skip_nulls && options.value_set.null_count() > 0 &&
+      indices.null_count() > 0) {
+    for (int64_t row = 0; row < indices.length(); row++) {
+      if (indices.IsNull(row)) {
+        arrow::bit_util::SetBit(bits, row);
+      }
+    }
+  }
+  out->value = arrow::ArrayData::Make(arrow::boolean(), array->length(),
+                                      {nullptr, std::move(bitmap)}, 0);
+  return arrow::Status::OK();
+}
+
+arrow::Status execIntern(cp::KernelContext *ctx, const cp::ExecSpan &batch,
+                         cp::ExecResult *out) {
+  const auto &options = getOptions<InternOptions>(ctx);
+  ARROW_ASSIGN_OR_RAISE(auto array, getDictionaryArray(batch));
+  ARROW_ASSIGN_OR_RAISE(auto codes,
+                        options.interner->intern(*array->dictionary()));
+
+  const auto length = array->length();
+  ARROW_ASSIGN_OR_RAISE(
+      auto validity, arrow::AllocateEmptyBitmap(length, ctx->memory_pool()));
+  ARROW_ASSIGN_OR_RAISE(
+      std::shared_ptr<arrow::Buffer> values,
+      arrow::AllocateBuffer(length * static_cast<int64_t>(sizeof(int32_t)),
+                            ctx->memory_pool()));
+  auto *valid_bits = validity->mutable_data();
+  auto *interned = reinterpret_cast<int32_t *>(values->mutable_data());
+  std::fill(interned, interned + length, 0);
+  ARROW_RETURN_NOT_OK(visitValidCodes(*array, [&](int64_t row, int64_t code) {
+    if (codes[code] >= 0) {
+      interned[row] = codes[code];
+      arrow::bit_util::SetBit(valid_bits, row);
+    }
+  }));
+  out->value = arrow::ArrayData::Make(arrow::int32(), length,
+                                      {std::move(validity), std::move(values)},
+                                      arrow::kUnknownNullCount);
+  return arrow::Status::OK();
+}
+
+arrow::Status execLookupInterned(cp::KernelContext *ctx,
+                                 const cp::ExecSpan &batch,
+                                 cp::ExecResult *out) {
+  const auto &options = getOptions<InternOptions>(ctx);
+  if (!batch[0].is_array()) {
+    return arrow::Status::NotImplemented("scalar interned input");
+  }
+  auto codes =
+      std::static_pointer_cast<arrow::Int32Array>(batch[0].array.ToArray());
+  ARROW_ASSIGN_OR_RAISE(auto strings, options.interner->lookup(*codes));
+  out->value = strings->data();
+  return arrow::Status::OK();
+}
+
+arrow::Status addFunction(const char *name, const cp::FunctionDoc &doc,
+                          cp::InputType input,
+                          std::shared_ptr<arrow::DataType> output,
+                          cp::ArrayKernelExec exec, cp::KernelInit init,
+                          cp::NullHandling::type null_handling) {
+  auto function =
+      std::make_shared<cp::ScalarFunction>(name, cp::Arity::Unary(), doc);
+  cp::ScalarKernel kernel{{std::move(input)}, std::move(output), exec,
+                          std::move(init)};
+  kernel.null_handling = null_handling;
+  kernel.mem_allocation = cp::MemAllocation::NO_PREALLOCATE;
+  kernel.can_write_into_slices = false;
+  ARROW_RETURN_NOT_OK(function->AddKernel(std::move(kernel)));
+  return cp::GetFunctionRegistry()->AddFunction(std::move(function));
+}
+
+arrow::Status registerDictionaryFunctionsImpl() {
+  ARROW_RETURN_NOT_OK(addFunction(
+      kDictIsIn,
+      cp::FunctionDoc{"Whether each value is in a set, through its code",
+                      "Nulls match as by is_in.",
+                      {"dictionary_array"},
+                      "SetLookupOptions"},
+      cp::InputType(arrow::Type::DICTIONARY), arrow::boolean(), execDictIsIn,
+      initOptions<cp::SetLookupOptions>, cp::NullHandling::OUTPUT_NOT_NULL));
+  ARROW_RETURN_NOT_OK(addFunction(
+      kIntern,
+      cp::FunctionDoc{"Codes of the strings of a dictionary array",
+                      "The codes are shared by the arrays interned by the same "
+                      "interner.",
+                      {"dictionary_array"},
+                      "InternOptions"},
+      cp::InputType(arrow::Type::DICTIONARY), arrow::int32(), execIntern,
+      initOptions<InternOptions>,
+      cp::NullHandling::COMPUTED_NO_PREALLOCATE));
+  return addFunction(
+      kLookupInterned,
+      cp::FunctionDoc{"Strings of interned codes",
+                      "Unknown codes are null.",
+                      {"codes"},
+                      "InternOptions"},
+      cp::InputType(arrow::int32()), arrow::utf8(), execLookupInterned,
+      initOptions<InternOptions>, cp::NullHandling::COMPUTED_NO_PREALLOCATE);
+}
+
+// Whether `expr` refers to a string dictionary field of `schema`
+bool isDictionaryField(const cp::Expression &expr,
+                       const arrow::Schema &schema) {
+  const auto *ref = expr.field_ref();
+  if (!ref || !ref->name()) {
+    return false;
+  }
+  auto field = schema.GetFieldByName(*ref->name());
+  return field && field->type()->id() == arrow::Type::DICTIONARY &&
+         isStringType(*field->type());
+}
+} // namespace
+
+arrow::Result<cp::Expression>
+rewriteForDictionaries(const cp::Expression &expr,
+                       const arrow::Schema &schema) {
+  const auto *call = expr.call();
+  if (!call) {
+    return expr;
+  }
+
+  std::vector<cp::Expression> arguments{};
+  arguments.reserve(call->arguments.size());
+  for (const auto &argument : call->arguments) {
+    ARROW_ASSIGN_OR_RAISE(auto rewritten,
+                          rewriteForDictionaries(argument, schema));
+    arguments.emplace_back(std::move(rewritten));
+  }
+  if (arguments.empty() || !isDictionaryField(arguments[0], schema)) {
+    return cp::call(call->function_name, std::move(arguments), call->options);
+  }
+
+  if (call->function_name == "is_in" && call->options) {
+    const auto &options =
+        static_cast<const cp::SetLookupOptions &>(*call->options);
+    if (isStringType(*options.value_set.type())) {
+      return cp::call(kDictIsIn, {std::move(arguments[0])}, options);
+    }
+  }
+
+  const auto is_equal = call->function_name == "equal";
+  const auto is_not_equal = call->function_name == "not_equal";
+  const auto *literal =
+      arguments.size() == 2 ? arguments[1].literal() : nullptr;
+  if ((is_equal || is_not_equal) && literal && literal->is_scalar() &&
+      isStringType(*literal->type())) {
+    ARROW_ASSIGN_OR_RAISE(auto value_set,
+                          arrow::MakeArrayFromScalar(*literal->scalar(), 1));
+    auto is_in = cp::call(kDictIsIn, {arguments[0]},
+                          cp::SetLookupOptions{std::move(value_set),
+                                               /*skip_nulls=*/true});
+    if (is_equal) {
+      return is_in;
+    }
+    // Like the comparison, drops the rows where the col is null
+    return cp::and_(cp::is_valid(arguments[0]),
+                    cp::call("invert", {std::move(is_in)}));
+  }
+  return cp::call(call->function_name, std::move(arguments), call->options);
+}
+
+void registerDictionaryFunctions() {
+  static std::once_flag once{};
+  std::call_once(once, []() {
+    auto status = registerDictionaryFunctionsImpl();
+    if (!status.ok()) {
+      XLOG(ERR) << "fail to register dictionary functions: "
+                << status.ToString();
+    }
+  });
+}
+} // namespace bapid
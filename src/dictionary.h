@@ -0,0 +1,74 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <cstdint>
+#include <folly/Synchronized.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+// Type string cols of a table are read as, so that filters and group-bys
+// work on the codes rather than on the strings
+std::shared_ptr<arrow::DataType> getDictionaryType();
+
+// `schema` with its string fields of dictionary type
+std::shared_ptr<arrow::Schema>
+withDictionaryStrings(const std::shared_ptr<arrow::Schema> &schema);
+
+// Whether `type` holds strings, plain or dictionary encoded
+bool isStringType(const arrow::DataType &type);
+
+// Gives the strings of the dictionaries of a query's batches codes shared by
+// all of them, so that the batches group by integers despite each row group
+// having a dictionary of its own
+class StringInterner {
+public:
+  // The code of each entry of `dictionary`, -1 for a null one. New strings get
+  // the next codes.
+  arrow::Result<std::vector<int32_t>> intern(const arrow::Array &dictionary);
+  // The strings of `codes`
+  arrow::Result<std::shared_ptr<arrow::Array>>
+  lookup(const arrow::Int32Array &codes) const;
+
+private:
+  struct State {
+    std::unordered_map<std::string, int32_t> codes{};
+    std::vector<std::string> strings{};
+  };
+
+  folly::Synchronized<State> state_{};
+};
+
+class InternOptions : public cp::FunctionOptions {
+public:
+  explicit InternOptions(std::shared_ptr<StringInterner> interner = nullptr);
+
+  std::shared_ptr<StringInterner> interner;
+};
+
+// Whether each row of a dictionary array is in the value set of its
+// SetLookupOptions. The value set is looked up once per dictionary entry, then
+// the rows only index the result by their codes. Null rows match as by is_in:
+// only if the value set has a null and skip_nulls is false.
+inline constexpr char kDictIsIn[] = "bapid_dict_is_in";
+// The codes of a dictionary array of strings interned by its InternOptions
+inline constexpr char kIntern[] = "bapid_intern";
+// The strings of codes interned by its InternOptions
+inline constexpr char kLookupInterned[] = "bapid_lookup_interned";
+
+// Rewrites EQ, NE and set lookups of strings on the dictionary fields of
+// `schema` into kDictIsIn, keeping their handling of nulls
+arrow::Result<cp::Expression>
+rewriteForDictionaries(const cp::Expression &expr, const arrow::Schema &schema);
+
+// Adds the functions above to the default registry; a no-op after the first
+// call
+void registerDictionaryFunctions();
+} // namespace bapid
@@ -0,0 +1,132 @@
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <memory>
+#include <parquet/arrow/reader.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+std::optional<ColumnChunkStats>
+getColumnChunkStats(const pq::ColumnChunkMetaData &chunk,
+                    const std::shared_ptr<arrow::DataType> &type) {
+  auto statistics = chunk.statistics();
+  if (!chunk.is_stats_set() || !statistics) {
+    return std::nullopt;
+  }
+
+  ColumnChunkStats stats{};
+  if (statistics->HasNullCount()) {
+    stats.null_count = statistics->null_count();
+  }
+
+  if (!statistics->HasMinMax()) {
+    return stats;
+  }
+
+  // Stats of types Arrow cannot represent as scalars are dropped rather than
+  // failing the whole fragment
+  std::shared_ptr<arrow::Scalar> min;
+  std::shared_ptr<arrow::Scalar> max;
+  if (!pq::arrow::StatisticsAsScalars(*statistics, &min, &max).ok()) {
+    return stats;
+  }
+
+  // Those of a dictionary col are of its values, which filters compare to
+  const auto &value_type =
+      type->id() == arrow::Type::DICTIONARY
+          ? static_cast<const arrow::DictionaryType &>(*type).value_type()
+          : type;
+  auto typed_min = min->CastTo(value_type);
+  auto typed_max = max->CastTo(value_type);
+  if (typed_min.ok() && typed_max.ok()) {
+    stats.min = typed_min.MoveValueUnsafe();
+    stats.max = typed_max.MoveValueUnsafe();
+  }
+  return stats;
+}
+} // namespace
+
+/*static*/ arrow::Result<std::shared_ptr<const FragmentStats>>
+FragmentStats::fromParquetMetadata(const fs::FileInfo &info,
+                                   const pq::FileMetaData &metadata,
+                                   const arrow::Schema &schema) {
+  auto stats = std::make_shared<FragmentStats>();
+  stats->path = info.path();
+  stats->size = info.size();
+  stats->mtime_ns = info.mtime().time_since_epoch().count();
+  stats->num_rows = metadata.num_rows();
+
+  // Maps the Parquet leaf cols to the fields of the table schema
+  std::vector<int> field_indices(metadata.num_columns(), -1);
+  for (int i = 0; i < metadata.num_columns(); i++) {
+    field_indices[i] = schema.GetFieldIndex(
+        metadata.schema()->Column(i)->path()->ToDotString());
+  }
+
+  stats->row_groups.reserve(metadata.num_row_groups());
+  for (int i = 0; i < metadata.num_row_groups(); i++) {
+    auto row_group = metadata.RowGroup(i);
+    auto &row_group_stats = stats->row_groups.emplace_back(RowGroupStats{
+        .num_rows = row_group->num_rows(),
+        .cols = std::vector<std::optional<ColumnChunkStats>>(
+            schema.num_fields()),
+    });
+
+    for (int j = 0; j < row_group->num_columns(); j++) {
+      if (field_indices[j] < 0) {
+        continue;
+      }
+
+      row_group_stats.cols[field_indices[j]] = getColumnChunkStats(
+          *row_group->ColumnChunk(j), schema.field(field_indices[j])->type());
+    }
+  }
+
+  return stats;
+}
+
+fs::FileInfo FragmentStats::fileInfo() const {
+  fs::FileInfo info{path, fs::FileType::File};
+  info.set_size(size);
+  info.set_mtime(fs::TimePoint{fs::TimePoint::duration{mtime_ns}});
+  return info;
+}
+
+cp::Expression
+FragmentStats::rowGroupGuarantee(int row_group, const arrow::Schema &schema,
+                                 const std::vector<int> &field_indices) const {
+  const auto &row_group_stats = row_groups[row_group];
+  std::vector<cp::Expression> guarantees{};
+  for (const auto i : field_indices) {
+    const auto &col = row_group_stats.cols[i];
+    if (!col) {
+      continue;
+    }
+
+    auto field = cp::field_ref(schema.field(i)->name());
+    if (col->null_count == row_group_stats.num_rows) {
+      guarantees.emplace_back(cp::is_null(std::move(field)));
+      continue;
+    }
+
+    if (!col->min) {
+      continue;
+    }
+
+    auto in_range = cp::and_(cp::greater_equal(field, cp::literal(col->min)),
+                             cp::less_equal(field, cp::literal(col->max)));
+    if (col->null_count == 0) {
+      guarantees.emplace_back(std::move(in_range));
+    } else {
+      guarantees.emplace_back(
+          cp::or_(std::move(in_range), cp::is_null(std::move(field))));
+    }
+  }
+
+  return cp::and_(std::move(guarantees));
+}
+} // namespace bapid
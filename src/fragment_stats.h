@@ -0,0 +1,63 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/filesystem/filesystem.h>
+#include <memory>
+#include <optional>
+#include <parquet/metadata.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+namespace fs = arrow::fs;
+namespace pq = parquet;
+namespace cp = arrow::compute;
+
+// Statistics of a col in a row group
+struct ColumnChunkStats {
+  // Both set or both null, typed as the values of the col in the table
+  // schema, i.e. as the value type of a dictionary col
+  std::shared_ptr<arrow::Scalar> min{};
+  std::shared_ptr<arrow::Scalar> max{};
+  std::optional<int64_t> null_count{};
+};
+
+struct RowGroupStats {
+  int64_t num_rows{0};
+  // Aligned with the fields of the table schema; nullopt if the Parquet
+  // footer has no statistics for the col
+  std::vector<std::optional<ColumnChunkStats>> cols{};
+};
+
+// What is known about a fragment without opening it
+struct FragmentStats {
+  std::string path;
+  int64_t size{0};
+  int64_t mtime_ns{0};
+  int64_t num_rows{0};
+  std::vector<RowGroupStats> row_groups{};
+  // Whether a bitmap index or Bloom filters of the fragment sit next to it
+  bool has_bitmap_index{false};
+  bool has_bloom_filters{false};
+
+  static arrow::Result<std::shared_ptr<const FragmentStats>>
+  fromParquetMetadata(const fs::FileInfo &info,
+                      const pq::FileMetaData &metadata,
+                      const arrow::Schema &schema);
+
+  fs::FileInfo fileInfo() const;
+
+  // An expression that holds for every row of the row group, used to test
+  // whether a filter can match any of its rows. Only covers the cols at
+  // `field_indices` of the table schema.
+  cp::Expression rowGroupGuarantee(int row_group, const arrow::Schema &schema,
+                                   const std::vector<int> &field_indices) const;
+};
+
+// Stats of the fragments of a table keyed by their paths
+using FragmentStatsIndex =
+    std::unordered_map<std::string, std::shared_ptr<const FragmentStats>>;
+} // namespace bapid
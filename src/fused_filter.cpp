@@ -0,0 +1,239 @@
+#include "src/fused_filter.h"
+#include "src/dictionary.h"
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/map_node.h>
+#include <folly/logging/xlog.h>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Below this share of selected rows, the later predicates are evaluated on the
+// gathered selected rows rather than on the whole batch
+constexpr double kMaxSparseSelectivity = 0.25;
+
+bool isTrueLiteral(const cp::Expression &expr) {
+  const auto *literal = expr.literal();
+  if (!literal || !literal->is_scalar()) {
+    return false;
+  }
+  const auto &scalar = literal->scalar_as<arrow::BooleanScalar>();
+  return scalar.is_valid && scalar.value;
+}
+
+cp::ExecBatch makeEmptyBatch(const cp::ExecBatch &batch) {
+  std::vector<arrow::Datum> values{};
+  values.reserve(batch.values.size());
+  for (const auto &value : batch.values) {
+    values.emplace_back(value.is_array()
+                            ? arrow::Datum{value.make_array()->Slice(0, 0)}
+                            : value);
+  }
+  return cp::ExecBatch{std::move(values), 0};
+}
+} // namespace
+
+/*static*/ arrow::Result<FusedFilter>
+FusedFilter::make(std::vector<cp::Expression> predicates,
+                  const arrow::Schema &schema, cp::ExecContext *exec_context) {
+  std::vector<Predicate> bound_predicates{};
+  bound_predicates.reserve(predicates.size());
+  for (auto &expr : predicates) {
+    if (!expr.IsBound()) {
+      // String comparisons on dictionary cols then compare codes
+      ARROW_ASSIGN_OR_RAISE(expr, rewriteForDictionaries(expr, schema));
+      ARROW_ASSIGN_OR_RAISE(expr, expr.Bind(schema, exec_context));
+    }
+
+    std::vector<int> field_indices{};
+    for (const auto &ref : cp::FieldsInExpression(expr)) {
+      ARROW_ASSIGN_OR_RAISE(auto path, ref.FindOne(schema));
+      field_indices.emplace_back(path[0]);
+    }
+    bound_predicates.emplace_back(
+        Predicate{std::move(expr), std::move(field_indices)});
+  }
+
+  return FusedFilter{std::move(bound_predicates),
+                     std::make_shared<arrow::Schema>(schema)};
+}
+
+FusedFilter::FusedFilter(std::vector<Predicate> predicates,
+                         std::shared_ptr<arrow::Schema> schema)
+    : predicates_{std::move(predicates)}, schema_{std::move(schema)} {}
+
+arrow::Result<cp::ExecBatch>
+FusedFilter::apply(const cp::ExecBatch &batch,
+                   cp::ExecContext *exec_context) const {
+  // The rows still selected: all of them while both are null, the set ones of
+  // `mask` while it is dense, then those in `selection`.
+  std::shared_ptr<arrow::BooleanArray> mask{};
+  std::shared_ptr<arrow::Array> selection{};
+  int64_t num_selected = batch.length;
+
+  for (const auto &predicate : predicates_) {
+    if (num_selected == 0) {
+      break;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(
+        auto expr, cp::SimplifyWithGuarantee(predicate.expr, batch.guarantee));
+    if (!expr.IsSatisfiable()) {
+      num_selected = 0;
+      break;
+    }
+    if (isTrueLiteral(expr)) {
+      continue;
+    }
+
+    arrow::Datum keep_datum{};
+    if (selection) {
+      // Only the fields the predicate reads are gathered; the others are never
+      // looked at
+      std::vector<arrow::Datum> values{};
+      values.reserve(batch.values.size());
+      for (size_t i = 0; i < batch.values.size(); i++) {
+        values.emplace_back(batch.values[i].is_scalar()
+                                ? batch.values[i]
+                                : arrow::Datum{arrow::MakeNullScalar(
+                                      schema_->field(i)->type())});
+      }
+      for (const auto i : predicate.field_indices) {
+        if (batch.values[i].is_array()) {
+          ARROW_ASSIGN_OR_RAISE(values[i],
+                                cp::Take(batch.values[i], selection,
+                                         cp::TakeOptions::NoBoundsCheck(),
+                                         exec_context));
+        }
+      }
+      ARROW_ASSIGN_OR_RAISE(
+          keep_datum,
+          cp::ExecuteScalarExpression(
+              expr, cp::ExecBatch{std::move(values), selection->length()},
+              exec_context));
+    } else {
+      ARROW_ASSIGN_OR_RAISE(
+          keep_datum, cp::ExecuteScalarExpression(expr, batch, exec_context));
+    }
+
+    if (keep_datum.is_scalar()) {
+      const auto &keep = keep_datum.scalar_as<arrow::BooleanScalar>();
+      if (!keep.is_valid || !keep.value) {
+        num_selected = 0;
+      }
+      continue;
+    }
+
+    auto keep =
+        std::static_pointer_cast<arrow::BooleanArray>(keep_datum.make_array());
+    if (selection) {
+      ARROW_ASSIGN_OR_RAISE(auto filtered,
+                            cp::Filter(selection, keep,
+                                       cp::FilterOptions::Defaults(),
+                                       exec_context));
+      selection = filtered.make_array();
+      num_selected = selection->length();
+      continue;
+    }
+
+    if (mask) {
+      ARROW_ASSIGN_OR_RAISE(auto both, cp::And(mask, keep, exec_context));
+      keep = std::static_pointer_cast<arrow::BooleanArray>(both.make_array());
+    }
+    mask = std::move(keep);
+    num_selected = mask->true_count();
+    if (num_selected > 0 &&
+        num_selected < batch.length * kMaxSparseSelectivity) {
+      ARROW_ASSIGN_OR_RAISE(
+          auto indices,
+          cp::CallFunction("indices_nonzero", {mask}, exec_context));
+      selection = indices.make_array();
+      mask.reset();
+    }
+  }
+
+  if (num_selected == 0) {
+    return makeEmptyBatch(batch);
+  }
+  if (!selection && (!mask || num_selected == batch.length)) {
+    return batch;
+  }
+
+  std::vector<arrow::Datum> values{};
+  values.reserve(batch.values.size());
+  for (const auto &value : batch.values) {
+    if (!value.is_array()) {
+      values.emplace_back(value);
+      continue;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(
+        auto selected,
+        selection ? cp::Take(value, selection, cp::TakeOptions::NoBoundsCheck(),
+                             exec_context)
+                  : cp::Filter(value, mask, cp::FilterOptions::Defaults(),
+                               exec_context));
+    values.emplace_back(std::move(selected));
+  }
+
+  auto result = cp::ExecBatch{std::move(values), num_selected};
+  result.guarantee = batch.guarantee;
+  return result;
+}
+
+namespace {
+class FusedFilterNode : public cp::MapNode {
+public:
+  FusedFilterNode(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+                  std::shared_ptr<arrow::Schema> output_schema,
+                  FusedFilter filter)
+      : cp::MapNode(plan, std::move(inputs), std::move(output_schema)),
+        filter_{std::move(filter)} {}
+
+  static arrow::Result<cp::ExecNode *>
+  make(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+       const cp::ExecNodeOptions &options) {
+    if (inputs.size() != 1) {
+      return arrow::Status::Invalid("FusedFilterNode takes 1 input, got ",
+                                    inputs.size());
+    }
+
+    auto schema = inputs[0]->output_schema();
+    const auto &filter_options =
+        static_cast<const FusedFilterNodeOptions &>(options);
+    ARROW_ASSIGN_OR_RAISE(auto filter,
+                          FusedFilter::make(filter_options.predicates, *schema,
+                                            plan->exec_context()));
+    return plan->EmplaceNode<FusedFilterNode>(
+        plan, std::move(inputs), std::move(schema), std::move(filter));
+  }
+
+  const char *kind_name() const override { return "FusedFilterNode"; }
+
+  void InputReceived(cp::ExecNode * /*input*/, cp::ExecBatch batch) override {
+    SubmitTask(
+        [this](cp::ExecBatch batch) {
+          return filter_.apply(batch, plan()->exec_context());
+        },
+        std::move(batch));
+  }
+
+private:
+  FusedFilter filter_;
+};
+} // namespace
+
+void registerFusedFilterNode(cp::ExecFactoryRegistry *registry) {
+  static std::once_flag once{};
+  std::call_once(once, [registry]() {
+    auto status = registry->AddFactory(kFusedFilterNode, FusedFilterNode::make);
+    if (!status.ok()) {
+      XLOG(ERR) << "fail to register " << kFusedFilterNode << ": "
+                << status.ToString();
+    }
+  });
+}
+} // namespace bapid
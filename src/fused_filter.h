@@ -0,0 +1,57 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/compute/exec/options.h>
+#include <memory>
+#include <vector>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+// The conjunction of the filters of a query, evaluated in a single pass over a
+// batch. Predicates run in order and track the rows still selected: as a mask
+// over the whole batch while most rows are, then as a selection vector so that
+// the later predicates only look at the surviving rows. The batch is
+// materialized once, after the last predicate, or not at all if no row is
+// left.
+class FusedFilter {
+public:
+  static arrow::Result<FusedFilter>
+  make(std::vector<cp::Expression> predicates, const arrow::Schema &schema,
+       cp::ExecContext *exec_context);
+
+  arrow::Result<cp::ExecBatch> apply(const cp::ExecBatch &batch,
+                                     cp::ExecContext *exec_context) const;
+
+private:
+  struct Predicate {
+    cp::Expression expr;
+    // Indices of the fields of the input the predicate reads
+    std::vector<int> field_indices;
+  };
+
+  FusedFilter(std::vector<Predicate> predicates,
+              std::shared_ptr<arrow::Schema> schema);
+
+  std::vector<Predicate> predicates_;
+  std::shared_ptr<arrow::Schema> schema_;
+};
+
+// Name of the exec node applying a FusedFilter
+inline constexpr char kFusedFilterNode[] = "bapid_fused_filter";
+
+class FusedFilterNodeOptions : public cp::ExecNodeOptions {
+public:
+  explicit FusedFilterNodeOptions(std::vector<cp::Expression> predicates)
+      : predicates{std::move(predicates)} {}
+
+  std::vector<cp::Expression> predicates;
+};
+
+// Adds kFusedFilterNode to `registry`; a no-op after the first call
+void registerFusedFilterNode(cp::ExecFactoryRegistry *registry);
+} // namespace bapid
@@ -0,0 +1,179 @@
+#include "src/hot_tier.h"
+#include <arrow/array/concatenate.h>
+#include <arrow/compute/cast.h>
+#include <arrow/util/thread_pool.h>
+#include <folly/Conv.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/exception.h>
+#include <parquet/file_reader.h>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Row groups read ahead of the one the scan consumes
+constexpr int kReadahead = 4;
+// Keys of the cols decoded once remembered at most
+constexpr size_t kMaxDecodedKeys = 1 << 16;
+
+std::string getKey(const std::string &file_key, int row_group,
+                   const arrow::Field &field) {
+  return folly::to<std::string>(file_key, ":", row_group, ":", field.name(),
+                                ":", field.type()->ToString());
+}
+
+// Decodes the cols at `column_indices` of a row group of a file
+arrow::Result<std::shared_ptr<arrow::Table>>
+decodeRowGroup(const ds::ParquetFileFragment &fragment,
+               std::shared_ptr<pq::FileMetaData> metadata, int row_group,
+               const std::vector<int> &column_indices,
+               const pq::ArrowReaderProperties &properties) {
+  ARROW_ASSIGN_OR_RAISE(auto input, fragment.source().Open());
+  std::unique_ptr<pq::ParquetFileReader> file_reader{};
+  try {
+    // The known footer spares reading it again
+    file_reader = pq::ParquetFileReader::Open(
+        std::move(input), pq::default_reader_properties(), std::move(metadata));
+  } catch (const pq::ParquetException &e) {
+    return arrow::Status::IOError("fail to open ", fragment.source().path(),
+                                  ": ", e.what());
+  }
+
+  std::unique_ptr<pq::arrow::FileReader> reader{};
+  ARROW_RETURN_NOT_OK(pq::arrow::FileReader::Make(
+      arrow::default_memory_pool(), std::move(file_reader), properties,
+      &reader));
+  std::shared_ptr<arrow::Table> table{};
+  ARROW_RETURN_NOT_OK(reader->ReadRowGroup(row_group, column_indices, &table));
+  return table;
+}
+
+arrow::Result<std::shared_ptr<arrow::Array>>
+combineChunks(const arrow::ChunkedArray &chunked) {
+  switch (chunked.num_chunks()) {
+  case 0:
+    return arrow::MakeEmptyArray(chunked.type());
+  case 1:
+    return chunked.chunk(0);
+  default:
+    return arrow::Concatenate(chunked.chunks());
+  }
+}
+} // namespace
+
+HotTier::HotTier(int64_t max_bytes) : cache_{max_bytes} {}
+
+bool HotTier::admit(const std::string &key) {
+  auto decoded = decoded_.wlock();
+  if (decoded->keys.erase(key) > 0) {
+    return true;
+  }
+
+  decoded->keys.emplace(key);
+  decoded->order.emplace_back(key);
+  // Also drops the keys since admitted, which `keys` no longer has
+  while (decoded->order.size() > kMaxDecodedKeys) {
+    decoded->keys.erase(decoded->order.front());
+    decoded->order.pop_front();
+  }
+  return false;
+}
+
+arrow::Result<std::optional<cp::ExecBatch>>
+HotTier::readRowGroup(const ds::ParquetFileFragment &fragment,
+                      const std::string &file_key, int row_group,
+                      const arrow::Schema &schema) {
+  const auto metadata = fragment.metadata();
+  const auto num_rows = metadata->RowGroup(row_group)->num_rows();
+
+  std::vector<arrow::Datum> values(schema.num_fields());
+  // The cols to decode and the fields they are read as
+  std::vector<int> column_indices{};
+  std::vector<int> missed_fields{};
+  // Dictionary cols are decoded as such, like the scans of the table do
+  pq::ArrowReaderProperties properties{};
+  for (int i = 0; i < schema.num_fields(); i++) {
+    const auto &field = *schema.field(i);
+    auto cached = file_key.empty()
+                      ? nullptr
+                      : cache_.get(getKey(file_key, row_group, field), 0);
+    if (cached) {
+      num_hits_++;
+      values[i] = cached->column(0)->chunk(0);
+      continue;
+    }
+
+    const auto column_index = metadata->schema()->ColumnIndex(field.name());
+    if (column_index < 0) {
+      ARROW_ASSIGN_OR_RAISE(values[i],
+                            arrow::MakeArrayOfNull(field.type(), num_rows));
+      continue;
+    }
+    num_misses_++;
+    if (field.type()->id() == arrow::Type::DICTIONARY) {
+      properties.set_read_dictionary(column_index, true);
+    }
+    column_indices.emplace_back(column_index);
+    missed_fields.emplace_back(i);
+  }
+
+  if (!column_indices.empty()) {
+    ARROW_ASSIGN_OR_RAISE(
+        auto decoded,
+        decodeRowGroup(fragment, metadata, row_group, column_indices,
+                       properties));
+    for (size_t j = 0; j < missed_fields.size(); j++) {
+      const auto &field = schema.field(missed_fields[j]);
+      ARROW_ASSIGN_OR_RAISE(
+          auto col, combineChunks(*decoded->column(static_cast<int>(j))));
+      if (!col->type()->Equals(field->type())) {
+        ARROW_ASSIGN_OR_RAISE(col, cp::Cast(*col, field->type()));
+      }
+
+      const auto key = getKey(file_key, row_group, *field);
+      if (!file_key.empty() && admit(key)) {
+        cache_.put(key, 0, arrow::Table::Make(arrow::schema({field}), {col}));
+      }
+      values[missed_fields[j]] = std::move(col);
+    }
+  }
+
+  return cp::ExecBatch{std::move(values), num_rows};
+}
+
+arrow::AsyncGenerator<std::optional<cp::ExecBatch>>
+HotTier::scan(std::vector<ScanRowGroups> row_groups,
+              std::shared_ptr<arrow::Schema> schema) {
+  struct RowGroupRef {
+    std::shared_ptr<ds::ParquetFileFragment> fragment;
+    std::string file_key;
+    int row_group;
+  };
+  auto refs = std::make_shared<std::vector<RowGroupRef>>();
+  for (auto &[fragment, fragment_row_groups, file_key] : row_groups) {
+    for (const auto row_group : fragment_row_groups) {
+      refs->emplace_back(RowGroupRef{fragment, file_key, row_group});
+    }
+  }
+
+  // Each row group is read on the CPU pool, a few ahead of the consumer
+  auto next = std::make_shared<size_t>(0);
+  arrow::AsyncGenerator<std::optional<cp::ExecBatch>> gen =
+      [self = shared_from_this(), refs, next, schema = std::move(schema)]()
+      -> arrow::Future<std::optional<cp::ExecBatch>> {
+    if (*next == refs->size()) {
+      return arrow::Future<std::optional<cp::ExecBatch>>::MakeFinished(
+          std::nullopt);
+    }
+
+    const auto &ref = (*refs)[(*next)++];
+    return arrow::DeferNotOk(arrow::internal::GetCpuThreadPool()->Submit(
+        [self, ref, schema]() -> arrow::Result<std::optional<cp::ExecBatch>> {
+          ARROW_RETURN_NOT_OK(ref.fragment->EnsureCompleteMetadata());
+          return self->readRowGroup(*ref.fragment, ref.file_key,
+                                    ref.row_group, *schema);
+        }));
+  };
+  return arrow::MakeReadaheadGenerator(std::move(gen), kReadahead);
+}
+} // namespace bapid
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "src/result_cache.h"
+#include "src/shared_scan.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/util/async_generator.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <folly/Synchronized.h>
+#include <memory>
+#include <optional>
+#include <parquet/metadata.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace bapid {
+
+namespace pq = parquet;
+
+// Decoded cols of the row groups of the Parquet files of a table, kept in
+// memory within a budget so that scans of the hot cols skip decompressing and
+// decoding them. A col is only kept once decoded again soon after, so that a
+// scan of cold row groups does not evict the hot ones. The least recently
+// used ones are evicted first.
+class HotTier : public std::enable_shared_from_this<HotTier> {
+public:
+  explicit HotTier(int64_t max_bytes);
+
+  // The batches of the cols of `schema` in `row_groups`, one per row group,
+  // for a source node. The cols of a row group missing from the hot tier are
+  // decoded from its file, then kept if decoded before and the file has a
+  // key. A col missing from a file is null.
+  arrow::AsyncGenerator<std::optional<cp::ExecBatch>>
+  scan(std::vector<ScanRowGroups> row_groups,
+       std::shared_ptr<arrow::Schema> schema);
+
+  int64_t numBytes() const { return cache_.numBytes(); }
+  // Cols of row groups read from the hot tier and decoded from files
+  int64_t numHits() const { return num_hits_; }
+  int64_t numMisses() const { return num_misses_; }
+
+private:
+  arrow::Result<std::optional<cp::ExecBatch>>
+  readRowGroup(const ds::ParquetFileFragment &fragment,
+               const std::string &file_key, int row_group,
+               const arrow::Schema &schema);
+  // Whether the col of `key` was decoded recently, otherwise remembers it
+  bool admit(const std::string &key);
+
+  // Each col of a row group is a table of one col, tied to no version as its
+  // key tells the contents of the file
+  ResultCache cache_;
+  // Keys of the cols decoded recently but not kept, oldest first
+  struct Decoded {
+    std::unordered_set<std::string> keys{};
+    std::deque<std::string> order{};
+  };
+  folly::Synchronized<Decoded> decoded_{};
+  std::atomic<int64_t> num_hits_{0};
+  std::atomic<int64_t> num_misses_{0};
+};
+} // namespace bapid
@@ -0,0 +1,254 @@
+#include "src/manifest.h"
+#include "if/manifest.pb.h"
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/dictionary.h>
+#include <arrow/ipc/reader.h>
+#include <arrow/ipc/writer.h>
+#include <folly/Expected.h>
+#include <folly/FileUtil.h>
+#include <folly/Range.h>
+#include <folly/system/MemoryMapping.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+std::string getManifestPath(const std::string &dataset_dir) {
+  return dataset_dir + "/" + kManifestFileName;
+}
+
+arrow::Result<bapidmanifest::Value> toValue(const arrow::Scalar &scalar) {
+  bapidmanifest::Value value{};
+  switch (scalar.type->id()) {
+  case arrow::Type::INT8:
+  case arrow::Type::INT16:
+  case arrow::Type::INT32:
+  case arrow::Type::INT64:
+  case arrow::Type::UINT8:
+  case arrow::Type::UINT16:
+  case arrow::Type::UINT32:
+  case arrow::Type::UINT64: {
+    ARROW_ASSIGN_OR_RAISE(auto int_scalar, scalar.CastTo(arrow::int64()));
+    value.set_int_val(
+        std::static_pointer_cast<arrow::Int64Scalar>(int_scalar)->value);
+    return value;
+  }
+  case arrow::Type::TIMESTAMP: {
+    value.set_int_val(static_cast<const arrow::TimestampScalar &>(scalar).value);
+    return value;
+  }
+  case arrow::Type::DATE32: {
+    value.set_int_val(static_cast<const arrow::Date32Scalar &>(scalar).value);
+    return value;
+  }
+  case arrow::Type::DATE64: {
+    value.set_int_val(static_cast<const arrow::Date64Scalar &>(scalar).value);
+    return value;
+  }
+  case arrow::Type::HALF_FLOAT:
+  case arrow::Type::FLOAT:
+  case arrow::Type::DOUBLE: {
+    ARROW_ASSIGN_OR_RAISE(auto dbl_scalar, scalar.CastTo(arrow::float64()));
+    value.set_dbl_val(
+        std::static_pointer_cast<arrow::DoubleScalar>(dbl_scalar)->value);
+    return value;
+  }
+  case arrow::Type::STRING:
+  case arrow::Type::LARGE_STRING:
+  case arrow::Type::BINARY:
+  case arrow::Type::LARGE_BINARY: {
+    value.set_str_val(
+        static_cast<const arrow::BaseBinaryScalar &>(scalar).value->ToString());
+    return value;
+  }
+  default:
+    return arrow::Status::NotImplemented("no manifest value for ",
+                                         scalar.type->ToString());
+  }
+}
+
+// `type` is that of the col in the table schema, whose stats are of its values
+// if it is a dictionary
+arrow::Result<std::shared_ptr<arrow::Scalar>>
+fromValue(const bapidmanifest::Value &value,
+          const std::shared_ptr<arrow::DataType> &col_type) {
+  const auto &type =
+      col_type->id() == arrow::Type::DICTIONARY
+          ? static_cast<const arrow::DictionaryType &>(*col_type).value_type()
+          : col_type;
+  switch (value.value_case()) {
+  case bapidmanifest::Value::kIntVal:
+    return arrow::MakeScalar(type, value.int_val());
+  case bapidmanifest::Value::kDblVal:
+    return arrow::MakeScalar(type, value.dbl_val());
+  case bapidmanifest::Value::kStrVal:
+    return arrow::MakeScalar(type, arrow::Buffer::FromString(value.str_val()));
+  default:
+    return arrow::Status::Invalid("empty manifest value");
+  }
+}
+
+arrow::Result<bapidmanifest::Manifest>
+toProto(const FragmentManifest &manifest) {
+  bapidmanifest::Manifest proto{};
+  proto.set_version(FragmentManifest::kVersion);
+  ARROW_ASSIGN_OR_RAISE(auto schema,
+                        arrow::ipc::SerializeSchema(*manifest.schema));
+  proto.set_arrow_schema(schema->data(), schema->size());
+  proto.set_dir_mtime_ns(manifest.dir_mtime_ns);
+
+  for (const auto &fragment : manifest.fragments) {
+    auto *fragment_proto = proto.add_fragments();
+    fragment_proto->set_path(fragment->path);
+    fragment_proto->set_size(fragment->size);
+    fragment_proto->set_mtime_ns(fragment->mtime_ns);
+    fragment_proto->set_num_rows(fragment->num_rows);
+    fragment_proto->set_has_bitmap_index(fragment->has_bitmap_index);
+    fragment_proto->set_has_bloom_filters(fragment->has_bloom_filters);
+
+    for (const auto &row_group : fragment->row_groups) {
+      auto *row_group_proto = fragment_proto->add_row_groups();
+      row_group_proto->set_num_rows(row_group.num_rows);
+      for (const auto &col : row_group.cols) {
+        auto *col_proto = row_group_proto->add_cols();
+        if (!col) {
+          continue;
+        }
+
+        col_proto->set_has_stats(true);
+        if (col->null_count) {
+          col_proto->set_null_count(col->null_count.value());
+        }
+
+        if (!col->min) {
+          continue;
+        }
+
+        auto min = toValue(*col->min);
+        auto max = toValue(*col->max);
+        if (min.ok() && max.ok()) {
+          *col_proto->mutable_min() = min.MoveValueUnsafe();
+          *col_proto->mutable_max() = max.MoveValueUnsafe();
+        }
+      }
+    }
+  }
+
+  return proto;
+}
+
+arrow::Result<FragmentManifest>
+fromProto(const bapidmanifest::Manifest &proto) {
+  if (proto.version() != FragmentManifest::kVersion) {
+    return arrow::Status::Invalid("unsupported manifest version ",
+                                  proto.version());
+  }
+
+  FragmentManifest manifest{};
+  arrow::io::BufferReader schema_reader{proto.arrow_schema()};
+  arrow::ipc::DictionaryMemo dictionary_memo{};
+  ARROW_ASSIGN_OR_RAISE(
+      manifest.schema,
+      arrow::ipc::ReadSchema(&schema_reader, &dictionary_memo));
+  manifest.dir_mtime_ns = proto.dir_mtime_ns();
+
+  const auto &schema = *manifest.schema;
+  manifest.fragments.reserve(proto.fragments_size());
+  for (const auto &fragment_proto : proto.fragments()) {
+    auto fragment = std::make_shared<FragmentStats>();
+    fragment->path = fragment_proto.path();
+    fragment->size = fragment_proto.size();
+    fragment->mtime_ns = fragment_proto.mtime_ns();
+    fragment->num_rows = fragment_proto.num_rows();
+    fragment->has_bitmap_index = fragment_proto.has_bitmap_index();
+    fragment->has_bloom_filters = fragment_proto.has_bloom_filters();
+
+    fragment->row_groups.reserve(fragment_proto.row_groups_size());
+    for (const auto &row_group_proto : fragment_proto.row_groups()) {
+      if (row_group_proto.cols_size() != schema.num_fields()) {
+        return arrow::Status::Invalid("manifest of ", fragment->path,
+                                      " does not match the schema");
+      }
+
+      auto &row_group = fragment->row_groups.emplace_back(RowGroupStats{
+          .num_rows = row_group_proto.num_rows(),
+          .cols = std::vector<std::optional<ColumnChunkStats>>(
+              schema.num_fields()),
+      });
+
+      for (int i = 0; i < row_group_proto.cols_size(); i++) {
+        const auto &col_proto = row_group_proto.cols(i);
+        if (!col_proto.has_stats()) {
+          continue;
+        }
+
+        auto &col = row_group.cols[i].emplace();
+        if (col_proto.has_null_count()) {
+          col.null_count = col_proto.null_count();
+        }
+
+        if (col_proto.has_min() && col_proto.has_max()) {
+          const auto &type = schema.field(i)->type();
+          ARROW_ASSIGN_OR_RAISE(col.min, fromValue(col_proto.min(), type));
+          ARROW_ASSIGN_OR_RAISE(col.max, fromValue(col_proto.max(), type));
+        }
+      }
+    }
+
+    manifest.fragments.emplace_back(std::move(fragment));
+  }
+
+  return manifest;
+}
+} // namespace
+
+/*static*/ folly::Expected<FragmentManifest, std::string>
+FragmentManifest::read(const std::string &dataset_dir) {
+  const auto path = getManifestPath(dataset_dir);
+  bapidmanifest::Manifest proto{};
+  try {
+    folly::MemoryMapping mapping{path.c_str()};
+    const auto data = mapping.range();
+    if (!proto.ParseFromArray(data.data(), static_cast<int>(data.size()))) {
+      return folly::makeUnexpected("corrupted manifest: " + path);
+    }
+  } catch (const std::system_error &e) {
+    return folly::makeUnexpected(std::string{e.what()});
+  }
+
+  auto manifest = fromProto(proto);
+  if (!manifest.ok()) {
+    return folly::makeUnexpected(manifest.status().ToString());
+  }
+
+  return manifest.MoveValueUnsafe();
+}
+
+folly::Expected<folly::Unit, std::string>
+FragmentManifest::write(const std::string &dataset_dir) const {
+  auto proto = toProto(*this);
+  if (!proto.ok()) {
+    return folly::makeUnexpected(proto.status().ToString());
+  }
+
+  std::string data{};
+  if (!proto->SerializeToString(&data)) {
+    return folly::makeUnexpected(std::string{"fail to serialize manifest"});
+  }
+
+  const auto path = getManifestPath(dataset_dir);
+  const auto err = folly::writeFileAtomicNoThrow(
+      path, folly::ByteRange{folly::StringPiece{data}});
+  if (err != 0) {
+    return folly::makeUnexpected("fail to write " + path + ": " +
+                                 std::generic_category().message(err));
+  }
+
+  return folly::Unit{};
+}
+} // namespace bapid
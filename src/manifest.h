@@ -0,0 +1,34 @@
+#pragma once
+
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <folly/Expected.h>
+#include <folly/Unit.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+// Name of the manifest in a dataset dir. The leading underscore keeps it out of
+// dataset discovery.
+constexpr auto kManifestFileName = "_bapid_manifest";
+
+// The fragments of a dataset dir with their stats, as last discovered by bapid.
+// Persisted next to the dataset so that a restart does not reopen every footer.
+struct FragmentManifest {
+  static constexpr int kVersion = 1;
+
+  std::shared_ptr<arrow::Schema> schema{};
+  int64_t dir_mtime_ns{0};
+  std::vector<std::shared_ptr<const FragmentStats>> fragments{};
+
+  // Reads the manifest of `dataset_dir` through a memory mapping
+  static folly::Expected<FragmentManifest, std::string>
+  read(const std::string &dataset_dir);
+
+  // Atomically replaces the manifest of `dataset_dir`
+  folly::Expected<folly::Unit, std::string>
+  write(const std::string &dataset_dir) const;
+};
+} // namespace bapid
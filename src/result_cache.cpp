@@ -0,0 +1,73 @@
+#include "src/result_cache.h"
+#include <arrow/util/byte_size.h>
+#include <utility>
+
+namespace bapid {
+
+ResultCache::ResultCache(int64_t max_bytes) : max_bytes_{max_bytes} {}
+
+std::shared_ptr<arrow::Table> ResultCache::get(const std::string &key,
+                                               uint64_t version) {
+  auto state = state_.wlock();
+  if (state->version != version) {
+    return nullptr;
+  }
+  auto it = state->index.find(key);
+  if (it == state->index.end()) {
+    return nullptr;
+  }
+
+  state->entries.splice(state->entries.begin(), state->entries, it->second);
+  return it->second->result_set;
+}
+
+void ResultCache::put(const std::string &key, uint64_t version,
+                      std::shared_ptr<arrow::Table> result_set) {
+  const auto num_bytes =
+      static_cast<int64_t>(arrow::util::TotalBufferSize(*result_set));
+  if (max_bytes_ <= 0 || num_bytes > maxEntryBytes()) {
+    return;
+  }
+
+  auto state = state_.wlock();
+  if (version < state->version) {
+    return;
+  }
+  if (version > state->version) {
+    state->entries.clear();
+    state->index.clear();
+    state->num_bytes = 0;
+    state->version = version;
+  }
+
+  auto it = state->index.find(key);
+  if (it != state->index.end()) {
+    state->num_bytes -= it->second->num_bytes;
+    state->entries.erase(it->second);
+    state->index.erase(it);
+  }
+
+  state->entries.push_front(Entry{key, std::move(result_set), num_bytes});
+  state->index.emplace(key, state->entries.begin());
+  state->num_bytes += num_bytes;
+  while (state->num_bytes > max_bytes_) {
+    const auto &lru = state->entries.back();
+    state->num_bytes -= lru.num_bytes;
+    state->index.erase(lru.key);
+    state->entries.pop_back();
+  }
+}
+
+void ResultCache::invalidate(uint64_t version) {
+  auto state = state_.wlock();
+  if (version <= state->version) {
+    return;
+  }
+  state->entries.clear();
+  state->index.clear();
+  state->num_bytes = 0;
+  state->version = version;
+}
+
+int64_t ResultCache::numBytes() const { return state_.rlock()->num_bytes; }
+} // namespace bapid
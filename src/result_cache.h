@@ -0,0 +1,50 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <folly/Synchronized.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace bapid {
+
+// Result sets of queries on a table, evicted least recently used first to
+// stay within a memory budget. The entries are tied to a version of the
+// table and dropped once it changes.
+class ResultCache {
+public:
+  explicit ResultCache(int64_t max_bytes);
+
+  // nullptr if not cached for `version`
+  std::shared_ptr<arrow::Table> get(const std::string &key, uint64_t version);
+  // Ignored if `version` is older than the current one, or if the result set
+  // takes more than a quarter of the budget
+  void put(const std::string &key, uint64_t version,
+           std::shared_ptr<arrow::Table> result_set);
+  // Drops the entries of the versions before `version`
+  void invalidate(uint64_t version);
+
+  int64_t maxEntryBytes() const { return max_bytes_ / 4; }
+  int64_t numBytes() const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<arrow::Table> result_set;
+    int64_t num_bytes;
+  };
+
+  struct State {
+    uint64_t version{0};
+    // Most recently used first
+    std::list<Entry> entries{};
+    std::unordered_map<std::string, std::list<Entry>::iterator> index{};
+    int64_t num_bytes{0};
+  };
+
+  int64_t max_bytes_;
+  folly::Synchronized<State> state_{};
+};
+} // namespace bapid
@@ -0,0 +1,236 @@
+#include "src/sampling.h"
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/map_node.h>
+#include <cmath>
+#include <folly/logging/xlog.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Compacts the kept chunks once they hold this many times the rows of the
+// reservoir, most of them replaced since
+constexpr int64_t kMaxChunkRowsFactor = 4;
+
+double drawUniform(std::mt19937_64 &rng) {
+  // Excludes 0, whose log is not finite
+  return std::uniform_real_distribution<double>{
+      std::numeric_limits<double>::min(), 1}(rng);
+}
+} // namespace
+
+std::mt19937_64 makeRng(std::optional<uint64_t> seed) {
+  return std::mt19937_64{seed ? *seed : std::random_device{}()};
+}
+
+ReservoirSample::ReservoirSample(std::shared_ptr<arrow::Schema> schema,
+                                 int64_t size, uint64_t seed)
+    : schema_{std::move(schema)}, size_{size}, rng_{seed}, next_{size - 1} {}
+
+void ReservoirSample::skip() {
+  weight_ *= std::exp(std::log(drawUniform(rng_)) / size_);
+  const auto num_skipped =
+      std::floor(std::log(drawUniform(rng_)) / std::log1p(-weight_));
+  next_ += static_cast<int64_t>(num_skipped) + 1;
+}
+
+arrow::Status
+ReservoirSample::add(const std::shared_ptr<arrow::RecordBatch> &batch) {
+  const auto base = num_seen_;
+  const auto num_rows = batch->num_rows();
+  num_seen_ += num_rows;
+  if (size_ <= 0) {
+    return arrow::Status::OK();
+  }
+
+  // The rows of the batch to keep and the slot each goes to
+  std::vector<int64_t> rows{};
+  std::vector<int64_t> targets{};
+  int64_t i = 0;
+  for (; i < num_rows && base + i < size_; i++) {
+    rows.emplace_back(i);
+    targets.emplace_back(base + i);
+  }
+  if (base < size_ && base + i == size_) {
+    skip();
+  }
+  std::uniform_int_distribution<int64_t> pick_slot{0, size_ - 1};
+  while (next_ < num_seen_ && base + num_rows > size_) {
+    rows.emplace_back(next_ - base);
+    targets.emplace_back(pick_slot(rng_));
+    skip();
+  }
+  if (rows.empty()) {
+    return arrow::Status::OK();
+  }
+
+  arrow::Int64Builder builder{};
+  ARROW_RETURN_NOT_OK(builder.AppendValues(rows));
+  ARROW_ASSIGN_OR_RAISE(auto indices, builder.Finish());
+  ARROW_ASSIGN_OR_RAISE(auto taken,
+                        cp::Take(batch, indices,
+                                 cp::TakeOptions::NoBoundsCheck()));
+  const auto chunk = static_cast<int>(chunks_.size());
+  chunks_.emplace_back(taken.record_batch());
+  num_chunk_rows_ += static_cast<int64_t>(rows.size());
+
+  for (size_t j = 0; j < rows.size(); j++) {
+    const auto slot = Slot{chunk, static_cast<int64_t>(j)};
+    if (targets[j] == static_cast<int64_t>(slots_.size())) {
+      slots_.emplace_back(slot);
+    } else {
+      slots_[targets[j]] = slot;
+    }
+  }
+
+  if (num_chunk_rows_ > kMaxChunkRowsFactor * size_) {
+    ARROW_RETURN_NOT_OK(compact());
+  }
+  return arrow::Status::OK();
+}
+
+arrow::Result<std::shared_ptr<arrow::Table>>
+ReservoirSample::materialize() const {
+  std::vector<int64_t> offsets(chunks_.size(), 0);
+  for (size_t i = 1; i < chunks_.size(); i++) {
+    offsets[i] = offsets[i - 1] + chunks_[i - 1]->num_rows();
+  }
+
+  arrow::Int64Builder builder{};
+  ARROW_RETURN_NOT_OK(builder.Reserve(static_cast<int64_t>(slots_.size())));
+  for (const auto &slot : slots_) {
+    builder.UnsafeAppend(offsets[slot.chunk] + slot.row);
+  }
+  ARROW_ASSIGN_OR_RAISE(auto indices, builder.Finish());
+  ARROW_ASSIGN_OR_RAISE(auto table,
+                        arrow::Table::FromRecordBatches(schema_, chunks_));
+  ARROW_ASSIGN_OR_RAISE(auto sampled,
+                        cp::Take(table, indices,
+                                 cp::TakeOptions::NoBoundsCheck()));
+  return sampled.table();
+}
+
+// Drops the rows of the kept chunks that are no longer sampled
+arrow::Status ReservoirSample::compact() {
+  ARROW_ASSIGN_OR_RAISE(auto table, materialize());
+  ARROW_ASSIGN_OR_RAISE(table,
+                        table->CombineChunks(arrow::default_memory_pool()));
+  arrow::TableBatchReader reader{*table};
+  std::shared_ptr<arrow::RecordBatch> batch{};
+  ARROW_RETURN_NOT_OK(reader.ReadNext(&batch));
+
+  chunks_.clear();
+  num_chunk_rows_ = 0;
+  if (!batch) {
+    slots_.clear();
+    return arrow::Status::OK();
+  }
+  for (size_t i = 0; i < slots_.size(); i++) {
+    slots_[i] = Slot{0, static_cast<int64_t>(i)};
+  }
+  num_chunk_rows_ = batch->num_rows();
+  chunks_.emplace_back(std::move(batch));
+  return arrow::Status::OK();
+}
+
+arrow::Result<std::shared_ptr<arrow::Table>> ReservoirSample::finish() {
+  return materialize();
+}
+
+namespace {
+class BernoulliSampleNode : public cp::MapNode {
+public:
+  BernoulliSampleNode(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+                      std::shared_ptr<arrow::Schema> output_schema,
+                      double rate, uint64_t seed)
+      : cp::MapNode(plan, std::move(inputs), std::move(output_schema)),
+        rate_{rate}, rng_{seed} {}
+
+  static arrow::Result<cp::ExecNode *>
+  make(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+       const cp::ExecNodeOptions &options) {
+    if (inputs.size() != 1) {
+      return arrow::Status::Invalid("BernoulliSampleNode takes 1 input, got ",
+                                    inputs.size());
+    }
+
+    const auto &sample_options =
+        static_cast<const BernoulliSampleNodeOptions &>(options);
+    if (sample_options.rate <= 0 || sample_options.rate > 1) {
+      return arrow::Status::Invalid("invalid sample rate ",
+                                    sample_options.rate);
+    }
+    auto schema = inputs[0]->output_schema();
+    return plan->EmplaceNode<BernoulliSampleNode>(
+        plan, std::move(inputs), std::move(schema), sample_options.rate,
+        sample_options.seed);
+  }
+
+  const char *kind_name() const override { return "BernoulliSampleNode"; }
+
+  void InputReceived(cp::ExecNode * /*input*/, cp::ExecBatch batch) override {
+    // Batches are sampled in parallel, each from a generator of its own. The
+    // seeds go to the batches in the order they arrive in, which is not stable.
+    const auto seed = [this]() {
+      std::lock_guard<std::mutex> lock{mutex_};
+      return rng_();
+    }();
+    SubmitTask(
+        [this, seed](cp::ExecBatch batch) { return sample(batch, seed); },
+        std::move(batch));
+  }
+
+private:
+  arrow::Result<cp::ExecBatch> sample(const cp::ExecBatch &batch,
+                                      uint64_t seed) const {
+    // The gaps between kept rows are geometric, so that the cost is in the
+    // number of kept rows rather than of rows
+    std::mt19937_64 rng{seed};
+    std::geometric_distribution<int64_t> gap{rate_};
+    arrow::Int64Builder builder{};
+    for (auto row = gap(rng); row < batch.length; row += gap(rng) + 1) {
+      ARROW_RETURN_NOT_OK(builder.Append(row));
+    }
+    ARROW_ASSIGN_OR_RAISE(auto indices, builder.Finish());
+
+    std::vector<arrow::Datum> values{};
+    values.reserve(batch.values.size());
+    for (const auto &value : batch.values) {
+      if (!value.is_array()) {
+        values.emplace_back(value);
+        continue;
+      }
+      ARROW_ASSIGN_OR_RAISE(
+          auto sampled,
+          cp::Take(value, indices, cp::TakeOptions::NoBoundsCheck(),
+                   plan()->exec_context()));
+      values.emplace_back(std::move(sampled));
+    }
+
+    auto result = cp::ExecBatch{std::move(values), indices->length()};
+    result.guarantee = batch.guarantee;
+    return result;
+  }
+
+  double rate_;
+  std::mutex mutex_{};
+  std::mt19937_64 rng_;
+};
+} // namespace
+
+void registerBernoulliSampleNode(cp::ExecFactoryRegistry *registry) {
+  static std::once_flag once{};
+  std::call_once(once, [registry]() {
+    auto status =
+        registry->AddFactory(kBernoulliSampleNode, BernoulliSampleNode::make);
+    if (!status.ok()) {
+      XLOG(ERR) << "fail to register " << kBernoulliSampleNode << ": "
+                << status.ToString();
+    }
+  });
+}
+} // namespace bapid
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "src/collector.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+// How a query samples the rows of a table. The rates are in (0, 1]; 1 keeps
+// everything.
+struct Sampling {
+  // Share of the row groups the scan reads, picked at random, so that the
+  // others are never read
+  double row_group_rate{1};
+  // Share of the scanned rows kept, each independently of the others
+  double row_rate{1};
+  // Seeds the random picks; a random one is used if unset. Only the picked
+  // row groups are reproducible: the kept rows also depend on the order the
+  // scan delivers batches in, which varies from one run to the next.
+  std::optional<uint64_t> seed{};
+  // Scans each sampled row group as a fragment of its own, so that the
+  // __fragment_index of a row identifies its row group
+  bool row_group_fragments{false};
+};
+
+std::mt19937_64 makeRng(std::optional<uint64_t> seed);
+
+// Uniform random sample of a fixed number of rows of a stream of batches of
+// unknown length, through reservoir sampling with geometric skips (Li's
+// algorithm L). Only the rows sampled so far are kept, copied out of their
+// batches.
+class ReservoirSample : public Collector {
+public:
+  ReservoirSample(std::shared_ptr<arrow::Schema> schema, int64_t size,
+                  uint64_t seed);
+
+  arrow::Status
+  add(const std::shared_ptr<arrow::RecordBatch> &batch) override;
+  // The sampled rows, in no particular order
+  arrow::Result<std::shared_ptr<arrow::Table>> finish() override;
+  int64_t numSeen() const { return num_seen_; }
+
+private:
+  struct Slot {
+    int chunk;
+    int64_t row;
+  };
+
+  void skip();
+  arrow::Result<std::shared_ptr<arrow::Table>> materialize() const;
+  arrow::Status compact();
+
+  std::shared_ptr<arrow::Schema> schema_;
+  int64_t size_;
+  std::mt19937_64 rng_;
+
+  int64_t num_seen_{0};
+  // Position in the stream of the next row to sample once the reservoir is
+  // full, and the running weight it is drawn from
+  int64_t next_{0};
+  double weight_{1};
+
+  std::vector<std::shared_ptr<arrow::RecordBatch>> chunks_{};
+  int64_t num_chunk_rows_{0};
+  std::vector<Slot> slots_{};
+};
+
+// Name of the exec node keeping each row of its input with a given
+// probability, independently of the other rows
+inline constexpr char kBernoulliSampleNode[] = "bapid_bernoulli_sample";
+
+class BernoulliSampleNodeOptions : public cp::ExecNodeOptions {
+public:
+  BernoulliSampleNodeOptions(double rate, uint64_t seed)
+      : rate{rate}, seed{seed} {}
+
+  double rate;
+  uint64_t seed;
+};
+
+// Adds kBernoulliSampleNode to `registry`; a no-op after the first call
+void registerBernoulliSampleNode(cp::ExecFactoryRegistry *registry);
+} // namespace bapid
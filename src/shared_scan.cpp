@@ -0,0 +1,393 @@
+#include "src/shared_scan.h"
+#include <algorithm>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/util/checked_cast.h>
+#include <folly/executors/GlobalExecutor.h>
+#include <folly/futures/Future.h>
+#include <map>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Past this many batches left to consume by a query, the pass pauses until
+// every query is back to half of it
+constexpr int64_t kMaxQueuedBatches = 16;
+} // namespace
+
+class SharedScan::Group : public std::enable_shared_from_this<Group> {
+public:
+  using Producer = arrow::PushGenerator<std::optional<cp::ExecBatch>>::Producer;
+
+  Group(std::shared_ptr<ds::FileSystemDataset> dataset,
+        std::chrono::steady_clock::time_point deadline)
+      : dataset_{std::move(dataset)}, deadline_{deadline} {}
+
+  // Waits for the pass to stop, which the batches being consumed refer to
+  ~Group() {
+    if (plan_) {
+      if (!stopped_ && !plan_->finished().is_finished()) {
+        plan_->StopProducing();
+      }
+      plan_->finished().Wait();
+    }
+  }
+
+  // nullopt once the pass started
+  std::optional<int> add(std::vector<ScanRowGroups> &row_groups,
+                         const std::vector<std::string> &fields,
+                         Producer producer) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (started_) {
+      return std::nullopt;
+    }
+
+    subscribers_.emplace_back(Subscriber{
+        .row_groups = std::move(row_groups),
+        .fields = fields,
+        .producer = std::move(producer),
+    });
+    return static_cast<int>(subscribers_.size()) - 1;
+  }
+
+  // Schedules the pass for the end of the window on a timer, so that no
+  // thread waits for it; a pass failing to start ends the streams with its
+  // error
+  void start() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (scheduled_) {
+        return;
+      }
+      scheduled_ = true;
+    }
+
+    const auto delay = std::max(deadline_ - std::chrono::steady_clock::now(),
+                                std::chrono::steady_clock::duration::zero());
+    folly::futures::sleep(
+        std::chrono::duration_cast<folly::HighResDuration>(delay))
+        .via(folly::getGlobalCPUExecutor())
+        .thenValue([group = shared_from_this()](folly::Unit) {
+          const auto status = group->startPass();
+          if (!status.ok()) {
+            group->finish(status);
+          }
+        });
+  }
+
+  void setBackpressure(cp::BackpressureControl *backpressure) {
+    backpressure_ = backpressure;
+  }
+
+  arrow::Status consume(cp::ExecBatch batch) {
+    const auto &index_value = batch.values.back();
+    ARROW_ASSIGN_OR_RAISE(auto index_scalar,
+                          index_value.is_scalar()
+                              ? arrow::Result<std::shared_ptr<arrow::Scalar>>(
+                                    index_value.scalar())
+                              : index_value.make_array()->GetScalar(0));
+    const auto index =
+        arrow::internal::checked_cast<const arrow::Int32Scalar &>(
+            *index_scalar)
+            .value;
+
+    std::vector<std::pair<Producer, cp::ExecBatch>> pushes{};
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      for (const auto id : routes_.at(index)) {
+        auto &subscriber = subscribers_[id];
+        if (!subscriber.active) {
+          continue;
+        }
+
+        std::vector<arrow::Datum> values{};
+        values.reserve(subscriber.field_indices.size());
+        for (const auto field_index : subscriber.field_indices) {
+          values.emplace_back(batch.values[field_index]);
+        }
+        auto routed = cp::ExecBatch{std::move(values), batch.length};
+        routed.guarantee = batch.guarantee;
+        pushes.emplace_back(subscriber.producer, std::move(routed));
+        subscriber.num_queued++;
+        // The scan only pauses reading ahead, so no batch comes back in here
+        if (subscriber.num_queued > kMaxQueuedBatches && !paused_) {
+          paused_ = true;
+          backpressure_->Pause();
+        }
+      }
+    }
+
+    // Outside of the lock, as a waiting consumer resumes right away
+    for (auto &[producer, routed] : pushes) {
+      producer.push(std::optional<cp::ExecBatch>{std::move(routed)});
+    }
+    return arrow::Status::OK();
+  }
+
+  void dequeued(int id) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    subscribers_[id].num_queued--;
+    const auto resume = shouldResume();
+    lock.unlock();
+    if (resume) {
+      backpressure_->Resume();
+    }
+  }
+
+  void leave(int id) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    auto &subscriber = subscribers_[id];
+    subscriber.active = false;
+    auto producer = subscriber.producer;
+    const auto resume = shouldResume();
+    const auto stop =
+        plan_ && !stopped_ &&
+        std::none_of(subscribers_.begin(), subscribers_.end(),
+                     [](const auto &other) { return other.active; });
+    stopped_ = stopped_ || stop;
+    auto plan = plan_;
+    lock.unlock();
+
+    producer.close();
+    if (resume) {
+      backpressure_->Resume();
+    }
+    if (stop) {
+      plan->StopProducing();
+    }
+  }
+
+private:
+  struct Subscriber {
+    std::vector<ScanRowGroups> row_groups;
+    std::vector<std::string> fields;
+    Producer producer;
+    // Indices of `fields` in the batches of the pass
+    std::vector<int> field_indices{};
+    int64_t num_queued{0};
+    bool active{true};
+  };
+
+  // Whether a paused pass can resume, under the lock
+  bool shouldResume() {
+    if (!paused_) {
+      return false;
+    }
+    for (const auto &subscriber : subscribers_) {
+      if (subscriber.active &&
+          subscriber.num_queued > kMaxQueuedBatches / 2) {
+        return false;
+      }
+    }
+    paused_ = false;
+    return true;
+  }
+
+  // Plans the pass over one fragment per row group, so that the fragment
+  // index of a batch tells which queries it goes to
+  arrow::Status startPass() {
+    std::vector<std::string> fields{};
+    std::map<std::string, int> field_indices{};
+    std::map<std::pair<std::string, int>, int> fragment_indices{};
+    std::vector<std::shared_ptr<ds::FileFragment>> fragments{};
+    auto &format =
+        static_cast<ds::ParquetFileFormat &>(*dataset_->format());
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      started_ = true;
+      for (size_t id = 0; id < subscribers_.size(); id++) {
+        auto &subscriber = subscribers_[id];
+        if (!subscriber.active) {
+          continue;
+        }
+
+        for (const auto &field : subscriber.fields) {
+          auto [it, inserted] = field_indices.emplace(
+              field, static_cast<int>(fields.size()));
+          if (inserted) {
+            fields.emplace_back(field);
+          }
+          subscriber.field_indices.emplace_back(it->second);
+        }
+
+        for (const auto &scanned : subscriber.row_groups) {
+          const auto &fragment = scanned.fragment;
+          for (const auto row_group : scanned.row_groups) {
+            auto [it, inserted] = fragment_indices.emplace(
+                std::make_pair(fragment->source().path(), row_group),
+                static_cast<int>(fragments.size()));
+            if (inserted) {
+              ARROW_ASSIGN_OR_RAISE(
+                  auto row_group_fragment,
+                  format.MakeFragment(fragment->source(),
+                                      fragment->partition_expression(),
+                                      /*physical_schema=*/nullptr,
+                                      {row_group}));
+              fragments.emplace_back(std::move(row_group_fragment));
+              routes_.emplace_back();
+            }
+            routes_[it->second].emplace_back(static_cast<int>(id));
+          }
+        }
+      }
+    }
+
+    ARROW_ASSIGN_OR_RAISE(
+        auto dataset,
+        ds::FileSystemDataset::Make(
+            dataset_->schema(), dataset_->partition_expression(),
+            dataset_->format(), dataset_->filesystem(), std::move(fragments),
+            dataset_->partitioning()));
+
+    std::vector<cp::Expression> scan_projects{};
+    for (const auto &field : fields) {
+      scan_projects.emplace_back(cp::field_ref(field));
+    }
+    auto projects = scan_projects;
+    projects.emplace_back(cp::field_ref("__fragment_index"));
+    auto options = std::make_shared<ds::ScanOptions>();
+    options->filter = cp::literal(true);
+    options->projection = cp::project(std::move(scan_projects), {});
+
+    ARROW_ASSIGN_OR_RAISE(auto plan,
+                          cp::ExecPlan::Make(cp::default_exec_context()));
+    ARROW_RETURN_NOT_OK(
+        cp::Declaration::Sequence(
+            {
+                {"scan", ds::ScanNodeOptions{std::move(dataset), options}},
+                {"project", cp::ProjectNodeOptions{std::move(projects)}},
+                {"consuming_sink",
+                 cp::ConsumingSinkNodeOptions{
+                     std::make_shared<PassConsumer>(this)}},
+            })
+            .AddToPlan(plan.get())
+            .status());
+    ARROW_RETURN_NOT_OK(plan->StartProducing());
+
+    // The queries left meanwhile do not stop the pass, which is stopped here
+    // if all of them did
+    bool stop = false;
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      plan_ = plan;
+      stop = std::none_of(subscribers_.begin(), subscribers_.end(),
+                          [](const auto &other) { return other.active; });
+      stopped_ = stop;
+    }
+    if (stop) {
+      plan->StopProducing();
+    }
+    plan->finished().AddCallback(
+        [weak = weak_from_this()](const arrow::Status &status) {
+          if (auto group = weak.lock()) {
+            group->finish(status);
+          }
+        });
+    return arrow::Status::OK();
+  }
+
+  // Ends the streams of the queries, with `status` if the pass failed
+  void finish(const arrow::Status &status) {
+    std::vector<Producer> producers{};
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      for (const auto &subscriber : subscribers_) {
+        if (subscriber.active) {
+          producers.emplace_back(subscriber.producer);
+        }
+      }
+    }
+
+    for (auto &producer : producers) {
+      if (!status.ok()) {
+        producer.push(status);
+      }
+      producer.close();
+    }
+  }
+
+  class PassConsumer : public cp::SinkNodeConsumer {
+  public:
+    explicit PassConsumer(Group *group) : group_{group} {}
+
+    arrow::Status Init(const std::shared_ptr<arrow::Schema> & /*schema*/,
+                       cp::BackpressureControl *backpressure) override {
+      group_->setBackpressure(backpressure);
+      return arrow::Status::OK();
+    }
+    arrow::Status Consume(cp::ExecBatch batch) override {
+      return group_->consume(std::move(batch));
+    }
+    arrow::Future<> Finish() override {
+      return arrow::Future<>::MakeFinished();
+    }
+
+  private:
+    // Outlives the plan of the pass
+    Group *group_;
+  };
+
+  std::shared_ptr<ds::FileSystemDataset> dataset_;
+  std::chrono::steady_clock::time_point deadline_;
+
+  std::mutex mutex_{};
+  std::vector<Subscriber> subscribers_{};
+  // Whether a query scheduled the pass, which the others then wait for
+  bool scheduled_{false};
+  bool started_{false};
+  // Subscribers of each fragment of the pass
+  std::vector<std::vector<int>> routes_{};
+  std::shared_ptr<cp::ExecPlan> plan_{};
+  bool stopped_{false};
+  cp::BackpressureControl *backpressure_{nullptr};
+  bool paused_{false};
+};
+
+SharedScan::Subscription::Subscription(
+    std::shared_ptr<Group> group, int id, std::shared_ptr<arrow::Schema> schema,
+    arrow::AsyncGenerator<std::optional<cp::ExecBatch>> gen)
+    : group_{std::move(group)}, id_{id}, schema_{std::move(schema)},
+      gen_{std::move(gen)} {}
+
+SharedScan::Subscription::~Subscription() { group_->leave(id_); }
+
+void SharedScan::Subscription::start() { group_->start(); }
+
+SharedScan::SharedScan(std::chrono::milliseconds window) : window_{window} {}
+
+arrow::Result<std::shared_ptr<SharedScan::Subscription>>
+SharedScan::subscribe(const std::shared_ptr<ds::FileSystemDataset> &dataset,
+                      std::vector<ScanRowGroups> row_groups,
+                      const std::vector<std::string> &fields) {
+  arrow::FieldVector schema_fields{};
+  for (const auto &name : fields) {
+    auto field = dataset->schema()->GetFieldByName(name);
+    if (!field) {
+      return arrow::Status::Invalid("no unique field ", name);
+    }
+    schema_fields.emplace_back(std::move(field));
+  }
+
+  arrow::PushGenerator<std::optional<cp::ExecBatch>> push_gen{};
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto id = open_group_
+                ? open_group_->add(row_groups, fields, push_gen.producer())
+                : std::nullopt;
+  if (!id) {
+    open_group_ = std::make_shared<Group>(
+        dataset, std::chrono::steady_clock::now() + window_);
+    id = open_group_->add(row_groups, fields, push_gen.producer());
+  }
+
+  auto gen = arrow::MakeMappedGenerator(
+      arrow::AsyncGenerator<std::optional<cp::ExecBatch>>{std::move(push_gen)},
+      [group = open_group_,
+       id = *id](const std::optional<cp::ExecBatch> &batch) {
+        group->dequeued(id);
+        return batch;
+      });
+  return std::make_shared<Subscription>(open_group_, *id,
+                                        arrow::schema(std::move(schema_fields)),
+                                        std::move(gen));
+}
+} // namespace bapid
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/dataset/api.h>
+#include <arrow/util/async_generator.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+namespace ds = arrow::dataset;
+
+// The row groups of a Parquet file a query scans
+struct ScanRowGroups {
+  std::shared_ptr<ds::ParquetFileFragment> fragment;
+  std::vector<int> row_groups;
+  // Tells the contents of the file apart from those it had or will have if
+  // rewritten in place, e.g. by its size and mtime; empty if unknown
+  std::string file_key{};
+};
+
+// Runs the scans of the queries on a table that start within a window of each
+// other as one pass over the union of their row groups and cols. Each batch
+// goes to the queries that scan its row group, with only their cols, and
+// through their own plans from there. The pass pauses while a query has too
+// many batches left to consume.
+class SharedScan {
+public:
+  class Group;
+
+  // The scan of a query, which takes part in the pass of its group
+  class Subscription {
+  public:
+    Subscription(std::shared_ptr<Group> group, int id,
+                 std::shared_ptr<arrow::Schema> schema,
+                 arrow::AsyncGenerator<std::optional<cp::ExecBatch>> gen);
+    // Leaves the pass, which stops once no query is left
+    ~Subscription();
+
+    Subscription(const Subscription &) = delete;
+    Subscription &operator=(const Subscription &) = delete;
+
+    // Starts the pass unless another query of the group did, once the window
+    // elapsed so that more queries can join. Returns right away: the batches
+    // of the pass, or its error, come through `generator()`.
+    void start();
+    // The batches of the scan for a source node, with the cols of `schema`
+    const std::shared_ptr<arrow::Schema> &schema() const { return schema_; }
+    arrow::AsyncGenerator<std::optional<cp::ExecBatch>> generator() const {
+      return gen_;
+    }
+
+  private:
+    std::shared_ptr<Group> group_;
+    int id_;
+    std::shared_ptr<arrow::Schema> schema_;
+    arrow::AsyncGenerator<std::optional<cp::ExecBatch>> gen_;
+  };
+
+  explicit SharedScan(std::chrono::milliseconds window);
+
+  // Joins the group of queries waiting for their pass, or opens one, to scan
+  // `fields` of `row_groups` of `dataset`. `dataset` only serves as a
+  // template of the dataset of the pass, which must be made of Parquet files.
+  arrow::Result<std::shared_ptr<Subscription>>
+  subscribe(const std::shared_ptr<ds::FileSystemDataset> &dataset,
+            std::vector<ScanRowGroups> row_groups,
+            const std::vector<std::string> &fields);
+
+private:
+  std::chrono::milliseconds window_;
+  std::mutex mutex_{};
+  std::shared_ptr<Group> open_group_{};
+};
+} // namespace bapid
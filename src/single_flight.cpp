@@ -0,0 +1,209 @@
+#include "src/single_flight.h"
+#include <algorithm>
+#include <arrow/util/byte_size.h>
+#include <folly/ScopeGuard.h>
+#include <iterator>
+#include <utility>
+
+namespace bapid {
+
+SharedResultSet::Reader::Reader(std::shared_ptr<SharedResultSet> result_set,
+                                int id)
+    : result_set_{std::move(result_set)}, id_{id} {}
+
+SharedResultSet::Reader::Reader(Reader &&other) noexcept
+    : result_set_{std::move(other.result_set_)}, id_{other.id_} {}
+
+SharedResultSet::Reader::~Reader() {
+  if (result_set_) {
+    result_set_->leave(id_);
+  }
+}
+
+BatchOrError SharedResultSet::Reader::next() { return result_set_->next(id_); }
+
+const std::shared_ptr<arrow::Schema> &
+SharedResultSet::Reader::schema() const {
+  return result_set_->schema_;
+}
+
+SharedResultSet::SharedResultSet(BatchStream stream, int64_t max_bytes)
+    : schema_{std::move(stream.schema)}, max_bytes_{max_bytes},
+      pull_{std::move(stream.next)} {}
+
+std::optional<SharedResultSet::Reader> SharedResultSet::join() {
+  auto state = state_.lock();
+  if (!state->joinable) {
+    return std::nullopt;
+  }
+
+  const auto id = state->next_id++;
+  state->cursors.emplace(id, 0);
+  return Reader{shared_from_this(), id};
+}
+
+int SharedResultSet::numReaders() const {
+  return static_cast<int>(state_.lock()->cursors.size());
+}
+
+BatchOrError SharedResultSet::next(int id) {
+  // The batch at the cursor if already pulled, or the outcome of the query
+  auto read = [this, id](State &state) -> std::optional<BatchOrError> {
+    auto &cursor = state.cursors.at(id);
+    const auto index = cursor - state.first;
+    if (index < static_cast<int64_t>(state.batches.size())) {
+      auto batch = state.batches[index];
+      cursor++;
+      trim(state);
+      return batch;
+    }
+    if (state.error) {
+      return folly::makeUnexpected(*state.error);
+    }
+    if (state.done) {
+      return std::shared_ptr<arrow::RecordBatch>{};
+    }
+    return std::nullopt;
+  };
+
+  if (auto batch = read(*state_.lock())) {
+    return std::move(*batch);
+  }
+
+  std::lock_guard<std::mutex> lock{pull_mutex_};
+  // Another reader may have pulled meanwhile
+  if (auto batch = read(*state_.lock())) {
+    return std::move(*batch);
+  }
+  // Ahead of readers that have yet to read the whole budget, which they drop
+  // as they read it
+  {
+    auto state = state_.lock();
+    trimmed_.wait(state.as_lock(),
+                  [&]() { return state->num_bytes <= max_bytes_; });
+  }
+
+  auto batch = pull_();
+  auto state = state_.lock();
+  if (batch.hasError()) {
+    state->error = batch.error();
+  } else if (!batch.value()) {
+    state->done = true;
+  } else {
+    state->batches.emplace_back(batch.value());
+    state->num_bytes += arrow::util::TotalBufferSize(*batch.value());
+    if (state->num_bytes > max_bytes_) {
+      state->joinable = false;
+    }
+  }
+  return *read(*state);
+}
+
+void SharedResultSet::trim(State &state) {
+  if (state.joinable) {
+    return;
+  }
+
+  auto min_cursor = state.first + static_cast<int64_t>(state.batches.size());
+  for (const auto &[_, cursor] : state.cursors) {
+    min_cursor = std::min(min_cursor, cursor);
+  }
+  if (state.first == min_cursor) {
+    return;
+  }
+  while (state.first < min_cursor) {
+    state.num_bytes -=
+        arrow::util::TotalBufferSize(*state.batches.front());
+    state.batches.pop_front();
+    state.first++;
+  }
+  trimmed_.notify_all();
+}
+
+void SharedResultSet::leave(int id) {
+  auto state = state_.lock();
+  state->cursors.erase(id);
+  trim(*state);
+}
+
+SingleFlight::SingleFlight(int64_t max_bytes) : max_bytes_{max_bytes} {}
+
+folly::SemiFuture<SingleFlight::ReaderOrError>
+SingleFlight::join(std::string key, StartFn start) {
+  std::shared_ptr<Flight> flight{};
+  auto starts = false;
+  {
+    auto flights = flights_.lock();
+    auto &entry = (*flights)[key];
+    if (entry && entry->started) {
+      if (auto running = entry->result_set.lock()) {
+        if (auto reader = running->join()) {
+          return folly::makeSemiFuture(ReaderOrError{std::move(*reader)});
+        }
+      }
+      entry = nullptr;
+    }
+
+    if (!entry) {
+      entry = std::make_shared<Flight>();
+      starts = true;
+      for (auto it = flights->begin(); it != flights->end();) {
+        it = it->second && it->second->started &&
+                     it->second->result_set.expired()
+                 ? flights->erase(it)
+                 : std::next(it);
+      }
+    }
+    flight = entry;
+  }
+
+  if (!starts) {
+    // Then joins it, unless no longer joinable
+    return flight->ready.getSemiFuture().deferValue(
+        [this, key = std::move(key), start = std::move(start)](
+            folly::Expected<folly::Unit, std::string> ready) mutable
+        -> folly::SemiFuture<ReaderOrError> {
+          if (ready.hasError()) {
+            return folly::makeSemiFuture(ReaderOrError{
+                folly::makeUnexpected(std::move(ready.error()))});
+          }
+          return join(std::move(key), std::move(start));
+        });
+  }
+
+  auto abandoned = folly::makeGuard([&]() {
+    abandon(key, flight, "query of " + key + " failed to start");
+  });
+  auto stream = start();
+  abandoned.dismiss();
+  if (stream.hasError()) {
+    abandon(key, flight, stream.error());
+    return folly::makeSemiFuture(
+        ReaderOrError{folly::makeUnexpected(std::move(stream.error()))});
+  }
+
+  auto result_set = std::make_shared<SharedResultSet>(
+      std::move(stream.value()), max_bytes_);
+  auto reader = result_set->join();
+  {
+    auto flights = flights_.lock();
+    flight->started = true;
+    flight->result_set = result_set;
+  }
+  flight->ready.setValue(folly::unit);
+  return folly::makeSemiFuture(ReaderOrError{std::move(*reader)});
+}
+
+void SingleFlight::abandon(const std::string &key,
+                           const std::shared_ptr<Flight> &flight,
+                           std::string error) {
+  {
+    auto flights = flights_.lock();
+    auto it = flights->find(key);
+    if (it != flights->end() && it->second == flight) {
+      flights->erase(it);
+    }
+  }
+  flight->ready.setValue(folly::makeUnexpected(std::move(error)));
+}
+} // namespace bapid
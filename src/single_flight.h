@@ -0,0 +1,131 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <folly/Expected.h>
+#include <folly/Function.h>
+#include <folly/Synchronized.h>
+#include <folly/Unit.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/SharedPromise.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace bapid {
+
+using BatchOrError =
+    folly::Expected<std::shared_ptr<arrow::RecordBatch>, std::string>;
+
+// A result set produced a batch at a time; `next` returns nullptr once it is
+// exhausted
+struct BatchStream {
+  std::shared_ptr<arrow::Schema> schema;
+  folly::Function<BatchOrError()> next;
+};
+
+// The result set of a running query, read by every query identical to it.
+// Batches are pulled from the query by the first reader to need them, and
+// kept for the others. New readers can join as long as no batch was dropped,
+// which happens once the kept batches exceed a budget: only the batches some
+// reader has yet to read are then kept, and the reader ahead waits for the
+// others to read them before pulling past the budget.
+class SharedResultSet
+    : public std::enable_shared_from_this<SharedResultSet> {
+public:
+  class Reader {
+  public:
+    // The next batch of the result set, or nullptr once it is exhausted
+    BatchOrError next();
+    const std::shared_ptr<arrow::Schema> &schema() const;
+
+    Reader(std::shared_ptr<SharedResultSet> result_set, int id);
+    ~Reader();
+
+    Reader(Reader &&other) noexcept;
+    Reader &operator=(Reader &&) = delete;
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+  private:
+    std::shared_ptr<SharedResultSet> result_set_;
+    int id_;
+  };
+
+  SharedResultSet(BatchStream stream, int64_t max_bytes);
+
+  // nullopt if batches were already dropped
+  std::optional<Reader> join();
+  int numReaders() const;
+
+private:
+  struct State {
+    // Batches from the `first`-th of the result set
+    std::deque<std::shared_ptr<arrow::RecordBatch>> batches{};
+    int64_t first{0};
+    int64_t num_bytes{0};
+    bool joinable{true};
+    bool done{false};
+    std::optional<std::string> error{};
+    // Index of the next batch of each reader
+    std::unordered_map<int, int64_t> cursors{};
+    int next_id{0};
+  };
+
+  BatchOrError next(int id);
+  // Drops the batches every reader has read, once no reader can join
+  void trim(State &state);
+  void leave(int id);
+
+  std::shared_ptr<arrow::Schema> schema_;
+  int64_t max_bytes_;
+  // Held while pulling from the query, which only one reader does at a time
+  std::mutex pull_mutex_{};
+  folly::Function<BatchOrError()> pull_;
+  folly::Synchronized<State, std::mutex> state_{};
+  // Notified as the kept batches are dropped
+  std::condition_variable trimmed_{};
+};
+
+// Coalesces identical queries running at the same time into one
+class SingleFlight {
+public:
+  // `max_bytes` bounds the batches a query keeps for readers joining late
+  explicit SingleFlight(int64_t max_bytes);
+
+  using StartFn = folly::Function<folly::Expected<BatchStream, std::string>()>;
+  using ReaderOrError = folly::Expected<SharedResultSet::Reader, std::string>;
+
+  // Reads the result set of the running query of `key` if it can still be
+  // joined, otherwise of the query `start` runs. `start` runs without holding
+  // up queries of other keys, while the identical ones arriving meanwhile wait
+  // for it to join its query, without blocking a thread. `start` may thus run
+  // once this returns, until the future completes.
+  folly::SemiFuture<ReaderOrError> join(std::string key, StartFn start);
+
+private:
+  // A query of a key, in the map from as soon as it starts starting
+  struct Flight {
+    // Fulfilled once the query started, or failed to
+    folly::SharedPromise<folly::Expected<folly::Unit, std::string>> ready{};
+    // Set along with `started`, under the lock of the map; the result set
+    // stops running once its last reader is gone
+    bool started{false};
+    std::weak_ptr<SharedResultSet> result_set{};
+  };
+
+  // Drops `flight` of `key`, which failed to start, and tells the queries
+  // waiting on it
+  void abandon(const std::string &key, const std::shared_ptr<Flight> &flight,
+               std::string error);
+
+  int64_t max_bytes_;
+  folly::Synchronized<
+      std::unordered_map<std::string, std::shared_ptr<Flight>>, std::mutex>
+      flights_{};
+};
+} // namespace bapid
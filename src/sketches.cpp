@@ -0,0 +1,276 @@
+#include "src/sketches.h"
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/kernel.h>
+#include <arrow/compute/registry.h>
+#include <arrow/util/bit_util.h>
+#include <cmath>
+#include <cstring>
+#include <folly/hash/Hash.h>
+#include <folly/hash/SpookyHashV2.h>
+#include <folly/logging/xlog.h>
+#include <memory>
+#include <mutex>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+namespace {
+constexpr size_t kNumRegisters = size_t{1} << HyperLogLog::kPrecision;
+} // namespace
+
+void HyperLogLog::add(uint64_t hash) {
+  if (registers_.empty()) {
+    registers_.resize(kNumRegisters, 0);
+  }
+
+  // The first bits pick the register, which keeps the longest run of leading
+  // zeros seen in the other bits
+  const auto index = hash >> (64 - kPrecision);
+  const auto rest = (hash << kPrecision) | (uint64_t{1} << (kPrecision - 1));
+  const auto rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+  registers_[index] = std::max(registers_[index], rank);
+}
+
+void HyperLogLog::merge(const HyperLogLog &other) {
+  if (other.registers_.empty()) {
+    return;
+  }
+  if (registers_.empty()) {
+    registers_ = other.registers_;
+    return;
+  }
+
+  for (size_t i = 0; i < kNumRegisters; i++) {
+    registers_[i] = std::max(registers_[i], other.registers_[i]);
+  }
+}
+
+double HyperLogLog::estimate() const {
+  if (registers_.empty()) {
+    return 0;
+  }
+
+  const auto m = static_cast<double>(kNumRegisters);
+  double sum = 0;
+  int num_zeros = 0;
+  for (const auto reg : registers_) {
+    sum += std::ldexp(1.0, -reg);
+    num_zeros += reg == 0 ? 1 : 0;
+  }
+
+  const auto alpha = 0.7213 / (1 + 1.079 / m);
+  const auto estimate = alpha * m * m / sum;
+  // Linear counting is more accurate while many registers are unset
+  if (estimate <= 2.5 * m && num_zeros > 0) {
+    return m * std::log(m / num_zeros);
+  }
+  return estimate;
+}
+
+void hashValues(const arrow::ArrayData &values, std::vector<uint64_t> &hashes,
+                std::vector<bool> &valid) {
+  const auto length = values.length;
+  hashes.resize(length);
+  valid.resize(length);
+  const auto *validity =
+      values.buffers[0] ? values.buffers[0]->data() : nullptr;
+  for (int64_t i = 0; i < length; i++) {
+    valid[i] = !validity ||
+               arrow::bit_util::GetBit(validity, values.offset + i);
+  }
+
+  switch (values.type->id()) {
+  case arrow::Type::INT64:
+  case arrow::Type::DOUBLE: {
+    const auto *raw = values.GetValues<uint64_t>(1);
+    for (int64_t i = 0; i < length; i++) {
+      hashes[i] = folly::hash::twang_mix64(raw[i]);
+    }
+    break;
+  }
+  case arrow::Type::STRING: {
+    const auto *offsets = values.GetValues<int32_t>(1);
+    const auto *data = values.buffers[2]->data();
+    for (int64_t i = 0; i < length; i++) {
+      hashes[i] = folly::hash::SpookyHashV2::Hash64(
+          data + offsets[i], offsets[i + 1] - offsets[i], 0);
+    }
+    break;
+  }
+  default:
+    std::fill(valid.begin(), valid.end(), false);
+    break;
+  }
+}
+
+namespace {
+struct HllState : public cp::KernelState {
+  HyperLogLog sketch{};
+};
+
+struct GroupedHllState : public cp::KernelState {
+  std::vector<HyperLogLog> sketches{};
+};
+
+arrow::Result<std::unique_ptr<cp::KernelState>>
+initHll(cp::KernelContext * /*ctx*/, const cp::KernelInitArgs & /*args*/) {
+  return std::make_unique<HllState>();
+}
+
+arrow::Result<std::unique_ptr<cp::KernelState>>
+initGroupedHll(cp::KernelContext * /*ctx*/,
+               const cp::KernelInitArgs & /*args*/) {
+  return std::make_unique<GroupedHllState>();
+}
+
+// The values of the first arg of `batch` as an array, even if a scalar
+arrow::Result<std::shared_ptr<arrow::ArrayData>>
+getValues(const cp::ExecSpan &batch) {
+  if (batch[0].is_array()) {
+    return batch[0].array.ToArrayData();
+  }
+  ARROW_ASSIGN_OR_RAISE(auto array,
+                        arrow::MakeArrayFromScalar(*batch[0].scalar,
+                                                   batch.length));
+  return array->data();
+}
+
+arrow::Status consumeHll(cp::KernelContext *ctx, const cp::ExecSpan &batch) {
+  auto &state = static_cast<HllState &>(*ctx->state());
+  ARROW_ASSIGN_OR_RAISE(auto values, getValues(batch));
+  std::vector<uint64_t> hashes{};
+  std::vector<bool> valid{};
+  hashValues(*values, hashes, valid);
+  for (size_t i = 0; i < hashes.size(); i++) {
+    if (valid[i]) {
+      state.sketch.add(hashes[i]);
+    }
+  }
+  return arrow::Status::OK();
+}
+
+arrow::Status mergeHll(cp::KernelContext * /*ctx*/, cp::KernelState &&src,
+                       cp::KernelState *dst) {
+  static_cast<HllState *>(dst)->sketch.merge(
+      static_cast<HllState &>(src).sketch);
+  return arrow::Status::OK();
+}
+
+arrow::Status finalizeHll(cp::KernelContext *ctx, arrow::Datum *out) {
+  const auto &state = static_cast<HllState &>(*ctx->state());
+  *out = arrow::Datum{std::make_shared<arrow::Int64Scalar>(
+      std::llround(state.sketch.estimate()))};
+  return arrow::Status::OK();
+}
+
+arrow::Status resizeGroupedHll(cp::KernelContext *ctx, int64_t num_groups) {
+  auto &state = static_cast<GroupedHllState &>(*ctx->state());
+  state.sketches.resize(num_groups);
+  return arrow::Status::OK();
+}
+
+arrow::Status consumeGroupedHll(cp::KernelContext *ctx,
+                                const cp::ExecSpan &batch) {
+  auto &state = static_cast<GroupedHllState &>(*ctx->state());
+  ARROW_ASSIGN_OR_RAISE(auto values, getValues(batch));
+  std::vector<uint64_t> hashes{};
+  std::vector<bool> valid{};
+  hashValues(*values, hashes, valid);
+
+  // The group ids are the last arg of a hash aggregation
+  const auto *group_ids = batch[1].array.GetValues<uint32_t>(1);
+  for (size_t i = 0; i < hashes.size(); i++) {
+    if (valid[i]) {
+      state.sketches[group_ids[i]].add(hashes[i]);
+    }
+  }
+  return arrow::Status::OK();
+}
+
+arrow::Status mergeGroupedHll(cp::KernelContext *ctx,
+                              cp::KernelState &&other,
+                              const arrow::ArrayData &group_id_mapping) {
+  auto &state = static_cast<GroupedHllState &>(*ctx->state());
+  auto &other_state = static_cast<GroupedHllState &>(other);
+  const auto *mapping = group_id_mapping.GetValues<uint32_t>(1);
+  for (size_t i = 0; i < other_state.sketches.size(); i++) {
+    state.sketches[mapping[i]].merge(other_state.sketches[i]);
+  }
+  return arrow::Status::OK();
+}
+
+arrow::Status finalizeGroupedHll(cp::KernelContext *ctx, arrow::Datum *out) {
+  const auto &state = static_cast<GroupedHllState &>(*ctx->state());
+  auto builder = arrow::Int64Builder{};
+  ARROW_RETURN_NOT_OK(builder.Reserve(state.sketches.size()));
+  for (const auto &sketch : state.sketches) {
+    builder.UnsafeAppend(std::llround(sketch.estimate()));
+  }
+  ARROW_ASSIGN_OR_RAISE(auto estimates, builder.Finish());
+  *out = arrow::Datum{std::move(estimates)};
+  return arrow::Status::OK();
+}
+
+const std::vector<std::shared_ptr<arrow::DataType>> &getSketchedTypes() {
+  static const std::vector<std::shared_ptr<arrow::DataType>> types{
+      arrow::int64(), arrow::float64(), arrow::utf8()};
+  return types;
+}
+
+arrow::Status registerSketchFunctionsImpl() {
+  auto *registry = cp::GetFunctionRegistry();
+
+  auto approx_count_distinct = std::make_shared<cp::ScalarAggregateFunction>(
+      kApproxCountDistinct, cp::Arity::Unary(),
+      cp::FunctionDoc{"Approximate distinct count through HyperLogLog",
+                      "Nulls are not counted.",
+                      {"array"}});
+  for (const auto &type : getSketchedTypes()) {
+    cp::ScalarAggregateKernel kernel{};
+    kernel.signature =
+        cp::KernelSignature::Make({cp::InputType(type)}, arrow::int64());
+    kernel.init = initHll;
+    kernel.consume = consumeHll;
+    kernel.merge = mergeHll;
+    kernel.finalize = finalizeHll;
+    ARROW_RETURN_NOT_OK(approx_count_distinct->AddKernel(std::move(kernel)));
+  }
+  ARROW_RETURN_NOT_OK(registry->AddFunction(std::move(approx_count_distinct)));
+
+  auto hash_approx_count_distinct =
+      std::make_shared<cp::HashAggregateFunction>(
+          kHashApproxCountDistinct, cp::Arity::Binary(),
+          cp::FunctionDoc{
+              "Approximate distinct count per group through HyperLogLog",
+              "Nulls are not counted.",
+              {"array", "group_id_array"}});
+  for (const auto &type : getSketchedTypes()) {
+    cp::HashAggregateKernel kernel{};
+    kernel.signature = cp::KernelSignature::Make(
+        {cp::InputType(type), cp::InputType(arrow::uint32())},
+        arrow::int64());
+    kernel.init = initGroupedHll;
+    kernel.resize = resizeGroupedHll;
+    kernel.consume = consumeGroupedHll;
+    kernel.merge = mergeGroupedHll;
+    kernel.finalize = finalizeGroupedHll;
+    ARROW_RETURN_NOT_OK(
+        hash_approx_count_distinct->AddKernel(std::move(kernel)));
+  }
+  return registry->AddFunction(std::move(hash_approx_count_distinct));
+}
+} // namespace
+
+void registerSketchFunctions() {
+  static std::once_flag once{};
+  std::call_once(once, []() {
+    auto status = registerSketchFunctionsImpl();
+    if (!status.ok()) {
+      XLOG(ERR) << "fail to register sketch functions: " << status.ToString();
+    }
+  });
+}
+} // namespace bapid
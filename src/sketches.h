@@ -0,0 +1,40 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <cstdint>
+#include <vector>
+
+namespace bapid {
+
+// HyperLogLog sketch of the distinct values of a col. Takes 2^kPrecision bytes
+// whatever the number of values, allocated on the first value, for a standard
+// error of about 1.6%. Sketches of disjoint parts of a col merge into the
+// sketch of the whole col.
+class HyperLogLog {
+public:
+  static constexpr int kPrecision = 12;
+
+  void add(uint64_t hash);
+  void merge(const HyperLogLog &other);
+  double estimate() const;
+
+private:
+  std::vector<uint8_t> registers_{};
+};
+
+// Hashes of the non-null values of an int64, double or utf8 array, in `hashes`
+// aligned with the array; `valid` tells which are set
+void hashValues(const arrow::ArrayData &values, std::vector<uint64_t> &hashes,
+                std::vector<bool> &valid);
+
+// Approximate distinct count of a col through HyperLogLog. The hash_ variant
+// aggregates per group. Both keep one sketch per group and scan thread, merged
+// once the scan is done.
+inline constexpr char kApproxCountDistinct[] = "bapid_approx_count_distinct";
+inline constexpr char kHashApproxCountDistinct[] =
+    "hash_bapid_approx_count_distinct";
+
+// Adds the functions above to the default function registry; a no-op after
+// the first call
+void registerSketchFunctions();
+} // namespace bapid
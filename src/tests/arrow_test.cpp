@@ -1,9 +1,14 @@
 #include "src/arrow.h"
+#include <arrow/compute/api.h>
+#include <arrow/io/memory.h>
+#include <arrow/ipc/reader.h>
 #include <filesystem>
 #include <gtest/gtest.h>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace bapid {
 
@@ -24,6 +29,9 @@ void EXPECT_ALL_GT(const std::shared_ptr<arrow::Table> &result_set,
   }
 }
 
+std::string getDatasetDir() {
+  return std::filesystem::current_path().string() + "/src/tests/fixtures";
+}
 } // namespace
 
 TEST(ArrowTest, BasicFilter) {
@@ -53,4 +61,325 @@ TEST(ArrowTest, BasicFilter) {
   EXPECT_ALL_GT(result_set, "tolls_amount", min_val);
   EXPECT_ALL_GT(result_set, "total_amount", 2 * min_val);
 }
+
+TEST(ArrowTest, StreamIpcChunks) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto request = bapidrpc::SamplesQuery{};
+  *request.add_int_filters() = DBL_GT("tip_amount", 30);
+  request.add_dbl_col_names("tip_amount");
+  request.add_dbl_col_names("total_amount");
+  request.set_limit(10);
+
+  auto query = table.value()->newSamplesQuery(request);
+  EXPECT_TRUE(query.hasValue());
+  auto runnable = std::move(query.value()).finalize().value();
+  auto encoder = IpcStreamEncoder::make(runnable.schema()).value();
+
+  std::string stream{};
+  while (auto batch = runnable.next().value()) {
+    stream += encoder.encode(*batch).value()->ToString();
+  }
+  stream += encoder.finish().value()->ToString();
+
+  auto reader = arrow::ipc::RecordBatchStreamReader::Open(
+                    std::make_shared<arrow::io::BufferReader>(
+                        arrow::Buffer::FromString(std::move(stream))))
+                    .ValueOrDie();
+  auto result_set = reader->ToTable().ValueOrDie();
+  EXPECT_EQ(result_set->num_columns(), 2);
+  EXPECT_EQ(result_set->num_rows(), 10);
+  EXPECT_ALL_GT(result_set, "tip_amount", 30);
+}
+
+TEST(ArrowTest, PruneRowGroups) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto query = table.value()
+                   ->newSamplesQueryX()
+                   .filter(DBL_GT("tip_amount", 1e12))
+                   .project(DBL_COL("tip_amount"));
+  auto runnable = std::move(query).finalize().value();
+  const auto &stats = runnable.scanStats();
+  EXPECT_GT(stats.num_row_groups, 0);
+  EXPECT_EQ(stats.num_row_groups_skipped, stats.num_row_groups);
+  EXPECT_EQ(stats.num_fragments_skipped, stats.num_fragments);
+
+  auto result_set = std::move(runnable).gen().value();
+  EXPECT_EQ(result_set->num_rows(), 0);
+}
+
+TEST(ArrowTest, PruneByTimeRange) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi",
+                                         "tpep_pickup_datetime");
+  EXPECT_TRUE(table.hasValue());
+
+  // Long after the trips of the dataset
+  auto query = table.value()
+                   ->newSamplesQueryX()
+                   .timeRange(4102444800 /* 2100-01-01 */, std::nullopt)
+                   .project(DBL_COL("tip_amount"));
+  auto runnable = std::move(query).finalize().value();
+  const auto &stats = runnable.scanStats();
+  EXPECT_GT(stats.num_fragments, 0);
+  EXPECT_EQ(stats.num_fragments_skipped_by_time, stats.num_fragments);
+
+  auto result_set = std::move(runnable).gen().value();
+  EXPECT_EQ(result_set->num_rows(), 0);
+}
+
+TEST(ArrowTest, InFilter) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto countRows = [&](std::vector<int64_t> vals) {
+    auto filter = bapidrpc::Filter{};
+    filter.set_col_name("passenger_count");
+    filter.set_op(bapidrpc::FilterOp::EQ);
+    for (const auto val : vals) {
+      filter.add_int_vals(val);
+    }
+    auto query = table.value()
+                     ->newSamplesQueryX()
+                     .filter(filter)
+                     .project(DBL_COL("passenger_count"));
+    return std::move(query).finalize().value().gen().value()->num_rows();
+  };
+
+  const auto num_in = countRows({1, 2});
+  EXPECT_GT(num_in, 0);
+  EXPECT_EQ(num_in, countRows({1}) + countRows({2}));
+}
+
+TEST(ArrowTest, LateMaterialization) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto runQuery = [&]() {
+    auto query = table.value()
+                     ->newSamplesQueryX()
+                     .filter(DBL_GT("tip_amount", 200))
+                     .project(DBL_COL("total_amount"));
+    return std::move(query).finalize().value().gen().value();
+  };
+
+  FLAGS_late_materialization = false;
+  auto expected = runQuery();
+  FLAGS_late_materialization = true;
+  auto result_set = runQuery();
+  EXPECT_EQ(result_set->num_rows(), expected->num_rows());
+
+  // A plain limit stops the scan early rather than scanning all the row groups
+  // for matches first
+  auto limit_query = table.value()
+                         ->newSamplesQueryX()
+                         .filter(DBL_GT("tip_amount", 200))
+                         .project(DBL_COL("total_amount"))
+                         .take(1);
+  auto runnable = std::move(limit_query).finalize().value();
+  EXPECT_EQ(runnable.scanStats().num_row_groups_skipped_by_filter, 0);
+  EXPECT_LE(std::move(runnable).gen().value()->num_rows(), 1);
+}
+
+TEST(ArrowTest, TableQuery) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto count_query = TableQuery{table.value()->newSamplesQueryX()};
+  count_query.aggregate(bapidrpc::AggOp::COUNT, {});
+  auto total = std::move(count_query).finalize().value().gen().value();
+  EXPECT_EQ(total->num_rows(), 1);
+  const auto num_rows = std::static_pointer_cast<arrow::Int64Scalar>(
+                            total->column(0)->GetScalar(0).ValueOrDie())
+                            ->value;
+  EXPECT_GT(num_rows, 0);
+
+  auto group_by_query = TableQuery{table.value()->newSamplesQueryX()};
+  group_by_query.groupBy(INT_COL("passenger_count"))
+      .aggregate(bapidrpc::AggOp::COUNT, {})
+      .aggregate(bapidrpc::AggOp::MAX, DBL_COL("tip_amount"));
+  auto result_set = std::move(group_by_query).finalize().value().gen().value();
+  EXPECT_EQ(result_set->num_columns(), 3);
+  EXPECT_EQ(result_set->schema()->field(0)->name(), "passenger_count");
+  auto sum = cp::Sum(result_set->GetColumnByName("count")).ValueOrDie();
+  EXPECT_EQ(sum.scalar_as<arrow::Int64Scalar>().value, num_rows);
+}
+
+TEST(ArrowTest, CountFromStats) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto getCount = [](const std::shared_ptr<arrow::Table> &result_set) {
+    EXPECT_EQ(result_set->num_rows(), 1);
+    return std::static_pointer_cast<arrow::Int64Scalar>(
+               result_set->GetColumnByName("count")->GetScalar(0).ValueOrDie())
+        ->value;
+  };
+
+  // Every row group is counted from its stats without a filter
+  auto total = table.value()->newSamplesQueryX().count().value();
+  EXPECT_GT(total.scanStats().num_row_groups, 0);
+  EXPECT_EQ(total.scanStats().num_row_groups_counted_by_stats,
+            total.scanStats().num_row_groups);
+  const auto num_rows = total.scanStats().num_rows_counted_by_stats;
+  EXPECT_EQ(getCount(std::move(total).gen().value()), num_rows);
+
+  // Row groups with tips both above and below are scanned
+  for (const auto min_val : {-1.0, 30.0}) {
+    auto count_query = table.value()->newSamplesQueryX();
+    count_query.filter(DBL_GT("tip_amount", min_val));
+    auto count = std::move(count_query).count().value();
+    auto query = table.value()
+                     ->newSamplesQueryX()
+                     .filter(DBL_GT("tip_amount", min_val))
+                     .project(DBL_COL("tip_amount"));
+    EXPECT_EQ(getCount(std::move(count).gen().value()),
+              std::move(query).finalize().value().gen().value()->num_rows());
+  }
+}
+
+TEST(ArrowTest, SampledQuery) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  const auto min_val = 10;
+  auto query = table.value()
+                   ->newSamplesQueryX()
+                   .filter(DBL_GT("tip_amount", min_val))
+                   .project(DBL_COL("tip_amount"))
+                   .take(100)
+                   .sample(Sampling{.row_rate = 0.5, .seed = 42});
+  auto result_set = std::move(query).finalize().value().gen().value();
+  EXPECT_GT(result_set->num_rows(), 0);
+  EXPECT_LE(result_set->num_rows(), 100);
+  EXPECT_ALL_GT(result_set, "tip_amount", min_val);
+}
+TEST(ArrowTest, ApproximateTableQuery) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto runCount = [&](double sample_rate) {
+    auto query = TableQuery{table.value()->newSamplesQueryX()};
+    query.aggregate(bapidrpc::AggOp::COUNT, {})
+        .aggregate(bapidrpc::AggOp::AVG, DBL_COL("tip_amount"))
+        .approximate(Approximation{.sample_rate = sample_rate, .seed = 42});
+    return std::move(query).finalize().value().gen().value();
+  };
+
+  // Scanning every row group is exact
+  auto exact = runCount(1);
+  EXPECT_EQ(exact->num_columns(), 2);
+
+  auto approximate = runCount(0.5);
+  EXPECT_EQ(approximate->num_rows(), 1);
+  EXPECT_EQ(approximate->num_columns(), 4);
+  EXPECT_EQ(approximate->schema()->field(0)->name(), "count");
+  EXPECT_EQ(approximate->schema()->field(1)->name(), "count_ci");
+  EXPECT_EQ(approximate->schema()->field(3)->name(), "avg_tip_amount_ci");
+}
+
+TEST(ArrowTest, OrderBy) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto all_query =
+      table.value()->newSamplesQueryX().project(DBL_COL("tip_amount"));
+  auto all = std::move(all_query).finalize().value().gen().value();
+  auto sorted =
+      cp::SortIndices(all->GetColumnByName("tip_amount"),
+                      cp::SortOrder::Descending)
+          .ValueOrDie();
+  auto expected =
+      cp::Take(all->GetColumnByName("tip_amount"), sorted).ValueOrDie();
+
+  auto query = table.value()
+                   ->newSamplesQueryX()
+                   .orderBy(DBL_COL("tip_amount"), /*descending=*/true)
+                   .take(10);
+  auto result_set = std::move(query).finalize().value().gen().value();
+  ASSERT_EQ(result_set->num_rows(), 10);
+  auto tips = result_set->GetColumnByName("tip_amount");
+  for (int64_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(tips->GetScalar(i).ValueOrDie()->Equals(
+        *expected.chunked_array()->GetScalar(i).ValueOrDie()));
+  }
+}
+
+TEST(ArrowTest, SharedScan) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto makeQuery = [&](double min_tip) {
+    auto query = table.value()
+                     ->newSamplesQueryX()
+                     .filter(DBL_GT("tip_amount", min_tip))
+                     .project(DBL_COL("total_amount"));
+    return query;
+  };
+  auto expected_high = std::move(makeQuery(10)).finalize().value().gen();
+  auto expected_low = std::move(makeQuery(1)).finalize().value().gen();
+
+  // Both queries start within the window, so they share one pass
+  auto shared_scan =
+      std::make_shared<SharedScan>(std::chrono::milliseconds{50});
+  auto high = makeQuery(10).shareScan(shared_scan);
+  auto low = makeQuery(1).shareScan(shared_scan);
+  auto runnable_high = std::move(high).finalize();
+  auto runnable_low = std::move(low).finalize();
+  ASSERT_TRUE(runnable_high.hasValue());
+  ASSERT_TRUE(runnable_low.hasValue());
+
+  std::shared_ptr<arrow::Table> result_high{};
+  std::thread runner{[&]() {
+    result_high = std::move(runnable_high.value()).gen().value();
+  }};
+  auto result_low = std::move(runnable_low.value()).gen().value();
+  runner.join();
+
+  EXPECT_EQ(result_high->num_rows(), expected_high.value()->num_rows());
+  EXPECT_EQ(result_low->num_rows(), expected_low.value()->num_rows());
+  EXPECT_ALL_GT(result_high, "total_amount", 10);
+}
+
+TEST(ArrowTest, HotTier) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  EXPECT_TRUE(table.hasValue());
+
+  auto hot_tier = std::make_shared<HotTier>(int64_t{1} << 30);
+  auto runQuery = [&](std::shared_ptr<HotTier> tier) {
+    auto query = table.value()
+                     ->newSamplesQueryX()
+                     .filter(DBL_GT("tip_amount", 10))
+                     .project(DBL_COL("total_amount"));
+    if (tier) {
+      query.useHotTier(std::move(tier));
+    }
+    return std::move(query).finalize().value().gen().value();
+  };
+
+  auto expected = runQuery(nullptr);
+  auto decoded = runQuery(hot_tier);
+  EXPECT_EQ(decoded->num_rows(), expected->num_rows());
+  EXPECT_EQ(hot_tier->numHits(), 0);
+  const auto num_misses = hot_tier->numMisses();
+  EXPECT_GT(num_misses, 0);
+  // A col decoded once is not kept
+  EXPECT_EQ(hot_tier->numBytes(), 0);
+
+  // Decoded again, then kept
+  EXPECT_EQ(runQuery(hot_tier)->num_rows(), expected->num_rows());
+  EXPECT_EQ(hot_tier->numHits(), 0);
+  EXPECT_EQ(hot_tier->numMisses(), 2 * num_misses);
+  EXPECT_GT(hot_tier->numBytes(), 0);
+
+  // Every col of every row group is now in the hot tier
+  auto cached = runQuery(hot_tier);
+  EXPECT_EQ(cached->num_rows(), expected->num_rows());
+  EXPECT_EQ(hot_tier->numHits(), num_misses);
+  EXPECT_EQ(hot_tier->numMisses(), 2 * num_misses);
+  EXPECT_ALL_GT(cached, "total_amount", 10);
+}
+
 } // namespace bapid
@@ -0,0 +1,108 @@
+#include "src/arrow.h"
+#include "src/bitmap_index.h"
+#include "src/tests/index_test_lib.h"
+#include <arrow/compute/api.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+TEST(BitmapIndexTest, RowBitmap) {
+  // A dense chunk, held as a bitset, and a sparse one
+  RowBitmap evens{};
+  for (uint32_t row = 0; row < 10000; row += 2) {
+    evens.add(row);
+  }
+  evens.add(70000);
+  EXPECT_EQ(evens.cardinality(), 5001);
+
+  RowBitmap some{};
+  for (uint32_t row = 5; row <= 15; row++) {
+    some.add(row);
+  }
+  some.add(70000);
+  some.add(70001);
+
+  auto united = evens;
+  united |= some;
+  EXPECT_EQ(united.cardinality(), 5001 + 6 + 1);
+
+  auto common = evens;
+  common &= some;
+  EXPECT_EQ(common.cardinality(), 6);
+  EXPECT_FALSE(common.intersects(7, 8));
+  EXPECT_TRUE(common.intersects(7, 9));
+  EXPECT_TRUE(common.intersects(65536, 70001));
+  EXPECT_FALSE(common.intersects(16, 70000));
+
+  common &= RowBitmap{};
+  EXPECT_TRUE(common.empty());
+}
+
+TEST(BitmapIndexTest, BuildAndMatch) {
+  auto vendors = arrow::Int64Builder{};
+  ASSERT_TRUE(
+      vendors.AppendValues({1, 2, 1, 0, 3}, {true, true, true, false, true})
+          .ok());
+  auto kinds = arrow::StringBuilder{};
+  ASSERT_TRUE(kinds.AppendValues({"a", "b", "a", "c", "d"}).ok());
+  auto table = arrow::Table::Make(
+      arrow::schema({arrow::field("vendor", arrow::int64()),
+                     arrow::field("kind", arrow::utf8())}),
+      {vendors.Finish().ValueOrDie(), kinds.Finish().ValueOrDie()});
+
+  auto bitmap_index = BitmapIndex::build(*table, 3).ValueOrDie();
+  ASSERT_NE(bitmap_index, nullptr);
+  // `kind` has too many values
+  EXPECT_FALSE(bitmap_index->match({cp::equal(cp::field_ref("kind"),
+                                              cp::literal("a"))}));
+
+  auto read = writeAndRead(*bitmap_index, "bitmap_index_test");
+  ASSERT_TRUE(read.ok()) << read.status().ToString();
+
+  auto value_set = arrow::Int64Builder{};
+  ASSERT_TRUE(value_set.AppendValues({2, 3}).ok());
+  const cp::SetLookupOptions twos_or_threes_options{
+      value_set.Finish().ValueOrDie(), /*skip_nulls=*/true};
+
+  for (const auto &index : {bitmap_index, *read}) {
+    EXPECT_EQ(index->numRows(), 5);
+    auto ones = index->match(
+        {cp::equal(cp::field_ref("vendor"), cp::literal(int64_t{1}))});
+    ASSERT_TRUE(ones);
+    EXPECT_EQ(ones->cardinality(), 2);
+
+    auto twos_or_threes = index->match({cp::call(
+        "is_in", {cp::field_ref("vendor")}, twos_or_threes_options)});
+    ASSERT_TRUE(twos_or_threes);
+    EXPECT_EQ(twos_or_threes->cardinality(), 2);
+    EXPECT_FALSE(twos_or_threes->intersects(0, 1));
+
+    // Not an EQ, nor a value of the type of the col
+    EXPECT_FALSE(index->match(
+        {cp::greater(cp::field_ref("vendor"), cp::literal(int64_t{1}))}));
+    EXPECT_FALSE(index->match(
+        {cp::equal(cp::field_ref("vendor"), cp::literal(1.0))}));
+  }
+}
+
+TEST(BitmapIndexTest, SkipsRowGroups) {
+  const auto out_dir = compactIndexedBatch(
+      "bitmap_index_out", CompactionOptions{.bitmap_index_max_values = 16});
+  ASSERT_TRUE(std::filesystem::exists(
+      getBitmapIndexPath((out_dir / "part-00000.parquet").string())));
+
+  forEachLoad(out_dir, [](BapidTable &table) {
+    for (const auto &vals : std::vector<std::vector<int64_t>>{{4}, {4, 5}}) {
+      auto query = table.newSamplesQueryX();
+      query.filter(intIn("vendor", vals)).project(INT_COL("seq"));
+      auto runnable = std::move(query).finalize().value();
+      EXPECT_EQ(runnable.scanStats().num_row_groups, 10);
+      EXPECT_EQ(runnable.scanStats().num_row_groups_skipped_by_index, 9);
+      EXPECT_EQ(std::move(runnable).gen().value()->num_rows(), 10);
+    }
+  });
+}
+} // namespace bapid
@@ -0,0 +1,123 @@
+#include "src/arrow.h"
+#include "src/bloom_filter.h"
+#include "src/tests/index_test_lib.h"
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/localfs.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+TEST(BloomFilterTest, NoFalseNegatives) {
+  auto filter = BloomFilter::make(1000);
+  for (int64_t i = 0; i < 1000; i++) {
+    filter.insert(BloomFilter::hash(i));
+  }
+  filter.insert(BloomFilter::hash(std::string_view{"abc"}));
+
+  for (int64_t i = 0; i < 1000; i++) {
+    EXPECT_TRUE(filter.mayContain(BloomFilter::hash(i)));
+  }
+  EXPECT_TRUE(filter.mayContain(BloomFilter::hash(std::string_view{"abc"})));
+
+  int false_positives = 0;
+  for (int64_t i = 1000; i < 11000; i++) {
+    false_positives += filter.mayContain(BloomFilter::hash(i));
+  }
+  EXPECT_LT(false_positives, 300);
+}
+
+TEST(BloomFilterTest, BuildAndMatch) {
+  auto ids = arrow::Int32Builder{};
+  ASSERT_TRUE(ids.AppendValues({1, 2, 3, 4, 5}).ok());
+  auto kinds = arrow::StringBuilder{};
+  ASSERT_TRUE(kinds.AppendValues({"a", "b", "c", "d", "e"}).ok());
+  auto table = arrow::Table::Make(
+      arrow::schema({arrow::field("id", arrow::int32()),
+                     arrow::field("kind", arrow::utf8())}),
+      {ids.Finish().ValueOrDie(), kinds.Finish().ValueOrDie()});
+
+  EXPECT_EQ(BloomFilterIndex::build(*table, {"other"}, 2).ValueOrDie(),
+            nullptr);
+  auto bloom_filters =
+      BloomFilterIndex::build(*table, {"id", "kind"}, 2).ValueOrDie();
+  ASSERT_NE(bloom_filters, nullptr);
+
+  auto read = writeAndRead(*bloom_filters, "bloom_filter_test");
+  ASSERT_TRUE(read.ok()) << read.status().ToString();
+
+  auto value_set = arrow::StringBuilder{};
+  ASSERT_TRUE(value_set.AppendValues({"a", "e"}).ok());
+  const cp::SetLookupOptions a_or_e_options{value_set.Finish().ValueOrDie(),
+                                            /*skip_nulls=*/true};
+
+  for (const auto &index : {bloom_filters, *read}) {
+    EXPECT_EQ(index->rowGroupNumRows(), (std::vector<int64_t>{2, 2, 1}));
+    auto threes = index->match(
+        {cp::equal(cp::field_ref("id"), cp::literal(int64_t{3}))});
+    ASSERT_TRUE(threes);
+    EXPECT_TRUE((*threes)[1]);
+
+    auto a_or_e = index->match(
+        {cp::call("is_in", {cp::field_ref("kind")}, a_or_e_options)});
+    ASSERT_TRUE(a_or_e);
+    EXPECT_TRUE((*a_or_e)[0]);
+    EXPECT_TRUE((*a_or_e)[2]);
+
+    // Not an EQ, nor a value of the type of the col
+    EXPECT_FALSE(index->match(
+        {cp::greater(cp::field_ref("id"), cp::literal(int64_t{1}))}));
+    EXPECT_FALSE(
+        index->match({cp::equal(cp::field_ref("id"), cp::literal("a"))}));
+  }
+}
+
+TEST(BloomFilterTest, SkipsRowGroups) {
+  const auto out_dir = compactIndexedBatch(
+      "bloom_filter_out", CompactionOptions{.bloom_filter_cols = {"id"}});
+  ASSERT_TRUE(std::filesystem::exists(
+      getBloomFilterPath((out_dir / "part-00000.parquet").string())));
+
+  forEachLoad(out_dir, [](BapidTable &table) {
+    for (const auto &vals : std::vector<std::vector<int64_t>>{{42}, {42, 43}}) {
+      auto query = table.newSamplesQueryX();
+      query.filter(intIn("id", vals)).project(INT_COL("seq"));
+      auto runnable = std::move(query).finalize().value();
+      EXPECT_EQ(runnable.scanStats().num_row_groups, 10);
+      EXPECT_GE(runnable.scanStats().num_row_groups_skipped_by_bloom_filter,
+                10 - 2 * static_cast<int64_t>(vals.size()));
+      EXPECT_EQ(std::move(runnable).gen().value()->num_rows(),
+                static_cast<int64_t>(vals.size()));
+    }
+  });
+}
+
+TEST(BloomFilterTest, IgnoresMismatchedRowGroups) {
+  const auto out_dir = compactIndexedBatch(
+      "bloom_filter_mismatch", CompactionOptions{.bloom_filter_cols = {"id"}});
+  // Replaced by filters of row groups of 500 rows, e.g. outdated by a rewrite
+  // of the fragment, so that their row groups are not those of the fragment
+  auto table =
+      arrow::Table::FromRecordBatches({makeIndexedBatch()}).ValueOrDie();
+  auto bloom_filters =
+      BloomFilterIndex::build(*table, {"id"}, 500).ValueOrDie();
+  ASSERT_NE(bloom_filters, nullptr);
+  arrow::fs::LocalFileSystem file_sys{};
+  ASSERT_TRUE(
+      bloom_filters
+          ->write(file_sys, getBloomFilterPath(
+                                (out_dir / "part-00000.parquet").string()))
+          .ok());
+
+  forEachLoad(out_dir, [](BapidTable &table) {
+    auto query = table.newSamplesQueryX();
+    query.filter(intIn("id", {42})).project(INT_COL("seq"));
+    auto runnable = std::move(query).finalize().value();
+    EXPECT_EQ(runnable.scanStats().num_row_groups_skipped_by_bloom_filter, 0);
+    EXPECT_EQ(std::move(runnable).gen().value()->num_rows(), 1);
+  });
+}
+} // namespace bapid
@@ -0,0 +1,201 @@
+#include "src/catalog.h"
+#include "src/manifest.h"
+#include <arrow/api.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+namespace stdfs = std::filesystem;
+
+std::vector<stdfs::path> getFixtures() {
+  std::vector<stdfs::path> fixtures{};
+  for (const auto &entry : stdfs::directory_iterator(
+           stdfs::current_path() / "src/tests/fixtures")) {
+    if (entry.path().extension() == ".parquet") {
+      fixtures.emplace_back(entry.path());
+    }
+  }
+  return fixtures;
+}
+
+// `num_rows` rows of an int col `id` and a string col `kind`
+std::shared_ptr<arrow::RecordBatch> makeBatch(int64_t num_rows) {
+  auto ids = arrow::Int64Builder{};
+  auto kinds = arrow::StringBuilder{};
+  for (int64_t i = 0; i < num_rows; i++) {
+    EXPECT_TRUE(ids.Append(i).ok());
+    EXPECT_TRUE(kinds.Append(i % 2 == 0 ? "even" : "odd").ok());
+  }
+  return arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("id", arrow::int64()),
+                     arrow::field("kind", arrow::utf8())}),
+      num_rows, {ids.Finish().ValueOrDie(), kinds.Finish().ValueOrDie()});
+}
+
+int64_t countFragments(const std::shared_ptr<BapidTable> &table) {
+  auto fragments = table->getDataset()->GetFragments().ValueOrDie();
+  int64_t num_fragments = 0;
+  for (const auto &fragment : fragments) {
+    EXPECT_TRUE(fragment.ok());
+    num_fragments++;
+  }
+  return num_fragments;
+}
+} // namespace
+
+TEST(CatalogTest, RefreshOnDirChange) {
+  FLAGS_refresh_interval_ms = 0;
+  const auto fixtures = getFixtures();
+  ASSERT_FALSE(fixtures.empty());
+
+  const auto dataset_dir = stdfs::path{testing::TempDir()} / "catalog_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  stdfs::copy_file(fixtures.front(), dataset_dir / "a.parquet");
+
+  TableCatalog catalog{};
+  EXPECT_TRUE(catalog.addFsTable("taxi", dataset_dir.string()).hasValue());
+  EXPECT_TRUE(catalog.getTable("missing").hasError());
+
+  auto table = catalog.getTable("taxi");
+  ASSERT_TRUE(table.hasValue());
+  EXPECT_EQ(countFragments(table.value()), 1);
+  const auto dataset = table.value()->getDataset();
+
+  // Unchanged dir keeps serving the same dataset
+  EXPECT_EQ(catalog.getTable("taxi").value()->getDataset(), dataset);
+
+  stdfs::copy_file(fixtures.front(), dataset_dir / "b.parquet");
+  stdfs::copy_file(fixtures.front(), dataset_dir / "_ignored.parquet");
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 2);
+  // Neither the manifest written meanwhile nor a relist of the unchanged files
+  // bumps the version
+  const auto version = table.value()->getVersion();
+  EXPECT_EQ(catalog.getTable("taxi").value()->getVersion(), version);
+  ASSERT_TRUE(table.value()->refresh().hasValue());
+  EXPECT_EQ(table.value()->getVersion(), version);
+
+  stdfs::remove(dataset_dir / "a.parquet");
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 1);
+}
+
+TEST(CatalogTest, SkipsUnreadableFiles) {
+  FLAGS_refresh_interval_ms = 0;
+  const auto fixtures = getFixtures();
+  ASSERT_FALSE(fixtures.empty());
+
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "catalog_unreadable_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  stdfs::copy_file(fixtures.front(), dataset_dir / "a.parquet");
+
+  TableCatalog catalog{};
+  EXPECT_TRUE(catalog.addFsTable("taxi", dataset_dir.string()).hasValue());
+
+  // E.g. still being copied
+  std::ofstream{dataset_dir / "b.parquet"} << "not yet parquet";
+  auto table = catalog.getTable("taxi");
+  ASSERT_TRUE(table.hasValue());
+  EXPECT_EQ(countFragments(table.value()), 1);
+
+  // Picked up once readable, though the dir is unchanged
+  stdfs::copy_file(fixtures.front(), dataset_dir / "b.parquet",
+                   stdfs::copy_options::overwrite_existing);
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 2);
+}
+
+TEST(CatalogTest, RefreshesAtMostEveryInterval) {
+  FLAGS_refresh_interval_ms = 60 * 1000;
+  const auto fixtures = getFixtures();
+  ASSERT_FALSE(fixtures.empty());
+
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "catalog_interval_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  stdfs::copy_file(fixtures.front(), dataset_dir / "a.parquet");
+
+  TableCatalog catalog{};
+  EXPECT_TRUE(catalog.addFsTable("taxi", dataset_dir.string()).hasValue());
+  stdfs::copy_file(fixtures.front(), dataset_dir / "b.parquet");
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 1);
+
+  FLAGS_refresh_interval_ms = 0;
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 2);
+}
+
+TEST(CatalogTest, LoadFromManifest) {
+  FLAGS_refresh_interval_ms = 0;
+  const auto fixtures = getFixtures();
+  ASSERT_FALSE(fixtures.empty());
+
+  const auto dataset_dir = stdfs::path{testing::TempDir()} / "manifest_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  stdfs::copy_file(fixtures.front(), dataset_dir / "a.parquet");
+  stdfs::copy_file(fixtures.front(), dataset_dir / "b.parquet");
+
+  {
+    TableCatalog catalog{};
+    EXPECT_TRUE(catalog.addFsTable("taxi", dataset_dir.string()).hasValue());
+  }
+  EXPECT_TRUE(stdfs::exists(dataset_dir / kManifestFileName));
+
+  auto manifest = FragmentManifest::read(dataset_dir.string());
+  ASSERT_TRUE(manifest.hasValue());
+  EXPECT_EQ(manifest->fragments.size(), 2);
+  EXPECT_GT(manifest->fragments.front()->num_rows, 0);
+  EXPECT_FALSE(manifest->fragments.front()->row_groups.empty());
+
+  // A restarted catalog serves the table from the manifest and reconciles it
+  // with the dir on first use
+  TableCatalog catalog{};
+  auto table = catalog.addFsTable("taxi", dataset_dir.string());
+  ASSERT_TRUE(table.hasValue());
+  EXPECT_EQ(countFragments(table.value()), 2);
+
+  stdfs::remove(dataset_dir / "b.parquet");
+  EXPECT_EQ(countFragments(catalog.getTable("taxi").value()), 1);
+  EXPECT_EQ(FragmentManifest::read(dataset_dir.string())->fragments.size(), 1);
+}
+
+TEST(CatalogTest, LoadManifestWithStringCol) {
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "manifest_string_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+
+  {
+    TableCatalog catalog{};
+    auto table = catalog.addFsTable("events", dataset_dir.string());
+    ASSERT_TRUE(table.hasValue());
+    // The second flush refreshes a table whose string col is read as a
+    // dictionary
+    for (int i = 0; i < 2; i++) {
+      ASSERT_TRUE(table.value()->append({makeBatch(100)}).hasValue());
+      ASSERT_TRUE(table.value()->flush().hasValue());
+    }
+  }
+
+  auto manifest = FragmentManifest::read(dataset_dir.string());
+  ASSERT_TRUE(manifest.hasValue()) << manifest.error();
+  ASSERT_EQ(manifest->fragments.size(), 2);
+  const auto kind = manifest->schema->GetFieldIndex("kind");
+  ASSERT_GE(kind, 0);
+  const auto &stats = manifest->fragments.front()->row_groups.front().cols;
+  ASSERT_TRUE(stats[kind] && stats[kind]->min);
+  EXPECT_EQ(stats[kind]->min->ToString(), "even");
+
+  TableCatalog catalog{};
+  auto table = catalog.addFsTable("events", dataset_dir.string());
+  ASSERT_TRUE(table.hasValue());
+  EXPECT_EQ(countFragments(table.value()), 2);
+}
+} // namespace bapid
@@ -0,0 +1,65 @@
+#include "src/column_stats.h"
+#include <arrow/api.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+std::shared_ptr<arrow::Schema> getSchema() {
+  return arrow::schema({arrow::field("id", arrow::int64()),
+                        arrow::field("name", arrow::utf8())});
+}
+
+// 10 row groups of 100 rows each, with ids in [100 * i, 100 * i + 99] and no
+// stats for the names
+FragmentStatsIndex getFragmentStats() {
+  auto stats = std::make_shared<FragmentStats>();
+  stats->path = "a.parquet";
+  for (int64_t i = 0; i < 10; i++) {
+    RowGroupStats row_group{.num_rows = 100};
+    row_group.cols.emplace_back(
+        ColumnChunkStats{.min = arrow::MakeScalar(int64_t{100 * i}),
+                         .max = arrow::MakeScalar(int64_t{100 * i + 99}),
+                         .null_count = 0});
+    row_group.cols.emplace_back(std::nullopt);
+    stats->row_groups.emplace_back(std::move(row_group));
+    stats->num_rows += 100;
+  }
+  return {{stats->path, stats}};
+}
+} // namespace
+
+TEST(ColumnStatsTest, EstimateSelectivity) {
+  auto stats = TableColumnStats::make(*getSchema(), getFragmentStats());
+  const auto *id = stats.find("id");
+  ASSERT_NE(id, nullptr);
+  EXPECT_EQ(id->num_rows, 1000);
+  EXPECT_DOUBLE_EQ(id->ndv.value(), 1000);
+
+  EXPECT_NEAR(stats.estimateSelectivity(
+                  cp::less(cp::field_ref("id"), cp::literal(int64_t{250}))),
+              0.25, 0.01);
+  EXPECT_DOUBLE_EQ(stats.estimateSelectivity(cp::equal(
+                       cp::field_ref("id"), cp::literal(int64_t{5000}))),
+                   0);
+  EXPECT_DOUBLE_EQ(stats.estimateSelectivity(
+                       cp::is_null(cp::field_ref("id"))),
+                   0);
+}
+
+TEST(ColumnStatsTest, ReorderPredicates) {
+  auto schema = getSchema();
+  auto stats = TableColumnStats::make(*schema, getFragmentStats());
+
+  auto by_name = cp::equal(cp::field_ref("name"), cp::literal("a"));
+  auto most_ids = cp::greater(cp::field_ref("id"), cp::literal(int64_t{10}));
+  auto few_ids = cp::less(cp::field_ref("id"), cp::literal(int64_t{10}));
+  std::vector<cp::Expression> predicates{by_name, most_ids, few_ids};
+  reorderPredicates(predicates, *schema, stats);
+
+  EXPECT_EQ(predicates,
+            (std::vector<cp::Expression>{few_ids, by_name, most_ids}));
+}
+} // namespace bapid
@@ -0,0 +1,109 @@
+#include "src/arrow.h"
+#include "src/compaction.h"
+#include <arrow/compute/api.h>
+#include <arrow/dataset/api.h>
+#include <arrow/io/file.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <parquet/arrow/reader.h>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+namespace stdfs = std::filesystem;
+
+std::string getDatasetDir() {
+  return (stdfs::current_path() / "src/tests/fixtures").string();
+}
+
+int64_t countRows(const BapidTable &table) {
+  auto scanner_builder = table.getDataset()->NewScan().ValueOrDie();
+  return scanner_builder->Finish().ValueOrDie()->CountRows().ValueOrDie();
+}
+} // namespace
+
+TEST(CompactionTest, WritesSortedFiles) {
+  auto table = BapidTable::fromFsDataset(getDatasetDir(), "taxi");
+  ASSERT_TRUE(table.hasValue());
+  const auto num_rows = countRows(*table.value());
+
+  const auto out_dir = stdfs::path{testing::TempDir()} / "compaction_test";
+  stdfs::remove_all(out_dir);
+  auto stats = table.value()->compact(CompactionOptions{
+      .out_dir = out_dir.string(),
+      .sort_col = "tip_amount",
+      .rows_per_file = num_rows / 2 + 1,
+      .rows_per_row_group = 1000,
+      .num_threads = 2,
+  });
+  ASSERT_TRUE(stats.hasValue()) << stats.error();
+  EXPECT_EQ(stats->num_rows, num_rows);
+  EXPECT_GE(stats->num_output_files, 1);
+
+  int64_t num_files = 0;
+  for (const auto &entry : stdfs::directory_iterator(out_dir)) {
+    num_files++;
+    auto input =
+        arrow::io::ReadableFile::Open(entry.path().string()).ValueOrDie();
+    std::unique_ptr<parquet::arrow::FileReader> reader{};
+    ASSERT_TRUE(parquet::arrow::OpenFile(input, arrow::default_memory_pool(),
+                                         &reader)
+                    .ok());
+    const auto &metadata = *reader->parquet_reader()->metadata();
+    for (int i = 0; i < metadata.num_row_groups(); i++) {
+      EXPECT_LE(metadata.RowGroup(i)->num_rows(), 1000);
+    }
+
+    std::shared_ptr<arrow::Table> file{};
+    ASSERT_TRUE(reader->ReadTable(&file).ok());
+    auto tips = file->GetColumnByName("tip_amount");
+    ASSERT_NE(tips, nullptr);
+    auto indices = cp::SortIndices(*tips).ValueOrDie();
+    auto sorted = cp::Take(tips, indices).ValueOrDie();
+    EXPECT_TRUE(sorted.chunked_array()->Equals(*tips));
+  }
+  EXPECT_EQ(num_files, stats->num_output_files);
+
+  auto compacted = BapidTable::fromFsDataset(out_dir.string(), "taxi");
+  ASSERT_TRUE(compacted.hasValue());
+  EXPECT_EQ(countRows(*compacted.value()), num_rows);
+
+  // The output dir has to be empty
+  EXPECT_TRUE(table.value()
+                  ->compact(CompactionOptions{.out_dir = out_dir.string()})
+                  .hasError());
+}
+
+TEST(CompactionTest, CompactsBufferedRows) {
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "compaction_buffered";
+  const auto out_dir =
+      stdfs::path{testing::TempDir()} / "compaction_buffered_out";
+  stdfs::remove_all(dataset_dir);
+  stdfs::remove_all(out_dir);
+  stdfs::create_directories(dataset_dir);
+  auto table = BapidTable::fromFsDataset(dataset_dir.string(), "ids");
+  ASSERT_TRUE(table.hasValue());
+
+  auto ids = arrow::Int64Builder{};
+  for (int64_t i = 0; i < 100; i++) {
+    ASSERT_TRUE(ids.Append(i).ok());
+  }
+  auto batch = arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("id", arrow::int64())}), 100,
+      {ids.Finish().ValueOrDie()});
+  ASSERT_TRUE(table.value()->append({batch}).hasValue());
+
+  // Not flushed yet, but still compacted
+  auto stats = table.value()->compact(CompactionOptions{
+      .out_dir = out_dir.string(),
+      .sort_col = "id",
+  });
+  ASSERT_TRUE(stats.hasValue()) << stats.error();
+  EXPECT_EQ(stats->num_rows, 100);
+  EXPECT_EQ(table.value()->numBufferedRows(), 0);
+}
+} // namespace bapid
@@ -0,0 +1,152 @@
+#include "src/arrow.h"
+#include "src/dictionary.h"
+#include "src/fused_filter.h"
+#include <arrow/compute/api.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+namespace stdfs = std::filesystem;
+
+using Strings = std::vector<std::optional<std::string>>;
+
+std::shared_ptr<arrow::Array> makeUtf8(const Strings &strings) {
+  auto builder = arrow::StringBuilder{};
+  for (const auto &string : strings) {
+    EXPECT_TRUE(
+        (string ? builder.Append(*string) : builder.AppendNull()).ok());
+  }
+  return builder.Finish().ValueOrDie();
+}
+
+std::shared_ptr<arrow::Array> makeStrings(const Strings &strings) {
+  return cp::DictionaryEncode(makeUtf8(strings)).ValueOrDie().make_array();
+}
+
+std::map<std::string, int64_t>
+countByStr(BapidTable &table, const std::string &col) {
+  auto query = TableQuery{table.newSamplesQueryX()};
+  query.groupBy(STR_COL(col)).aggregate(bapidrpc::AggOp::COUNT, {});
+  auto result_set = std::move(query).finalize().value().gen().value();
+
+  std::map<std::string, int64_t> counts{};
+  for (int64_t i = 0; i < result_set->num_rows(); i++) {
+    auto key = result_set->column(0)->GetScalar(i).ValueOrDie();
+    auto count = result_set->column(1)->GetScalar(i).ValueOrDie();
+    counts[key->is_valid ? key->ToString() : "null"] =
+        std::static_pointer_cast<arrow::Int64Scalar>(count)->value;
+  }
+  return counts;
+}
+} // namespace
+
+TEST(DictionaryTest, DictIsIn) {
+  registerDictionaryFunctions();
+  auto array = makeStrings({"a", "b", std::nullopt, "c", "a"});
+  cp::SetLookupOptions options{makeUtf8({"a", "c", "d"}),
+                               /*skip_nulls=*/true};
+  auto matches = cp::CallFunction(kDictIsIn, {array}, &options);
+  ASSERT_TRUE(matches.ok()) << matches.status().ToString();
+  const auto &matched = static_cast<const arrow::BooleanArray &>(
+      *matches->make_array());
+  std::vector<bool> values{};
+  for (int64_t i = 0; i < matched.length(); i++) {
+    values.emplace_back(matched.IsValid(i) && matched.Value(i));
+  }
+  EXPECT_EQ(values, (std::vector<bool>{true, false, false, true, true}));
+
+  // As is_in, a null of the value set matches the null rows unless skipped
+  for (const auto skip_nulls : {true, false}) {
+    cp::SetLookupOptions null_options{makeUtf8({"b", std::nullopt}),
+                                      skip_nulls};
+    auto dict_matches = cp::CallFunction(kDictIsIn, {array}, &null_options);
+    auto expected = cp::IsIn(makeUtf8({"a", "b", std::nullopt, "c", "a"}),
+                             null_options);
+    ASSERT_TRUE(dict_matches.ok()) << dict_matches.status().ToString();
+    ASSERT_TRUE(expected.ok());
+    EXPECT_TRUE(dict_matches->make_array()->Equals(*expected->make_array()))
+        << dict_matches->make_array()->ToString();
+  }
+}
+
+TEST(DictionaryTest, FilterOnCodes) {
+  registerDictionaryFunctions();
+  auto schema = arrow::schema({arrow::field("s", getDictionaryType())});
+  auto batch =
+      cp::ExecBatch{{makeStrings({"a", "b", std::nullopt, "c", "a"})}, 5};
+
+  auto count = [&](cp::Expression predicate) {
+    auto filter = FusedFilter::make({std::move(predicate)}, *schema,
+                                    cp::default_exec_context())
+                      .ValueOrDie();
+    return filter.apply(batch, cp::default_exec_context()).ValueOrDie().length;
+  };
+  EXPECT_EQ(count(cp::equal(cp::field_ref("s"), cp::literal("a"))), 2);
+  // Nulls are dropped, as by the comparison
+  EXPECT_EQ(count(cp::not_equal(cp::field_ref("s"), cp::literal("a"))), 2);
+  EXPECT_EQ(count(cp::equal(cp::field_ref("s"), cp::literal("x"))), 0);
+
+  auto rewritten = rewriteForDictionaries(
+      cp::equal(cp::field_ref("s"), cp::literal("a")), *schema);
+  ASSERT_TRUE(rewritten.ok());
+  EXPECT_EQ(rewritten->call()->function_name, kDictIsIn);
+}
+
+TEST(DictionaryTest, InternAcrossDictionaries) {
+  StringInterner interner{};
+  auto a = std::static_pointer_cast<arrow::DictionaryArray>(
+      makeStrings({"x", "y"}));
+  auto b = std::static_pointer_cast<arrow::DictionaryArray>(
+      makeStrings({"y", "z", "x"}));
+  auto a_codes = interner.intern(*a->dictionary()).ValueOrDie();
+  auto b_codes = interner.intern(*b->dictionary()).ValueOrDie();
+  EXPECT_EQ(a_codes, (std::vector<int32_t>{0, 1}));
+  EXPECT_EQ(b_codes, (std::vector<int32_t>{1, 2, 0}));
+
+  auto codes = arrow::Int32Builder{};
+  ASSERT_TRUE(codes.AppendValues({2, 0, 0}, {true, false, true}).ok());
+  auto strings =
+      interner.lookup(*std::static_pointer_cast<arrow::Int32Array>(
+          codes.Finish().ValueOrDie()));
+  EXPECT_TRUE(strings.ValueOrDie()->Equals(
+      *makeUtf8({"z", std::nullopt, "x"})));
+}
+
+TEST(DictionaryTest, GroupByStrings) {
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "dictionary_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  auto table = BapidTable::fromFsDataset(dataset_dir.string(), "events");
+  ASSERT_TRUE(table.hasValue());
+
+  auto batch = arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("kind", arrow::utf8())}), 5,
+      {makeUtf8({"click", "view", "click", std::nullopt, "view"})});
+  ASSERT_TRUE(table.value()->append({batch}).hasValue());
+  EXPECT_TRUE(table.value()
+                  ->getDataset()
+                  ->schema()
+                  ->GetFieldByName("kind")
+                  ->type()
+                  ->Equals(getDictionaryType()));
+
+  const std::map<std::string, int64_t> expected{
+      {"click", 2}, {"view", 2}, {"null", 1}};
+  EXPECT_EQ(countByStr(*table.value(), "kind"), expected);
+
+  // Then read from a file, with a dictionary of its own
+  ASSERT_TRUE(table.value()->flush().hasValue());
+  ASSERT_TRUE(table.value()->append({batch}).hasValue());
+  const std::map<std::string, int64_t> doubled{
+      {"click", 4}, {"view", 4}, {"null", 2}};
+  EXPECT_EQ(countByStr(*table.value(), "kind"), doubled);
+}
+} // namespace bapid
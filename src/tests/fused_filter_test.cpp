@@ -0,0 +1,67 @@
+#include "src/fused_filter.h"
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+// Cols `id` in [0, num_rows) and `half`, which is id / 2 and null for id 7
+cp::ExecBatch makeBatch(int64_t num_rows) {
+  auto ids = arrow::Int64Builder{};
+  auto halves = arrow::DoubleBuilder{};
+  for (int64_t i = 0; i < num_rows; i++) {
+    EXPECT_TRUE(ids.Append(i).ok());
+    EXPECT_TRUE((i == 7 ? halves.AppendNull() : halves.Append(i / 2.0)).ok());
+  }
+  return cp::ExecBatch{
+      {ids.Finish().ValueOrDie(), halves.Finish().ValueOrDie()}, num_rows};
+}
+
+std::shared_ptr<arrow::Schema> getSchema() {
+  return arrow::schema({arrow::field("id", arrow::int64()),
+                        arrow::field("half", arrow::float64())});
+}
+
+std::vector<int64_t> getIds(const cp::ExecBatch &batch) {
+  auto ids = std::static_pointer_cast<arrow::Int64Array>(
+      batch.values[0].make_array());
+  return {ids->raw_values(), ids->raw_values() + ids->length()};
+}
+} // namespace
+
+TEST(FusedFilterTest, Conjunction) {
+  auto filter = FusedFilter::make(
+                    {
+                        cp::greater_equal(cp::field_ref("id"), cp::literal(4)),
+                        // Leaves few enough rows to switch to a selection
+                        cp::less(cp::field_ref("id"), cp::literal(10)),
+                        cp::greater(cp::field_ref("half"), cp::literal(2.0)),
+                    },
+                    *getSchema(), cp::default_exec_context())
+                    .ValueOrDie();
+
+  auto result =
+      filter.apply(makeBatch(100), cp::default_exec_context()).ValueOrDie();
+  EXPECT_EQ(result.length, 4);
+  EXPECT_EQ(getIds(result), (std::vector<int64_t>{5, 6, 8, 9}));
+  EXPECT_EQ(result.values[1].make_array()->length(), 4);
+}
+
+TEST(FusedFilterTest, NoRowLeft) {
+  auto filter = FusedFilter::make(
+                    {
+                        cp::greater(cp::field_ref("id"), cp::literal(1000)),
+                        cp::greater(cp::field_ref("half"), cp::literal(2.0)),
+                    },
+                    *getSchema(), cp::default_exec_context())
+                    .ValueOrDie();
+
+  auto result =
+      filter.apply(makeBatch(100), cp::default_exec_context()).ValueOrDie();
+  EXPECT_EQ(result.length, 0);
+  EXPECT_EQ(result.values[0].make_array()->length(), 0);
+}
+} // namespace bapid
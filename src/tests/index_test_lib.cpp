@@ -0,0 +1,71 @@
+#include "src/tests/index_test_lib.h"
+
+namespace bapid {
+
+namespace stdfs = std::filesystem;
+
+std::shared_ptr<arrow::RecordBatch> makeIndexedBatch() {
+  auto seqs = arrow::Int64Builder{};
+  auto ids = arrow::Int64Builder{};
+  auto vendors = arrow::Int64Builder{};
+  for (int64_t i = 0; i < 10000; i++) {
+    EXPECT_TRUE(seqs.Append(i).ok());
+    EXPECT_TRUE(ids.Append(i * 7919 % 10000).ok());
+    EXPECT_TRUE(vendors.Append(i >= 4200 && i < 4210 ? 4 : i % 2 * 8).ok());
+  }
+  return arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("seq", arrow::int64()),
+                     arrow::field("id", arrow::int64()),
+                     arrow::field("vendor", arrow::int64())}),
+      10000,
+      {seqs.Finish().ValueOrDie(), ids.Finish().ValueOrDie(),
+       vendors.Finish().ValueOrDie()});
+}
+
+bapidrpc::Filter intIn(const std::string &col_name,
+                       const std::vector<int64_t> &vals) {
+  auto filter = bapidrpc::Filter{};
+  filter.set_col_name(col_name);
+  filter.set_op(bapidrpc::FilterOp::EQ);
+  for (const auto val : vals) {
+    filter.add_int_vals(val);
+  }
+  return filter;
+}
+
+stdfs::path compactIndexedBatch(const std::string &name,
+                                CompactionOptions options) {
+  const auto dataset_dir = stdfs::path{testing::TempDir()} / (name + "_in");
+  const auto out_dir = stdfs::path{testing::TempDir()} / name;
+  stdfs::remove_all(dataset_dir);
+  stdfs::remove_all(out_dir);
+  stdfs::create_directories(dataset_dir);
+
+  auto table = BapidTable::fromFsDataset(dataset_dir.string(), name);
+  EXPECT_TRUE(table.hasValue());
+  if (table.hasError()) {
+    return out_dir;
+  }
+  EXPECT_TRUE(table.value()->append({makeIndexedBatch()}).hasValue());
+  EXPECT_TRUE(table.value()->flush().hasValue());
+  options.out_dir = out_dir.string();
+  options.sort_col = "seq";
+  options.rows_per_row_group = 1000;
+  auto stats = table.value()->compact(options);
+  EXPECT_TRUE(stats.hasValue()) << stats.error();
+  if (stats.hasValue()) {
+    EXPECT_EQ(stats->num_output_files, 1);
+  }
+  return out_dir;
+}
+
+void forEachLoad(const stdfs::path &dir,
+                 const std::function<void(BapidTable &)> &fn) {
+  for (int i = 0; i < 2; i++) {
+    auto table = BapidTable::fromFsDataset(dir.string(),
+                                             dir.filename().string());
+    ASSERT_TRUE(table.hasValue());
+    fn(*table.value());
+  }
+}
+} // namespace bapid
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "if/bapid.pb.h"
+#include "src/arrow.h"
+#include "src/compaction.h"
+#include <arrow/api.h>
+#include <arrow/filesystem/localfs.h>
+#include <filesystem>
+#include <functional>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Fixtures shared by the tests of the indexes next to compacted fragments
+
+namespace bapid {
+
+// 10000 rows of cols `seq` in [0, 10000); `id`, a shuffle of it, so that
+// sorted by `seq` the ids of every row group span about the whole range; and
+// `vendor`, which is 0 or 8 but 4 for seqs in [4200, 4210), so that the stats
+// of no row group rule out 4
+std::shared_ptr<arrow::RecordBatch> makeIndexedBatch();
+
+// An EQ filter of the int col `col_name` on any of `vals`
+bapidrpc::Filter intIn(const std::string &col_name,
+                       const std::vector<int64_t> &vals);
+
+// Appends the batch above to a new table, flushes it, then compacts it with
+// `options`, sorted by `seq` into row groups of 1000 rows, to a new dir named
+// `name` under the test tmp dir; returns that dir
+std::filesystem::path compactIndexedBatch(const std::string &name,
+                                          CompactionOptions options);
+
+// Calls `fn` on the table of the compacted `dir`, once discovered from the dir
+// and once loaded from its manifest
+void forEachLoad(const std::filesystem::path &dir,
+                 const std::function<void(BapidTable &)> &fn);
+
+// Writes `index` to `name` under the test tmp dir, then reads it back
+template <typename Index>
+arrow::Result<std::shared_ptr<const Index>>
+writeAndRead(const Index &index, const std::string &name) {
+  const auto dir = std::filesystem::path{testing::TempDir()} / name;
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  arrow::fs::LocalFileSystem file_sys{};
+  const auto path = (dir / "_index").string();
+  ARROW_RETURN_NOT_OK(index.write(file_sys, path));
+  return Index::read(file_sys, path);
+}
+} // namespace bapid
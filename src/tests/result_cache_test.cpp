@@ -0,0 +1,79 @@
+#include "src/result_cache.h"
+#include <arrow/api.h>
+#include <arrow/util/byte_size.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+// A table of `num_rows` tips
+std::shared_ptr<arrow::Table> makeTable(int64_t num_rows) {
+  arrow::Int64Builder builder{};
+  EXPECT_TRUE(builder.AppendValues(std::vector<int64_t>(num_rows, 1)).ok());
+  auto schema = arrow::schema({arrow::field("tip", arrow::int64())});
+  return arrow::Table::Make(schema, {builder.Finish().ValueOrDie()});
+}
+
+int64_t getNumBytes(const std::shared_ptr<arrow::Table> &table) {
+  return static_cast<int64_t>(arrow::util::TotalBufferSize(*table));
+}
+} // namespace
+
+TEST(ResultCacheTest, EvictsLeastRecentlyUsed) {
+  auto table = makeTable(100);
+  ResultCache cache{getNumBytes(table) * 4};
+
+  cache.put("a", 0, table);
+  cache.put("b", 0, makeTable(100));
+  cache.put("c", 0, makeTable(100));
+  cache.put("d", 0, makeTable(100));
+  EXPECT_EQ(cache.numBytes(), getNumBytes(table) * 4);
+
+  // "a" becomes the most recently used, so "b" goes first
+  EXPECT_EQ(cache.get("a", 0), table);
+  cache.put("e", 0, makeTable(100));
+  EXPECT_EQ(cache.numBytes(), getNumBytes(table) * 4);
+  EXPECT_EQ(cache.get("b", 0), nullptr);
+  EXPECT_NE(cache.get("a", 0), nullptr);
+  EXPECT_NE(cache.get("e", 0), nullptr);
+}
+
+TEST(ResultCacheTest, IgnoresLargeResultSets) {
+  auto table = makeTable(100);
+  ResultCache cache{getNumBytes(table) * 3};
+
+  cache.put("a", 0, table);
+  EXPECT_EQ(cache.get("a", 0), nullptr);
+  EXPECT_EQ(cache.numBytes(), 0);
+
+  ResultCache disabled{0};
+  disabled.put("a", 0, makeTable(0));
+  EXPECT_EQ(disabled.get("a", 0), nullptr);
+}
+
+TEST(ResultCacheTest, InvalidatesOnNewVersion) {
+  auto table = makeTable(100);
+  ResultCache cache{getNumBytes(table) * 4};
+
+  cache.put("a", 0, table);
+  EXPECT_EQ(cache.get("a", 1), nullptr);
+
+  cache.invalidate(1);
+  EXPECT_EQ(cache.get("a", 0), nullptr);
+  EXPECT_EQ(cache.numBytes(), 0);
+
+  // A result set of an older version is stale
+  cache.put("a", 0, table);
+  EXPECT_EQ(cache.get("a", 0), nullptr);
+  cache.put("a", 1, table);
+  EXPECT_EQ(cache.get("a", 1), table);
+
+  // A newer version drops the entries of the current one
+  cache.put("b", 2, table);
+  EXPECT_EQ(cache.get("a", 1), nullptr);
+  EXPECT_EQ(cache.get("b", 2), table);
+  EXPECT_EQ(cache.numBytes(), getNumBytes(table));
+}
+} // namespace bapid
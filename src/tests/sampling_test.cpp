@@ -0,0 +1,74 @@
+#include "src/sampling.h"
+#include <arrow/api.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+std::shared_ptr<arrow::Schema> getSchema() {
+  return arrow::schema({arrow::field("id", arrow::int64())});
+}
+
+// Ids in [begin, end)
+std::shared_ptr<arrow::RecordBatch> makeBatch(int64_t begin, int64_t end) {
+  arrow::Int64Builder builder{};
+  for (auto i = begin; i < end; i++) {
+    EXPECT_TRUE(builder.Append(i).ok());
+  }
+  return arrow::RecordBatch::Make(getSchema(), end - begin,
+                                  {builder.Finish().ValueOrDie()});
+}
+
+std::vector<int64_t> getIds(const arrow::Table &table) {
+  std::vector<int64_t> ids{};
+  for (const auto &chunk : table.column(0)->chunks()) {
+    const auto &values = static_cast<const arrow::Int64Array &>(*chunk);
+    for (int64_t i = 0; i < values.length(); i++) {
+      ids.emplace_back(values.Value(i));
+    }
+  }
+  return ids;
+}
+} // namespace
+
+TEST(SamplingTest, ReservoirKeepsShortStream) {
+  ReservoirSample reservoir{getSchema(), 100, 1};
+  ASSERT_TRUE(reservoir.add(makeBatch(0, 30)).ok());
+  ASSERT_TRUE(reservoir.add(makeBatch(30, 60)).ok());
+  auto ids = getIds(*reservoir.finish().ValueOrDie());
+  EXPECT_EQ(ids.size(), size_t{60});
+  EXPECT_EQ(std::set<int64_t>(ids.begin(), ids.end()).size(), size_t{60});
+}
+
+TEST(SamplingTest, ReservoirIsUniform) {
+  // How often each id is sampled over many runs
+  constexpr int kNumRuns = 200;
+  std::vector<int> counts(10000, 0);
+  for (int run = 0; run < kNumRuns; run++) {
+    ReservoirSample reservoir{getSchema(), 100, static_cast<uint64_t>(run)};
+    for (int64_t begin = 0; begin < 10000; begin += 1000) {
+      ASSERT_TRUE(reservoir.add(makeBatch(begin, begin + 1000)).ok());
+    }
+    EXPECT_EQ(reservoir.numSeen(), 10000);
+
+    auto ids = getIds(*reservoir.finish().ValueOrDie());
+    ASSERT_EQ(ids.size(), size_t{100});
+    EXPECT_EQ(std::set<int64_t>(ids.begin(), ids.end()).size(), size_t{100});
+    for (const auto id : ids) {
+      counts[id]++;
+    }
+  }
+
+  // Each tenth of the stream gets about a tenth of the samples
+  for (int tenth = 0; tenth < 10; tenth++) {
+    int num_sampled = 0;
+    for (int i = tenth * 1000; i < (tenth + 1) * 1000; i++) {
+      num_sampled += counts[i];
+    }
+    EXPECT_NEAR(num_sampled, kNumRuns * 10, kNumRuns * 10 * 0.2);
+  }
+}
+} // namespace bapid
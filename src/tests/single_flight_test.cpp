@@ -0,0 +1,223 @@
+#include "src/single_flight.h"
+#include <arrow/api.h>
+#include <arrow/util/byte_size.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+std::shared_ptr<arrow::Schema> getSchema() {
+  return arrow::schema({arrow::field("tip", arrow::int64())});
+}
+
+std::shared_ptr<arrow::RecordBatch> makeBatch(int64_t tip) {
+  arrow::Int64Builder builder{};
+  EXPECT_TRUE(builder.AppendValues(std::vector<int64_t>(100, tip)).ok());
+  return arrow::RecordBatch::Make(getSchema(), 100,
+                                  {builder.Finish().ValueOrDie()});
+}
+
+// A stream of `num_batches` batches, counting the batches pulled from it
+BatchStream makeStream(int num_batches, int &num_pulled) {
+  return BatchStream{getSchema(), [=, &num_pulled]() mutable -> BatchOrError {
+                       if (num_pulled == num_batches) {
+                         return std::shared_ptr<arrow::RecordBatch>{};
+                       }
+                       return makeBatch(num_pulled++);
+                     }};
+}
+
+std::vector<int64_t> readTips(SharedResultSet::Reader &reader) {
+  std::vector<int64_t> tips{};
+  while (true) {
+    auto batch = reader.next();
+    EXPECT_TRUE(batch.hasValue());
+    if (!batch.value()) {
+      return tips;
+    }
+    tips.emplace_back(
+        std::static_pointer_cast<arrow::Int64Array>(batch.value()->column(0))
+            ->Value(0));
+  }
+}
+
+int64_t getBatchBytes() {
+  return static_cast<int64_t>(arrow::util::TotalBufferSize(*makeBatch(0)));
+}
+} // namespace
+
+TEST(SingleFlightTest, SharesRunningQuery) {
+  SingleFlight flights{getBatchBytes() * 10};
+  int num_started = 0;
+  int num_pulled = 0;
+  auto start = [&]() -> folly::Expected<BatchStream, std::string> {
+    num_started++;
+    return makeStream(3, num_pulled);
+  };
+
+  auto first = flights.join("q", start).get();
+  ASSERT_TRUE(first.hasValue());
+  ASSERT_TRUE(first->next().hasValue());
+
+  // Joins late, yet reads the whole result set
+  auto second = flights.join("q", start).get();
+  ASSERT_TRUE(second.hasValue());
+  EXPECT_EQ(num_started, 1);
+  EXPECT_EQ(readTips(second.value()), (std::vector<int64_t>{0, 1, 2}));
+  EXPECT_EQ(readTips(first.value()), (std::vector<int64_t>{1, 2}));
+  EXPECT_EQ(num_pulled, 3);
+
+  auto other = flights.join("other", start).get();
+  ASSERT_TRUE(other.hasValue());
+  EXPECT_EQ(num_started, 2);
+}
+
+TEST(SingleFlightTest, StartsAgainOnceDone) {
+  SingleFlight flights{getBatchBytes() * 10};
+  int num_started = 0;
+  int num_pulled = 0;
+  auto start = [&]() -> folly::Expected<BatchStream, std::string> {
+    num_started++;
+    num_pulled = 0;
+    return makeStream(2, num_pulled);
+  };
+
+  {
+    auto reader = flights.join("q", start).get();
+    ASSERT_TRUE(reader.hasValue());
+    EXPECT_EQ(readTips(reader.value()), (std::vector<int64_t>{0, 1}));
+  }
+  auto reader = flights.join("q", start).get();
+  ASSERT_TRUE(reader.hasValue());
+  EXPECT_EQ(num_started, 2);
+}
+
+TEST(SingleFlightTest, StopsJoinsPastBudget) {
+  SingleFlight flights{getBatchBytes() * 2};
+  int num_started = 0;
+  int num_pulled = 0;
+  auto start = [&]() -> folly::Expected<BatchStream, std::string> {
+    num_started++;
+    return makeStream(5, num_pulled);
+  };
+
+  auto first = flights.join("q", start).get();
+  auto second = flights.join("q", start).get();
+  ASSERT_TRUE(first.hasValue());
+  ASSERT_TRUE(second.hasValue());
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(first->next().hasValue());
+  }
+
+  // Past the budget, the query can no longer be joined
+  auto late = flights.join("q", start).get();
+  ASSERT_TRUE(late.hasValue());
+  EXPECT_EQ(num_started, 2);
+  EXPECT_EQ(readTips(second.value()), (std::vector<int64_t>{0, 1, 2, 3, 4}));
+  EXPECT_EQ(readTips(first.value()), (std::vector<int64_t>{3, 4}));
+}
+
+TEST(SingleFlightTest, WaitsForSlowReaders) {
+  SingleFlight flights{getBatchBytes() * 2};
+  std::atomic<int> num_pulled{0};
+  auto start = [&]() -> folly::Expected<BatchStream, std::string> {
+    return BatchStream{getSchema(), [&]() -> BatchOrError {
+                         const auto tip = num_pulled++;
+                         return tip < 10
+                                    ? makeBatch(tip)
+                                    : std::shared_ptr<arrow::RecordBatch>{};
+                       }};
+  };
+
+  auto fast = flights.join("q", start).get();
+  auto slow = flights.join("q", start).get();
+  ASSERT_TRUE(fast.hasValue());
+  ASSERT_TRUE(slow.hasValue());
+  auto fast_tips =
+      std::async(std::launch::async, [&]() { return readTips(fast.value()); });
+
+  // The fast reader stops pulling once ahead by the budget
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_LE(num_pulled, 3);
+  EXPECT_EQ(readTips(slow.value()),
+            (std::vector<int64_t>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+  EXPECT_EQ(fast_tips.get(),
+            (std::vector<int64_t>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(SingleFlightTest, SharesErrors) {
+  SingleFlight flights{getBatchBytes() * 10};
+  auto start = []() -> folly::Expected<BatchStream, std::string> {
+    return BatchStream{getSchema(), []() -> BatchOrError {
+                         return folly::makeUnexpected(std::string{"oops"});
+                       }};
+  };
+
+  auto first = flights.join("q", start).get();
+  auto second = flights.join("q", start).get();
+  ASSERT_TRUE(first.hasValue());
+  ASSERT_TRUE(second.hasValue());
+  EXPECT_EQ(first->next().error(), "oops");
+  EXPECT_EQ(second->next().error(), "oops");
+
+  auto fail = []() -> folly::Expected<BatchStream, std::string> {
+    return folly::makeUnexpected(std::string{"invalid"});
+  };
+  auto failed = flights.join("p", fail).get();
+  ASSERT_TRUE(failed.hasError());
+  EXPECT_EQ(failed.error(), "invalid");
+}
+
+TEST(SingleFlightTest, StartsWithoutBlockingOthers) {
+  SingleFlight flights{getBatchBytes() * 10};
+  std::promise<void> starting{};
+  std::promise<void> resume{};
+  auto resumed = resume.get_future().share();
+  std::atomic<int> num_slow_started{0};
+  std::atomic<int> num_pulled{0};
+  auto slow_start = [&]() -> folly::Expected<BatchStream, std::string> {
+    num_slow_started++;
+    starting.set_value();
+    resumed.wait();
+    return BatchStream{getSchema(), [&]() -> BatchOrError {
+                         return num_pulled++ == 0
+                                    ? makeBatch(0)
+                                    : std::shared_ptr<arrow::RecordBatch>{};
+                       }};
+  };
+  auto joinSlow = [&]() { return flights.join("q", slow_start).get(); };
+
+  auto first = std::async(std::launch::async, joinSlow);
+  starting.get_future().wait();
+
+  // Other queries start while it starts
+  int num_other_pulled = 0;
+  auto other = flights
+                   .join("other",
+                         [&]() {
+                           return folly::Expected<BatchStream, std::string>{
+                               makeStream(1, num_other_pulled)};
+                         })
+                   .get();
+  ASSERT_TRUE(other.hasValue());
+  EXPECT_EQ(readTips(other.value()), (std::vector<int64_t>{0}));
+
+  // An identical query waits for it to start, then joins it
+  auto second = std::async(std::launch::async, joinSlow);
+  resume.set_value();
+  auto first_reader = first.get();
+  auto second_reader = second.get();
+  ASSERT_TRUE(first_reader.hasValue());
+  ASSERT_TRUE(second_reader.hasValue());
+  EXPECT_EQ(num_slow_started, 1);
+  EXPECT_EQ(readTips(first_reader.value()), (std::vector<int64_t>{0}));
+  EXPECT_EQ(readTips(second_reader.value()), (std::vector<int64_t>{0}));
+}
+} // namespace bapid
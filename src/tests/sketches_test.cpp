@@ -0,0 +1,53 @@
+#include "src/sketches.h"
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <cmath>
+#include <folly/hash/Hash.h>
+#include <gtest/gtest.h>
+#include <memory>
+
+namespace bapid {
+
+namespace {
+HyperLogLog makeSketch(uint64_t begin, uint64_t end) {
+  HyperLogLog sketch{};
+  for (auto i = begin; i < end; i++) {
+    sketch.add(folly::hash::twang_mix64(i));
+  }
+  return sketch;
+}
+} // namespace
+
+TEST(SketchesTest, HyperLogLogEstimate) {
+  EXPECT_EQ(HyperLogLog{}.estimate(), 0);
+  EXPECT_NEAR(makeSketch(0, 100).estimate(), 100, 2);
+  EXPECT_NEAR(makeSketch(0, 100000).estimate(), 100000, 100000 * 0.05);
+
+  // Adding the same values again changes nothing
+  auto sketch = makeSketch(0, 1000);
+  const auto estimate = sketch.estimate();
+  sketch.merge(makeSketch(0, 1000));
+  EXPECT_DOUBLE_EQ(sketch.estimate(), estimate);
+}
+
+TEST(SketchesTest, HyperLogLogMerge) {
+  auto merged = makeSketch(0, 60000);
+  merged.merge(makeSketch(40000, 100000));
+  EXPECT_DOUBLE_EQ(merged.estimate(), makeSketch(0, 100000).estimate());
+}
+
+TEST(SketchesTest, ApproxCountDistinct) {
+  registerSketchFunctions();
+  arrow::StringBuilder builder{};
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_TRUE(builder.Append("v" + std::to_string(i % 300)).ok());
+  }
+  ASSERT_TRUE(builder.AppendNull().ok());
+  auto values = builder.Finish().ValueOrDie();
+
+  auto result = arrow::compute::CallFunction(kApproxCountDistinct, {values});
+  ASSERT_TRUE(result.ok()) << result.status().ToString();
+  const auto count = result->scalar_as<arrow::Int64Scalar>().value;
+  EXPECT_NEAR(count, 300, 300 * 0.05);
+}
+} // namespace bapid
@@ -0,0 +1,38 @@
+#include "src/time_index.h"
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+
+namespace bapid {
+
+TEST(TimeIndexTest, BucketsBeforeEpoch) {
+  auto ts_field = arrow::field("ts", arrow::timestamp(arrow::TimeUnit::MILLI));
+  TimeIndex time_index{ts_field, {}};
+
+  arrow::TimestampBuilder builder{ts_field->type(),
+                                  arrow::default_memory_pool()};
+  const std::vector<int64_t> ts_ms{-61000, -60000, -1, 0, 59999, 60000};
+  ASSERT_TRUE(builder.AppendValues(ts_ms).ok());
+  auto schema = arrow::schema({ts_field});
+  const cp::ExecBatch batch{{builder.Finish().ValueOrDie()},
+                            static_cast<int64_t>(ts_ms.size())};
+
+  auto bucket = time_index.makeBucket(60);
+  ASSERT_TRUE(bucket.ok()) << bucket.status().ToString();
+  auto bound = bucket->Bind(*schema);
+  ASSERT_TRUE(bound.ok()) << bound.status().ToString();
+  auto buckets = cp::ExecuteScalarExpression(*bound, batch);
+  ASSERT_TRUE(buckets.ok()) << buckets.status().ToString();
+
+  const auto &starts =
+      static_cast<const arrow::Int64Array &>(*buckets->make_array());
+  std::vector<int64_t> values{};
+  for (int64_t i = 0; i < starts.length(); i++) {
+    values.emplace_back(starts.Value(i));
+  }
+  EXPECT_EQ(values, (std::vector<int64_t>{-120, -60, -60, 0, 0, 60}));
+}
+} // namespace bapid
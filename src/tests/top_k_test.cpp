@@ -0,0 +1,111 @@
+#include "src/top_k.h"
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+std::shared_ptr<arrow::Schema> getSchema() {
+  return arrow::schema({arrow::field("tip", arrow::int64())});
+}
+
+std::shared_ptr<arrow::RecordBatch>
+makeBatch(const std::vector<int64_t> &tips) {
+  arrow::Int64Builder builder{};
+  EXPECT_TRUE(builder.AppendValues(tips).ok());
+  return arrow::RecordBatch::Make(getSchema(),
+                                  static_cast<int64_t>(tips.size()),
+                                  {builder.Finish().ValueOrDie()});
+}
+
+// One row group of `num_rows` with tips in [min, max]
+RowGroupStats makeRowGroup(int64_t num_rows, int64_t min, int64_t max) {
+  RowGroupStats row_group{.num_rows = num_rows};
+  row_group.cols.emplace_back(ColumnChunkStats{.min = arrow::MakeScalar(min),
+                                               .max = arrow::MakeScalar(max),
+                                               .null_count = 0});
+  return row_group;
+}
+} // namespace
+
+TEST(TopKTest, KeepsTopRowsSorted) {
+  TopK top_k{getSchema(), OrderBy{"tip", /*descending=*/true}, 5};
+  std::vector<int64_t> expected{};
+  // Enough batches for the candidates to be narrowed down on the way
+  for (int64_t batch = 0; batch < 20; batch++) {
+    std::vector<int64_t> tips{};
+    for (int64_t i = 0; i < 10; i++) {
+      tips.emplace_back((batch * 37 + i * 11) % 101);
+    }
+    expected.insert(expected.end(), tips.begin(), tips.end());
+    ASSERT_TRUE(top_k.add(makeBatch(tips)).ok());
+  }
+  std::sort(expected.rbegin(), expected.rend());
+  expected.resize(5);
+
+  auto result_set = top_k.finish().ValueOrDie();
+  ASSERT_EQ(result_set->num_rows(), 5);
+  for (int64_t i = 0; i < 5; i++) {
+    auto tip = result_set->column(0)->GetScalar(i).ValueOrDie();
+    EXPECT_EQ(std::static_pointer_cast<arrow::Int64Scalar>(tip)->value,
+              expected[i]);
+  }
+}
+
+TEST(TopKTest, OrdersByDictionaryStrings) {
+  // As the scans read string cols, each batch with a dictionary of its own
+  auto schema = arrow::schema(
+      {arrow::field("kind", arrow::dictionary(arrow::int32(), arrow::utf8()))});
+  TopK top_k{schema, OrderBy{"kind"}, 3};
+  for (const auto &kinds : std::vector<std::vector<std::string>>{
+           {"d", "b", "f", "b"}, {"e", "a", "c"}, {"g", "c"}}) {
+    arrow::StringBuilder builder{};
+    ASSERT_TRUE(builder.AppendValues(kinds).ok());
+    auto encoded =
+        cp::DictionaryEncode(builder.Finish().ValueOrDie()).ValueOrDie();
+    ASSERT_TRUE(top_k
+                    .add(arrow::RecordBatch::Make(
+                        schema, static_cast<int64_t>(kinds.size()),
+                        {encoded.make_array()}))
+                    .ok());
+  }
+
+  auto result_set = top_k.finish();
+  ASSERT_TRUE(result_set.ok()) << result_set.status().ToString();
+  std::vector<std::string> kinds{};
+  for (int64_t i = 0; i < (*result_set)->num_rows(); i++) {
+    auto kind = (*result_set)->column(0)->GetScalar(i).ValueOrDie();
+    kinds.emplace_back(std::static_pointer_cast<arrow::DictionaryScalar>(kind)
+                           ->GetEncodedValue()
+                           .ValueOrDie()
+                           ->ToString());
+  }
+  EXPECT_EQ(kinds, (std::vector<std::string>{"a", "b", "b"}));
+}
+
+TEST(TopKTest, TopKBound) {
+  auto stats = std::make_shared<FragmentStats>();
+  stats->path = "a.parquet";
+  stats->row_groups.emplace_back(makeRowGroup(100, 0, 10));
+  stats->row_groups.emplace_back(makeRowGroup(100, 50, 60));
+  stats->row_groups.emplace_back(makeRowGroup(100, 40, 45));
+  const FragmentStatsIndex index{{stats->path, stats}};
+
+  const auto desc = OrderBy{"tip", /*descending=*/true};
+  // The 100 rows of the second row group are all at least 50
+  EXPECT_EQ(getTopKBound(index, 0, desc, 100), 50);
+  EXPECT_EQ(getTopKBound(index, 0, desc, 150), 40);
+  EXPECT_EQ(getTopKBound(index, 0, desc, 1000), std::nullopt);
+  EXPECT_FALSE(mayReachBound(stats->row_groups[0].cols[0], desc, 50));
+  EXPECT_TRUE(mayReachBound(stats->row_groups[1].cols[0], desc, 50));
+
+  const auto asc = OrderBy{"tip", /*descending=*/false};
+  EXPECT_EQ(getTopKBound(index, 0, asc, 100), 10);
+  EXPECT_FALSE(mayReachBound(stats->row_groups[1].cols[0], asc, 10));
+}
+} // namespace bapid
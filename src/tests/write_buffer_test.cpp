@@ -0,0 +1,105 @@
+#include "src/arrow.h"
+#include "src/write_buffer.h"
+#include <chrono>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bapid {
+
+namespace {
+namespace stdfs = std::filesystem;
+
+stdfs::path getFixture() {
+  for (const auto &entry : stdfs::directory_iterator(
+           stdfs::current_path() / "src/tests/fixtures")) {
+    if (entry.path().extension() == ".parquet") {
+      return entry.path();
+    }
+  }
+  return {};
+}
+
+int64_t countTipsOver(BapidTable &table, double tip_amount) {
+  auto query = table.newSamplesQueryX()
+                   .filter(DBL_GT("tip_amount", tip_amount))
+                   .project(DBL_COL("tip_amount"));
+  return std::move(query).finalize().value().gen().value()->num_rows();
+}
+
+bapidrpc::AppendRequest makeTipsRequest(const std::vector<double> &tips) {
+  bapidrpc::AppendRequest request{};
+  *request.add_cols() = DBL_COL("tip_amount");
+  for (const auto tip : tips) {
+    request.add_rows()->add_vals()->set_double_val(tip);
+  }
+  // A null tip
+  request.add_rows()->add_vals();
+  return request;
+}
+} // namespace
+
+TEST(WriteBufferTest, AppendAndFlush) {
+  const auto fixture = getFixture();
+  ASSERT_FALSE(fixture.empty());
+  const auto dataset_dir =
+      stdfs::path{testing::TempDir()} / "write_buffer_test";
+  stdfs::remove_all(dataset_dir);
+  stdfs::create_directories(dataset_dir);
+  stdfs::copy_file(fixture, dataset_dir / "a.parquet");
+
+  auto table = BapidTable::fromFsDataset(dataset_dir.string(), "taxi");
+  ASSERT_TRUE(table.hasValue());
+  const auto num_rows = countTipsOver(*table.value(), 30);
+
+  auto appended = table.value()->append(makeTipsRequest({100, 200, 1}));
+  ASSERT_TRUE(appended.hasValue()) << appended.error();
+  EXPECT_EQ(appended.value(), 4);
+  EXPECT_EQ(table.value()->numBufferedRows(), 4);
+  // Seen by queries before being flushed
+  EXPECT_EQ(countTipsOver(*table.value(), 30), num_rows + 2);
+
+  ASSERT_TRUE(table.value()->flush().hasValue());
+  EXPECT_EQ(table.value()->numBufferedRows(), 0);
+  EXPECT_EQ(countTipsOver(*table.value(), 30), num_rows + 2);
+  int num_files = 0;
+  for (const auto &entry : stdfs::directory_iterator(dataset_dir)) {
+    num_files += entry.path().extension() == ".parquet";
+  }
+  EXPECT_EQ(num_files, 2);
+
+  // Nothing is appended from a request with an unknown col
+  auto request = makeTipsRequest({100});
+  *request.add_cols() = DBL_COL("missing");
+  for (auto &row : *request.mutable_rows()) {
+    row.add_vals();
+  }
+  EXPECT_TRUE(table.value()->append(request).hasError());
+  EXPECT_EQ(table.value()->numBufferedRows(), 0);
+}
+
+TEST(WriteBufferTest, ShouldFlush) {
+  const auto now = WriteBuffer::Clock::now();
+  WriteBuffer buffer{};
+  EXPECT_FALSE(buffer.shouldFlush(0, std::chrono::milliseconds{0}, now));
+
+  auto batch = arrow::RecordBatch::Make(
+      arrow::schema({arrow::field("a", arrow::int64())}), 0,
+      {arrow::MakeArrayOfNull(arrow::int64(), 0).ValueOrDie()});
+  buffer.append(batch, now);
+  buffer.append(batch, now + std::chrono::seconds{1});
+  EXPECT_FALSE(buffer.shouldFlush(1 << 20, std::chrono::seconds{2},
+                                  now + std::chrono::seconds{1}));
+  EXPECT_TRUE(buffer.shouldFlush(1 << 20, std::chrono::seconds{2},
+                                 now + std::chrono::seconds{2}));
+
+  // The age is that of the oldest batch left
+  buffer.drop(1);
+  EXPECT_FALSE(buffer.shouldFlush(1 << 20, std::chrono::seconds{2},
+                                  now + std::chrono::seconds{2}));
+  buffer.drop(1);
+  EXPECT_TRUE(buffer.empty());
+}
+} // namespace bapid
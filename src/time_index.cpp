@@ -0,0 +1,163 @@
+#include "src/time_index.h"
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/compute/cast.h>
+#include <memory>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Timestamps are compared in seconds; integer cols are taken as seconds
+arrow::Result<int64_t> getUnitsPerSecond(const arrow::DataType &type) {
+  switch (type.id()) {
+  case arrow::Type::TIMESTAMP:
+    switch (static_cast<const arrow::TimestampType &>(type).unit()) {
+    case arrow::TimeUnit::SECOND:
+      return 1;
+    case arrow::TimeUnit::MILLI:
+      return 1000;
+    case arrow::TimeUnit::MICRO:
+      return 1000 * 1000;
+    case arrow::TimeUnit::NANO:
+      return 1000 * 1000 * 1000;
+    }
+    break;
+  case arrow::Type::INT32:
+  case arrow::Type::INT64:
+  case arrow::Type::UINT32:
+  case arrow::Type::UINT64:
+    return 1;
+  default:
+    break;
+  }
+
+  return arrow::Status::TypeError("unsupported timestamp col type ",
+                                  type.ToString());
+}
+
+arrow::Result<int64_t> toSeconds(const arrow::Scalar &scalar,
+                                 int64_t units_per_second) {
+  if (scalar.type->id() == arrow::Type::TIMESTAMP) {
+    const auto value =
+        static_cast<const arrow::TimestampScalar &>(scalar).value;
+    // Rounds towards -inf so that the range still covers the value
+    return value >= 0 ? value / units_per_second
+                      : -((-value + units_per_second - 1) / units_per_second);
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto value, scalar.CastTo(arrow::int64()));
+  return std::static_pointer_cast<arrow::Int64Scalar>(value)->value;
+}
+} // namespace
+
+bool TimeWindow::overlaps(const TimeRange &range) const {
+  return range.max_ts >= min_ts && (!max_ts || range.min_ts <= max_ts.value());
+}
+
+/*static*/ arrow::Result<std::shared_ptr<const TimeIndex>>
+TimeIndex::make(const arrow::Schema &schema, const std::string &ts_col_name,
+                const FragmentStatsIndex &fragment_stats) {
+  const auto field_index = schema.GetFieldIndex(ts_col_name);
+  if (field_index < 0) {
+    return arrow::Status::KeyError("no timestamp col ", ts_col_name);
+  }
+
+  auto ts_field = schema.field(field_index);
+  ARROW_ASSIGN_OR_RAISE(const auto units_per_second,
+                        getUnitsPerSecond(*ts_field->type()));
+
+  std::unordered_map<std::string, FragmentTimeRanges> fragments{};
+  fragments.reserve(fragment_stats.size());
+  for (const auto &[path, stats] : fragment_stats) {
+    FragmentTimeRanges ranges{};
+    bool all_known = !stats->row_groups.empty();
+    for (const auto &row_group : stats->row_groups) {
+      const auto &col = row_group.cols[field_index];
+      if (!col || !col->min) {
+        ranges.row_groups.emplace_back(std::nullopt);
+        all_known = false;
+        continue;
+      }
+
+      ARROW_ASSIGN_OR_RAISE(auto min_ts,
+                            toSeconds(*col->min, units_per_second));
+      ARROW_ASSIGN_OR_RAISE(auto max_ts,
+                            toSeconds(*col->max, units_per_second));
+      ranges.row_groups.emplace_back(TimeRange{min_ts, max_ts});
+      if (!ranges.fragment) {
+        ranges.fragment = TimeRange{min_ts, max_ts};
+      } else {
+        ranges.fragment->min_ts = std::min(ranges.fragment->min_ts, min_ts);
+        ranges.fragment->max_ts = std::max(ranges.fragment->max_ts, max_ts);
+      }
+    }
+
+    if (!all_known) {
+      ranges.fragment.reset();
+    }
+    fragments.emplace(path, std::move(ranges));
+  }
+
+  return std::make_shared<const TimeIndex>(std::move(ts_field),
+                                           std::move(fragments));
+}
+
+TimeIndex::TimeIndex(
+    std::shared_ptr<arrow::Field> ts_field,
+    std::unordered_map<std::string, FragmentTimeRanges> fragments)
+    : ts_field_{std::move(ts_field)}, fragments_{std::move(fragments)} {}
+
+const std::shared_ptr<arrow::Field> &TimeIndex::getTsField() const {
+  return ts_field_;
+}
+
+const TimeIndex::FragmentTimeRanges *
+TimeIndex::find(const std::string &path) const {
+  auto it = fragments_.find(path);
+  return it == fragments_.end() ? nullptr : &it->second;
+}
+
+arrow::Result<cp::Expression>
+TimeIndex::makeFilter(const TimeWindow &window) const {
+  const auto &type = ts_field_->type();
+  ARROW_ASSIGN_OR_RAISE(const auto units_per_second, getUnitsPerSecond(*type));
+  auto toLiteral =
+      [&](int64_t ts) -> arrow::Result<std::shared_ptr<arrow::Scalar>> {
+    return arrow::MakeScalar(type, ts * units_per_second);
+  };
+
+  auto field = cp::field_ref(ts_field_->name());
+  ARROW_ASSIGN_OR_RAISE(auto min_ts, toLiteral(window.min_ts));
+  auto filter = cp::greater_equal(field, cp::literal(std::move(min_ts)));
+  if (!window.max_ts) {
+    return filter;
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto max_ts, toLiteral(window.max_ts.value()));
+  return cp::and_(std::move(filter),
+                  cp::less_equal(field, cp::literal(std::move(max_ts))));
+}
+
+arrow::Result<cp::Expression> TimeIndex::makeBucket(int64_t granularity) const {
+  if (granularity <= 0) {
+    return arrow::Status::Invalid("granularity must be positive, got ",
+                                  granularity);
+  }
+
+  ARROW_ASSIGN_OR_RAISE(const auto units_per_second,
+                        getUnitsPerSecond(*ts_field_->type()));
+  auto ts = cp::call("cast", {cp::field_ref(ts_field_->name())},
+                     cp::CastOptions::Safe(arrow::int64()));
+  // Rounds towards -inf, as `divide` truncates, so that a timestamp before
+  // the epoch lands in the bucket below rather than above
+  const auto bucket_units = cp::literal(units_per_second * granularity);
+  auto quotient = cp::call("divide", {ts, bucket_units});
+  auto floored = cp::call(
+      "if_else",
+      {cp::greater(cp::call("multiply", {quotient, bucket_units}), ts),
+       cp::call("subtract", {quotient, cp::literal(int64_t{1})}), quotient});
+  return cp::call("multiply", {std::move(floored), cp::literal(granularity)});
+}
+} // namespace bapid
+
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bapid {
+
+// [min_ts, max_ts] of the rows of a fragment or a row group, in seconds
+struct TimeRange {
+  int64_t min_ts;
+  int64_t max_ts;
+};
+
+// The time range requested by a query, in seconds. No max_ts means up to now.
+struct TimeWindow {
+  int64_t min_ts;
+  std::optional<int64_t> max_ts;
+
+  bool overlaps(const TimeRange &range) const;
+};
+
+// The time ranges of the fragments of a table and of their row groups on the
+// table's timestamp col. Built from the fragment stats when the table loads, so
+// that a query skips data outside its time window before scheduling any I/O.
+class TimeIndex {
+public:
+  struct FragmentTimeRanges {
+    // nullopt if unknown for any of its row groups
+    std::optional<TimeRange> fragment;
+    std::vector<std::optional<TimeRange>> row_groups;
+  };
+
+  static arrow::Result<std::shared_ptr<const TimeIndex>>
+  make(const arrow::Schema &schema, const std::string &ts_col_name,
+       const FragmentStatsIndex &fragment_stats);
+
+  TimeIndex(std::shared_ptr<arrow::Field> ts_field,
+            std::unordered_map<std::string, FragmentTimeRanges> fragments);
+
+  const std::shared_ptr<arrow::Field> &getTsField() const;
+  // nullptr if the fragment is not indexed
+  const FragmentTimeRanges *find(const std::string &path) const;
+  // The row-level filter of `window` on the timestamp col
+  arrow::Result<cp::Expression> makeFilter(const TimeWindow &window) const;
+  // The start in seconds of the `granularity` seconds wide bucket of the
+  // timestamp col
+  arrow::Result<cp::Expression> makeBucket(int64_t granularity) const;
+
+private:
+  std::shared_ptr<arrow::Field> ts_field_;
+  std::unordered_map<std::string, FragmentTimeRanges> fragments_;
+};
+} // namespace bapid
@@ -0,0 +1,255 @@
+#include "src/top_k.h"
+#include <algorithm>
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/map_node.h>
+#include <folly/logging/xlog.h>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace bapid {
+
+namespace {
+// Narrows the candidates down once they hold this many times k rows
+constexpr int64_t kMaxCandidatesFactor = 4;
+
+cp::SortKey getSortKey(const OrderBy &order_by) {
+  return cp::SortKey{cp::FieldRef{order_by.col_name},
+                     order_by.descending ? cp::SortOrder::Descending
+                                         : cp::SortOrder::Ascending};
+}
+
+// The value type of `type` if it is a dictionary, as the sort kernels take
+// none; nullptr otherwise
+std::shared_ptr<arrow::DataType> getDecodedType(const arrow::DataType &type) {
+  if (type.id() != arrow::Type::DICTIONARY) {
+    return nullptr;
+  }
+  return static_cast<const arrow::DictionaryType &>(type).value_type();
+}
+
+// What the rows of `batch` are ordered on: the batch itself, or only its
+// order col decoded if a dictionary, e.g. of strings
+arrow::Result<arrow::Datum>
+getSortable(const std::shared_ptr<arrow::RecordBatch> &batch,
+            const OrderBy &order_by) {
+  auto col = batch->GetColumnByName(order_by.col_name);
+  auto type = col ? getDecodedType(*col->type()) : nullptr;
+  if (!type) {
+    return arrow::Datum{batch};
+  }
+  ARROW_ASSIGN_OR_RAISE(auto decoded, cp::Cast(*col, type));
+  return arrow::Datum{arrow::RecordBatch::Make(
+      arrow::schema({arrow::field(order_by.col_name, type)}),
+      batch->num_rows(), {std::move(decoded)})};
+}
+
+// Same as above for a table
+arrow::Result<arrow::Datum>
+getSortable(const std::shared_ptr<arrow::Table> &table,
+            const OrderBy &order_by) {
+  auto col = table->GetColumnByName(order_by.col_name);
+  auto type = col ? getDecodedType(*col->type()) : nullptr;
+  if (!type) {
+    return arrow::Datum{table};
+  }
+  ARROW_ASSIGN_OR_RAISE(auto decoded, cp::Cast(arrow::Datum{col}, type));
+  return arrow::Datum{arrow::Table::Make(
+      arrow::schema({arrow::field(order_by.col_name, type)}),
+      {decoded.chunked_array()}, table->num_rows())};
+}
+
+std::optional<double> toDouble(const std::shared_ptr<arrow::Scalar> &scalar) {
+  if (!scalar || !scalar->is_valid ||
+      !arrow::is_numeric(scalar->type->id())) {
+    return std::nullopt;
+  }
+  auto value = scalar->CastTo(arrow::float64());
+  if (!value.ok()) {
+    return std::nullopt;
+  }
+  return std::static_pointer_cast<arrow::DoubleScalar>(*value)->value;
+}
+} // namespace
+
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+selectTopK(const std::shared_ptr<arrow::RecordBatch> &batch,
+           const OrderBy &order_by, int64_t k) {
+  if (batch->num_rows() <= k) {
+    return batch;
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto sortable, getSortable(batch, order_by));
+  ARROW_ASSIGN_OR_RAISE(
+      auto indices,
+      cp::SelectKUnstable(sortable,
+                          cp::SelectKOptions{k, {getSortKey(order_by)}}));
+  ARROW_ASSIGN_OR_RAISE(auto top,
+                        cp::Take(batch, indices,
+                                 cp::TakeOptions::NoBoundsCheck()));
+  return top.record_batch();
+}
+
+TopK::TopK(std::shared_ptr<arrow::Schema> schema, OrderBy order_by, int64_t k)
+    : schema_{std::move(schema)}, order_by_{std::move(order_by)}, k_{k} {}
+
+arrow::Status TopK::add(const std::shared_ptr<arrow::RecordBatch> &batch) {
+  if (batch->num_rows() == 0 || k_ <= 0) {
+    return arrow::Status::OK();
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto top, selectTopK(batch, order_by_, k_));
+  num_candidates_ += top->num_rows();
+  candidates_.emplace_back(std::move(top));
+  if (num_candidates_ <= kMaxCandidatesFactor * k_) {
+    return arrow::Status::OK();
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto selected, selectCandidates());
+  candidates_.clear();
+  ARROW_RETURN_NOT_OK(arrow::TableBatchReader{*selected}.ReadAll(&candidates_));
+  num_candidates_ = selected->num_rows();
+  return arrow::Status::OK();
+}
+
+arrow::Result<std::shared_ptr<arrow::Table>> TopK::selectCandidates() const {
+  ARROW_ASSIGN_OR_RAISE(auto table,
+                        arrow::Table::FromRecordBatches(schema_, candidates_));
+  if (table->num_rows() <= k_) {
+    return table;
+  }
+
+  ARROW_ASSIGN_OR_RAISE(auto sortable, getSortable(table, order_by_));
+  ARROW_ASSIGN_OR_RAISE(
+      auto indices,
+      cp::SelectKUnstable(sortable,
+                          cp::SelectKOptions{k_, {getSortKey(order_by_)}}));
+  ARROW_ASSIGN_OR_RAISE(auto top,
+                        cp::Take(table, indices,
+                                 cp::TakeOptions::NoBoundsCheck()));
+  return top.table();
+}
+
+arrow::Result<std::shared_ptr<arrow::Table>> TopK::finish() {
+  ARROW_ASSIGN_OR_RAISE(auto top, selectCandidates());
+  ARROW_ASSIGN_OR_RAISE(auto sortable, getSortable(top, order_by_));
+  ARROW_ASSIGN_OR_RAISE(
+      auto indices,
+      cp::SortIndices(sortable, cp::SortOptions{{getSortKey(order_by_)}}));
+  ARROW_ASSIGN_OR_RAISE(auto sorted,
+                        cp::Take(top, indices,
+                                 cp::TakeOptions::NoBoundsCheck()));
+  return sorted.table();
+}
+
+std::optional<double> getTopKBound(const FragmentStatsIndex &fragment_stats,
+                                   int field_index, const OrderBy &order_by,
+                                   int64_t k) {
+  // The bound every row of a row group reaches, and its non-null rows
+  std::vector<std::pair<double, int64_t>> row_groups{};
+  for (const auto &[_, fragment] : fragment_stats) {
+    for (const auto &row_group : fragment->row_groups) {
+      if (static_cast<size_t>(field_index) >= row_group.cols.size()) {
+        continue;
+      }
+      const auto &col = row_group.cols[field_index];
+      if (!col || !col->null_count) {
+        continue;
+      }
+      auto bound = toDouble(order_by.descending ? col->min : col->max);
+      if (bound) {
+        row_groups.emplace_back(*bound,
+                                row_group.num_rows - col->null_count.value());
+      }
+    }
+  }
+
+  std::sort(row_groups.begin(), row_groups.end(),
+            [&](const auto &a, const auto &b) {
+              return order_by.descending ? a.first > b.first
+                                         : a.first < b.first;
+            });
+  int64_t num_rows = 0;
+  for (const auto &[bound, num_non_null] : row_groups) {
+    num_rows += num_non_null;
+    if (num_rows >= k) {
+      return bound;
+    }
+  }
+  return std::nullopt;
+}
+
+bool mayReachBound(const std::optional<ColumnChunkStats> &col,
+                   const OrderBy &order_by, double bound) {
+  if (!col) {
+    return true;
+  }
+  // Rows equal to the bound may still be among the top ones
+  auto value = toDouble(order_by.descending ? col->max : col->min);
+  if (!value) {
+    return true;
+  }
+  return order_by.descending ? *value >= bound : *value <= bound;
+}
+
+namespace {
+class TopKNode : public cp::MapNode {
+public:
+  TopKNode(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+           std::shared_ptr<arrow::Schema> output_schema, OrderBy order_by,
+           int64_t k)
+      : cp::MapNode(plan, std::move(inputs), std::move(output_schema)),
+        order_by_{std::move(order_by)}, k_{k} {}
+
+  static arrow::Result<cp::ExecNode *>
+  make(cp::ExecPlan *plan, std::vector<cp::ExecNode *> inputs,
+       const cp::ExecNodeOptions &options) {
+    if (inputs.size() != 1) {
+      return arrow::Status::Invalid("TopKNode takes 1 input, got ",
+                                    inputs.size());
+    }
+
+    const auto &top_k_options = static_cast<const TopKNodeOptions &>(options);
+    auto schema = inputs[0]->output_schema();
+    ARROW_RETURN_NOT_OK(
+        cp::FieldRef{top_k_options.order_by.col_name}.FindOne(*schema));
+    return plan->EmplaceNode<TopKNode>(plan, std::move(inputs),
+                                       std::move(schema),
+                                       top_k_options.order_by, top_k_options.k);
+  }
+
+  const char *kind_name() const override { return "TopKNode"; }
+
+  void InputReceived(cp::ExecNode * /*input*/, cp::ExecBatch batch) override {
+    SubmitTask(
+        [this](cp::ExecBatch batch) -> arrow::Result<cp::ExecBatch> {
+          if (batch.length <= k_) {
+            return batch;
+          }
+          ARROW_ASSIGN_OR_RAISE(auto record_batch,
+                                batch.ToRecordBatch(output_schema()));
+          ARROW_ASSIGN_OR_RAISE(auto top,
+                                selectTopK(record_batch, order_by_, k_));
+          return cp::ExecBatch{*top};
+        },
+        std::move(batch));
+  }
+
+private:
+  OrderBy order_by_;
+  int64_t k_;
+};
+} // namespace
+
+void registerTopKNode(cp::ExecFactoryRegistry *registry) {
+  static std::once_flag once{};
+  std::call_once(once, [registry]() {
+    auto status = registry->AddFactory(kTopKNode, TopKNode::make);
+    if (!status.ok()) {
+      XLOG(ERR) << "fail to register " << kTopKNode << ": "
+                << status.ToString();
+    }
+  });
+}
+} // namespace bapid
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "src/collector.h"
+#include "src/fragment_stats.h"
+#include <arrow/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+struct OrderBy {
+  std::string col_name;
+  bool descending{false};
+};
+
+// The first `k` rows of `batch` in `order_by`, in no particular order
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+selectTopK(const std::shared_ptr<arrow::RecordBatch> &batch,
+           const OrderBy &order_by, int64_t k);
+
+// The first `k` rows of a result set in `order_by`. Only keeps the candidates
+// selected from each batch, which are narrowed down to `k` again once they
+// outnumber them; only the final `k` rows are sorted.
+class TopK : public Collector {
+public:
+  TopK(std::shared_ptr<arrow::Schema> schema, OrderBy order_by, int64_t k);
+
+  arrow::Status
+  add(const std::shared_ptr<arrow::RecordBatch> &batch) override;
+  // The top rows, sorted
+  arrow::Result<std::shared_ptr<arrow::Table>> finish() override;
+
+private:
+  arrow::Result<std::shared_ptr<arrow::Table>> selectCandidates() const;
+
+  std::shared_ptr<arrow::Schema> schema_;
+  OrderBy order_by_;
+  int64_t k_;
+
+  std::vector<std::shared_ptr<arrow::RecordBatch>> candidates_{};
+  int64_t num_candidates_{0};
+};
+
+// A value the k-th row of the table in `order_by` is known to reach from the
+// row group stats alone: the row groups with the most extreme bounds that
+// hold k non-null rows between them all reach the last of these bounds. Only
+// holds for a query that keeps every row.
+std::optional<double> getTopKBound(const FragmentStatsIndex &fragment_stats,
+                                   int field_index, const OrderBy &order_by,
+                                   int64_t k);
+
+// Whether a row group with the col stats `col` may hold a row reaching `bound`
+bool mayReachBound(const std::optional<ColumnChunkStats> &col,
+                   const OrderBy &order_by, double bound);
+
+// Name of the exec node passing on only the top k rows of each batch, so that
+// the later nodes never see the other ones
+inline constexpr char kTopKNode[] = "bapid_top_k";
+
+class TopKNodeOptions : public cp::ExecNodeOptions {
+public:
+  TopKNodeOptions(OrderBy order_by, int64_t k)
+      : order_by{std::move(order_by)}, k{k} {}
+
+  OrderBy order_by;
+  int64_t k;
+};
+
+// Adds kTopKNode to `registry`; a no-op after the first call
+void registerTopKNode(cp::ExecFactoryRegistry *registry);
+} // namespace bapid
@@ -0,0 +1,137 @@
+#include "src/write_buffer.h"
+#include <arrow/compute/api.h>
+#include <arrow/util/byte_size.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+#include <utility>
+
+namespace bapid {
+
+namespace cp = arrow::compute;
+
+void WriteBuffer::append(std::shared_ptr<arrow::RecordBatch> batch,
+                         Clock::time_point now) {
+  const auto num_bytes =
+      static_cast<int64_t>(arrow::util::TotalBufferSize(*batch));
+  num_rows_ += batch->num_rows();
+  num_bytes_ += num_bytes;
+  entries_.emplace_back(Entry{std::move(batch), num_bytes, now});
+}
+
+void WriteBuffer::drop(size_t num_batches) {
+  for (size_t i = 0; i < num_batches && !entries_.empty(); i++) {
+    num_rows_ -= entries_.front().batch->num_rows();
+    num_bytes_ -= entries_.front().num_bytes;
+    entries_.pop_front();
+  }
+}
+
+std::vector<std::shared_ptr<arrow::RecordBatch>> WriteBuffer::batches() const {
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches{};
+  batches.reserve(entries_.size());
+  for (const auto &entry : entries_) {
+    batches.emplace_back(entry.batch);
+  }
+  return batches;
+}
+
+bool WriteBuffer::shouldFlush(int64_t max_bytes,
+                              std::chrono::milliseconds max_age,
+                              Clock::time_point now) const {
+  if (entries_.empty()) {
+    return false;
+  }
+  return num_bytes_ >= max_bytes ||
+         now - entries_.front().appended_at >= max_age;
+}
+
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+conformBatch(const arrow::RecordBatch &batch,
+             const std::shared_ptr<arrow::Schema> &schema) {
+  for (const auto &field : batch.schema()->fields()) {
+    if (schema->GetFieldIndex(field->name()) < 0) {
+      return arrow::Status::Invalid("no unique col ", field->name(),
+                                    " in the table");
+    }
+  }
+
+  std::vector<std::shared_ptr<arrow::Array>> cols{};
+  cols.reserve(schema->num_fields());
+  for (const auto &field : schema->fields()) {
+    auto col = batch.GetColumnByName(field->name());
+    if (!col) {
+      ARROW_ASSIGN_OR_RAISE(col, arrow::MakeArrayOfNull(field->type(),
+                                                        batch.num_rows()));
+    } else if (field->type()->id() == arrow::Type::DICTIONARY &&
+               col->type_id() != arrow::Type::DICTIONARY) {
+      // Which a cast does not do
+      ARROW_ASSIGN_OR_RAISE(auto encoded, cp::DictionaryEncode(col));
+      col = encoded.make_array();
+    }
+    if (!col->type()->Equals(field->type())) {
+      ARROW_ASSIGN_OR_RAISE(col, cp::Cast(*col, field->type()));
+    }
+    cols.emplace_back(std::move(col));
+  }
+  return arrow::RecordBatch::Make(schema, batch.num_rows(), std::move(cols));
+}
+
+std::string getHiddenPath(const std::string &path) {
+  const auto slash = path.rfind('/');
+  return slash == std::string::npos
+             ? "." + path + ".tmp"
+             : path.substr(0, slash + 1) + "." + path.substr(slash + 1) +
+                   ".tmp";
+}
+
+arrow::Status writeParquetFile(
+    fs::FileSystem &file_sys, const std::string &path,
+    const std::shared_ptr<arrow::Schema> &schema,
+    const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches) {
+  ARROW_ASSIGN_OR_RAISE(auto table,
+                        arrow::Table::FromRecordBatches(schema, batches));
+  ARROW_ASSIGN_OR_RAISE(auto output, file_sys.OpenOutputStream(path));
+  auto status = parquet::arrow::WriteTable(
+      *table, arrow::default_memory_pool(), output,
+      parquet::DEFAULT_MAX_ROW_GROUP_LENGTH,
+      parquet::default_writer_properties(),
+      parquet::ArrowWriterProperties::Builder().store_schema()->build());
+  return status & output->Close();
+}
+
+PeriodicTask::PeriodicTask(std::chrono::milliseconds interval,
+                           std::function<void()> fn)
+    : interval_{interval}, fn_{std::move(fn)}, thread_{[this]() { run(); }} {}
+
+PeriodicTask::~PeriodicTask() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void PeriodicTask::wake() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    woken_ = true;
+  }
+  cv_.notify_one();
+}
+
+void PeriodicTask::run() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true) {
+    cv_.wait_for(lock, interval_, [this]() { return woken_ || stopping_; });
+    if (stopping_) {
+      return;
+    }
+    woken_ = false;
+
+    lock.unlock();
+    fn_();
+    lock.lock();
+  }
+}
+} // namespace bapid
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <arrow/api.h>
+#include <arrow/filesystem/filesystem.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bapid {
+
+namespace fs = arrow::fs;
+
+// Rows appended to a table but not flushed to its files yet, which queries
+// scan along with the files. Batches are flushed in the order they were
+// appended, so a flush drops a prefix of them.
+class WriteBuffer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  void append(std::shared_ptr<arrow::RecordBatch> batch,
+              Clock::time_point now = Clock::now());
+  // Drops the first `num_batches` batches once they are in the files
+  void drop(size_t num_batches);
+
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches() const;
+  bool empty() const { return entries_.empty(); }
+  int64_t numRows() const { return num_rows_; }
+  int64_t numBytes() const { return num_bytes_; }
+  // Whether the buffer holds `max_bytes` or has held a batch for `max_age`
+  bool shouldFlush(int64_t max_bytes, std::chrono::milliseconds max_age,
+                   Clock::time_point now = Clock::now()) const;
+
+private:
+  struct Entry {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    int64_t num_bytes;
+    Clock::time_point appended_at;
+  };
+
+  std::deque<Entry> entries_{};
+  int64_t num_rows_{0};
+  int64_t num_bytes_{0};
+};
+
+// The cols of `batch` in the order of `schema` and cast to its types, with
+// the cols `batch` lacks null. Fails on a col not in `schema`.
+arrow::Result<std::shared_ptr<arrow::RecordBatch>>
+conformBatch(const arrow::RecordBatch &batch,
+             const std::shared_ptr<arrow::Schema> &schema);
+
+// The hidden name a file is written under before it is renamed to `path`, so
+// that a listing of its dir never sees it partially written
+std::string getHiddenPath(const std::string &path);
+
+// Writes `batches` as one Parquet file at `path`
+arrow::Status writeParquetFile(
+    fs::FileSystem &file_sys, const std::string &path,
+    const std::shared_ptr<arrow::Schema> &schema,
+    const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches);
+
+// Runs `fn` on its own thread every `interval`, or sooner when woken, until
+// destroyed
+class PeriodicTask {
+public:
+  PeriodicTask(std::chrono::milliseconds interval, std::function<void()> fn);
+  ~PeriodicTask();
+
+  void wake();
+
+  PeriodicTask(const PeriodicTask &) = delete;
+  PeriodicTask &operator=(const PeriodicTask &) = delete;
+
+private:
+  void run();
+
+  std::chrono::milliseconds interval_;
+  std::function<void()> fn_;
+  std::mutex mutex_{};
+  std::condition_variable cv_{};
+  bool woken_{false};
+  bool stopping_{false};
+  std::thread thread_;
+};
+} // namespace bapid